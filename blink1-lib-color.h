@@ -0,0 +1,358 @@
+/**
+ * blink1-lib-color.h -- batch color kernels for blink1-lib
+ *
+ * SIMD versions of blink1_adjustBrightness(), blink1_degamma() and
+ * hsbtorgb() for arrays of pixels. Each kernel gives exactly the same
+ * bytes as the single-pixel function; only the speed differs.
+ *  - SSE2 on any x86_64 (and x86 built with SSE2)
+ *  - AVX2 picked at runtime, GCC & Clang only
+ *  - NEON on ARM (table lookups for degamma need AArch64)
+ *  - scalar everywhere else, and for the leftover tail
+ * Only included by blink1-lib.c, after GammaE[]
+ *
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BLINK1_COLOR_SSE2 1
+#include <emmintrin.h>
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32)
+#define BLINK1_COLOR_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BLINK1_COLOR_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef BLINK1_COLOR_AVX2
+static int blink1_color_avx2 = -1;
+
+static int blink1_colorHaveAVX2(void)
+{
+    if( blink1_color_avx2 < 0 ) {  // racing here is harmless, same answer
+        __builtin_cpu_init();
+        blink1_color_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return blink1_color_avx2;
+}
+#endif
+
+//
+// brightness: (x * brightness) >> 8 on every byte.
+// rgb_t has no padding, so n pixels are just 3*n bytes
+//
+
+static void blink1_brightnessBytes_scalar( uint8_t brightness, uint8_t* p, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) {
+        p[i] = (p[i] * brightness) >> 8;
+    }
+}
+
+#ifdef BLINK1_COLOR_SSE2
+static size_t blink1_brightnessBytes_sse2( uint8_t brightness, uint8_t* p, size_t n )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bv = _mm_set1_epi16( brightness );
+    size_t i = 0;
+    for( ; i + 16 <= n; i += 16 ) {
+        __m128i x  = _mm_loadu_si128( (const __m128i*)(p + i) );
+        __m128i lo = _mm_srli_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8(x, zero), bv ), 8 );
+        __m128i hi = _mm_srli_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8(x, zero), bv ), 8 );
+        _mm_storeu_si128( (__m128i*)(p + i), _mm_packus_epi16(lo, hi) );
+    }
+    return i;
+}
+#endif
+
+#ifdef BLINK1_COLOR_AVX2
+__attribute__((target("avx2")))
+static size_t blink1_brightnessBytes_avx2( uint8_t brightness, uint8_t* p, size_t n )
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bv = _mm256_set1_epi16( brightness );
+    size_t i = 0;
+    for( ; i + 32 <= n; i += 32 ) {
+        // unpack/pack work per 128-bit lane, so the byte order comes back as it was
+        __m256i x  = _mm256_loadu_si256( (const __m256i*)(p + i) );
+        __m256i lo = _mm256_srli_epi16( _mm256_mullo_epi16( _mm256_unpacklo_epi8(x, zero), bv ), 8 );
+        __m256i hi = _mm256_srli_epi16( _mm256_mullo_epi16( _mm256_unpackhi_epi8(x, zero), bv ), 8 );
+        _mm256_storeu_si256( (__m256i*)(p + i), _mm256_packus_epi16(lo, hi) );
+    }
+    return i;
+}
+#endif
+
+#ifdef BLINK1_COLOR_NEON
+static size_t blink1_brightnessBytes_neon( uint8_t brightness, uint8_t* p, size_t n )
+{
+    const uint8x8_t bv = vdup_n_u8( brightness );
+    size_t i = 0;
+    for( ; i + 16 <= n; i += 16 ) {
+        uint8x16_t x = vld1q_u8( p + i );
+        uint8x8_t lo = vshrn_n_u16( vmull_u8( vget_low_u8(x),  bv ), 8 );
+        uint8x8_t hi = vshrn_n_u16( vmull_u8( vget_high_u8(x), bv ), 8 );
+        vst1q_u8( p + i, vcombine_u8(lo, hi) );
+    }
+    return i;
+}
+#endif
+
+static void blink1_brightnessBytes( uint8_t brightness, uint8_t* p, size_t n )
+{
+    size_t i = 0;
+#if defined(BLINK1_COLOR_AVX2)
+    if( blink1_colorHaveAVX2() ) i = blink1_brightnessBytes_avx2( brightness, p, n );
+#endif
+#if defined(BLINK1_COLOR_SSE2)
+    i += blink1_brightnessBytes_sse2( brightness, p + i, n - i );
+#elif defined(BLINK1_COLOR_NEON)
+    i += blink1_brightnessBytes_neon( brightness, p + i, n - i );
+#endif
+    blink1_brightnessBytes_scalar( brightness, p + i, n - i );
+}
+
+//
+// degamma: GammaE[x] on every byte.
+// x86 has no byte gather (and the dword gather is slower than plain loads),
+// so there it's an unrolled scalar lookup. AArch64 can look up 64 bytes of
+// table per TBL/TBX, so four of them cover GammaE[]
+//
+
+static void blink1_degammaBytes_scalar( uint8_t* p, size_t n )
+{
+    size_t i = 0;
+    for( ; i + 4 <= n; i += 4 ) {
+        uint8_t a = GammaE[p[i]], b = GammaE[p[i+1]];
+        uint8_t c = GammaE[p[i+2]], d = GammaE[p[i+3]];
+        p[i] = a; p[i+1] = b; p[i+2] = c; p[i+3] = d;
+    }
+    for( ; i < n; i++ ) {
+        p[i] = GammaE[p[i]];
+    }
+}
+
+#if defined(BLINK1_COLOR_NEON) && defined(__aarch64__)
+static size_t blink1_degammaBytes_neon( uint8_t* p, size_t n )
+{
+    uint8x16x4_t tab[4];
+    for( int k=0; k<4; k++ ) {
+        for( int j=0; j<4; j++ ) tab[k].val[j] = vld1q_u8( GammaE + k*64 + j*16 );
+    }
+    const uint8x16_t q = vdupq_n_u8( 64 );
+    size_t i = 0;
+    for( ; i + 16 <= n; i += 16 ) {
+        // TBX leaves lanes with an index >= 64 alone, so after each
+        // subtract only the bytes in that quarter of the table change
+        uint8x16_t x = vld1q_u8( p + i );
+        uint8x16_t y = vqtbl4q_u8( tab[0], x );
+        x = vsubq_u8( x, q );  y = vqtbx4q_u8( y, tab[1], x );
+        x = vsubq_u8( x, q );  y = vqtbx4q_u8( y, tab[2], x );
+        x = vsubq_u8( x, q );  y = vqtbx4q_u8( y, tab[3], x );
+        vst1q_u8( p + i, y );
+    }
+    return i;
+}
+#endif
+
+static void blink1_degammaBytes( uint8_t* p, size_t n )
+{
+    size_t i = 0;
+#if defined(BLINK1_COLOR_NEON) && defined(__aarch64__)
+    i = blink1_degammaBytes_neon( p, n );
+#endif
+    blink1_degammaBytes_scalar( p + i, n - i );
+}
+
+//
+// hsbtorgb: the same integer math, done on 16-bit lanes, with the
+// switch on hue region turned into compare-and-select so there's
+// nothing to mispredict. h/43 is (h*191)>>13, exact for h in 0-255
+// and small enough to stay in 16 bits
+//
+
+static void blink1_hsbtorgb_scalar( rgb_t* out, const uint8_t* hsb, size_t n )
+{
+    for( size_t i=0; i<n; i++ ) {
+        hsbtorgb( &out[i], (uint8_t*)(hsb + 3*i) );
+    }
+}
+
+#ifdef BLINK1_COLOR_SSE2
+// (m & a) | (~m & b)
+#define blink1_sel128(m,a,b)  _mm_or_si128( _mm_and_si128(m,a), _mm_andnot_si128(m,b) )
+
+static size_t blink1_hsbtorgb_sse2( rgb_t* out, const uint8_t* hsb, size_t n )
+{
+    const __m128i c255 = _mm_set1_epi16( 255 );
+    const __m128i c43  = _mm_set1_epi16( 43 );
+    const __m128i c6   = _mm_set1_epi16( 6 );
+    const __m128i c191 = _mm_set1_epi16( 191 );
+    uint16_t hh[8], ss[8], vv[8], rr[8], gg[8], bb[8];
+    size_t i = 0;
+    for( ; i + 8 <= n; i += 8 ) {
+        const uint8_t* s8 = hsb + 3*i;
+        for( int j=0; j<8; j++ ) {
+            hh[j] = s8[3*j]; ss[j] = s8[3*j+1]; vv[j] = s8[3*j+2];
+        }
+        __m128i h = _mm_loadu_si128( (const __m128i*)hh );
+        __m128i s = _mm_loadu_si128( (const __m128i*)ss );
+        __m128i v = _mm_loadu_si128( (const __m128i*)vv );
+
+        __m128i region = _mm_srli_epi16( _mm_mullo_epi16(h, c191), 13 );
+        __m128i fpart  = _mm_mullo_epi16( _mm_sub_epi16(h, _mm_mullo_epi16(region, c43)), c6 );
+        __m128i p = _mm_srli_epi16( _mm_mullo_epi16(v, _mm_sub_epi16(c255, s)), 8 );
+        __m128i sf = _mm_srli_epi16( _mm_mullo_epi16(s, fpart), 8 );
+        __m128i q = _mm_srli_epi16( _mm_mullo_epi16(v, _mm_sub_epi16(c255, sf)), 8 );
+        __m128i st = _mm_srli_epi16( _mm_mullo_epi16(s, _mm_sub_epi16(c255, fpart)), 8 );
+        __m128i t = _mm_srli_epi16( _mm_mullo_epi16(v, _mm_sub_epi16(c255, st)), 8 );
+
+        __m128i m0 = _mm_cmpeq_epi16( region, _mm_set1_epi16(0) );
+        __m128i m1 = _mm_cmpeq_epi16( region, _mm_set1_epi16(1) );
+        __m128i m2 = _mm_cmpeq_epi16( region, _mm_set1_epi16(2) );
+        __m128i m3 = _mm_cmpeq_epi16( region, _mm_set1_epi16(3) );
+        __m128i m4 = _mm_cmpeq_epi16( region, _mm_set1_epi16(4) );
+        __m128i grey = _mm_cmpeq_epi16( s, _mm_setzero_si128() );
+
+        __m128i r = blink1_sel128( m4, t, v );
+        r = blink1_sel128( _mm_or_si128(m2, m3), p, r );
+        r = blink1_sel128( m1, q, r );
+        __m128i g = blink1_sel128( m3, q, p );
+        g = blink1_sel128( _mm_or_si128(m1, m2), v, g );
+        g = blink1_sel128( m0, t, g );
+        __m128i b = blink1_sel128( _mm_or_si128(m3, m4), v, q );
+        b = blink1_sel128( m2, t, b );
+        b = blink1_sel128( _mm_or_si128(m0, m1), p, b );
+
+        _mm_storeu_si128( (__m128i*)rr, blink1_sel128(grey, v, r) );
+        _mm_storeu_si128( (__m128i*)gg, blink1_sel128(grey, v, g) );
+        _mm_storeu_si128( (__m128i*)bb, blink1_sel128(grey, v, b) );
+        for( int j=0; j<8; j++ ) {
+            out[i+j].r = (uint8_t)rr[j]; out[i+j].g = (uint8_t)gg[j]; out[i+j].b = (uint8_t)bb[j];
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef BLINK1_COLOR_AVX2
+#define blink1_sel256(m,a,b)  _mm256_blendv_epi8( b, a, m )
+
+__attribute__((target("avx2")))
+static size_t blink1_hsbtorgb_avx2( rgb_t* out, const uint8_t* hsb, size_t n )
+{
+    const __m256i c255 = _mm256_set1_epi16( 255 );
+    const __m256i c43  = _mm256_set1_epi16( 43 );
+    const __m256i c6   = _mm256_set1_epi16( 6 );
+    const __m256i c191 = _mm256_set1_epi16( 191 );
+    uint16_t hh[16], ss[16], vv[16], rr[16], gg[16], bb[16];
+    size_t i = 0;
+    for( ; i + 16 <= n; i += 16 ) {
+        const uint8_t* s8 = hsb + 3*i;
+        for( int j=0; j<16; j++ ) {
+            hh[j] = s8[3*j]; ss[j] = s8[3*j+1]; vv[j] = s8[3*j+2];
+        }
+        __m256i h = _mm256_loadu_si256( (const __m256i*)hh );
+        __m256i s = _mm256_loadu_si256( (const __m256i*)ss );
+        __m256i v = _mm256_loadu_si256( (const __m256i*)vv );
+
+        __m256i region = _mm256_srli_epi16( _mm256_mullo_epi16(h, c191), 13 );
+        __m256i fpart  = _mm256_mullo_epi16( _mm256_sub_epi16(h, _mm256_mullo_epi16(region, c43)), c6 );
+        __m256i p = _mm256_srli_epi16( _mm256_mullo_epi16(v, _mm256_sub_epi16(c255, s)), 8 );
+        __m256i sf = _mm256_srli_epi16( _mm256_mullo_epi16(s, fpart), 8 );
+        __m256i q = _mm256_srli_epi16( _mm256_mullo_epi16(v, _mm256_sub_epi16(c255, sf)), 8 );
+        __m256i st = _mm256_srli_epi16( _mm256_mullo_epi16(s, _mm256_sub_epi16(c255, fpart)), 8 );
+        __m256i t = _mm256_srli_epi16( _mm256_mullo_epi16(v, _mm256_sub_epi16(c255, st)), 8 );
+
+        __m256i m0 = _mm256_cmpeq_epi16( region, _mm256_set1_epi16(0) );
+        __m256i m1 = _mm256_cmpeq_epi16( region, _mm256_set1_epi16(1) );
+        __m256i m2 = _mm256_cmpeq_epi16( region, _mm256_set1_epi16(2) );
+        __m256i m3 = _mm256_cmpeq_epi16( region, _mm256_set1_epi16(3) );
+        __m256i m4 = _mm256_cmpeq_epi16( region, _mm256_set1_epi16(4) );
+        __m256i grey = _mm256_cmpeq_epi16( s, _mm256_setzero_si256() );
+
+        __m256i r = blink1_sel256( m4, t, v );
+        r = blink1_sel256( _mm256_or_si256(m2, m3), p, r );
+        r = blink1_sel256( m1, q, r );
+        __m256i g = blink1_sel256( m3, q, p );
+        g = blink1_sel256( _mm256_or_si256(m1, m2), v, g );
+        g = blink1_sel256( m0, t, g );
+        __m256i b = blink1_sel256( _mm256_or_si256(m3, m4), v, q );
+        b = blink1_sel256( m2, t, b );
+        b = blink1_sel256( _mm256_or_si256(m0, m1), p, b );
+
+        _mm256_storeu_si256( (__m256i*)rr, blink1_sel256(grey, v, r) );
+        _mm256_storeu_si256( (__m256i*)gg, blink1_sel256(grey, v, g) );
+        _mm256_storeu_si256( (__m256i*)bb, blink1_sel256(grey, v, b) );
+        for( int j=0; j<16; j++ ) {
+            out[i+j].r = (uint8_t)rr[j]; out[i+j].g = (uint8_t)gg[j]; out[i+j].b = (uint8_t)bb[j];
+        }
+    }
+    return i;
+}
+#endif
+
+#ifdef BLINK1_COLOR_NEON
+static size_t blink1_hsbtorgb_neon( rgb_t* out, const uint8_t* hsb, size_t n )
+{
+    const uint16x8_t c255 = vdupq_n_u16( 255 );
+    const uint16x8_t c43  = vdupq_n_u16( 43 );
+    const uint16x8_t c6   = vdupq_n_u16( 6 );
+    const uint16x8_t c191 = vdupq_n_u16( 191 );
+    size_t i = 0;
+    for( ; i + 8 <= n; i += 8 ) {
+        uint8x8x3_t in = vld3_u8( hsb + 3*i );   // de-interleaves h,s,v
+        uint16x8_t h = vmovl_u8( in.val[0] );
+        uint16x8_t s = vmovl_u8( in.val[1] );
+        uint16x8_t v = vmovl_u8( in.val[2] );
+
+        uint16x8_t region = vshrq_n_u16( vmulq_u16(h, c191), 13 );
+        uint16x8_t fpart  = vmulq_u16( vsubq_u16(h, vmulq_u16(region, c43)), c6 );
+        uint16x8_t p = vshrq_n_u16( vmulq_u16(v, vsubq_u16(c255, s)), 8 );
+        uint16x8_t sf = vshrq_n_u16( vmulq_u16(s, fpart), 8 );
+        uint16x8_t q = vshrq_n_u16( vmulq_u16(v, vsubq_u16(c255, sf)), 8 );
+        uint16x8_t st = vshrq_n_u16( vmulq_u16(s, vsubq_u16(c255, fpart)), 8 );
+        uint16x8_t t = vshrq_n_u16( vmulq_u16(v, vsubq_u16(c255, st)), 8 );
+
+        uint16x8_t m0 = vceqq_u16( region, vdupq_n_u16(0) );
+        uint16x8_t m1 = vceqq_u16( region, vdupq_n_u16(1) );
+        uint16x8_t m2 = vceqq_u16( region, vdupq_n_u16(2) );
+        uint16x8_t m3 = vceqq_u16( region, vdupq_n_u16(3) );
+        uint16x8_t m4 = vceqq_u16( region, vdupq_n_u16(4) );
+        uint16x8_t grey = vceqq_u16( s, vdupq_n_u16(0) );
+
+        uint16x8_t r = vbslq_u16( m4, t, v );
+        r = vbslq_u16( vorrq_u16(m2, m3), p, r );
+        r = vbslq_u16( m1, q, r );
+        uint16x8_t g = vbslq_u16( m3, q, p );
+        g = vbslq_u16( vorrq_u16(m1, m2), v, g );
+        g = vbslq_u16( m0, t, g );
+        uint16x8_t b = vbslq_u16( vorrq_u16(m3, m4), v, q );
+        b = vbslq_u16( m2, t, b );
+        b = vbslq_u16( vorrq_u16(m0, m1), p, b );
+
+        uint8x8x3_t o;
+        o.val[0] = vmovn_u16( vbslq_u16(grey, v, r) );
+        o.val[1] = vmovn_u16( vbslq_u16(grey, v, g) );
+        o.val[2] = vmovn_u16( vbslq_u16(grey, v, b) );
+        vst3_u8( (uint8_t*)(out + i), o );       // re-interleaves r,g,b
+    }
+    return i;
+}
+#endif
+
+static void blink1_hsbtorgbMany_impl( rgb_t* out, const uint8_t* hsb, size_t n )
+{
+    size_t i = 0;
+#if defined(BLINK1_COLOR_AVX2)
+    if( blink1_colorHaveAVX2() ) i = blink1_hsbtorgb_avx2( out, hsb, n );
+#endif
+#if defined(BLINK1_COLOR_SSE2)
+    i += blink1_hsbtorgb_sse2( out + i, hsb + 3*i, n - i );
+#elif defined(BLINK1_COLOR_NEON)
+    i += blink1_hsbtorgb_neon( out + i, hsb + 3*i, n - i );
+#endif
+    blink1_hsbtorgb_scalar( out + i, hsb + 3*i, n - i );
+}
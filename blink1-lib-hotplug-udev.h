@@ -0,0 +1,110 @@
+/**
+ * blink1-lib-hotplug-udev.h -- Linux hotplug tracking with a libudev monitor
+ *
+ * Watches hidraw add/remove uevents and updates the device cache one
+ * device at a time, so open handles of other devices are left alone.
+ * Only included by blink1-lib.c, when built with BLINK1_HOTPLUG_UDEV.
+ *
+ */
+
+#include <libudev.h>
+#include <poll.h>
+
+#define blink1_udev(ctx)     ((struct udev*)(ctx)->udev)
+#define blink1_udev_mon(ctx) ((struct udev_monitor*)(ctx)->udev_mon)
+
+//
+int blink1_ctxHotplugStart( blink1_context* ctx )
+{
+    if( ctx->transport != &blink1_transport_hid ) return -1;  // udev only sees USB
+    blink1_lock(ctx);
+    if( ctx->udev_mon ) {
+        int fd = udev_monitor_get_fd( blink1_udev_mon(ctx) );
+        blink1_unlock(ctx);
+        return fd;
+    }
+
+    ctx->udev = udev_new();
+    if( ctx->udev == NULL ) { blink1_unlock(ctx); return -1; }
+    ctx->udev_mon = udev_monitor_new_from_netlink( blink1_udev(ctx), "udev" );
+    if( ctx->udev_mon == NULL ||
+        udev_monitor_filter_add_match_subsystem_devtype( blink1_udev_mon(ctx), "hidraw", NULL ) < 0 ||
+        udev_monitor_enable_receiving( blink1_udev_mon(ctx) ) < 0 ) {
+        LOGC(ctx, "blink1_hotplugStart: couldn't start udev monitor\n");
+        blink1_ctxHotplugStop( ctx );
+        blink1_unlock(ctx);
+        return -1;
+    }
+    // monitor first, then enumerate, so nothing plugged in between is missed
+    blink1_ctxEnumerate( ctx );
+    int fd = udev_monitor_get_fd( blink1_udev_mon(ctx) );
+    blink1_unlock(ctx);
+    return fd;
+}
+
+//
+void blink1_ctxHotplugStop( blink1_context* ctx )
+{
+    blink1_lock(ctx);
+    if( ctx->udev_mon ) udev_monitor_unref( blink1_udev_mon(ctx) );
+    if( ctx->udev ) udev_unref( blink1_udev(ctx) );
+    ctx->udev_mon = NULL;
+    ctx->udev = NULL;
+    blink1_unlock(ctx);
+}
+
+// handle one hidraw uevent
+static void blink1_hotplugHandle( blink1_context* ctx, struct udev_device* udev_dev )
+{
+    const char* action = udev_device_get_action( udev_dev );
+    const char* path = udev_device_get_devnode( udev_dev );
+    if( action == NULL || path == NULL ) return;
+
+    if( strcmp(action, "add") == 0 ) {
+        // vid/pid and serial live on the parent hid device,
+        // e.g. HID_ID=0003:000027B8:000001ED HID_UNIQ=3FFFABCD
+        struct udev_device* hid =
+            udev_device_get_parent_with_subsystem_devtype( udev_dev, "hid", NULL );
+        if( hid == NULL ) return;
+        const char* hid_id = udev_device_get_property_value( hid, "HID_ID" );
+        const char* serial = udev_device_get_property_value( hid, "HID_UNIQ" );
+        unsigned int bus, vid, pid;
+        if( hid_id == NULL || serial == NULL || serial[0] == 0 ) return;
+        if( sscanf( hid_id, "%x:%x:%x", &bus, &vid, &pid ) != 3 ) return;
+        if( (int)vid != blink1_vid() || (int)pid != blink1_pid() ) return;
+
+        LOGC(ctx, "blink1_hotplug: add %s %s\n", serial, path);
+        if( blink1_ctxCacheAdd( ctx, path, serial ) >= 0 ) {
+            blink1_hotplugNotify( ctx, BLINK1_HOTPLUG_ADDED, serial, path );
+        }
+    }
+    else if( strcmp(action, "remove") == 0 ) {
+        // parent is already gone, but the path is all we need
+        int i = blink1_ctxGetCacheIndexByPath( ctx, path );
+        if( i < 0 ) return;  // not a blink(1) we know about
+        char serial[serialstrmax];
+        strcpy( serial, ctx->infos[i].serial );
+
+        LOGC(ctx, "blink1_hotplug: remove %s %s\n", serial, path);
+        blink1_hotplugDetach( ctx, i );
+        blink1_hotplugNotify( ctx, BLINK1_HOTPLUG_REMOVED, serial, path );
+    }
+}
+
+//
+int blink1_ctxHotplugPoll( blink1_context* ctx )
+{
+    int n = 0;
+    blink1_lock(ctx);
+    if( ctx->udev_mon == NULL ) { blink1_unlock(ctx); return 0; }
+    struct pollfd pfd = { udev_monitor_get_fd( blink1_udev_mon(ctx) ), POLLIN, 0 };
+    while( poll( &pfd, 1, 0 ) > 0 && (pfd.revents & POLLIN) ) {
+        struct udev_device* udev_dev = udev_monitor_receive_device( blink1_udev_mon(ctx) );
+        if( udev_dev == NULL ) break;
+        blink1_hotplugHandle( ctx, udev_dev );
+        udev_device_unref( udev_dev );
+        n++;
+    }
+    blink1_unlock(ctx);
+    return n;
+}
@@ -0,0 +1,382 @@
+
+//
+// Virtual blink(1) transport
+//
+// Models enough of the blink(1) mk2/mk3 firmware to stand in for real
+// devices in tests and benchmarks: per-LED fades that progress in real
+// time, pattern RAM, pattern playing, startup params and notes.
+// A write runs the command and stores the reply, the next read returns
+// it, just like a feature report round trip on the real thing.
+//
+
+#define blink1_virtual_nleds    2
+#define blink1_virtual_nnotes  10
+#define blink1_virtual_pattmax 32   // largest of blink1_pattMaxes[]
+
+typedef struct {
+    uint8_t from[3];        // color when the fade started
+    uint8_t to[3];          // fade target
+    uint64_t start;         // micros
+    uint32_t dur;           // micros
+    uint16_t dms;           // fade time as sent, millis/10
+} blink1_vled;
+
+typedef struct {
+    uint8_t r, g, b;
+    uint16_t dms;
+    uint8_t ledn;
+} blink1_vline;
+
+typedef struct {
+    char serial[serialstrmax];
+    char path[32];
+    int type;
+    blink1_mutex_t lock;
+    blink1_vled leds[blink1_virtual_nleds];
+    blink1_vline patt[blink1_virtual_pattmax];
+    uint8_t ledn;           // set with 'l', used by 'P'
+    uint8_t playing, playstart, playend, playcount, playpos;
+    uint64_t playnext;      // micros of next pattern step
+    uint8_t bootmode, bootstart, bootend, bootcount;
+    uint8_t notes[blink1_virtual_nnotes][blink1_note_size];
+    uint8_t reply[blink1_buf2_size];
+    blink1_virtual_stats stats;
+} blink1_vdev;
+
+typedef struct {
+    blink1_mutex_t lock;    // guards devs and count
+    blink1_vdev** devs;
+    int count;
+    uint32_t latency;       // micros per report
+    uint32_t open_latency;  // micros per open and per close
+} blink1_virtual;
+
+static void blink1_usleep( uint32_t micros )
+{
+#ifdef _WIN32
+    Sleep( (micros + 999) / 1000 );
+#else
+    usleep( micros );
+#endif
+}
+
+// color of LED l at time now
+static void blink1_vledColor( blink1_vled* l, uint64_t now, uint8_t* rgb )
+{
+    if( l->dur == 0 || now >= l->start + l->dur ) {
+        memcpy( rgb, l->to, 3 );
+        return;
+    }
+    int64_t e = now - l->start;
+    for( int c=0; c<3; c++ ) {
+        rgb[c] = l->from[c] + ((int)l->to[c] - (int)l->from[c]) * e / (int64_t)l->dur;
+    }
+}
+
+// start a fade on ledn (0 = all) at time 'at'
+static void blink1_vdevFade( blink1_vdev* vd, uint8_t ledn,
+                             uint8_t r, uint8_t g, uint8_t b, uint16_t dms, uint64_t at )
+{
+    for( int i=0; i < blink1_virtual_nleds; i++ ) {
+        if( ledn != 0 && ledn != i+1 ) continue;
+        blink1_vled* l = &vd->leds[i];
+        blink1_vledColor( l, at, l->from );
+        l->to[0] = r; l->to[1] = g; l->to[2] = b;
+        l->start = at;
+        l->dur = (uint32_t)dms * 10000;
+        l->dms = dms;
+    }
+}
+
+// run pattern steps that are due by now
+static void blink1_vdevAdvance( blink1_vdev* vd, uint64_t now )
+{
+    while( vd->playing && now >= vd->playnext ) {
+        blink1_vline* line = &vd->patt[vd->playpos];
+        blink1_vdevFade( vd, line->ledn, line->r, line->g, line->b, line->dms, vd->playnext );
+        vd->playnext += (uint64_t)((line->dms) ? line->dms : 1) * 10000;
+        vd->playpos++;
+        if( vd->playpos >= vd->playend ) {
+            vd->playpos = vd->playstart;
+            if( vd->playcount && --vd->playcount == 0 ) {  // 0 = forever
+                vd->playing = 0;
+            }
+        }
+    }
+}
+
+// handle one command report, leaving the answer in vd->reply
+static void blink1_vdevCommand( blink1_vdev* vd, const uint8_t* b, int len, uint64_t now )
+{
+    int pmax = blink1_pattMaxes[vd->type];
+    uint8_t* rp = vd->reply;
+    uint8_t cmd = b[1];
+    uint16_t dms = (b[5] << 8) | b[6];
+
+    memset( rp, 0, sizeof(vd->reply) );
+    memcpy( rp, b, (len < (int)sizeof(vd->reply)) ? len : (int)sizeof(vd->reply) );
+
+    switch( cmd ) {
+    case 'c':   // fade to rgb: r,g,b, dms_hi,dms_lo, ledn
+        blink1_vdevFade( vd, b[7], b[2], b[3], b[4], dms, now );
+        break;
+    case 'n':   // set rgb now, all LEDs
+        blink1_vdevFade( vd, 0, b[2], b[3], b[4], 0, now );
+        break;
+    case 'r': { // read rgb of ledn
+        int i = (b[7]) ? b[7]-1 : 0;
+        if( i < blink1_virtual_nleds ) {
+            blink1_vledColor( &vd->leds[i], now, rp+2 );
+            rp[5] = vd->leds[i].dms >> 8;
+            rp[6] = vd->leds[i].dms & 0xff;
+        }
+        break;
+    }
+    case 'P':   // write pattern line: r,g,b, dms_hi,dms_lo, pos
+        if( b[7] < pmax ) {
+            blink1_vline* line = &vd->patt[b[7]];
+            line->r = b[2]; line->g = b[3]; line->b = b[4];
+            line->dms = dms;
+            line->ledn = vd->ledn;
+        }
+        break;
+    case 'R':   // read pattern line at pos
+        if( b[7] < pmax ) {
+            blink1_vline* line = &vd->patt[b[7]];
+            rp[2] = line->r; rp[3] = line->g; rp[4] = line->b;
+            rp[5] = line->dms >> 8;
+            rp[6] = line->dms & 0xff;
+            rp[7] = line->ledn;
+        }
+        break;
+    case 'p':   // play/stop: play, startpos, endpos, count
+        vd->playing = 0;
+        if( b[2] && b[3] < pmax ) {
+            vd->playstart = b[3];
+            vd->playend = (b[4] == 0 || b[4] > pmax) ? pmax : b[4];
+            vd->playcount = b[5];
+            vd->playpos = vd->playstart;
+            vd->playnext = now;
+            vd->playing = (vd->playstart < vd->playend);
+            blink1_vdevAdvance( vd, now );
+        }
+        break;
+    case 'S':   // read play state
+        rp[2] = vd->playing;
+        rp[3] = vd->playstart;
+        rp[4] = vd->playend;
+        rp[5] = vd->playcount;
+        rp[6] = vd->playpos;
+        break;
+    case 'l':   // set ledn for following 'P'
+        vd->ledn = b[2];
+        break;
+    case 'b':   // get startup params
+        rp[2] = vd->bootmode;
+        rp[3] = vd->bootstart;
+        rp[4] = vd->bootend;
+        rp[5] = vd->bootcount;
+        break;
+    case 'B':   // set startup params
+        vd->bootmode  = b[2];
+        vd->bootstart = b[3];
+        vd->bootend   = b[4];
+        vd->bootcount = b[5];
+        break;
+    case 'F':   // write note (report 2): noteid, data
+        if( b[0] == blink1_report2_id && b[2] < blink1_virtual_nnotes &&
+            len >= 3 + blink1_note_size ) {
+            memcpy( vd->notes[b[2]], b+3, blink1_note_size );
+        }
+        break;
+    case 'f':   // read note
+        if( b[2] < blink1_virtual_nnotes ) {
+            memcpy( rp+3, vd->notes[b[2]], blink1_note_size );
+        }
+        break;
+    case 'v':   // version, newest firmware of each type
+        rp[3] = '0' + vd->type;
+        rp[4] = '9';
+        break;
+    default:    // everything else is acked and ignored
+        break;
+    }
+}
+
+//
+static int blink1_virtual_enumerate( blink1_transport* t, int vid, int pid,
+                                     blink1_transport_add_fn add, void* arg )
+{
+    blink1_virtual* v = t->priv;
+    if( vid != blink1_vid() || pid != blink1_pid() ) return 0;
+    blink1_mutex_lock( &v->lock );
+    for( int i=0; i < v->count; i++ ) {
+        add( v->devs[i]->path, v->devs[i]->serial, arg );
+    }
+    int n = v->count;
+    blink1_mutex_unlock( &v->lock );
+    return n;
+}
+
+//
+static void* blink1_virtual_open( blink1_transport* t, const char* path, const char* serial )
+{
+    blink1_virtual* v = t->priv;
+    blink1_vdev* vd = NULL;
+    blink1_mutex_lock( &v->lock );
+    for( int i=0; i < v->count && vd == NULL; i++ ) {
+        if( path ) {
+            if( strcmp( v->devs[i]->path, path ) == 0 ) vd = v->devs[i];
+        }
+        else if( serial && strcasecmp( v->devs[i]->serial, serial ) == 0 ) {
+            vd = v->devs[i];
+        }
+    }
+    blink1_mutex_unlock( &v->lock );
+    if( vd && v->open_latency ) blink1_usleep( v->open_latency );
+    return vd;
+}
+
+//
+static void blink1_virtual_close( blink1_transport* t, void* handle )
+{
+    blink1_virtual* v = t->priv;
+    if( handle && v->open_latency ) blink1_usleep( v->open_latency );
+}
+
+//
+static int blink1_virtual_write( blink1_transport* t, void* handle, const void* buf, int len )
+{
+    blink1_virtual* v = t->priv;
+    blink1_vdev* vd = handle;
+    const uint8_t* b = buf;
+    if( vd == NULL || len < 2 ) return -1;
+    if( v->latency ) blink1_usleep( v->latency );
+
+    blink1_mutex_lock( &vd->lock );
+    uint64_t now = blink1_micros();
+    blink1_vdevAdvance( vd, now );
+    blink1_vdevCommand( vd, b, len, now );
+    vd->stats.writes++;
+    if( b[1] < 128 ) vd->stats.cmds[b[1]]++;
+    blink1_mutex_unlock( &vd->lock );
+    return len;
+}
+
+//
+static int blink1_virtual_read( blink1_transport* t, void* handle, void* buf, int len )
+{
+    blink1_virtual* v = t->priv;
+    blink1_vdev* vd = handle;
+    if( vd == NULL || len <= 0 ) return -1;
+    if( v->latency ) blink1_usleep( v->latency );
+
+    blink1_mutex_lock( &vd->lock );
+    if( len > (int)sizeof(vd->reply) ) len = sizeof(vd->reply);
+    memcpy( buf, vd->reply, len );
+    vd->stats.reads++;
+    blink1_mutex_unlock( &vd->lock );
+    return len;
+}
+
+//
+blink1_transport* blink1_virtualNew(void)
+{
+    blink1_transport* t = calloc( 1, sizeof(blink1_transport) );
+    blink1_virtual* v = calloc( 1, sizeof(blink1_virtual) );
+    if( t == NULL || v == NULL ) {
+        free(t);
+        free(v);
+        return NULL;
+    }
+    blink1_mutex_init( &v->lock );
+    t->name      = "virtual";
+    t->enumerate = blink1_virtual_enumerate;
+    t->open      = blink1_virtual_open;
+    t->close     = blink1_virtual_close;
+    t->write     = blink1_virtual_write;
+    t->read      = blink1_virtual_read;
+    t->priv      = v;
+    return t;
+}
+
+//
+void blink1_virtualFree( blink1_transport* t )
+{
+    if( t == NULL ) return;
+    blink1_virtual* v = t->priv;
+    for( int i=0; i < v->count; i++ ) {
+        blink1_mutex_destroy( &v->devs[i]->lock );
+        free( v->devs[i] );
+    }
+    free( v->devs );
+    blink1_mutex_destroy( &v->lock );
+    free( v );
+    free( t );
+}
+
+//
+int blink1_virtualAdd( blink1_transport* t, const char* serial )
+{
+    blink1_virtual* v = t->priv;
+    if( serial == NULL || strlen(serial) == 0 || strlen(serial) >= serialstrmax ) return -1;
+    blink1_vdev* vd = calloc( 1, sizeof(blink1_vdev) );
+    if( vd == NULL ) return -1;
+    strcpy( vd->serial, serial );
+    vd->type = blink1_serialToType( serial );
+    blink1_mutex_init( &vd->lock );
+
+    blink1_mutex_lock( &v->lock );
+    blink1_vdev** devs = realloc( v->devs, (v->count+1) * sizeof(blink1_vdev*) );
+    int i = -1;
+    if( devs != NULL ) {
+        v->devs = devs;
+        i = v->count++;
+        snprintf( vd->path, sizeof(vd->path), "virtual:%d", i );
+        devs[i] = vd;
+    }
+    blink1_mutex_unlock( &v->lock );
+    if( i < 0 ) {
+        blink1_mutex_destroy( &vd->lock );
+        free( vd );
+    }
+    return i;
+}
+
+//
+int blink1_virtualCount( blink1_transport* t )
+{
+    blink1_virtual* v = t->priv;
+    blink1_mutex_lock( &v->lock );
+    int n = v->count;
+    blink1_mutex_unlock( &v->lock );
+    return n;
+}
+
+//
+void blink1_virtualSetLatency( blink1_transport* t, uint32_t micros )
+{
+    ((blink1_virtual*)t->priv)->latency = micros;
+}
+
+//
+void blink1_virtualSetOpenLatency( blink1_transport* t, uint32_t micros )
+{
+    ((blink1_virtual*)t->priv)->open_latency = micros;
+}
+
+//
+int blink1_virtualGetStats( blink1_transport* t, int i, blink1_virtual_stats* stats )
+{
+    blink1_virtual* v = t->priv;
+    blink1_vdev* vd = NULL;
+    blink1_mutex_lock( &v->lock );
+    if( i >= 0 && i < v->count ) vd = v->devs[i];
+    blink1_mutex_unlock( &v->lock );
+    if( vd == NULL || stats == NULL ) return -1;
+
+    blink1_mutex_lock( &vd->lock );
+    *stats = vd->stats;
+    blink1_mutex_unlock( &vd->lock );
+    return 0;
+}
@@ -1,63 +1,138 @@
 #ifndef __BLINK1_LIB_PATTERNS_H__
 #define __BLINK1_LIB_PATTERNS_H__
 
+#include "blink1-lib.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+//
+// Named color patterns.
+//
+// The built-in ones are listed in blink1-lib-patterns.def.  At build
+// time server/gen-patterns.c parses them and lays them out behind a
+// minimal perfect hash, so finding one by name is one hash and one
+// strcmp(), and nothing is parsed at runtime.  The generated table is
+// linked in by programs that use it (blink1-tiny-server), not by
+// blink1-lib itself.
+//
+// Patterns added at runtime go in a blink1_pattern_index, an
+// open-addressing hash table with the same kind of lookup.
+//
+
 typedef struct _blink1_pattern_info
 {
-    char name[100];  // name of pattern
-    char str[200];   // string format of pattern data
+    const char* name;            // name of pattern
+    const char* str;             // string format of pattern data
+    int repeats;                 // str, parsed at build time
+    int len;
+    const patternline_t* lines;
 } blink1_pattern_info;
 
+// a minimal perfect hash over a fixed set of names
+typedef struct {
+    const blink1_pattern_info* patterns;  // in the order listed
+    int count;
+    const int16_t* slots;    // count of them, hash slot -> index into patterns
+    const uint16_t* disp;    // nbuckets of them, per-bucket hash seed
+    int nbuckets;
+} blink1_pattern_table;
+
+// slot in a blink1_pattern_index
+typedef struct {
+    uint32_t hash;
+    const char* name;   // NULL if empty.  Not copied, must outlive the entry
+    int value;
+} blink1_pattern_slot;
 
+// name -> int, linear probing, kept at most half full
+typedef struct {
+    blink1_pattern_slot* slots;
+    uint32_t mask;      // number of slots - 1
+    int count;
+} blink1_pattern_index;
+
+// FNV-1a and a final mix, shared by the generator and lookups
+static inline uint32_t blink1_patternMix( uint32_t h )
+{
+    h ^= h >> 16;  h *= 0x85ebca6bu;
+    h ^= h >> 13;  h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
 
-// list of all the patterns
-static const blink1_pattern_info blink1_patterns[]
-= {
-    {"red flash",        "9,#ff0000,0.5,0,#000000,0.5,0"},
-    {"green flash",      "9,#00ff00,0.5,0,#000000,0.5,0"},
-    {"blue flash",       "9,#0000ff,0.5,0,#000000,0.5,0"},
-    {"white flash",      "9,#ffffff,0.5,0,#000000,0.5,0"},
-    {"yellow flash",     "9,#ffff00,0.5,0,#000000,0.5,0"},
-    {"purple flash",     "9,#ff00ff,0.5,0,#000000,0.5,0"},
-    {"groovy",           "3,#ff4cff,1.0,0,#630000,0.2,0,#0000ff,0.1,0"},
-    {"off",              "1,#000000,0.1,0"},
-    {"policecar",        "6,#ff0000,0.3,1,#0000ff,0.3,2,#000000,0.1,0,#ff0000,0.3,2,#0000ff,0.3,1,#000000,0.1,0"},
-    {"fireengine",       "6,#ff0000,0.3,1,#ff0000,0.3,2,#000000,0.1,0,#ff0000,0.3,2,#ff0000,0.3,1,#000000,0.1,0"},
-    {"palette colors",   "3,#e7009a,1,0,#3d00e7,1,0,#00b8e7,1,0,#00e71e,1,0,#d7e700,1,0,#e70000,1,0,#e7e7e7,1,0"},
-    {"CMYK",             "3,#00fff2,0.8,0,#000000,0.3,0,#65003c,0.8,0,#000000,0.3,0,#ffd905,0.8,0,#000000,0.1,0,#000000,0.7,0"},
-    {"RGB",              "3,#ff0000,0.8,0,#000000,0.3,0,#00ff00,0.8,0,#000000,0.3,0,#0000ff,0.8,0,#000000,0.3,0"},
-    {"undervolt",        "1,#821500,1,0,#634100,1,0,#554f00,1,0,#395800,1,0,#00580b,1,0,#005025,1,0,#005844,1,0,#00465a,1,0"},
-    {"fire shrine",      "3,#751100,0,1,#ff1d00,0,2,#ff1000,0.4,1,#680300,0.4,2,#000000,0.9,1,#e01200,0,0,#000000,2,0"},
-    {"molten lava",      "3,#ff0000,0.2,1,#ff0000,0.2,2,#bd0000,0.1,1,#bd0000,0.1,2,#690000,0.1,1,#690000,0.1,2,#3f0000,0.2,1,#3f0000,0.2,2"},
-    {"lighting storm",   "3,#6f756f,0,1,#ffffff,0,2,#ffffff,0.4,1,#686868,0.4,2,#000000,0.9,1,#e0e0e0,0,0,#000000,2,0"},
-    {"rain",             "1,#0a01ff,0.1,1,#04004f,0,1,#1701ff,0.4,2,#04004f,0,2,#0019ff,0.3,1,#04004f,0.3,1,#1b01ff,0.3,2,#04004f,0,2"},
-    {"nightfall",        "1,#001980,1,0,#000000,10,0"},
-    {"dawn",             "1,#000000,1,0,#ff6800,15,0"},
-    {"dancefloor",       "6,#ff0004,0.1,1,#ff0004,0.1,2,#f2ff00,0.1,1,#f2ff00,0.1,2,#00ff37,0.1,1,#00ff2a,0.1,2,#ff00aa,0.1,1,#ff00b6,0.1,2"},
-    {"rave",             "6,#8b8800,0,0,#010b9e,0.1,0,#009b00,0.1,0,#a5008c,0.1,0,#01998e,0.1,0,#9b0007,0.1,0,#0114a5,0.1,0,#8c8d85,0.1,0"},
-    {"sexy",             "3,#e7009a,0.4,1,#ff007b,0,2,#ff00dc,0.4,1,#680029,0.4,2,#000000,0.9,1,#e0006c,0,0,#53004d,2,0"},
-    {"calmdown",         "3,#00ff33,2,1,#ff00e9,2,2,#ff0004,2,1,#003fff,2,2,#faff00,2,1,#ffffff,2,1"},
-    {"emergency",        "3,#ff7c01,0,2,#732f00,0.1,0,#ff7e00,0,1,#602700,0.3,1"},
-    {"lowbattery",       "3,#7a0000,0.1,0,#000000,0,0,#7e0000,0.1,0,#000000,0.1,0,#000000,3,0"},
-    {"EKG",              "5,#0c4f00,0,0,#29ff00,0,0,#0c4f00,0.1,0,#29ff00,0.1,0,#0c4f00,2.1,0"},
-    {"patternA",         "3,#ff4cff,0.7,0,#630000,0.2,0,#00ff00,0.1,0"},
-    {"patternB",         "3,#ff4cff,0.7,0,#630000,0.2,0,#0000ff,0.1,0"},
-};
-
-
-const char* blink1_pattern_find(const char* name)
+static inline uint32_t blink1_patternHash( const char* s )
 {
-    size_t n = sizeof(blink1_patterns) / sizeof(blink1_patterns[0]);
-    for (size_t i = 0; i < n; i++) {
-        if (strcmp(blink1_patterns[i].name, name) == 0) {
-            return blink1_patterns[i].str;
-            //return &blink1_patterns[i];
-        }
+    uint32_t h = 2166136261u;
+    for( ; *s; s++ ) {
+        h ^= (uint8_t)*s;
+        h *= 16777619u;
     }
-    return NULL; // not found
+    return blink1_patternMix( h );
+}
+
+// where hash h lands, for a bucket's seed d, in a table of n slots
+static inline uint32_t blink1_patternSlot( uint32_t h, uint16_t d, int n )
+{
+    return blink1_patternMix( h ^ (d * 0x9e3779b9u) ) % (uint32_t)n;
+}
+
+/**
+ * Build a minimal perfect hash for n distinct names, as
+ * server/gen-patterns.c does for the built-in patterns.
+ * @param nbuckets number of seeds, n/2+1 is plenty
+ * @param disp out, nbuckets seeds
+ * @param slots out, n indexes into names
+ * @return 0 on success, -1 if names aren't distinct (or no seeds fit)
+ */
+int blink1_patternTableBuild( const char* const* names, int n, int nbuckets,
+                              uint16_t* disp, int16_t* slots );
+
+/**
+ * Look up name in a perfect-hash table.
+ * @return index into t->patterns, -1 if it's not there
+ */
+int blink1_patternTableGet( const blink1_pattern_table* t, const char* name );
+
+/**
+ * Empty index, no allocation until the first put.
+ */
+void blink1_patternIndexInit( blink1_pattern_index* ix );
+void blink1_patternIndexFree( blink1_pattern_index* ix );
+
+/**
+ * Add name, or change its value.  name is not copied.
+ * @return 0 on success, -1 if out of memory
+ */
+int blink1_patternIndexPut( blink1_pattern_index* ix, const char* name, int value );
+
+/**
+ * @return name's value, -1 if it's not there
+ */
+int blink1_patternIndexGet( const blink1_pattern_index* ix, const char* name );
+
+/**
+ * Remove name.
+ * @return the value it had, -1 if it wasn't there
+ */
+int blink1_patternIndexDel( blink1_pattern_index* ix, const char* name );
+
+// the built-in patterns, in the generated blink1-lib-patterns-builtin.c
+extern const blink1_pattern_table blink1_builtin_patterns;
+
+// built-in pattern by name, NULL if none
+static inline const blink1_pattern_info* blink1_pattern_lookup( const char* name )
+{
+    int i = blink1_patternTableGet( &blink1_builtin_patterns, name );
+    return (i < 0) ? NULL : &blink1_builtin_patterns.patterns[i];
+}
+
+// built-in pattern string by name, NULL if none
+static inline const char* blink1_pattern_find( const char* name )
+{
+    const blink1_pattern_info* p = blink1_pattern_lookup( name );
+    return (p) ? p->str : NULL;
 }
 
 #ifdef __cplusplus
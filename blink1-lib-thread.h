@@ -0,0 +1,245 @@
+/**
+ * blink1-lib-thread.h -- minimal portable threads for blink1-lib
+ *
+ * pthreads on Unix-likes, native Win32 primitives on Windows
+ * (so MSVC builds don't need a pthreads port).
+ * Included by blink1-lib.c, and by blink1-tiny-server for its atomics
+ *
+ */
+
+#ifdef _WIN32
+
+typedef HANDLE             blink1_thread_t;
+typedef CRITICAL_SECTION   blink1_mutex_t;
+typedef CONDITION_VARIABLE blink1_cond_t;
+typedef INIT_ONCE          blink1_once_t;
+#define BLINK1_ONCE_INIT   INIT_ONCE_STATIC_INIT
+
+#define blink1_mutex_init(m)      InitializeCriticalSection(m)
+#define blink1_mutex_init_recursive(m) InitializeCriticalSection(m) // always recursive
+#define blink1_mutex_destroy(m)   DeleteCriticalSection(m)
+#define blink1_mutex_lock(m)      EnterCriticalSection(m)
+#define blink1_mutex_unlock(m)    LeaveCriticalSection(m)
+#define blink1_cond_init(c)       InitializeConditionVariable(c)
+#define blink1_cond_destroy(c)    ((void)(c))
+#define blink1_cond_wait(c,m)     SleepConditionVariableCS(c,m,INFINITE)
+#define blink1_cond_signal(c)     WakeConditionVariable(c)
+#define blink1_cond_broadcast(c)  WakeAllConditionVariable(c)
+
+typedef struct {
+    void* (*fn)(void*);
+    void* arg;
+} blink1_thread_start;
+
+static DWORD WINAPI blink1_thread_trampoline( LPVOID p )
+{
+    blink1_thread_start st = *(blink1_thread_start*)p;
+    free(p);
+    st.fn(st.arg);
+    return 0;
+}
+
+// returns 0 on success
+static inline int blink1_thread_create( blink1_thread_t* t, void* (*fn)(void*), void* arg )
+{
+    blink1_thread_start* st = malloc(sizeof(*st));
+    if( st == NULL ) return -1;
+    st->fn = fn;
+    st->arg = arg;
+    *t = CreateThread(NULL, 0, blink1_thread_trampoline, st, 0, NULL);
+    if( *t == NULL ) { free(st); return -1; }
+    return 0;
+}
+
+static inline void blink1_thread_join( blink1_thread_t t )
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+static BOOL CALLBACK blink1_once_trampoline( PINIT_ONCE o, PVOID fn, PVOID* ctx )
+{
+    (void)o; (void)ctx;
+    ((void (*)(void))fn)();
+    return TRUE;
+}
+
+static inline void blink1_once( blink1_once_t* once, void (*fn)(void) )
+{
+    InitOnceExecuteOnce(once, blink1_once_trampoline, (PVOID)fn, NULL);
+}
+
+// relaxed 64-bit atomics, for counters
+#define blink1_atomic_add64(p,v)    InterlockedExchangeAdd64((LONG64 volatile*)(p),(LONG64)(v))
+#define blink1_atomic_load64(p)     ((uint64_t)InterlockedOr64((LONG64 volatile*)(p),0))
+#define blink1_atomic_store64(p,v)  InterlockedExchange64((LONG64 volatile*)(p),(LONG64)(v))
+// returns the value *p had before
+#define blink1_atomic_cas64(p,old,v) \
+    ((uint64_t)InterlockedCompareExchange64((LONG64 volatile*)(p),(LONG64)(v),(LONG64)(old)))
+
+// pointer atomics, full barriers
+#define blink1_atomic_loadptr(p)    InterlockedCompareExchangePointer((PVOID volatile*)(p),NULL,NULL)
+#define blink1_atomic_xchgptr(p,v)  InterlockedExchangePointer((PVOID volatile*)(p),(v))
+// returns the value *p had before
+#define blink1_atomic_casptr(p,old,v) \
+    InterlockedCompareExchangePointer((PVOID volatile*)(p),(v),(old))
+
+#else // pthreads
+
+#include <pthread.h>
+
+typedef pthread_t          blink1_thread_t;
+typedef pthread_mutex_t    blink1_mutex_t;
+typedef pthread_cond_t     blink1_cond_t;
+typedef pthread_once_t     blink1_once_t;
+#define BLINK1_ONCE_INIT   PTHREAD_ONCE_INIT
+
+#define blink1_mutex_init(m)      pthread_mutex_init(m,NULL)
+#define blink1_mutex_destroy(m)   pthread_mutex_destroy(m)
+#define blink1_mutex_lock(m)      pthread_mutex_lock(m)
+#define blink1_mutex_unlock(m)    pthread_mutex_unlock(m)
+#define blink1_cond_init(c)       pthread_cond_init(c,NULL)
+#define blink1_cond_destroy(c)    pthread_cond_destroy(c)
+#define blink1_cond_wait(c,m)     pthread_cond_wait(c,m)
+#define blink1_cond_signal(c)     pthread_cond_signal(c)
+#define blink1_cond_broadcast(c)  pthread_cond_broadcast(c)
+#define blink1_once(o,fn)         pthread_once(o,fn)
+
+static inline void blink1_mutex_init_recursive( blink1_mutex_t* m )
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// returns 0 on success
+static inline int blink1_thread_create( blink1_thread_t* t, void* (*fn)(void*), void* arg )
+{
+    return pthread_create(t, NULL, fn, arg);
+}
+
+static inline void blink1_thread_join( blink1_thread_t t )
+{
+    pthread_join(t, NULL);
+}
+
+// relaxed 64-bit atomics, for counters
+#if defined(__GCC_ATOMIC_LLONG_LOCK_FREE) && __GCC_ATOMIC_LLONG_LOCK_FREE == 2
+
+#define blink1_atomic_add64(p,v)    __atomic_fetch_add((p),(v),__ATOMIC_RELAXED)
+#define blink1_atomic_load64(p)     __atomic_load_n((p),__ATOMIC_RELAXED)
+#define blink1_atomic_store64(p,v)  __atomic_store_n((p),(v),__ATOMIC_RELAXED)
+
+// returns the value *p had before
+static inline uint64_t blink1_atomic_cas64( uint64_t* p, uint64_t old, uint64_t v )
+{
+    __atomic_compare_exchange_n(p, &old, v, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return old;
+}
+
+#elif defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+
+// gcc before 4.7 (e.g. older OpenWrt SDKs) has only the __sync builtins
+#define blink1_atomic_add64(p,v)    __sync_fetch_and_add((p),(v))
+#define blink1_atomic_load64(p)     __sync_fetch_and_add((p),0)
+#define blink1_atomic_cas64(p,old,v) __sync_val_compare_and_swap((p),(old),(v))
+
+static inline void blink1_atomic_store64( uint64_t* p, uint64_t v )
+{
+    uint64_t cur = *p, prev;
+    while( (prev = __sync_val_compare_and_swap(p, cur, v)) != cur ) cur = prev;
+}
+
+#else
+
+// no lock-free 64-bit ops (e.g. 32-bit MIPS, which would need libatomic):
+// guard them with a mutex instead.  Each file including this gets its
+// own, which is fine as long as no two files share a counter.
+static pthread_mutex_t blink1_atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t blink1_atomic_add64( uint64_t* p, uint64_t v )
+{
+    pthread_mutex_lock(&blink1_atomic_lock);
+    uint64_t old = *p;
+    *p = old + v;
+    pthread_mutex_unlock(&blink1_atomic_lock);
+    return old;
+}
+
+static inline uint64_t blink1_atomic_load64( uint64_t* p )
+{
+    pthread_mutex_lock(&blink1_atomic_lock);
+    uint64_t v = *p;
+    pthread_mutex_unlock(&blink1_atomic_lock);
+    return v;
+}
+
+static inline void blink1_atomic_store64( uint64_t* p, uint64_t v )
+{
+    pthread_mutex_lock(&blink1_atomic_lock);
+    *p = v;
+    pthread_mutex_unlock(&blink1_atomic_lock);
+}
+
+// returns the value *p had before
+static inline uint64_t blink1_atomic_cas64( uint64_t* p, uint64_t old, uint64_t v )
+{
+    pthread_mutex_lock(&blink1_atomic_lock);
+    uint64_t cur = *p;
+    if( cur == old ) *p = v;
+    pthread_mutex_unlock(&blink1_atomic_lock);
+    return cur;
+}
+
+#endif
+
+// pointer atomics, acquire/release, for lock-free lists.  Pointer-sized
+// CAS is lock-free everywhere, so only gcc before 4.7 needs __sync.
+#if defined(__ATOMIC_ACQ_REL)
+
+static inline void* blink1_atomic_loadptr( void** p )
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void* blink1_atomic_xchgptr( void** p, void* v )
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+}
+
+// returns the value *p had before
+static inline void* blink1_atomic_casptr( void** p, void* old, void* v )
+{
+    __atomic_compare_exchange_n(p, &old, v, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return old;
+}
+
+#else
+
+#define blink1_atomic_loadptr(p)      __sync_val_compare_and_swap((p),NULL,NULL)
+#define blink1_atomic_casptr(p,old,v) __sync_val_compare_and_swap((p),(old),(v))
+
+static inline void* blink1_atomic_xchgptr( void** p, void* v )
+{
+    void* cur = *p;
+    void* prev;
+    while( (prev = __sync_val_compare_and_swap(p, cur, v)) != cur ) cur = prev;
+    return cur;
+}
+
+#endif
+
+#endif
+
+// raise *p to v if v is bigger
+static inline void blink1_atomic_max64( uint64_t* p, uint64_t v )
+{
+    uint64_t cur = blink1_atomic_load64(p);
+    while( v > cur ) {
+        uint64_t prev = blink1_atomic_cas64(p, cur, v);
+        if( prev == cur ) break;
+        cur = prev;
+    }
+}
@@ -21,11 +21,16 @@
 #else
 #include <unistd.h>
 #include <strings.h>
+#include <time.h>   // for clock_gettime()
+#include <errno.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach_time.h>
 #endif
 
 #include "blink1-lib.h"
-
-int msg_quiet = 0;
+#include "blink1-lib-patterns.h"
+#include "blink1-lib-thread.h"
 
 // blink1 copy of some hid_device_info and other bits.
 // this seems kinda dumb, though. is there a better way?
@@ -34,21 +39,98 @@ typedef struct blink1_info_ {
     char path[pathstrmax];  // platform-specific device path
     char serial[serialstrmax];
     int type;  // from blink1types
+    int pooled;     // dev is owned by the handle pool (see blink1_acquire*())
+    int refcnt;     // number of outstanding blink1_acquire*() on dev
+    uint64_t atime; // millis of last blink1_release(), for idle timeout
 } blink1_info;
 
-static blink1_info blink1_infos[cache_max];
-static int blink1_cached_count = 0;  // number of cached entities
-
-static int blink1_enable_degamma = 1;
-
-int blink1_lib_verbose = 0;
-
-// set in Makefile to debug HIDAPI stuff
-#ifdef DEBUG_PRINTF
-#define LOG(...) fprintf(stderr, __VA_ARGS__)
+typedef struct {
+    int id;
+    blink1_hotplug_cb cb;
+    void* userdata;
+} blink1_hotplug_listener;
+
+// hash indexes into infos[] by serial, path, and open handle.
+// open addressing with linear probing, slots hold (cache index + 1),
+// 0 is empty.  All three tables share one power-of-two size.
+enum { BLINK1_IDX_SERIAL, BLINK1_IDX_PATH, BLINK1_IDX_DEV, BLINK1_IDX_COUNT };
+
+// everything that used to be a global, see blink1_contextNew()
+struct blink1_context_ {
+    blink1_mutex_t lock;    // recursive, guards everything below
+
+    blink1_info* infos;     // grows as needed, see blink1_cacheReserve()
+    int cached_count;       // number of cached entities
+    int infos_cap;          // number of allocated entities
+    int* idx[BLINK1_IDX_COUNT];
+    int idx_mask;           // table size - 1, -1 if no tables
+
+    int enable_degamma;
+
+    uint32_t pool_idle_millis;  // 0 = never auto-close
+    uint64_t pool_lastsweep;
+
+    blink1_hotplug_listener* listeners;
+    int nlisteners;
+    int lastlistenerid;
+    void* udev;             // hotplug monitor, see blink1-lib-hotplug-udev.h
+    void* udev_mon;
+
+    int verbose;            // send debug output to the log sink
+    int quiet;              // drop msg() output
+    blink1_log_fn logfn;    // NULL = stdout/stderr
+    void* logdata;
+
+    blink1_transport* transport;  // see blink1_ctxSetTransport()
+
+    int iostats;            // give devices opened from now on I/O stats
+
+    struct blink1_devstate_** states;  // by serial, see blink1_stateFor()
+    int nstates;
+    int states_cap;
+    uint32_t shadow_maxage;   // millis a value read from a device is trusted
+    int shadow_estimates;     // answer with modeled (mid-fade) colors
+
+    struct blink1_calentry_* cals;  // calibration profiles, see blink1_ctxSetCalibration()
+    int ncals;
+    int cals_cap;
+};
+
+// what a blink1_device* points to
+struct blink1_device_ {
+    blink1_context* ctx;    // context the device was opened in
+    blink1_transport* tr;   // transport it was opened with
+    void* hid;              // transport handle, e.g. hid_device*
+    blink1_iostats* iostats;  // NULL unless I/O stats were on at open
+    struct blink1_devstate_* state;  // what we know about it, may be NULL
+};
+
+// monotonic microsecond clock
+static uint64_t blink1_micros(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if( freq.QuadPart == 0 ) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+        (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t tb;
+    if( tb.denom == 0 ) mach_timebase_info(&tb);
+    return (mach_absolute_time() * tb.numer / tb.denom) / 1000;
 #else
-#define LOG(...) { if(blink1_lib_verbose) { fprintf(stderr, __VA_ARGS__); } }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 #endif
+}
+
+// monotonic millisecond clock
+static uint64_t blink1_millis(void)
+{
+    return blink1_micros() / 1000;
+}
 
 // addresses in EEPROM for mk1 blink(1) devices
 #define blink1_eeaddr_osccal        0
@@ -57,7 +139,20 @@ int blink1_lib_verbose = 0;
 #define blink1_serialnum_len        4
 #define blink1_eeaddr_patternstart (blink1_eeaddr_serialnum + blink1_serialnum_len)
 
-void blink1_sortCache(void);
+static void blink1_sortCache(blink1_context* ctx);
+static void blink1_poolCarryOver(blink1_context* ctx, blink1_info* prev, int prevcount);
+static int blink1_cacheReserve(blink1_context* ctx, int n);
+static void blink1_cacheSetDev(blink1_context* ctx, int i, blink1_device* dev);
+static void blink1_registryRebuild(blink1_context* ctx);
+static blink1Type_t blink1_serialToType(const char* serial);
+static struct blink1_devstate_* blink1_stateFor(blink1_context* ctx, const char* serial);
+static void blink1_stateForget(blink1_context* ctx, const char* serial);
+static void blink1_stateWrote(blink1_device* dev, const uint8_t* buf, int len, int rc);
+static void blink1_stateRead(blink1_device* dev, uint8_t cmd, uint8_t arg, const uint8_t* buf, int rc);
+static void blink1_statesFree(blink1_context* ctx);
+static int blink1_parseFail(blink1_parse_error* err, size_t offset, const char* msg);
+static void blink1_stateCalibrate(blink1_context* ctx, struct blink1_devstate_* st);
+static uint8_t blink1_degammaFor(blink1_device* dev, int c, uint8_t v);
 
 const char * const deviceTypeStrings[] =
     {
@@ -76,551 +171,3136 @@ const char * const deviceTypeStrings[] =
 #endif
 // default to USE_HIDAPI unless specifically told otherwise
 
+#include "blink1-lib-lowlevel-virtual.h"
 
-// -------------------------------------------------------------------------
-// everything below here doesn't need to know about USB details
-// except for a "blink1_device*"
-// -------------------------------------------------------------------------
 
-//
-// blink1 hardware api
-//
+static blink1_context blink1_default_ctx;
+static blink1_once_t blink1_default_once = BLINK1_ONCE_INIT;
 
-//
-int blink1_getCachedCount(void)
+int blink1_lib_verbose = 0;
+
+static void blink1_contextInit( blink1_context* ctx )
 {
-    return blink1_cached_count;
+    memset( ctx, 0, sizeof(blink1_context) );
+    blink1_mutex_init_recursive( &ctx->lock );
+    ctx->idx_mask = -1;
+    ctx->enable_degamma = 1;
+    ctx->pool_idle_millis = 1000;
+    ctx->transport = &blink1_transport_hid;
+    ctx->shadow_maxage = 1000;
+    ctx->shadow_estimates = 1;
 }
 
-//
-const char* blink1_getCachedPath(int i)
+// BLINK1_VIRTUAL=n starts the default context with n virtual devices
+static void blink1_defaultContextInit(void)
 {
-    if( i > blink1_getCachedCount()-1 ) return NULL;
-    return blink1_infos[i].path;
+    blink1_contextInit( &blink1_default_ctx );
+
+    const char* nvirt = getenv("BLINK1_VIRTUAL");
+    int n = (nvirt) ? atoi(nvirt) : 0;
+    if( n > 0 ) {
+        blink1_transport* t = blink1_virtualNew();
+        if( t == NULL ) return;
+        char serial[serialstrmax];
+        for( int i=0; i<n; i++ ) {
+            snprintf( serial, sizeof(serial), "%X", blink1mk3_serialstart + 0xB100000 + i );
+            blink1_virtualAdd( t, serial );
+        }
+        const char* lat = getenv("BLINK1_VIRTUAL_LATENCY");
+        if( lat ) blink1_virtualSetLatency( t, strtoul(lat, NULL, 0) );
+        const char* olat = getenv("BLINK1_VIRTUAL_OPEN_LATENCY");
+        if( olat ) blink1_virtualSetOpenLatency( t, strtoul(olat, NULL, 0) );
+        blink1_default_ctx.transport = t;
+    }
+
+    const char* calpath = getenv("BLINK1_CALIBRATION");
+    if( calpath && *calpath ) {
+        blink1_parse_error err;
+        if( blink1_ctxLoadCalibration( &blink1_default_ctx, calpath, &err ) == -1 ) {
+            // can't msg() here, it would re-enter blink1_defaultContext()
+            fprintf(stderr, "blink1-lib: BLINK1_CALIBRATION %s: %s at char %d\n",
+                    calpath, err.msg, err.offset);
+        }
+    }
 }
+
 //
-const char* blink1_getCachedSerial(int i)
+blink1_context* blink1_defaultContext(void)
 {
-    if( i > blink1_getCachedCount()-1 ) return NULL;
-    return blink1_infos[i].serial;
+    blink1_once( &blink1_default_once, blink1_defaultContextInit );
+    return &blink1_default_ctx;
 }
 
-int blink1_getCacheIndexByPath( const char* path )
+// context of a device, default context if dev is NULL
+static blink1_context* blink1_devCtx( blink1_device* dev )
 {
-    for( int i=0; i< cache_max; i++ ) {
-        if( strcmp( blink1_infos[i].path, (const char*) path ) == 0 ) return i;
-    }
-    return -1;
+    return (dev) ? dev->ctx : blink1_defaultContext();
 }
 
-int blink1_getCacheIndexById( uint32_t i )
+// wrap a transport handle, returns NULL if hid is NULL
+static blink1_device* blink1_devNew( blink1_context* ctx, void* hid )
 {
-    if( i > blink1_max_devices ) { // then i is a serial number not an array index
-        char serialstr[serialstrmax];
-        snprintf(serialstr, sizeof(serialstr), "%X", i); // convert to wchar_t*
-        return blink1_getCacheIndexBySerial( serialstr );
+    if( hid == NULL ) return NULL;
+    blink1_device* dev = malloc( sizeof(blink1_device) );
+    if( dev == NULL ) {
+        ctx->transport->close( ctx->transport, hid );
+        return NULL;
     }
-    return i;
+    dev->ctx = ctx;
+    dev->tr = ctx->transport;
+    dev->hid = hid;
+    dev->iostats = (ctx->iostats) ? calloc( 1, sizeof(blink1_iostats) ) : NULL;
+    dev->state = NULL;  // set once it's in the cache, see blink1_cacheSetDev()
+    return dev;
 }
 
-int blink1_getCacheIndexBySerial( const char* serial )
+#define blink1_lock(ctx)   blink1_mutex_lock( &(ctx)->lock )
+#define blink1_unlock(ctx) blink1_mutex_unlock( &(ctx)->lock )
+
+//
+// logging
+//
+
+static void blink1_vlog( blink1_context* ctx, int level, const char* fmt, va_list args )
 {
-    for( int i=0; i< cache_max; i++ ) {
-        if( strcasecmp( blink1_infos[i].serial, serial ) == 0 ) return i;
+    if( ctx->logfn ) {
+        char line[1024];
+        vsnprintf( line, sizeof(line), fmt, args );
+        ctx->logfn( level, line, ctx->logdata );
+    }
+    else {
+        vfprintf( (level == BLINK1_LOG_DEBUG) ? stderr : stdout, fmt, args );
     }
-    return -1;
 }
 
-int blink1_getCacheIndexByDev( blink1_device* dev )
+// debug output for ctx (NULL = default context), if verbose is on
+static void blink1_log( blink1_context* ctx, const char* fmt, ... )
 {
-    for( int i=0; i< cache_max; i++ ) {
-        if( blink1_infos[i].dev == dev ) return i;
-    }
-    return -1;
+    if( ctx == NULL ) ctx = blink1_defaultContext();
+    if( !ctx->verbose && !(ctx == &blink1_default_ctx && blink1_lib_verbose) ) return;
+    va_list args;
+    va_start( args, fmt );
+    blink1_vlog( ctx, BLINK1_LOG_DEBUG, fmt, args );
+    va_end( args );
 }
 
-const char* blink1_getSerialForDev(blink1_device* dev)
+// set in Makefile to debug HIDAPI stuff
+#ifdef DEBUG_PRINTF
+#define LOGC(ctx, ...) fprintf(stderr, __VA_ARGS__)
+#else
+#define LOGC(ctx, ...) blink1_log(ctx, __VA_ARGS__)
+#endif
+#define LOG(...) LOGC(NULL, __VA_ARGS__)
+
+//
+void blink1_ctxSetLogger( blink1_context* ctx, blink1_log_fn fn, void* userdata )
 {
-    int i = blink1_getCacheIndexByDev( dev );
-    if( i>=0 ) return blink1_infos[i].serial;
-    return NULL;
+    blink1_lock(ctx);
+    ctx->logfn = fn;
+    ctx->logdata = userdata;
+    blink1_unlock(ctx);
 }
 
-int blink1_clearCacheDev( blink1_device* dev )
+//
+void blink1_ctxSetVerbose( blink1_context* ctx, int verbose )
 {
-    int i = blink1_getCacheIndexByDev( dev );
-    if( i>=0 ) blink1_infos[i].dev = NULL; // FIXME: hmmmm
-    return i;
+    ctx->verbose = verbose;
 }
 
-blink1Type_t blink1_deviceTypeById( int i )
+// -------------------------------------------------------------------------
+// everything below here doesn't need to know about USB details
+// except for a "blink1_device*"
+// -------------------------------------------------------------------------
+
+//
+// contexts
+//
+
+//
+blink1_context* blink1_contextNew(void)
 {
-    return blink1_infos[i].type;
+    blink1_context* ctx = malloc( sizeof(blink1_context) );
+    if( ctx ) blink1_contextInit( ctx );
+    return ctx;
 }
 
-// returns BLINK1_MK1, BLINK1_MK2, BLINK1_MK3, or BLINK1_MK4
-blink1Type_t blink1_deviceType( blink1_device* dev )
+//
+void blink1_contextFree( blink1_context* ctx )
 {
-  return blink1_deviceTypeById( blink1_getCacheIndexByDev(dev) );
+    if( ctx == NULL || ctx == &blink1_default_ctx ) return;
+    blink1_ctxHotplugStop( ctx );
+    for( int i=0; i < ctx->cached_count; i++ ) {
+        if( ctx->infos[i].dev ) blink1_close_internal( ctx->infos[i].dev );
+    }
+    for( int k=0; k < BLINK1_IDX_COUNT; k++ ) free( ctx->idx[k] );
+    free( ctx->infos );
+    blink1_statesFree( ctx );
+    free( ctx->cals );
+    free( ctx->listeners );
+    blink1_mutex_destroy( &ctx->lock );
+    free( ctx );
 }
 
-const char* blink1_deviceTypeToStr(blink1Type_t t)
+//
+blink1_context* blink1_getContext( blink1_device* dev )
 {
-    return deviceTypeStrings[t];
+    return blink1_devCtx( dev );
 }
 
-int blink1_isMk1ById( int i )
+//
+int blink1_enumerate(void)
 {
-    if( i>=0  && blink1_infos[i].type == BLINK1_MK1 ) return 1;
-    return 0;
+    return blink1_ctxEnumerate( blink1_defaultContext() );
 }
 
-int blink1_isMk2ById( int i )
+//
+int blink1_ctxEnumerate( blink1_context* ctx )
 {
-    if( i>=0  && blink1_infos[i].type == BLINK1_MK2 ) return 1;
-    return 0;
+    return blink1_ctxEnumerateByVidPid( ctx, blink1_vid(), blink1_pid() );
 }
 
-int blink1_isMk1( blink1_device* dev )
+//
+int blink1_enumerateByVidPid( int vid, int pid )
 {
-    return blink1_isMk1ById( blink1_getCacheIndexByDev(dev) );
+    return blink1_ctxEnumerateByVidPid( blink1_defaultContext(), vid, pid );
 }
 
-int blink1_isMk2( blink1_device* dev )
+//
+blink1_device* blink1_open(void)
 {
-    return blink1_isMk2ById( blink1_getCacheIndexByDev(dev) );
+    return blink1_ctxOpen( blink1_defaultContext() );
 }
 
-int blink1_getPattMax(blink1_device* dev) {
-  return blink1_pattMaxes[blink1_deviceType(dev)];
+//
+blink1_device* blink1_openByPath( const char* path )
+{
+    return blink1_ctxOpenByPath( blink1_defaultContext(), path );
 }
 
 //
-int blink1_getVersion(blink1_device *dev)
+blink1_device* blink1_openBySerial( const char* serial )
 {
-    char buf[blink1_buf_size] = {blink1_report_id, 'v' };
-    int len = sizeof(buf);
-
-    int rc = blink1_read(dev, buf, len);
-    if( rc != -1 ) // also no error
-        rc = ((buf[3]-'0') * 100) + (buf[4]-'0');
-    // rc is now version number or error
-    // FIXME: we don't know vals of errcodes
-    return rc;
+    return blink1_ctxOpenBySerial( blink1_defaultContext(), serial );
 }
 
-// mk1 only, not supported on mk2
-int blink1_eeread(blink1_device *dev, uint16_t addr, uint8_t* val)
+//
+blink1_device* blink1_openById( uint32_t id )
 {
-    char buf[blink1_buf_size] = {blink1_report_id, 'e', addr };
-    int len = sizeof(buf);
+    return blink1_ctxOpenById( blink1_defaultContext(), id );
+}
 
-    int rc = blink1_write(dev, buf, len );
-    blink1_sleep( 50 ); // FIXME:
-    if( rc != -1 ) // no error
-        rc = blink1_read(dev, buf, len );
-    if( rc != -1 )
-        *val = buf[3];
-    return rc;
+//
+// transports
+//
+
+//
+blink1_transport* blink1_transportHid(void)
+{
+    return &blink1_transport_hid;
 }
 
-// mk1 only, not supported on mk2
-int blink1_eewrite(blink1_device *dev, uint16_t addr, uint8_t val)
+//
+blink1_transport* blink1_ctxGetTransport( blink1_context* ctx )
 {
-    char buf[blink1_buf_size] = {blink1_report_id, 'E', addr, val };
+    return ctx->transport;
+}
 
-    int rc = blink1_write(dev, buf, sizeof(buf) );
+//
+void blink1_ctxSetTransport( blink1_context* ctx, blink1_transport* t )
+{
+    blink1_lock(ctx);
+    for( int i=0; i < ctx->cached_count; i++ ) {
+        blink1_info* bi = &ctx->infos[i];
+        if( bi->dev && bi->pooled && bi->refcnt == 0 ) {
+            blink1_close_internal( bi->dev );
+        }
+    }
+    // held handles are closed on release, since they're no longer cached
+    for( int i=0; i < ctx->cached_count; i++ ) {
+        blink1_stateForget( ctx, ctx->infos[i].serial );
+    }
+    ctx->cached_count = 0;
+    blink1_registryRebuild( ctx );
+    ctx->transport = (t) ? t : &blink1_transport_hid;
+    blink1_unlock(ctx);
+}
 
-    return rc;
+//
+void blink1_setTransport( blink1_transport* t )
+{
+    blink1_ctxSetTransport( blink1_defaultContext(), t );
 }
 
+typedef struct {
+    blink1_context* ctx;
+    int count;
+} blink1_enumerate_state;
 
-//
-int blink1_fadeToRGBN(blink1_device *dev,  uint16_t fadeMillis,
-                      uint8_t r, uint8_t g, uint8_t b, uint8_t n)
+// transport enumerate() callback, fills in ctx->infos[]
+static void blink1_enumerateAdd( const char* path, const char* serial, void* arg )
 {
-    int dms = fadeMillis/10;  // millis_divided_by_10
+    blink1_enumerate_state* es = arg;
+    blink1_context* ctx = es->ctx;
+    if( blink1_cacheReserve( ctx, es->count+1 ) != 0 ) return;
+    blink1_info* bi = &ctx->infos[es->count];
+    memset( bi, 0, sizeof(blink1_info) );
+    strncpy( bi->path, path, sizeof(bi->path)-1 );
+    strncpy( bi->serial, serial, sizeof(bi->serial)-1 );
+    bi->type = blink1_serialToType( bi->serial );
+    es->count++;
+}
 
-    char buf[blink1_buf_size];
+// get all matching devices by VID/PID pair
+int blink1_ctxEnumerateByVidPid(blink1_context* ctx, int vid, int pid)
+{
+    blink1_lock(ctx);
+    // keep the old list around so open handles can be carried over
+    int prevcount = ctx->cached_count;
+    blink1_info* prev = NULL;
+    if( prevcount ) {
+        prev = malloc( prevcount * sizeof(blink1_info) );
+        if( prev == NULL ) { blink1_unlock(ctx); return prevcount; }
+        memcpy( prev, ctx->infos, prevcount * sizeof(blink1_info) );
+    }
 
-    buf[0] = blink1_report_id;     // report id
-    buf[1] = 'c';   // command code for 'fade to rgb'
-    buf[2] = ((blink1_enable_degamma) ? blink1_degamma(r) : r );
-    buf[3] = ((blink1_enable_degamma) ? blink1_degamma(g) : g );
-    buf[4] = ((blink1_enable_degamma) ? blink1_degamma(b) : b );
-    buf[5] = (dms >> 8);
-    buf[6] = dms & 0xff;
-    buf[7] = n;
+    blink1_enumerate_state es = { ctx, 0 };
+    ctx->transport->enumerate( ctx->transport, vid, pid, blink1_enumerateAdd, &es );
+    int p = es.count;
 
-    int rc = blink1_write(dev, buf, sizeof(buf) );
+    LOGC(ctx, "blink1_enumerateByVidPid: done, %d devices found\n",p);
+    for( int i=0; i<p; i++ ) {
+        LOGC(ctx, "blink1_enumerateByVidPid: blink1_infos[%d].serial=%s\n",
+            i, ctx->infos[i].serial);
+    }
+    ctx->cached_count = p;
+    blink1_sortCache( ctx );
+    blink1_poolCarryOver( ctx, prev, prevcount );
+    free( prev );
+    blink1_unlock(ctx);
 
-    return rc;
+    return p;
 }
 
-
 //
-int blink1_fadeToRGB(blink1_device *dev,  uint16_t fadeMillis,
-                     uint8_t r, uint8_t g, uint8_t b)
+blink1_device* blink1_ctxOpenByPath(blink1_context* ctx, const char* path)
 {
-    int dms = fadeMillis/10;  // millis_divided_by_10
+    if( path == NULL ) return NULL;
 
-    uint8_t buf[9];
+    LOGC(ctx, "blink1_openByPath: %s\n", path);
 
-    buf[0] = blink1_report_id;     // report id
-    buf[1] = 'c';   // command code for 'fade to rgb'
-    buf[2] = ((blink1_enable_degamma) ? blink1_degamma(r) : r );
-    buf[3] = ((blink1_enable_degamma) ? blink1_degamma(g) : g );
-    buf[4] = ((blink1_enable_degamma) ? blink1_degamma(b) : b );
-    buf[5] = (dms >> 8);
-    buf[6] = dms & 0xff;
-    buf[7] = 0;
+    blink1_lock(ctx);
+    blink1_transport* t = ctx->transport;
+    blink1_device* handle = blink1_devNew( ctx, t->open( t, path, NULL ) );
 
-    int rc = blink1_write(dev, buf, sizeof(buf) );
+    LOGC(ctx, "blink1_openByPath: handle=%p\n",handle);
 
-    return rc;
+    int i = blink1_ctxGetCacheIndexByPath( ctx, path );
+    if( i >= 0 ) {  // good
+        blink1_cacheSetDev( ctx, i, handle );
+    }
+    else { // uh oh, not in cache, now what?
+      LOGC(ctx, "blink1_openByPath: error no match\n");
+    }
+    blink1_unlock(ctx);
+    return handle;
 }
 
 //
-int blink1_setRGB(blink1_device *dev, uint8_t r, uint8_t g, uint8_t b )
+blink1_device* blink1_ctxOpenBySerial(blink1_context* ctx, const char* serial)
 {
-    uint8_t buf[blink1_buf_size];
+    if( serial == NULL || strlen(serial) == 0 ) return NULL;
 
-    buf[0] = blink1_report_id;     // report id
-    buf[1] = 'n';   // command code for "set rgb now"
-    buf[2] = ((blink1_enable_degamma) ? blink1_degamma(r) : r );     // red
-    buf[3] = ((blink1_enable_degamma) ? blink1_degamma(g) : g );     // grn
-    buf[4] = ((blink1_enable_degamma) ? blink1_degamma(b) : b );     // blu
-    buf[5] = 0;
-    buf[6] = 0;
-    buf[7] = 0;
+    LOGC(ctx, "blink1_openBySerial: %s\n", serial);
+    blink1_lock(ctx);
+    int i = blink1_ctxGetCacheIndexBySerial( ctx, serial );
+    if( i >= 0 ) {
+        serial = ctx->infos[i].serial;
+    }
 
-    int rc = blink1_write(dev, buf, sizeof(buf) );
+    blink1_transport* t = ctx->transport;
+    blink1_device* handle = blink1_devNew( ctx, t->open( t, NULL, serial ) );
+    if( handle ) LOGC(ctx, "blink1_openBySerial: got a blink1_device handle\n");
 
-    return rc;
+    if( i >= 0 ) {
+        LOGC(ctx, "blink1_openBySerial: good, serial id:%d was in cache\n",i);
+        blink1_cacheSetDev( ctx, i, handle );
+    }
+    else { // uh oh, not in cache, now what?
+        LOGC(ctx, "blink1_openBySerial: uh oh, serial id:%d was NOT IN CACHE\n",i);
+    }
+    blink1_unlock(ctx);
+
+    return handle;
 }
 
-// mk2 devices only
-int blink1_readRGB(blink1_device *dev, uint16_t* fadeMillis,
-                   uint8_t* r, uint8_t* g, uint8_t* b,
-                   uint8_t ledn)
+//
+blink1_device* blink1_ctxOpenById( blink1_context* ctx, uint32_t i )
 {
-    if( blink1_isMk1(dev) ) {
-        return blink1_readRGB_mk1( dev, fadeMillis, r,g,b);
-    }
-    uint8_t buf[blink1_buf_size] = { blink1_report_id, 'r', 0,0,0, 0,0,ledn };
-    int rc = blink1_read(dev, buf, sizeof(buf) );
-    if( rc != -1 ) {
-        *r = buf[2];
-        *g = buf[3];
-        *b = buf[4];
-        *fadeMillis = ((buf[5]<<8) + (buf[6] &0xff)) * 10;
+    LOGC(ctx, "blink1_openById: %d \n", i );
+    if( blink1_idIsSerial(i) ) { // then i is a serial number not an array index
+        char serialstr[serialstrmax];
+        snprintf(serialstr, sizeof(serialstr), "%x", i);
+        return blink1_ctxOpenBySerial( ctx, serialstr );
     }
-    return rc;
+    // otherwise it's an index 0-(count-1)
+    blink1_lock(ctx);
+    blink1_device* dev = blink1_ctxOpenByPath( ctx, blink1_ctxGetCachedPath(ctx, i) );
+    blink1_unlock(ctx);
+    return dev;
 }
 
-
-//
-// args:
-// - on == 1 or 0, enable or disable
-// - millis == milliseconds to wait until triggering
-// - st == 1 or 0, stay lit or set off()  (mk2 firmware only)
-// FIXME: bug in firmware? yes in v204 devices, max time is 62 secs
-// - millis = 100000 => dms = 10000, dms_hi =  39, dms_lo =  16 :: real time = 34 secs
-// - millis =  50000 => dms =  5000, dms_hi =  19, dms_lo = 136 :: real time = 50 secs
-// - millis = 652800 => dms = 65280, dms_hi = 255, dms_lo =   0 :: real time = 62 secs
-// - millis =  62000 => dms =  6200, dms_hi =  24, dms_lo =  56 :: real time = 62 secs
 //
-int blink1_serverdown(blink1_device *dev, uint8_t on, uint32_t millis, uint8_t st,
-                      uint8_t startpos, uint8_t endpos)
+blink1_device* blink1_ctxOpen(blink1_context* ctx)
 {
-    uint16_t dms = millis / 10;  // millis_divided_by_10
-
-    // printf("serverdown: millis: %u, dms: %d = %d / %d\n", millis, dms, (dms>>8), (dms % 0xff) );
-    uint8_t buf[blink1_buf_size];
-    buf[0] = blink1_report_id;
-    buf[1] = 'D';
-    buf[2] = on;
-    buf[3] = (dms>>8);
-    buf[4] = (dms & 0xff);
-    buf[5] = st;  // mk2 only
-    buf[6] = startpos;
-    buf[7] = endpos;
+    blink1_ctxEnumerate( ctx );
 
-    int rc = blink1_write(dev, buf, sizeof(buf) );
-    return rc;
+    return blink1_ctxOpenById( ctx, 0 );
 }
 
 //
-int blink1_play(blink1_device *dev, uint8_t play, uint8_t startpos)
+// FIXME: should we have a blink1_close_all() too?
+//
+void blink1_close_internal( blink1_device* dev )
 {
-    return blink1_playloop(dev, play, startpos, 0,0);
+    LOGC(blink1_devCtx(dev), "close_internal:%p\n",dev);
+    if( dev != NULL ) {
+        blink1_asyncStop(dev);     // send anything still queued
+        blink1_clearCacheDev(dev); // FIXME: hmmm
+        dev->tr->close( dev->tr, dev->hid );
+        free(dev->iostats);
+        free(dev);
+    }
 }
 
-// mk2 devices only
-int blink1_playloop(blink1_device *dev, uint8_t play, uint8_t startpos,uint8_t endpos, uint8_t count)
+// count and time one report in op
+static void blink1_ioStatsRecord( blink1_iostats_op* op, int rc, uint64_t micros )
 {
-    uint8_t buf[blink1_buf_size];
-    buf[0] = blink1_report_id;
-    buf[1] = 'p';
-    buf[2] = play;
-    buf[3] = startpos;
-    buf[4] = endpos;
-    buf[5] = count;
-    buf[6] = 0;
-    buf[7] = 0;
+    uint64_t v = micros >> 5;
+    int b = 0;
+    while( v && b < blink1_iostats_buckets-1 ) { v >>= 1; b++; }
+
+    blink1_atomic_add64( &op->count, 1 );
+    if( rc < 0 ) blink1_atomic_add64( &op->errors, 1 );
+    blink1_atomic_add64( &op->totalMicros, micros );
+    blink1_atomic_max64( &op->maxMicros, micros );
+    blink1_atomic_add64( &op->hist[b], 1 );
+}
 
-    int rc = blink1_write(dev, buf, sizeof(buf) );
+// command byte of a report, for I/O stats
+#define blink1_ioStatsCmd(buf,len)  (((len) > 1) ? ((uint8_t*)(buf))[1] & 0x7f : 0)
+
+//
+int blink1_write( blink1_device* dev, void* buf, int len)
+{
+    uint8_t* b = buf;
+    LOGC(blink1_devCtx(dev), "blink1_write: %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x %2.2x\n",
+        b[0],b[1],b[2],b[3],b[4],b[5],b[6],b[7]);
+    if( dev==NULL ) {
+        return -1; // BLINK1_ERR_NOTOPEN;
+    }
+    int rc;
+    if( dev->iostats == NULL ) {
+        rc = dev->tr->write( dev->tr, dev->hid, buf, len );
+    }
+    else {
+        uint64_t t0 = blink1_micros();
+        rc = dev->tr->write( dev->tr, dev->hid, buf, len );
+        blink1_ioStatsRecord( &dev->iostats->cmds[blink1_ioStatsCmd(buf,len)].write,
+                              rc, blink1_micros() - t0 );
+    }
+    if( dev->state ) blink1_stateWrote( dev, buf, len, rc );
+    if( rc==-1 ) {
+        LOGC(dev->ctx, "blink1_write error (%s)\n", dev->tr->name);
+    }
     return rc;
 }
 
-// mk2 devices only
-int blink1_readPlayState(blink1_device *dev, uint8_t* playing,
-                         uint8_t* playstart, uint8_t* playend,
-                         uint8_t* playcount, uint8_t* playpos)
+//
+int blink1_read_nosend( blink1_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // BLINK1_ERR_NOTOPEN;
+    }
+    int rc;
+    if( dev->iostats == NULL ) {
+        rc = dev->tr->read( dev->tr, dev->hid, buf, len );
+    }
+    else {
+        int cmd = blink1_ioStatsCmd(buf,len);  // before buf gets the reply
+        uint64_t t0 = blink1_micros();
+        rc = dev->tr->read( dev->tr, dev->hid, buf, len );
+        blink1_ioStatsRecord( &dev->iostats->cmds[cmd].read, rc, blink1_micros() - t0 );
+    }
+    if( rc==-1 ) {
+        LOGC(dev->ctx, "error reading data (%s)\n", dev->tr->name);
+    }
+    return rc;
+}
+
+// len should contain length of buf
+// after call, len will contain actual len of buf read
+int blink1_read( blink1_device* dev, void* buf, int len)
+{
+    if( dev==NULL ) {
+        return -1; // BLINK1_ERR_NOTOPEN;
+    }
+    uint8_t* b = buf;
+    uint8_t cmd = b[1], arg = b[7];  // the reply overwrites them
+    blink1_write( dev, buf, len ); // FIXME: check rc
+    int rc = blink1_read_nosend( dev, buf, len );
+    if( dev->state ) blink1_stateRead( dev, cmd, arg, buf, rc );
+    return rc;
+}
+
+// FIXME: Does not work at all times
+// for mk1 devices only
+int blink1_readRGB_mk1(blink1_device *dev, uint16_t* fadeMillis,
+                       uint8_t* r, uint8_t* g, uint8_t* b)
+{
+    (void) fadeMillis;
+    uint8_t buf[blink1_buf_size] = { blink1_report_id };
+    int rc;
+    blink1_sleep( 50 ); // FIXME:
+    rc = blink1_read_nosend( dev, buf, sizeof(buf) );
+    *r = buf[2];
+    *g = buf[3];
+    *b = buf[4];
+    return rc;
+}
+
+//
+// blink1 hardware api
+//
+
+//
+int blink1_ctxGetCachedCount( blink1_context* ctx )
+{
+    return ctx->cached_count;
+}
+
+//
+int blink1_getCachedCount(void)
+{
+    return blink1_ctxGetCachedCount( blink1_defaultContext() );
+}
+
+//
+const char* blink1_ctxGetCachedPath( blink1_context* ctx, int i )
+{
+    const char* path = NULL;
+    blink1_lock(ctx);
+    if( i >= 0 && i < ctx->cached_count ) path = ctx->infos[i].path;
+    blink1_unlock(ctx);
+    return path;
+}
+
+//
+const char* blink1_getCachedPath(int i)
+{
+    return blink1_ctxGetCachedPath( blink1_defaultContext(), i );
+}
+
+//
+const char* blink1_ctxGetCachedSerial( blink1_context* ctx, int i )
+{
+    const char* serial = NULL;
+    blink1_lock(ctx);
+    if( i >= 0 && i < ctx->cached_count ) serial = ctx->infos[i].serial;
+    blink1_unlock(ctx);
+    return serial;
+}
+
+//
+const char* blink1_getCachedSerial(int i)
+{
+    return blink1_ctxGetCachedSerial( blink1_defaultContext(), i );
+}
+
+//
+// device registry hash indexes
+// (all of these are called with ctx->lock held)
+//
+
+// FNV-1a, optionally case-folded for serial numbers
+static uint32_t blink1_hashStr( const char* str, int nocase )
+{
+    uint32_t h = 2166136261u;
+    for( const unsigned char* c = (const unsigned char*)str; *c; c++ ) {
+        h ^= (nocase) ? tolower(*c) : *c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t blink1_hashPtr( const void* ptr )
+{
+    uint64_t v = (uint64_t)(uintptr_t)ptr;
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;  // murmur3 finalizer
+    v ^= v >> 33;
+    return (uint32_t)v;
+}
+
+static uint32_t blink1_idxHashKey( int kind, const void* key )
+{
+    if( kind == BLINK1_IDX_SERIAL ) return blink1_hashStr( key, 1 );
+    if( kind == BLINK1_IDX_PATH )   return blink1_hashStr( key, 0 );
+    return blink1_hashPtr( key );
+}
+
+static const void* blink1_idxKeyOf( blink1_context* ctx, int kind, int i )
+{
+    if( kind == BLINK1_IDX_SERIAL ) return ctx->infos[i].serial;
+    if( kind == BLINK1_IDX_PATH )   return ctx->infos[i].path;
+    return ctx->infos[i].dev;
+}
+
+static int blink1_idxMatch( blink1_context* ctx, int kind, int i, const void* key )
+{
+    if( kind == BLINK1_IDX_SERIAL ) return strcasecmp( ctx->infos[i].serial, key ) == 0;
+    if( kind == BLINK1_IDX_PATH )   return strcmp( ctx->infos[i].path, key ) == 0;
+    return ctx->infos[i].dev == key;
+}
+
+// return cache index for key, or -1
+static int blink1_idxFind( blink1_context* ctx, int kind, const void* key )
+{
+    int mask = ctx->idx_mask;
+    if( mask < 0 ) { // no tables (out of memory), fall back to scan
+        for( int i=0; i < ctx->cached_count; i++ ) {
+            if( blink1_idxMatch( ctx, kind, i, key ) ) return i;
+        }
+        return -1;
+    }
+    int* slots = ctx->idx[kind];
+    uint32_t h = blink1_idxHashKey( kind, key ) & mask;
+    while( slots[h] ) {
+        if( blink1_idxMatch( ctx, kind, slots[h]-1, key ) ) return slots[h]-1;
+        h = (h+1) & mask;
+    }
+    return -1;
+}
+
+static void blink1_idxInsert( blink1_context* ctx, int kind, int i )
+{
+    int mask = ctx->idx_mask;
+    if( mask < 0 ) return;
+    int* slots = ctx->idx[kind];
+    uint32_t h = blink1_idxHashKey( kind, blink1_idxKeyOf(ctx,kind,i) ) & mask;
+    while( slots[h] ) h = (h+1) & mask;
+    slots[h] = i+1;
+}
+
+// remove entry i, must be called before its key changes
+static void blink1_idxRemove( blink1_context* ctx, int kind, int i )
+{
+    int mask = ctx->idx_mask;
+    if( mask < 0 ) return;
+    int* slots = ctx->idx[kind];
+    uint32_t h = blink1_idxHashKey( kind, blink1_idxKeyOf(ctx,kind,i) ) & mask;
+    while( slots[h] && slots[h] != i+1 ) h = (h+1) & mask;
+    if( slots[h] == 0 ) return;
+    // backward-shift deletion, so lookups never need tombstones
+    uint32_t hole = h;
+    h = (h+1) & mask;
+    while( slots[h] ) {
+        uint32_t home = blink1_idxHashKey( kind, blink1_idxKeyOf(ctx,kind,slots[h]-1) ) & mask;
+        // move slots[h] into the hole if its home isn't between hole and h
+        if( ((h - home) & mask) >= ((h - hole) & mask) ) {
+            slots[hole] = slots[h];
+            hole = h;
+        }
+        h = (h+1) & mask;
+    }
+    slots[hole] = 0;
+}
+
+// rebuild all indexes, called whenever infos[] is reordered
+static void blink1_registryRebuild( blink1_context* ctx )
+{
+    int size = 16;
+    while( size < 2*ctx->cached_count ) size *= 2;
+    if( ctx->idx_mask+1 != size ) {
+        ctx->idx_mask = -1;
+        for( int k=0; k < BLINK1_IDX_COUNT; k++ ) {
+            free( ctx->idx[k] );
+            ctx->idx[k] = malloc( size * sizeof(int) );
+            if( ctx->idx[k] == NULL ) return;
+        }
+        ctx->idx_mask = size-1;
+    }
+    for( int k=0; k < BLINK1_IDX_COUNT; k++ ) {
+        memset( ctx->idx[k], 0, size * sizeof(int) );
+    }
+    for( int i=0; i < ctx->cached_count; i++ ) {
+        if( ctx->infos[i].serial[0] ) blink1_idxInsert( ctx, BLINK1_IDX_SERIAL, i );
+        if( ctx->infos[i].path[0] )   blink1_idxInsert( ctx, BLINK1_IDX_PATH, i );
+        if( ctx->infos[i].dev )       blink1_idxInsert( ctx, BLINK1_IDX_DEV, i );
+    }
+}
+
+// make room for at least n cache entries, returns -1 if out of memory
+static int blink1_cacheReserve( blink1_context* ctx, int n )
+{
+    if( n <= ctx->infos_cap ) return 0;
+    int cap = (ctx->infos_cap) ? ctx->infos_cap : 8;
+    while( cap < n ) cap *= 2;
+    blink1_info* infos = realloc( ctx->infos, cap * sizeof(blink1_info) );
+    if( infos == NULL ) return -1;
+    ctx->infos = infos;
+    ctx->infos_cap = cap;
+    return 0;
+}
+
+// set the open handle for cache entry i, keeping the handle index current
+static void blink1_cacheSetDev( blink1_context* ctx, int i, blink1_device* dev )
+{
+    if( i < 0 || i >= ctx->cached_count ) return;
+    if( ctx->infos[i].dev ) blink1_idxRemove( ctx, BLINK1_IDX_DEV, i );
+    ctx->infos[i].dev = dev;
+    if( dev ) blink1_idxInsert( ctx, BLINK1_IDX_DEV, i );
+    if( dev && dev->state == NULL ) {
+        dev->state = blink1_stateFor( ctx, ctx->infos[i].serial );
+    }
+}
+
+//
+int blink1_ctxCacheAdd( blink1_context* ctx, const char* path, const char* serial )
+{
+    if( path == NULL || serial == NULL ) return -1;
+    blink1_lock(ctx);
+    int i = blink1_idxFind( ctx, BLINK1_IDX_PATH, path );
+    if( i < 0 && blink1_cacheReserve( ctx, ctx->cached_count+1 ) == 0 ) {
+        i = ctx->cached_count;
+        blink1_info* bi = &ctx->infos[i];
+        memset( bi, 0, sizeof(blink1_info) );
+        strncpy( bi->path, path, sizeof(bi->path)-1 );
+        strncpy( bi->serial, serial, sizeof(bi->serial)-1 );
+        bi->type = blink1_serialToType( serial );
+        ctx->cached_count++;
+        if( 2*ctx->cached_count > ctx->idx_mask+1 ) {
+            blink1_registryRebuild( ctx );
+        }
+        else {
+            blink1_idxInsert( ctx, BLINK1_IDX_SERIAL, i );
+            blink1_idxInsert( ctx, BLINK1_IDX_PATH, i );
+        }
+    }
+    blink1_unlock(ctx);
+    return i;
+}
+
+//
+int blink1_cacheAdd( const char* path, const char* serial )
+{
+    return blink1_ctxCacheAdd( blink1_defaultContext(), path, serial );
+}
+
+//
+int blink1_ctxCacheRemove( blink1_context* ctx, int i )
+{
+    blink1_lock(ctx);
+    if( i < 0 || i >= ctx->cached_count ) {
+        i = -1;
+    }
+    else {
+        blink1_stateForget( ctx, ctx->infos[i].serial );  // unplugged
+        memmove( &ctx->infos[i], &ctx->infos[i+1],
+                 (ctx->cached_count-i-1) * sizeof(blink1_info) );
+        ctx->cached_count--;
+        blink1_registryRebuild( ctx );  // later entries moved down
+    }
+    blink1_unlock(ctx);
+    return i;
+}
+
+//
+int blink1_cacheRemove( int i )
+{
+    return blink1_ctxCacheRemove( blink1_defaultContext(), i );
+}
+
+//
+int blink1_ctxGetCacheIndexByPath( blink1_context* ctx, const char* path )
+{
+    if( path == NULL ) return -1;
+    blink1_lock(ctx);
+    int i = blink1_idxFind( ctx, BLINK1_IDX_PATH, path );
+    blink1_unlock(ctx);
+    return i;
+}
+
+int blink1_getCacheIndexByPath( const char* path )
+{
+    return blink1_ctxGetCacheIndexByPath( blink1_defaultContext(), path );
+}
+
+//
+int blink1_ctxGetCacheIndexById( blink1_context* ctx, uint32_t i )
+{
+    if( blink1_idIsSerial(i) ) { // then i is a serial number not an array index
+        char serialstr[serialstrmax];
+        snprintf(serialstr, sizeof(serialstr), "%X", i); // convert to wchar_t*
+        return blink1_ctxGetCacheIndexBySerial( ctx, serialstr );
+    }
+    if( (int)i >= ctx->cached_count ) return -1;
+    return i;
+}
+
+int blink1_getCacheIndexById( uint32_t i )
+{
+    return blink1_ctxGetCacheIndexById( blink1_defaultContext(), i );
+}
+
+//
+int blink1_ctxGetCacheIndexBySerial( blink1_context* ctx, const char* serial )
+{
+    if( serial == NULL ) return -1;
+    blink1_lock(ctx);
+    int i = blink1_idxFind( ctx, BLINK1_IDX_SERIAL, serial );
+    blink1_unlock(ctx);
+    return i;
+}
+
+int blink1_getCacheIndexBySerial( const char* serial )
+{
+    return blink1_ctxGetCacheIndexBySerial( blink1_defaultContext(), serial );
+}
+
+int blink1_getCacheIndexByDev( blink1_device* dev )
+{
+    if( dev == NULL ) return -1;
+    blink1_context* ctx = dev->ctx;
+    blink1_lock(ctx);
+    int i = blink1_idxFind( ctx, BLINK1_IDX_DEV, dev );
+    blink1_unlock(ctx);
+    return i;
+}
+
+const char* blink1_getSerialForDev(blink1_device* dev)
+{
+    const char* serial = NULL;
+    if( dev == NULL ) return NULL;
+    blink1_lock(dev->ctx);
+    int i = blink1_getCacheIndexByDev( dev );
+    if( i>=0 ) serial = dev->ctx->infos[i].serial;
+    blink1_unlock(dev->ctx);
+    return serial;
+}
+
+int blink1_clearCacheDev( blink1_device* dev )
+{
+    if( dev == NULL ) return -1;
+    blink1_context* ctx = dev->ctx;
+    blink1_lock(ctx);
+    int i = blink1_getCacheIndexByDev( dev );
+    if( i>=0 ) {
+        blink1_cacheSetDev( ctx, i, NULL );
+        ctx->infos[i].pooled = 0;
+        ctx->infos[i].refcnt = 0;
+    }
+    blink1_unlock(ctx);
+    return i;
+}
+
+//
+// blink1 device handle pool
+//
+// Handles are opened on first acquire, shared by later acquires of the
+// same device, and closed once they've been released and idle for
+// pool_idle_millis.  Pool state lives in the context's infos[] so it
+// follows the device across a re-enumerate.
+//
+
+// close idle handles, but not on every call
+static void blink1_poolSweep( blink1_context* ctx )
+{
+    if( ctx->pool_idle_millis == 0 ) return;
+    uint64_t now = blink1_millis();
+    if( now - ctx->pool_lastsweep < ctx->pool_idle_millis/2 ) return;
+    ctx->pool_lastsweep = now;
+    blink1_ctxPoolFlush( ctx, ctx->pool_idle_millis );
+}
+
+// if mayopen is 0, only take a handle that's already open
+static blink1_device* blink1_acquireByIndex( blink1_context* ctx, int i, int mayopen )
+{
+    blink1_device* dev = NULL;
+    blink1_lock(ctx);
+    if( i >= 0 && i < ctx->cached_count ) {
+        blink1_poolSweep( ctx );
+        blink1_info* bi = &ctx->infos[i];
+        if( bi->dev == NULL && mayopen ) {
+            blink1_device* d = blink1_ctxOpenByPath( ctx, bi->path );
+            bi = &ctx->infos[i];
+            if( d ) {
+                blink1_cacheSetDev( ctx, i, d );
+                bi->refcnt = 0;
+            }
+        }
+        if( bi->dev ) {
+            bi->pooled = 1;
+            bi->refcnt++;
+            LOGC(ctx, "blink1_acquire: %s refcnt=%d\n", bi->serial, bi->refcnt);
+            dev = bi->dev;
+        }
+    }
+    blink1_unlock(ctx);
+    return dev;
+}
+
+blink1_device* blink1_ctxAcquireById( blink1_context* ctx, uint32_t id )
+{
+    blink1_lock(ctx);
+    blink1_device* dev = blink1_acquireByIndex( ctx, blink1_ctxGetCacheIndexById(ctx, id), 1 );
+    blink1_unlock(ctx);
+    return dev;
+}
+
+blink1_device* blink1_ctxAcquireOpenById( blink1_context* ctx, uint32_t id )
+{
+    blink1_lock(ctx);
+    blink1_device* dev = blink1_acquireByIndex( ctx, blink1_ctxGetCacheIndexById(ctx, id), 0 );
+    blink1_unlock(ctx);
+    return dev;
+}
+
+blink1_device* blink1_ctxAcquireBySerial( blink1_context* ctx, const char* serial )
+{
+    if( serial == NULL ) return NULL;
+    blink1_lock(ctx);
+    blink1_device* dev = blink1_acquireByIndex( ctx, blink1_ctxGetCacheIndexBySerial(ctx, serial), 1 );
+    blink1_unlock(ctx);
+    return dev;
+}
+
+blink1_device* blink1_ctxAcquireByPath( blink1_context* ctx, const char* path )
+{
+    if( path == NULL ) return NULL;
+    blink1_lock(ctx);
+    blink1_device* dev = blink1_acquireByIndex( ctx, blink1_ctxGetCacheIndexByPath(ctx, path), 1 );
+    blink1_unlock(ctx);
+    return dev;
+}
+
+blink1_device* blink1_acquireById( uint32_t id )
+{
+    return blink1_ctxAcquireById( blink1_defaultContext(), id );
+}
+
+blink1_device* blink1_acquireOpenById( uint32_t id )
+{
+    return blink1_ctxAcquireOpenById( blink1_defaultContext(), id );
+}
+
+blink1_device* blink1_acquireBySerial( const char* serial )
+{
+    return blink1_ctxAcquireBySerial( blink1_defaultContext(), serial );
+}
+
+blink1_device* blink1_acquireByPath( const char* path )
+{
+    return blink1_ctxAcquireByPath( blink1_defaultContext(), path );
+}
+
+void blink1_release( blink1_device* dev )
+{
+    if( dev == NULL ) return;
+    blink1_context* ctx = dev->ctx;
+    blink1_lock(ctx);
+    int i = blink1_getCacheIndexByDev( dev );
+    if( i < 0 || !ctx->infos[i].pooled ) {
+        // not pooled, or device went away in a re-enumerate
+        blink1_close_internal( dev );
+    }
+    else {
+        blink1_info* bi = &ctx->infos[i];
+        if( bi->refcnt > 0 ) bi->refcnt--;
+        bi->atime = blink1_millis();
+        LOGC(ctx, "blink1_release: %s refcnt=%d\n", bi->serial, bi->refcnt);
+        blink1_poolSweep( ctx );
+    }
+    blink1_unlock(ctx);
+}
+
+void blink1_ctxSetPoolIdleMillis( blink1_context* ctx, uint32_t millis )
+{
+    ctx->pool_idle_millis = millis;
+}
+
+void blink1_setPoolIdleMillis( uint32_t millis )
+{
+    blink1_ctxSetPoolIdleMillis( blink1_defaultContext(), millis );
+}
+
+int blink1_ctxPoolFlush( blink1_context* ctx, uint32_t idle_millis )
+{
+    uint64_t now = blink1_millis();
+    int closed = 0;
+    blink1_lock(ctx);
+    for( int i=0; i < ctx->cached_count; i++ ) {
+        blink1_info* bi = &ctx->infos[i];
+        if( bi->pooled && bi->dev && bi->refcnt == 0 &&
+            now - bi->atime >= idle_millis ) {
+            LOGC(ctx, "blink1_poolFlush: closing %s\n", bi->serial);
+            blink1_device* dev = bi->dev;
+            blink1_close( dev );
+            closed++;
+        }
+    }
+    blink1_unlock(ctx);
+    return closed;
+}
+
+int blink1_poolFlush( uint32_t idle_millis )
+{
+    return blink1_ctxPoolFlush( blink1_defaultContext(), idle_millis );
+}
+
+// called by blink1_enumerate() to move open handles from the
+// previous device list into the new one
+static void blink1_poolCarryOver( blink1_context* ctx, blink1_info* prev, int prevcount )
+{
+    for( int j=0; j < prevcount; j++ ) {
+        int i = blink1_ctxGetCacheIndexByPath( ctx, prev[j].path );
+        if( i < 0 ) blink1_stateForget( ctx, prev[j].serial );  // unplugged
+        if( prev[j].dev == NULL ) continue;
+        if( i >= 0 ) {
+            blink1_cacheSetDev( ctx, i, prev[j].dev );
+            ctx->infos[i].pooled = prev[j].pooled;
+            ctx->infos[i].refcnt = prev[j].refcnt;
+            ctx->infos[i].atime  = prev[j].atime;
+        }
+        else if( prev[j].pooled && prev[j].refcnt == 0 ) {
+            // device is gone and nobody holds it, so close it now
+            blink1_close_internal( prev[j].dev );
+        }
+    }
+}
+
+//
+// hotplug
+//
+// On Linux (hidraw) a udev monitor adds and removes single devices from
+// the cache as they come and go, see blink1-lib-hotplug-udev.h.
+// Elsewhere blink1_hotplugStart() fails and apps fall back to
+// blink1_enumerate().
+//
+
+//
+int blink1_ctxHotplugRegister( blink1_context* ctx, blink1_hotplug_cb cb, void* userdata )
+{
+    int id = -1;
+    if( cb == NULL ) return -1;
+    blink1_lock(ctx);
+    blink1_hotplug_listener* l = realloc( ctx->listeners,
+        (ctx->nlisteners+1) * sizeof(blink1_hotplug_listener) );
+    if( l != NULL ) {
+        ctx->listeners = l;
+        id = ++ctx->lastlistenerid;
+        l[ctx->nlisteners].id = id;
+        l[ctx->nlisteners].cb = cb;
+        l[ctx->nlisteners].userdata = userdata;
+        ctx->nlisteners++;
+    }
+    blink1_unlock(ctx);
+    return id;
+}
+
+//
+void blink1_ctxHotplugUnregister( blink1_context* ctx, int id )
+{
+    blink1_lock(ctx);
+    for( int i=0; i < ctx->nlisteners; i++ ) {
+        if( ctx->listeners[i].id == id ) {
+            memmove( &ctx->listeners[i], &ctx->listeners[i+1],
+                (ctx->nlisteners-i-1) * sizeof(blink1_hotplug_listener) );
+            ctx->nlisteners--;
+            break;
+        }
+    }
+    blink1_unlock(ctx);
+}
+
+#if BLINK1_HOTPLUG_UDEV
+
+static void blink1_hotplugNotify( blink1_context* ctx, int event,
+                                  const char* serial, const char* path )
+{
+    for( int i=0; i < ctx->nlisteners; i++ ) {
+        ctx->listeners[i].cb( event, serial, path, ctx->listeners[i].userdata );
+    }
+}
+
+// drop cache entry i for a device that was unplugged
+static void blink1_hotplugDetach( blink1_context* ctx, int i )
+{
+    blink1_info* bi = &ctx->infos[i];
+    if( bi->dev && bi->pooled && bi->refcnt == 0 ) {
+        blink1_close_internal( bi->dev );  // nobody holds it, close it now
+    }
+    // handles still held are closed by blink1_release() or blink1_close()
+    blink1_ctxCacheRemove( ctx, i );
+}
+
+#include "blink1-lib-hotplug-udev.h"
+#else
+int blink1_ctxHotplugStart( blink1_context* ctx )
+{
+    (void)ctx;
+    return -1;
+}
+
+void blink1_ctxHotplugStop( blink1_context* ctx )
+{
+    (void)ctx;
+}
+
+int blink1_ctxHotplugPoll( blink1_context* ctx )
+{
+    (void)ctx;
+    return 0;
+}
+#endif
+
+int blink1_hotplugStart(void)
+{
+    return blink1_ctxHotplugStart( blink1_defaultContext() );
+}
+
+void blink1_hotplugStop(void)
+{
+    blink1_ctxHotplugStop( blink1_defaultContext() );
+}
+
+int blink1_hotplugPoll(void)
+{
+    return blink1_ctxHotplugPoll( blink1_defaultContext() );
+}
+
+int blink1_hotplugRegister( blink1_hotplug_cb cb, void* userdata )
+{
+    return blink1_ctxHotplugRegister( blink1_defaultContext(), cb, userdata );
+}
+
+void blink1_hotplugUnregister( int id )
+{
+    blink1_ctxHotplugUnregister( blink1_defaultContext(), id );
+}
+
+//
+blink1Type_t blink1_ctxDeviceTypeById( blink1_context* ctx, int i )
+{
+    blink1Type_t type = BLINK1_UNKNOWN;
+    blink1_lock(ctx);
+    if( i >= 0 && i < ctx->cached_count ) type = ctx->infos[i].type;
+    blink1_unlock(ctx);
+    return type;
+}
+
+blink1Type_t blink1_deviceTypeById( int i )
+{
+    return blink1_ctxDeviceTypeById( blink1_defaultContext(), i );
+}
+
+// guess device type from serial number range
+static blink1Type_t blink1_serialToType( const char* serial )
+{
+    uint32_t serialnum = strtoul( serial, NULL, 16 );
+    if( serialnum >= blink1mk4_serialstart ) return BLINK1_MK4;
+    if( serialnum >= blink1mk3_serialstart ) return BLINK1_MK3;
+    if( serialnum >= blink1mk2_serialstart ) return BLINK1_MK2;
+    return BLINK1_MK1;
+}
+
+// returns BLINK1_MK1, BLINK1_MK2, BLINK1_MK3, or BLINK1_MK4
+blink1Type_t blink1_deviceType( blink1_device* dev )
+{
+    if( dev == NULL ) return BLINK1_UNKNOWN;
+    return blink1_ctxDeviceTypeById( dev->ctx, blink1_getCacheIndexByDev(dev) );
+}
+
+const char* blink1_deviceTypeToStr(blink1Type_t t)
+{
+    return deviceTypeStrings[t];
+}
+
+int blink1_isMk1ById( int i )
+{
+    return blink1_deviceTypeById(i) == BLINK1_MK1;
+}
+
+int blink1_isMk2ById( int i )
+{
+    return blink1_deviceTypeById(i) == BLINK1_MK2;
+}
+
+int blink1_isMk1( blink1_device* dev )
+{
+    return blink1_deviceType(dev) == BLINK1_MK1;
+}
+
+int blink1_isMk2( blink1_device* dev )
+{
+    return blink1_deviceType(dev) == BLINK1_MK2;
+}
+
+int blink1_getPattMax(blink1_device* dev) {
+  return blink1_pattMaxes[blink1_deviceType(dev)];
+}
+
+//
+int blink1_getVersion(blink1_device *dev)
+{
+    char buf[blink1_buf_size] = {blink1_report_id, 'v' };
+    int len = sizeof(buf);
+
+    int rc = blink1_read(dev, buf, len);
+    if( rc != -1 ) // also no error
+        rc = ((buf[3]-'0') * 100) + (buf[4]-'0');
+    // rc is now version number or error
+    // FIXME: we don't know vals of errcodes
+    return rc;
+}
+
+// mk1 only, not supported on mk2
+int blink1_eeread(blink1_device *dev, uint16_t addr, uint8_t* val)
+{
+    char buf[blink1_buf_size] = {blink1_report_id, 'e', addr };
+    int len = sizeof(buf);
+
+    int rc = blink1_write(dev, buf, len );
+    blink1_sleep( 50 ); // FIXME:
+    if( rc != -1 ) // no error
+        rc = blink1_read(dev, buf, len );
+    if( rc != -1 )
+        *val = buf[3];
+    return rc;
+}
+
+// mk1 only, not supported on mk2
+int blink1_eewrite(blink1_device *dev, uint16_t addr, uint8_t val)
+{
+    char buf[blink1_buf_size] = {blink1_report_id, 'E', addr, val };
+
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+
+    return rc;
+}
+
+
+// fill in a 'fade to rgb' report, shared by the single and many-device calls
+static void blink1_makeFadeReport(blink1_device* dev, uint8_t* buf, uint16_t fadeMillis,
+                                  uint8_t r, uint8_t g, uint8_t b, uint8_t n)
+{
+    int dms = fadeMillis/10;  // millis_divided_by_10
+
+    buf[0] = blink1_report_id;     // report id
+    buf[1] = 'c';   // command code for 'fade to rgb'
+    buf[2] = blink1_degammaFor( dev, 0, r );
+    buf[3] = blink1_degammaFor( dev, 1, g );
+    buf[4] = blink1_degammaFor( dev, 2, b );
+    buf[5] = (dms >> 8);
+    buf[6] = dms & 0xff;
+    buf[7] = n;
+    buf[8] = 0;
+}
+
+//
+int blink1_fadeToRGBN(blink1_device *dev,  uint16_t fadeMillis,
+                      uint8_t r, uint8_t g, uint8_t b, uint8_t n)
+{
+    uint8_t buf[blink1_buf_size];
+
+    blink1_makeFadeReport( dev, buf, fadeMillis, r,g,b, n );
+
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+
+    return rc;
+}
+
+//
+// fan-out worker pool
+//
+// A parallel-for over device indices: jobs are split one index at a time
+// between the pool's workers and the calling thread, which then waits
+// for the last index to finish.
+//
+
+typedef struct blink1_fanout_job_ {
+    void (*fn)(void* ctx, int i);
+    void* ctx;
+    int n;         // number of indices
+    int next;      // next index to hand out
+    int pending;   // indices not yet finished
+    blink1_cond_t done;
+    struct blink1_fanout_job_* nextjob;
+} blink1_fanout_job;
+
+static int blink1_fanout_maxthreads = 8;
+static int blink1_fanout_nthreads = 0;
+static blink1_mutex_t blink1_fanout_lock;
+static blink1_cond_t  blink1_fanout_wake;
+static blink1_fanout_job* blink1_fanout_jobs = NULL;  // jobs with indices left
+static blink1_once_t blink1_fanout_once = BLINK1_ONCE_INIT;
+
+static void blink1_fanout_init(void)
+{
+    blink1_mutex_init( &blink1_fanout_lock );
+    blink1_cond_init( &blink1_fanout_wake );
+}
+
+// take the next index from the first job, call with lock held
+static blink1_fanout_job* blink1_fanout_take( int* i )
+{
+    blink1_fanout_job* job = blink1_fanout_jobs;
+    if( job == NULL ) return NULL;
+    *i = job->next++;
+    if( job->next == job->n ) { // no more to hand out, unlink
+        blink1_fanout_jobs = job->nextjob;
+    }
+    return job;
+}
+
+// run index i of job, call without lock held
+static void blink1_fanout_run( blink1_fanout_job* job, int i )
+{
+    job->fn( job->ctx, i );
+    blink1_mutex_lock( &blink1_fanout_lock );
+    if( --job->pending == 0 ) {
+        blink1_cond_signal( &job->done );
+    }
+    blink1_mutex_unlock( &blink1_fanout_lock );
+}
+
+static void* blink1_fanout_worker( void* arg )
+{
+    (void)arg;
+    blink1_mutex_lock( &blink1_fanout_lock );
+    while( 1 ) {
+        int i;
+        blink1_fanout_job* job = blink1_fanout_take( &i );
+        if( job == NULL ) {
+            blink1_cond_wait( &blink1_fanout_wake, &blink1_fanout_lock );
+            continue;
+        }
+        blink1_mutex_unlock( &blink1_fanout_lock );
+        blink1_fanout_run( job, i );
+        blink1_mutex_lock( &blink1_fanout_lock );
+    }
+    return NULL;
+}
+
+// call fn(ctx,i) for i in 0..n-1, concurrently, returns when all are done
+static void blink1_fanout( int n, void (*fn)(void* ctx, int i), void* ctx )
+{
+    if( n <= 0 ) return;
+    if( n == 1 || blink1_fanout_maxthreads <= 1 ) {
+        for( int i=0; i<n; i++ ) fn(ctx, i);
+        return;
+    }
+    blink1_once( &blink1_fanout_once, blink1_fanout_init );
+
+    blink1_fanout_job job;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.n = n;
+    job.next = 0;
+    job.pending = n;
+    job.nextjob = NULL;
+    blink1_cond_init( &job.done );
+
+    blink1_mutex_lock( &blink1_fanout_lock );
+    // lazily grow pool, calling thread counts as one worker
+    while( blink1_fanout_nthreads < blink1_fanout_maxthreads-1 &&
+           blink1_fanout_nthreads < n-1 ) {
+        blink1_thread_t t;
+        if( blink1_thread_create( &t, blink1_fanout_worker, NULL ) != 0 ) break;
+        blink1_fanout_nthreads++;
+    }
+    blink1_fanout_job** jp = &blink1_fanout_jobs;  // append to job list
+    while( *jp ) jp = &(*jp)->nextjob;
+    *jp = &job;
+    blink1_cond_broadcast( &blink1_fanout_wake );
+
+    // help out until our job is all handed out
+    while( job.next < job.n ) {
+        int i;
+        blink1_fanout_job* j = blink1_fanout_take( &i );
+        blink1_mutex_unlock( &blink1_fanout_lock );
+        blink1_fanout_run( j, i );
+        blink1_mutex_lock( &blink1_fanout_lock );
+    }
+    while( job.pending > 0 ) {
+        blink1_cond_wait( &job.done, &blink1_fanout_lock );
+    }
+    blink1_mutex_unlock( &blink1_fanout_lock );
+    blink1_cond_destroy( &job.done );
+}
+
+void blink1_setFanoutThreads( int n )
+{
+    blink1_fanout_maxthreads = (n < 1) ? 1 : n;
+}
+
+typedef struct {
+    blink1_device** devs;
+    uint16_t fadeMillis;
+    uint8_t r, g, b, n;
+    int* results;
+} blink1_fadeMany_ctx;
+
+static void blink1_fadeMany_one( void* ctx, int i )
+{
+    blink1_fadeMany_ctx* fm = ctx;
+    uint8_t buf[blink1_buf_size];
+    // built per device, devices may belong to contexts with different degamma
+    blink1_makeFadeReport( fm->devs[i], buf, fm->fadeMillis, fm->r,fm->g,fm->b, fm->n );
+    int rc = blink1_write( fm->devs[i], buf, sizeof(buf) );
+    fm->results[i] = (rc == -1) ? -1 : 0;
+}
+
+//
+int blink1_fadeToRGBMany(blink1_device** devs, int ndevs, uint16_t fadeMillis,
+                         uint8_t r, uint8_t g, uint8_t b, uint8_t n,
+                         int* results)
+{
+    if( devs == NULL || ndevs <= 0 ) return 0;
+
+    int* rcs = results;
+    if( rcs == NULL ) {
+        rcs = malloc( ndevs * sizeof(int) );
+        if( rcs == NULL ) return ndevs;
+    }
+    blink1_fadeMany_ctx fm = { devs, fadeMillis, r,g,b, n, rcs };
+    blink1_fanout( ndevs, blink1_fadeMany_one, &fm );
+
+    int failed = 0;
+    for( int i=0; i<ndevs; i++ ) {
+        if( rcs[i] != 0 ) failed++;
+    }
+    if( rcs != results ) free(rcs);
+    return failed;
+}
+
+
+//
+int blink1_fadeToRGB(blink1_device *dev,  uint16_t fadeMillis,
+                     uint8_t r, uint8_t g, uint8_t b)
+{
+    int dms = fadeMillis/10;  // millis_divided_by_10
+
+    uint8_t buf[9];
+
+    buf[0] = blink1_report_id;     // report id
+    buf[1] = 'c';   // command code for 'fade to rgb'
+    buf[2] = blink1_degammaFor( dev, 0, r );
+    buf[3] = blink1_degammaFor( dev, 1, g );
+    buf[4] = blink1_degammaFor( dev, 2, b );
+    buf[5] = (dms >> 8);
+    buf[6] = dms & 0xff;
+    buf[7] = 0;
+
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+
+    return rc;
+}
+
+//
+int blink1_setRGB(blink1_device *dev, uint8_t r, uint8_t g, uint8_t b )
+{
+    uint8_t buf[blink1_buf_size];
+
+    buf[0] = blink1_report_id;     // report id
+    buf[1] = 'n';   // command code for "set rgb now"
+    buf[2] = blink1_degammaFor( dev, 0, r );     // red
+    buf[3] = blink1_degammaFor( dev, 1, g );     // grn
+    buf[4] = blink1_degammaFor( dev, 2, b );     // blu
+    buf[5] = 0;
+    buf[6] = 0;
+    buf[7] = 0;
+
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+
+    return rc;
+}
+
+// mk2 devices only
+int blink1_readRGB(blink1_device *dev, uint16_t* fadeMillis,
+                   uint8_t* r, uint8_t* g, uint8_t* b,
+                   uint8_t ledn)
+{
+    if( blink1_isMk1(dev) ) {
+        return blink1_readRGB_mk1( dev, fadeMillis, r,g,b);
+    }
+    uint8_t buf[blink1_buf_size] = { blink1_report_id, 'r', 0,0,0, 0,0,ledn };
+    int rc = blink1_read(dev, buf, sizeof(buf) );
+    if( rc != -1 ) {
+        *r = buf[2];
+        *g = buf[3];
+        *b = buf[4];
+        *fadeMillis = ((buf[5]<<8) + (buf[6] &0xff)) * 10;
+    }
+    return rc;
+}
+
+
+//
+// args:
+// - on == 1 or 0, enable or disable
+// - millis == milliseconds to wait until triggering
+// - st == 1 or 0, stay lit or set off()  (mk2 firmware only)
+// FIXME: bug in firmware? yes in v204 devices, max time is 62 secs
+// - millis = 100000 => dms = 10000, dms_hi =  39, dms_lo =  16 :: real time = 34 secs
+// - millis =  50000 => dms =  5000, dms_hi =  19, dms_lo = 136 :: real time = 50 secs
+// - millis = 652800 => dms = 65280, dms_hi = 255, dms_lo =   0 :: real time = 62 secs
+// - millis =  62000 => dms =  6200, dms_hi =  24, dms_lo =  56 :: real time = 62 secs
+//
+int blink1_serverdown(blink1_device *dev, uint8_t on, uint32_t millis, uint8_t st,
+                      uint8_t startpos, uint8_t endpos)
+{
+    uint16_t dms = millis / 10;  // millis_divided_by_10
+
+    // printf("serverdown: millis: %u, dms: %d = %d / %d\n", millis, dms, (dms>>8), (dms % 0xff) );
+    uint8_t buf[blink1_buf_size];
+    buf[0] = blink1_report_id;
+    buf[1] = 'D';
+    buf[2] = on;
+    buf[3] = (dms>>8);
+    buf[4] = (dms & 0xff);
+    buf[5] = st;  // mk2 only
+    buf[6] = startpos;
+    buf[7] = endpos;
+
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+    return rc;
+}
+
+//
+int blink1_play(blink1_device *dev, uint8_t play, uint8_t startpos)
+{
+    return blink1_playloop(dev, play, startpos, 0,0);
+}
+
+// mk2 devices only
+int blink1_playloop(blink1_device *dev, uint8_t play, uint8_t startpos,uint8_t endpos, uint8_t count)
+{
+    uint8_t buf[blink1_buf_size];
+    buf[0] = blink1_report_id;
+    buf[1] = 'p';
+    buf[2] = play;
+    buf[3] = startpos;
+    buf[4] = endpos;
+    buf[5] = count;
+    buf[6] = 0;
+    buf[7] = 0;
+
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+    return rc;
+}
+
+// mk2 devices only
+int blink1_readPlayState(blink1_device *dev, uint8_t* playing,
+                         uint8_t* playstart, uint8_t* playend,
+                         uint8_t* playcount, uint8_t* playpos)
 {
     uint8_t buf[blink1_buf_size] = { blink1_report_id, 'S', 0,0,0, 0,0,0 };
 
-    int rc = blink1_read(dev, buf, sizeof(buf) );
-    if( rc != -1 ) {
-        *playing   = buf[2];
-        *playstart = buf[3];
-        *playend   = buf[4];
-        *playcount = buf[5];
-        *playpos   = buf[6];
+    int rc = blink1_read(dev, buf, sizeof(buf) );
+    if( rc != -1 ) {
+        *playing   = buf[2];
+        *playstart = buf[3];
+        *playend   = buf[4];
+        *playcount = buf[5];
+        *playpos   = buf[6];
+    }
+    return rc;
+}
+
+
+//
+int blink1_writePatternLine(blink1_device *dev, uint16_t fadeMillis,
+                            uint8_t r, uint8_t g, uint8_t b,
+                            uint8_t pos)
+{
+    int dms = fadeMillis/10;  // millis_divided_by_10
+    r = blink1_degammaFor( dev, 0, r );
+    g = blink1_degammaFor( dev, 1, g );
+    b = blink1_degammaFor( dev, 2, b );
+
+    uint8_t buf[blink1_buf_size] =
+        {blink1_report_id, 'P', r,g,b, (dms>>8), (dms & 0xff), pos };
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+    return rc;
+}
+
+//
+int blink1_readPatternLine(blink1_device *dev, uint16_t* fadeMillis,
+                           uint8_t* r, uint8_t* g, uint8_t* b,
+                           uint8_t pos)
+{
+    uint8_t ledn;
+    return blink1_readPatternLineN( dev, fadeMillis, r,g,b, &ledn, pos);
+}
+
+//
+int blink1_readPatternLineN(blink1_device *dev, uint16_t* fadeMillis,
+                            uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* ledn,
+                            uint8_t pos)
+{
+    uint8_t buf[blink1_buf_size] = { blink1_report_id, 'R', 0,0,0, 0,0, pos };
+
+    int rc = blink1_read(dev, buf, sizeof(buf) );
+    if( rc != -1 ) {
+        *r = buf[2];
+        *g = buf[3];
+        *b = buf[4];
+        *fadeMillis = ((buf[5]<<8) + (buf[6] &0xff)) * 10;
+        *ledn = buf[7];
+    }
+    return rc;
+}
+
+// mk2 devices only, mk1 devices save on each writePatternLine()
+int blink1_savePattern( blink1_device *dev )
+{
+    uint8_t buf[blink1_buf_size];
+
+    buf[0] = blink1_report_id;     // report id
+    buf[1] = 'W';   // command code for "write pattern to flash"
+    buf[2] = 0xBE;
+    buf[3] = 0xEF;
+    buf[4] = 0xCA;
+    buf[5] = 0xFE;
+    buf[6] = 0x00;
+    buf[7] = 0x00;
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+    rc = 0; // assume success
+    // note rc will always return -1
+    // because of issue with flash programming timing out USB
+    return rc;
+}
+
+// only for devcies with fw val 204+
+int blink1_setLEDN( blink1_device* dev, uint8_t ledn)
+{
+    uint8_t buf[blink1_buf_size];
+
+    buf[0] = blink1_report_id;     // report id
+    buf[1] = 'l';   // command code for "set ledn"
+    buf[2] = ledn;
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+    return rc;
+}
+
+// only for devices with fw val 206+ or mk3
+int blink1_getStartupParams( blink1_device* dev, uint8_t* bootmode,
+                             uint8_t* playstart, uint8_t* playend, uint8_t* playcount)
+{
+  uint8_t buf[blink1_buf_size] = { blink1_report_id, 'b', 0,0,0, 0,0, 0 };
+
+  int rc = blink1_read(dev, buf, sizeof(buf) );
+  if( rc != -1 ) {
+    *bootmode  = buf[2];
+    *playstart = buf[3];
+    *playend   = buf[4];
+    *playcount = buf[5];
+  }
+  return rc;
+}
+
+// only for devices with fw val 206+ or mk3
+// FIXME: make 'params' a struct
+int blink1_setStartupParams( blink1_device* dev, uint8_t bootmode,
+                             uint8_t playstart, uint8_t playend, uint8_t playcount)
+{
+    uint8_t buf[blink1_buf_size];
+    buf[0] =  blink1_report_id;
+    buf[1] = 'B';
+    buf[2] = bootmode;   // (0=normal, 1=play, 2=off)
+    buf[3] = playstart;
+    buf[4] = playend;
+    buf[5] = playcount;
+    buf[6] = 0;          // unused1
+    buf[7] = 0;          // unused2
+    int rc = blink1_write(dev, buf, sizeof(buf) );
+    return rc;
+}
+
+// only for mk3
+int blink1_writeNote( blink1_device* dev, uint8_t noteid, const uint8_t* notebuf)
+{
+  uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'F', noteid };
+  memcpy( buf+3, notebuf, blink1_note_size ); // FIXME: notes are 100 bytes
+  //hexdump(stdout, (char*)notebuf, 15);
+  //hexdump(stdout, buf, 15);
+  int rc = blink1_write(dev, buf, sizeof(buf));
+  if( rc == -1 ) {
+    printf("blink1_writeNote: oops error\n");
+  }
+  return rc;
+}
+
+// only for mk3
+int blink1_readNote( blink1_device* dev, uint8_t noteid,  uint8_t** notebuf)
+{
+    uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'f', noteid  };
+
+    int rc = blink1_read(dev, buf, sizeof(buf) );
+    //int rc = blink1_write(dev, buf, sizeof(buf)-1 ); // why does this need to be one shorter?
+    //rc = blink1_read_nosend(dev, buf, sizeof(buf) );
+
+    uint8_t* notedata = buf+3;
+    memcpy( *notebuf, notedata, blink1_note_size); // skip over report id, cmd FIXME: harccoded 100
+
+    return rc;
+}
+
+/**
+ * Tell blink(1) to reset into bootloader.
+ * @note: only for mk3+
+ */
+int blink1_bootloaderGo( blink1_device* dev )
+{
+  uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'G', 'o','B','o','o','t',0 };
+  int rc = blink1_read(dev, buf, sizeof(buf));
+  if( rc == -1 ) {
+    printf("blink1_bootloaderLock: oops error\n");
+  }
+  else {
+    printf("blink1 response: '%s'\n", buf);
+    if( strncmp("GOBOOT", (char*)buf+1, 6) != 0 ) {
+      printf("blink1_bootloaderLock: bootloader is locked\n");
+      rc = 01; // fail
+    }
+  }
+  return rc;  // >0 on good completion
+}
+
+/**
+ * Lock the ability to go into bootloader.
+ * (bootloader then only by hardware modification)
+ * @note:  only for mk3+
+ */
+int blink1_bootloaderLock( blink1_device* dev )
+{
+  uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'L', 'o','c','k','B','o','o','t','l','o','a','d' };
+  int rc = blink1_read(dev, buf, sizeof(buf));
+  if( rc == -1 ) {
+    printf("blink1_bootlaoderLock: oops error\n");
+  }
+  else {
+    printf("blink1 response: %s\n", buf+1);
+    if( strncmp("LOCKED", (char*)buf+1, 6) != 0 ) {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+// only for mk3
+// idbuf must be at least blink1_report2_size-2 big
+//
+int blink1_getId( blink1_device *dev, uint8_t** idbuf )
+{
+    uint8_t buf[blink1_report2_size] = { blink1_report2_id, 'U', 0,0,0, 0,0,0 };
+    int rc = blink1_read(dev, buf, sizeof(buf));
+    if( rc != -1 ) {
+      memcpy( idbuf, buf+2, blink1_report2_size-2); // skip over report id & cmd
+    }
+    else {
+      printf("getId: read error: rc=%d\n", rc);
+    }
+    return rc;
+}
+
+//
+int blink1_testtest( blink1_device *dev, uint8_t reportid )
+{
+    uint8_t count = (reportid==1) ? blink1_buf_size : blink1_buf2_size;
+    uint8_t buf[blink1_report2_size] = { reportid, '!', 0,0,0, 0,0,0 };
+
+    int rc = blink1_write(dev, buf, count );
+    blink1_sleep( 50 ); //FIXME:
+    if( rc != -1 ) { // no error
+        rc = blink1_read(dev, buf, count);
+        for( int i=0; i<count; i++ ) {
+            printf("%2.2x,",(uint8_t)buf[i]);
+        }
+        printf("\n");
+    }
+    else {
+        printf("testtest error: rc=%d\n", rc);
+    }
+    return rc;
+}
+
+//
+// device state
+//
+// The host keeps a blink1_devstate per serial number, so it outlives
+// handles that the pool closes and reopens.  blink1_write() and
+// blink1_read() feed every report through it, so it stays current no
+// matter which call (sync, async or raw) talked to the device.  It's
+// forgotten when the device is unplugged, since a replugged blink(1)
+// reloads its pattern RAM from flash.
+//
+// It holds the pattern RAM image (see blink1_patternSync()), and a
+// shadow of each LED's fade and the play state (see blink1_shadow*()).
+// Pattern RAM only changes when we write it, so the image is always
+// exact.  LEDs and play position change on the device by themselves:
+// fades are modeled from the commands sent, and anything a playing
+// pattern (or a fired servertickle) does is treated as unknown.
+//
+
+#define blink1_pattmax_all  32  // largest of blink1_pattMaxes[]
+#define blink1_shadow_leds  18  // LEDs tracked per device, ledn 1-18
+
+typedef struct {
+    uint8_t rep[5];     // r,g,b, fade time hi,lo, as in a 'P' report
+    uint8_t ledn;
+    uint8_t known;
+} blink1_pattimage_line;
+
+// where an LED's shadow came from
+enum { BLINK1_SRC_NONE = 0, BLINK1_SRC_CMD, BLINK1_SRC_READ };
+
+typedef struct {
+    uint8_t from[3];    // color when the fade started
+    uint8_t to[3];      // fade target
+    uint64_t start;     // micros the fade started, or when read
+    uint32_t dur;       // micros
+    uint16_t dms;       // fade time as sent, millis/10
+    uint8_t fromknown;  // 0 if the fade started from an unknown color
+    uint8_t src;        // BLINK1_SRC_*
+} blink1_ledshadow;
+
+typedef struct blink1_devstate_ {
+    char serial[serialstrmax];
+    blink1_mutex_t lock;    // recursive, never held while taking ctx->lock
+    int pattmax;            // pattern lines the device has
+    int ledn;               // last setLEDN() value, -1 if unknown
+    blink1_pattimage_line patt[blink1_pattmax_all];
+    blink1_ledshadow leds[blink1_shadow_leds];
+    uint8_t playknown;      // play state below is valid
+    uint8_t playing, playstart, playend, playcount, playpos;
+    uint64_t tickle;        // micros servertickle fires at, 0 if off
+    uint64_t patthash;      // hash of the blink1_cpattern pattern RAM holds, 0 if none
+    uint8_t calibrated;     // cal came from a profile, not the plain curve
+    uint8_t cal[2][3][256]; // [degamma on][r,g,b][value], see blink1_stateCalibrate()
+} blink1_devstate;
+
+//
+static void blink1_stateClear( blink1_devstate* st )
+{
+    blink1_mutex_lock( &st->lock );
+    st->ledn = -1;
+    memset( st->patt, 0, sizeof(st->patt) );
+    memset( st->leds, 0, sizeof(st->leds) );
+    st->playknown = 0;
+    st->tickle = 0;
+    st->patthash = 0;
+    blink1_mutex_unlock( &st->lock );
+}
+
+// state for serial, created on first use.  Linear search is fine,
+// it only happens when a handle is opened.
+static blink1_devstate* blink1_stateFor( blink1_context* ctx, const char* serial )
+{
+    blink1_devstate* st = NULL;
+    blink1_lock(ctx);
+    for( int i=0; i < ctx->nstates; i++ ) {
+        if( strcmp( ctx->states[i]->serial, serial ) == 0 ) {
+            st = ctx->states[i];
+            break;
+        }
+    }
+    if( st == NULL && ctx->nstates == ctx->states_cap ) {
+        int cap = (ctx->states_cap) ? 2*ctx->states_cap : 8;
+        blink1_devstate** states = realloc( ctx->states, cap * sizeof(blink1_devstate*) );
+        if( states != NULL ) {
+            ctx->states = states;
+            ctx->states_cap = cap;
+        }
+    }
+    if( st == NULL && ctx->nstates < ctx->states_cap ) {
+        st = calloc( 1, sizeof(blink1_devstate) );
+        if( st != NULL ) {
+            snprintf( st->serial, sizeof(st->serial), "%s", serial );
+            blink1_mutex_init_recursive( &st->lock );
+            st->pattmax = blink1_pattMaxes[blink1_serialToType( serial )];
+            if( st->pattmax > blink1_pattmax_all ) st->pattmax = blink1_pattmax_all;
+            st->ledn = -1;
+            blink1_stateCalibrate( ctx, st );
+            ctx->states[ctx->nstates++] = st;
+        }
+    }
+    blink1_unlock(ctx);
+    return st;
+}
+
+// drop what we know about serial, e.g. when it's unplugged
+static void blink1_stateForget( blink1_context* ctx, const char* serial )
+{
+    blink1_lock(ctx);
+    for( int i=0; i < ctx->nstates; i++ ) {
+        if( strcmp( ctx->states[i]->serial, serial ) == 0 ) {
+            blink1_stateClear( ctx->states[i] );
+            break;
+        }
+    }
+    blink1_unlock(ctx);
+}
+
+//
+static void blink1_statesFree( blink1_context* ctx )
+{
+    for( int i=0; i < ctx->nstates; i++ ) {
+        blink1_mutex_destroy( &ctx->states[i]->lock );
+        free( ctx->states[i] );
+    }
+    free( ctx->states );
+    ctx->states = NULL;
+    ctx->nstates = ctx->states_cap = 0;
+}
+
+// color of LED l at time now, same model as the virtual devices use
+static void blink1_ledColorAt( const blink1_ledshadow* l, uint64_t now, uint8_t* rgb )
+{
+    if( l->dur == 0 || now >= l->start + l->dur ) {
+        memcpy( rgb, l->to, 3 );
+        return;
+    }
+    int64_t e = now - l->start;
+    for( int c=0; c<3; c++ ) {
+        rgb[c] = l->from[c] + ((int)l->to[c] - (int)l->from[c]) * e / (int64_t)l->dur;
+    }
+}
+
+// a fade to rgb was sent to ledn (0 = all) at now
+static void blink1_stateFade( blink1_devstate* st, uint8_t ledn, const uint8_t* rgb,
+                              uint16_t dms, uint64_t now, int ok )
+{
+    for( int i=0; i < blink1_shadow_leds; i++ ) {
+        if( ledn != 0 && ledn != i+1 ) continue;
+        blink1_ledshadow* l = &st->leds[i];
+        if( !ok ) {
+            l->src = BLINK1_SRC_NONE;
+            continue;
+        }
+        // only a settled, known color is a good starting point
+        l->fromknown = (l->src != BLINK1_SRC_NONE && (l->fromknown || now >= l->start + l->dur));
+        if( l->src != BLINK1_SRC_NONE ) blink1_ledColorAt( l, now, l->from );
+        memcpy( l->to, rgb, 3 );
+        l->start = now;
+        l->dur = (uint32_t)dms * 10000;
+        l->dms = dms;
+        l->src = BLINK1_SRC_CMD;
+    }
+}
+
+// track a report sent to dev (rc is what blink1_write() got)
+static void blink1_stateWrote( blink1_device* dev, const uint8_t* buf, int len, int rc )
+{
+    blink1_devstate* st = dev->state;
+    if( len < blink1_buf_size || buf[0] != blink1_report_id ) return;
+    uint8_t cmd = buf[1];
+    if( cmd != 'P' && cmd != 'l' && cmd != 'c' && cmd != 'n' &&
+        cmd != 'p' && cmd != 'D' ) return;
+    int ok = (rc != -1);
+    uint64_t now = blink1_micros();
+
+    blink1_mutex_lock( &st->lock );
+    switch( cmd ) {
+    case 'l':
+        st->ledn = (ok) ? buf[2] : -1;
+        break;
+    case 'P':
+        if( buf[7] < st->pattmax ) {
+            blink1_pattimage_line* l = &st->patt[buf[7]];
+            memcpy( l->rep, buf+2, sizeof(l->rep) );
+            l->ledn = (uint8_t)st->ledn;
+            l->known = (ok && st->ledn >= 0);
+            st->patthash = 0;
+        }
+        break;
+    case 'c':
+        blink1_stateFade( st, buf[7], buf+2, (buf[5]<<8) | buf[6], now, ok );
+        break;
+    case 'n':
+        blink1_stateFade( st, 0, buf+2, 0, now, ok );
+        break;
+    case 'p':
+        // a playing pattern takes over the LEDs
+        if( buf[2] || !ok ) memset( st->leds, 0, sizeof(st->leds) );
+        st->playknown = (ok && (buf[2] || st->playknown));
+        st->playing = buf[2];
+        if( buf[2] ) {
+            st->playstart = buf[3];
+            st->playend = buf[4];
+            st->playcount = buf[5];
+            st->playpos = buf[3];
+        }
+        break;
+    case 'D':
+        if( st->tickle && now >= st->tickle ) {  // it fired, who knows what played
+            memset( st->leds, 0, sizeof(st->leds) );
+            st->playknown = 0;
+        }
+        if( !ok ) st->tickle = now;  // might be on, assume the worst
+        else st->tickle = (buf[2]) ? now + (uint64_t)((buf[3]<<8) | buf[4]) * 10000 : 0;
+        break;
+    }
+    blink1_mutex_unlock( &st->lock );
+}
+
+// track a reply from dev to request cmd (arg is request byte 7)
+static void blink1_stateRead( blink1_device* dev, uint8_t cmd, uint8_t arg,
+                              const uint8_t* buf, int rc )
+{
+    blink1_devstate* st = dev->state;
+    if( rc == -1 ) return;
+    if( cmd != 'R' && cmd != 'r' && cmd != 'S' ) return;
+    uint64_t now = blink1_micros();
+
+    blink1_mutex_lock( &st->lock );
+    if( cmd == 'R' && arg < st->pattmax ) {
+        blink1_pattimage_line* l = &st->patt[arg];
+        if( !l->known || l->ledn != buf[7] || memcmp( l->rep, buf+2, sizeof(l->rep) ) != 0 ) {
+            st->patthash = 0;
+        }
+        memcpy( l->rep, buf+2, sizeof(l->rep) );
+        l->ledn = buf[7];
+        l->known = 1;
+    }
+    else if( cmd == 'r' && arg <= blink1_shadow_leds ) {
+        blink1_ledshadow* l = &st->leds[ (arg) ? arg-1 : 0 ];
+        if( l->src == BLINK1_SRC_CMD && now < l->start + l->dur ) {
+            // mid-fade, re-anchor the model on what the device says
+            l->dur = (uint32_t)(l->start + l->dur - now);
+            l->start = now;
+            memcpy( l->from, buf+2, 3 );
+            l->fromknown = 1;
+        }
+        else if( l->src != BLINK1_SRC_CMD || memcmp( l->to, buf+2, 3 ) != 0 ) {
+            // a reading, not something we commanded, so it ages
+            memcpy( l->from, buf+2, 3 );
+            memcpy( l->to, buf+2, 3 );
+            l->start = now;
+            l->dur = 0;
+            l->dms = (buf[5]<<8) | buf[6];
+            l->fromknown = 1;
+            l->src = BLINK1_SRC_READ;
+        }
+    }
+    else if( cmd == 'S' ) {
+        st->playknown = 1;
+        st->playing   = buf[2];
+        st->playstart = buf[3];
+        st->playend   = buf[4];
+        st->playcount = buf[5];
+        st->playpos   = buf[6];
+    }
+    blink1_mutex_unlock( &st->lock );
+}
+
+// make pattern line i of dev hold 'P' report rep (with ledn), unless
+// the image says it already does.  Called with st locked.
+static int blink1_syncLine( blink1_device* dev, blink1_devstate* st, int i,
+                            const uint8_t* rep, uint8_t ledn, int seed,
+                            blink1_pattsync_result* r )
+{
+    blink1_pattimage_line* l = (st && i < st->pattmax) ? &st->patt[i] : NULL;
+    int rc = 0;
+
+    if( l && !l->known && seed ) {
+        uint16_t millis;
+        uint8_t cr, cg, cb, cn;
+        blink1_readPatternLineN( dev, &millis, &cr,&cg,&cb, &cn, i ); // fills in l
+        r->reportsSent += 2;
+    }
+    if( l && l->known && l->ledn == ledn &&
+        memcmp( l->rep, rep+2, sizeof(l->rep) ) == 0 ) {
+        r->linesSkipped++;
+        return 0;
+    }
+    if( st == NULL || st->ledn != ledn ) {
+        if( blink1_setLEDN( dev, ledn ) == -1 ) rc = -1;
+        r->reportsSent++;
+    }
+    uint8_t buf[blink1_buf_size];
+    memcpy( buf, rep, sizeof(buf) );
+    if( blink1_write( dev, buf, sizeof(buf) ) == -1 ) rc = -1;
+    r->reportsSent++;
+    r->linesWritten++;
+    return rc;
+}
+
+//
+int blink1_patternSync( blink1_device* dev, const patternline_t* pattern, int n,
+                        int seed, blink1_pattsync_result* res )
+{
+    blink1_pattsync_result r = { n, 0, 0, 0, 0 };
+    if( dev == NULL || pattern == NULL || n < 0 ) return -1;
+    blink1_devstate* st = dev->state;
+    int rc = 0;
+
+    if( st ) blink1_mutex_lock( &st->lock );  // keep other writers out
+    for( int i=0; i<n; i++ ) {
+        const patternline_t* p = &pattern[i];
+        int dms = p->millis/10;
+        // same report as blink1_writePatternLine()
+        uint8_t rep[blink1_buf_size] = { blink1_report_id, 'P',
+                                         blink1_degammaFor( dev, 0, p->color.r ),
+                                         blink1_degammaFor( dev, 1, p->color.g ),
+                                         blink1_degammaFor( dev, 2, p->color.b ),
+                                         (dms>>8), (dms & 0xff), i };
+        if( blink1_syncLine( dev, st, i, rep, p->ledn, seed, &r ) == -1 ) rc = -1;
+    }
+    if( st ) blink1_mutex_unlock( &st->lock );
+
+    r.reportsAvoided = 2*n - r.reportsSent;
+    LOGC(dev->ctx, "blink1_patternSync: %d lines, %d written, %d reports avoided\n",
+         n, r.linesWritten, r.reportsAvoided);
+    if( res ) *res = r;
+    return rc;
+}
+
+//
+void blink1_patternForget( blink1_device* dev )
+{
+    if( dev && dev->state ) blink1_stateClear( dev->state );
+}
+
+//
+// compiled patterns
+//
+
+// 64-bit FNV-1a
+static uint64_t blink1_fnv1a( uint64_t h, const void* data, size_t len )
+{
+    const uint8_t* p = data;
+    for( size_t i=0; i<len; i++ ) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+//
+int blink1_cpatternCompile( blink1_cpattern* cp, const patternline_t* pattern, int n,
+                            int repeats, uint8_t brightness, int degamma )
+{
+    if( cp == NULL || pattern == NULL || n < 1 || n > blink1_cpattern_max ) return -1;
+    memset( cp, 0, sizeof(blink1_cpattern) );
+    cp->len = n;
+    cp->repeats = repeats;
+    cp->brightness = brightness;
+    cp->degamma = (degamma) ? 1 : 0;
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint8_t hdr[6] = { n, repeats & 0xff, (repeats>>8) & 0xff, brightness, cp->degamma, 0 };
+    h = blink1_fnv1a( h, hdr, sizeof(hdr) );
+    rgb_t colors[blink1_cpattern_max];
+    for( int i=0; i<n; i++ ) colors[i] = pattern[i].color;
+    blink1_adjustBrightnessMany( brightness, colors, n );
+    if( cp->degamma ) blink1_degammaMany( colors, n );
+    for( int i=0; i<n; i++ ) {
+        const patternline_t* p = &pattern[i];
+        uint8_t r = colors[i].r, g = colors[i].g, b = colors[i].b;
+        int dms = p->millis/10;
+        uint8_t* f = cp->fades[i];
+        uint8_t* w = cp->writes[i];
+        f[0] = w[0] = blink1_report_id;
+        f[1] = 'c';
+        w[1] = 'P';
+        f[2] = w[2] = r;
+        f[3] = w[3] = g;
+        f[4] = w[4] = b;
+        f[5] = w[5] = (dms>>8);
+        f[6] = w[6] = (dms & 0xff);
+        f[7] = p->ledn;
+        w[7] = i;
+        cp->lines[i] = *p;
+        cp->loopMillis += p->millis;
+
+        uint8_t line[7] = { p->color.r, p->color.g, p->color.b,
+                            p->millis >> 8, p->millis & 0xff, p->ledn, 0 };
+        h = blink1_fnv1a( h, line, sizeof(line) );
+    }
+    cp->hash = (h) ? h : 1;  // 0 means "no pattern" in the device state
+    return 0;
+}
+
+//
+int blink1_cpatternParse( blink1_cpattern* cp, const char* str, uint8_t brightness, int degamma,
+                          blink1_parse_error* err )
+{
+    patternline_t pattern[blink1_cpattern_max];
+    int repeats = 0;
+    if( cp == NULL ) return blink1_parseFail( err, 0, "no pattern" );
+    int n = blink1_parsePatternN( str, (str) ? strlen(str) : 0, &repeats,
+                                  pattern, blink1_cpattern_max, err );
+    if( n == -1 ) return -1;
+    if( n == 0 ) return blink1_parseFail( err, strlen(str), "no lines" );
+    return blink1_cpatternCompile( cp, pattern, n, repeats, brightness, degamma );
+}
+
+// line i of cp as a cmd ('c' or 'P') report for dev.  Precomputed
+// unless dev's context disagrees with cp about degamma, or dev has
+// its own calibration.
+static void blink1_cpatternReport( blink1_device* dev, const blink1_cpattern* cp, int i,
+                                   uint8_t cmd, uint8_t* buf )
+{
+    memcpy( buf, (cmd == 'c') ? cp->fades[i] : cp->writes[i], blink1_buf_size );
+    if( blink1_devCtx(dev)->enable_degamma != cp->degamma ||
+        (dev && dev->state && dev->state->calibrated) ) {
+        const patternline_t* p = &cp->lines[i];
+        uint8_t r = p->color.r, g = p->color.g, b = p->color.b;
+        blink1_adjustBrightness( cp->brightness, &r, &g, &b );
+        buf[2] = blink1_degammaFor( dev, 0, r );
+        buf[3] = blink1_degammaFor( dev, 1, g );
+        buf[4] = blink1_degammaFor( dev, 2, b );
+    }
+}
+
+//
+int blink1_cpatternWrite( blink1_device* dev, const blink1_cpattern* cp, int seed,
+                          blink1_pattsync_result* res )
+{
+    if( dev == NULL || cp == NULL ) return -1;
+    blink1_pattsync_result r = { cp->len, 0, 0, 0, 0 };
+    blink1_devstate* st = dev->state;
+    int exact = (blink1_devCtx(dev)->enable_degamma == cp->degamma);
+    int rc = 0;
+
+    if( st ) blink1_mutex_lock( &st->lock );
+    if( st && exact && st->patthash == cp->hash ) {
+        r.linesSkipped = cp->len;  // holds it already, nothing to compare
+    }
+    else {
+        for( int i=0; i<cp->len; i++ ) {
+            uint8_t rep[blink1_buf_size];
+            blink1_cpatternReport( dev, cp, i, 'P', rep );
+            if( blink1_syncLine( dev, st, i, rep, cp->lines[i].ledn, seed, &r ) == -1 ) rc = -1;
+        }
+        if( st && exact && rc == 0 && cp->len <= st->pattmax ) st->patthash = cp->hash;
+    }
+    if( st ) blink1_mutex_unlock( &st->lock );
+
+    r.reportsAvoided = 2*cp->len - r.reportsSent;
+    LOGC(dev->ctx, "blink1_cpatternWrite: %d lines, %d written, %d reports avoided\n",
+         cp->len, r.linesWritten, r.reportsAvoided);
+    if( res ) *res = r;
+    return rc;
+}
+
+//
+int blink1_cpatternFade( blink1_device* dev, const blink1_cpattern* cp, int i, int fadeMillis )
+{
+    if( dev == NULL || cp == NULL || i < 0 || i >= cp->len ) return -1;
+    uint8_t buf[blink1_buf_size];
+    blink1_cpatternReport( dev, cp, i, 'c', buf );
+    if( fadeMillis >= 0 ) {
+        int dms = fadeMillis/10;
+        buf[5] = (dms >> 8);
+        buf[6] = dms & 0xff;
+    }
+    return blink1_write( dev, buf, sizeof(buf) );
+}
+
+typedef struct {
+    blink1_device** devs;
+    const blink1_cpattern* cp;
+    int i;
+    int fadeMillis;
+    int* results;
+} blink1_cpatternFadeMany_ctx;
+
+static void blink1_cpatternFadeMany_one( void* ctx, int i )
+{
+    blink1_cpatternFadeMany_ctx* fm = ctx;
+    int rc = blink1_cpatternFade( fm->devs[i], fm->cp, fm->i, fm->fadeMillis );
+    fm->results[i] = (rc == -1) ? -1 : 0;
+}
+
+//
+int blink1_cpatternFadeMany( blink1_device** devs, int ndevs, const blink1_cpattern* cp,
+                             int i, int fadeMillis, int* results )
+{
+    if( devs == NULL || ndevs <= 0 ) return 0;
+
+    int* rcs = results;
+    if( rcs == NULL ) {
+        rcs = malloc( ndevs * sizeof(int) );
+        if( rcs == NULL ) return ndevs;
+    }
+    blink1_cpatternFadeMany_ctx fm = { devs, cp, i, fadeMillis, rcs };
+    blink1_fanout( ndevs, blink1_cpatternFadeMany_one, &fm );
+
+    int failed = 0;
+    for( int j=0; j<ndevs; j++ ) {
+        if( rcs[j] != 0 ) failed++;
+    }
+    if( rcs != results ) free(rcs);
+    return failed;
+}
+
+//
+// named pattern lookup, see blink1-lib-patterns.h
+//
+
+//
+int blink1_patternTableBuild( const char* const* names, int n, int nbuckets,
+                              uint16_t* disp, int16_t* slots )
+{
+    if( names == NULL || n < 1 || n > 32767 || nbuckets < 1 ) return -1;
+    uint32_t* h = malloc( n * sizeof(uint32_t) );
+    int* order = malloc( n * sizeof(int) );      // keys, grouped by bucket
+    int* start = calloc( nbuckets + 1, sizeof(int) );
+    int* bysize = malloc( nbuckets * sizeof(int) );
+    uint32_t* tried = malloc( n * sizeof(uint32_t) );
+    int rc = -1;
+    if( !h || !order || !start || !bysize || !tried ) goto done;
+
+    for( int i=0; i<n; i++ ) {
+        h[i] = blink1_patternHash( names[i] );
+        start[ h[i] % nbuckets + 1 ]++;
+    }
+    for( int b=0; b<nbuckets; b++ ) start[b+1] += start[b];
+    int* fill = bysize;  // borrowed as a cursor per bucket for a moment
+    for( int b=0; b<nbuckets; b++ ) fill[b] = start[b];
+    for( int i=0; i<n; i++ ) order[ fill[h[i] % nbuckets]++ ] = i;
+
+    // biggest buckets first, while the table is still mostly empty
+    for( int b=0; b<nbuckets; b++ ) bysize[b] = b;
+    for( int i=1; i<nbuckets; i++ ) {
+        int b = bysize[i], sz = start[b+1] - start[b], j = i;
+        while( j > 0 && start[bysize[j-1]+1] - start[bysize[j-1]] < sz ) {
+            bysize[j] = bysize[j-1];
+            j--;
+        }
+        bysize[j] = b;
+    }
+
+    for( int i=0; i<n; i++ ) slots[i] = -1;
+    for( int b=0; b<nbuckets; b++ ) disp[b] = 0;
+    for( int k=0; k<nbuckets; k++ ) {
+        int b = bysize[k];
+        int first = start[b], last = start[b+1];
+        if( first == last ) continue;
+        uint32_t d;
+        for( d=1; d <= 0xffff; d++ ) {
+            int ok = 1;
+            for( int j=first; j<last && ok; j++ ) {
+                uint32_t s = blink1_patternSlot( h[order[j]], d, n );
+                if( slots[s] != -1 ) ok = 0;
+                for( int q=first; q<j && ok; q++ ) {
+                    if( tried[q] == s ) ok = 0;   // two keys of this bucket collide
+                }
+                tried[j] = s;
+            }
+            if( ok ) break;
+        }
+        if( d > 0xffff ) goto done;  // equal names, or just unlucky
+        disp[b] = d;
+        for( int j=first; j<last; j++ ) slots[ tried[j] ] = order[j];
+    }
+    rc = 0;
+ done:
+    free( h ); free( order ); free( start ); free( bysize ); free( tried );
+    return rc;
+}
+
+//
+int blink1_patternTableGet( const blink1_pattern_table* t, const char* name )
+{
+    if( t == NULL || name == NULL || t->count == 0 ) return -1;
+    uint32_t h = blink1_patternHash( name );
+    uint32_t s = blink1_patternSlot( h, t->disp[ h % t->nbuckets ], t->count );
+    int i = t->slots[s];
+    return (i >= 0 && strcmp( t->patterns[i].name, name ) == 0) ? i : -1;
+}
+
+//
+void blink1_patternIndexInit( blink1_pattern_index* ix )
+{
+    ix->slots = NULL;
+    ix->mask = 0;
+    ix->count = 0;
+}
+
+//
+void blink1_patternIndexFree( blink1_pattern_index* ix )
+{
+    free( ix->slots );
+    blink1_patternIndexInit( ix );
+}
+
+// slot holding name, or the empty slot where it would go
+static uint32_t blink1_patternIndexProbe( const blink1_pattern_index* ix,
+                                          const char* name, uint32_t h )
+{
+    uint32_t i = h & ix->mask;
+    while( ix->slots[i].name != NULL ) {
+        if( ix->slots[i].hash == h && strcmp( ix->slots[i].name, name ) == 0 ) break;
+        i = (i + 1) & ix->mask;
+    }
+    return i;
+}
+
+//
+int blink1_patternIndexPut( blink1_pattern_index* ix, const char* name, int value )
+{
+    if( name == NULL ) return -1;
+    if( ix->slots == NULL || 2 * (uint32_t)(ix->count + 1) > ix->mask + 1 ) {
+        uint32_t n = (ix->slots) ? 2 * (ix->mask + 1) : 16;
+        blink1_pattern_slot* slots = calloc( n, sizeof(blink1_pattern_slot) );
+        if( slots == NULL ) return -1;
+        blink1_pattern_index grown = { slots, n - 1, ix->count };
+        for( uint32_t i=0; ix->slots && i <= ix->mask; i++ ) {
+            if( ix->slots[i].name == NULL ) continue;
+            grown.slots[ blink1_patternIndexProbe( &grown, ix->slots[i].name,
+                                                   ix->slots[i].hash ) ] = ix->slots[i];
+        }
+        free( ix->slots );
+        *ix = grown;
+    }
+    uint32_t h = blink1_patternHash( name );
+    uint32_t i = blink1_patternIndexProbe( ix, name, h );
+    if( ix->slots[i].name == NULL ) ix->count++;
+    ix->slots[i].hash = h;
+    ix->slots[i].name = name;
+    ix->slots[i].value = value;
+    return 0;
+}
+
+//
+int blink1_patternIndexGet( const blink1_pattern_index* ix, const char* name )
+{
+    if( ix->slots == NULL || name == NULL ) return -1;
+    uint32_t i = blink1_patternIndexProbe( ix, name, blink1_patternHash( name ) );
+    return (ix->slots[i].name) ? ix->slots[i].value : -1;
+}
+
+// backward-shift deletion, so there are no tombstones to skip later
+int blink1_patternIndexDel( blink1_pattern_index* ix, const char* name )
+{
+    if( ix->slots == NULL || name == NULL ) return -1;
+    uint32_t i = blink1_patternIndexProbe( ix, name, blink1_patternHash( name ) );
+    if( ix->slots[i].name == NULL ) return -1;
+    int value = ix->slots[i].value;
+    uint32_t j = i;
+    while( 1 ) {
+        j = (j + 1) & ix->mask;
+        if( ix->slots[j].name == NULL ) break;
+        uint32_t home = ix->slots[j].hash & ix->mask;
+        // move j back into the hole unless its home is in (i, j]
+        if( ((j - home) & ix->mask) >= ((j - i) & ix->mask) ) {
+            ix->slots[i] = ix->slots[j];
+            i = j;
+        }
+    }
+    ix->slots[i].name = NULL;
+    ix->count--;
+    return value;
+}
+
+//
+// state shadow queries
+//
+
+// how far to trust LED i's shadow at now, one of BLINK1_SHADOW_*
+static int blink1_stateLEDStatus( blink1_context* ctx, blink1_devstate* st, int i, uint64_t now )
+{
+    blink1_ledshadow* l = &st->leds[i];
+    if( (st->playknown && st->playing) || (st->tickle && now >= st->tickle) ) {
+        return BLINK1_SHADOW_UNKNOWN;  // a pattern owns the LEDs
+    }
+    if( l->src == BLINK1_SRC_CMD ) {
+        if( now < l->start + l->dur ) {
+            return (l->fromknown) ? BLINK1_SHADOW_ESTIMATED : BLINK1_SHADOW_UNKNOWN;
+        }
+        // without a known play state, a pattern might have overridden it
+        return (st->playknown) ? BLINK1_SHADOW_EXACT : BLINK1_SHADOW_ESTIMATED;
+    }
+    if( l->src == BLINK1_SRC_READ ) {
+        return (now - l->start <= (uint64_t)ctx->shadow_maxage * 1000) ?
+            BLINK1_SHADOW_EXACT : BLINK1_SHADOW_UNKNOWN;
+    }
+    return BLINK1_SHADOW_UNKNOWN;
+}
+
+//
+int blink1_shadowGetLED( blink1_device* dev, uint8_t ledn, blink1_shadow_led* led )
+{
+    if( led ) memset( led, 0, sizeof(blink1_shadow_led) );
+    if( dev == NULL || dev->state == NULL || led == NULL || ledn > blink1_shadow_leds ) {
+        return BLINK1_SHADOW_UNKNOWN;
+    }
+    blink1_devstate* st = dev->state;
+    int i = (ledn) ? ledn-1 : 0;
+    uint64_t now = blink1_micros();
+
+    blink1_mutex_lock( &st->lock );
+    int status = blink1_stateLEDStatus( dev->ctx, st, i, now );
+    if( status != BLINK1_SHADOW_UNKNOWN ) {
+        blink1_ledshadow* l = &st->leds[i];
+        blink1_ledColorAt( l, now, led->rgb );
+        memcpy( led->target, l->to, 3 );
+        led->fadeMillis = l->dms * 10;
+        led->fadeLeftMillis = (now < l->start + l->dur) ? (l->start + l->dur - now) / 1000 : 0;
+    }
+    blink1_mutex_unlock( &st->lock );
+    return status;
+}
+
+//
+int blink1_shadowReadRGB( blink1_device* dev, uint16_t* fadeMillis,
+                          uint8_t* r, uint8_t* g, uint8_t* b, uint8_t ledn )
+{
+    blink1_shadow_led led;
+    int status = blink1_shadowGetLED( dev, ledn, &led );
+    if( status == BLINK1_SHADOW_EXACT ||
+        (status == BLINK1_SHADOW_ESTIMATED && dev->ctx->shadow_estimates) ) {
+        *r = led.rgb[0];
+        *g = led.rgb[1];
+        *b = led.rgb[2];
+        *fadeMillis = led.fadeMillis;
+        return 0;
+    }
+    return blink1_readRGB( dev, fadeMillis, r,g,b, ledn );
+}
+
+//
+int blink1_shadowReadPlayState( blink1_device* dev, uint8_t* playing,
+                                uint8_t* playstart, uint8_t* playend,
+                                uint8_t* playcount, uint8_t* playpos )
+{
+    blink1_devstate* st = (dev) ? dev->state : NULL;
+    if( st ) {
+        uint64_t now = blink1_micros();
+        int known = 0;
+        blink1_mutex_lock( &st->lock );
+        // play position moves on its own, so only a stopped state is known
+        if( st->playknown && !st->playing && !(st->tickle && now >= st->tickle) ) {
+            *playing   = st->playing;
+            *playstart = st->playstart;
+            *playend   = st->playend;
+            *playcount = st->playcount;
+            *playpos   = st->playpos;
+            known = 1;
+        }
+        blink1_mutex_unlock( &st->lock );
+        if( known ) return 0;
+    }
+    return blink1_readPlayState( dev, playing, playstart, playend, playcount, playpos );
+}
+
+//
+int blink1_shadowReadPatternLineN( blink1_device* dev, uint16_t* fadeMillis,
+                                   uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* ledn,
+                                   uint8_t pos )
+{
+    blink1_devstate* st = (dev) ? dev->state : NULL;
+    if( st ) {
+        int known = 0;
+        blink1_mutex_lock( &st->lock );
+        if( pos < st->pattmax && st->patt[pos].known ) {
+            uint8_t* rep = st->patt[pos].rep;
+            *r = rep[0];
+            *g = rep[1];
+            *b = rep[2];
+            *fadeMillis = ((rep[3]<<8) + rep[4]) * 10;
+            *ledn = st->patt[pos].ledn;
+            known = 1;
+        }
+        blink1_mutex_unlock( &st->lock );
+        if( known ) return 0;
+    }
+    return blink1_readPatternLineN( dev, fadeMillis, r,g,b, ledn, pos );
+}
+
+//
+int blink1_shadowResync( blink1_device* dev )
+{
+    if( dev == NULL || dev->state == NULL ) return -1;
+    blink1_devstate* st = dev->state;
+    int mk2plus = (blink1_deviceType(dev) >= BLINK1_MK2);
+    int rc = 0;
+
+    blink1_mutex_lock( &st->lock );
+    uint64_t tickle = st->tickle;  // can't be read back
+    blink1_stateClear( st );
+    st->tickle = tickle;
+    blink1_mutex_unlock( &st->lock );
+
+    // the replies land in the shadow, see blink1_stateRead()
+    uint8_t r, g, b, n, playing, start, end, count, pos;
+    uint16_t millis;
+    if( mk2plus ) {
+        if( blink1_readPlayState( dev, &playing, &start, &end, &count, &pos ) == -1 ) rc = -1;
+        for( int i=1; i<=2; i++ ) {
+            if( blink1_readRGB( dev, &millis, &r,&g,&b, i ) == -1 ) rc = -1;
+        }
+    }
+    for( int i=0; i < st->pattmax; i++ ) {
+        if( blink1_readPatternLineN( dev, &millis, &r,&g,&b, &n, i ) == -1 ) rc = -1;
     }
     return rc;
 }
 
+//
+void blink1_ctxSetShadowMaxAge( blink1_context* ctx, uint32_t millis )
+{
+    ctx->shadow_maxage = millis;
+}
 
 //
-int blink1_writePatternLine(blink1_device *dev, uint16_t fadeMillis,
-                            uint8_t r, uint8_t g, uint8_t b,
-                            uint8_t pos)
+void blink1_setShadowMaxAge( uint32_t millis )
 {
-    int dms = fadeMillis/10;  // millis_divided_by_10
-    r = (blink1_enable_degamma) ? blink1_degamma(r) : r ;
-    g = (blink1_enable_degamma) ? blink1_degamma(g) : g ;
-    b = (blink1_enable_degamma) ? blink1_degamma(b) : b ;
+    blink1_ctxSetShadowMaxAge( blink1_defaultContext(), millis );
+}
 
-    uint8_t buf[blink1_buf_size] =
-        {blink1_report_id, 'P', r,g,b, (dms>>8), (dms & 0xff), pos };
-    int rc = blink1_write(dev, buf, sizeof(buf) );
-    return rc;
+//
+void blink1_ctxSetShadowEstimates( blink1_context* ctx, int on )
+{
+    ctx->shadow_estimates = on;
 }
 
 //
-int blink1_readPatternLine(blink1_device *dev, uint16_t* fadeMillis,
-                           uint8_t* r, uint8_t* g, uint8_t* b,
-                           uint8_t pos)
+void blink1_setShadowEstimates( int on )
 {
-    uint8_t ledn;
-    return blink1_readPatternLineN( dev, fadeMillis, r,g,b, &ledn, pos);
+    blink1_ctxSetShadowEstimates( blink1_defaultContext(), on );
 }
 
 //
-int blink1_readPatternLineN(blink1_device *dev, uint16_t* fadeMillis,
-                            uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* ledn,
-                            uint8_t pos)
+// async command queues
+//
+// Each device gets its own FIFO of pending reports (or calls), drained by
+// a worker thread that is started on the first async submit and stopped
+// by blink1_asyncStop() or blink1_close().  Submits only copy the report
+// into the queue, so they never wait on USB.
+//
+// Fades and sets from blink1_asyncFadeToRGBN() and blink1_asyncSetRGB()
+// are coalesced last-writer-wins (raw reports never are): a new one
+// replaces any still-pending ones for the same LED, looking back only as
+// far as the last ordered command (pattern write, playloop, call, etc.),
+// so those keep their place relative to the fades around them.
+//
+
+typedef struct {
+    uint8_t buf[blink1_buf2_size];
+    uint8_t len;               // 0 means 'call fn' instead of writing buf
+    uint8_t fade;              // a fade/set report, may be coalesced
+    blink1_async_fn fn;
+    void* arg;
+    blink1_async_cb cb;
+    void* userdata;
+    uint64_t enqueued;         // micros
+    int64_t ticket;
+} blink1_async_op;
+
+typedef struct blink1_async_queue_ {
+    blink1_device* dev;
+    blink1_thread_t thread;
+    blink1_mutex_t lock;
+    blink1_cond_t wake;        // worker waits here for ops
+    blink1_cond_t done;        // flush/wait wait here for completions
+    blink1_async_op* ops;      // ring buffer
+    int cap;
+    int head;
+    int count;
+    int stop;
+    int64_t inflight;          // ticket of op being sent, 0 if none
+    uint64_t errsSinceFlush;
+    blink1_async_stats stats;
+    uint64_t started;          // micros
+    struct blink1_async_queue_* next;
+} blink1_async_queue;
+
+static int blink1_async_maxdepth = 1024;
+static int blink1_async_coalesce = 1;
+static blink1_async_queue* blink1_async_queues = NULL;
+static blink1_mutex_t blink1_async_lock;  // protects blink1_async_queues
+static blink1_once_t blink1_async_once = BLINK1_ONCE_INIT;
+
+static void blink1_async_init(void)
 {
-    uint8_t buf[blink1_buf_size] = { blink1_report_id, 'R', 0,0,0, 0,0, pos };
+    blink1_mutex_init( &blink1_async_lock );
+}
 
-    int rc = blink1_read(dev, buf, sizeof(buf) );
-    if( rc != -1 ) {
-        *r = buf[2];
-        *g = buf[3];
-        *b = buf[4];
-        *fadeMillis = ((buf[5]<<8) + (buf[6] &0xff)) * 10;
-        *ledn = buf[7];
+// find queue for dev, call with blink1_async_lock held
+static blink1_async_queue* blink1_asyncFind( blink1_device* dev )
+{
+    blink1_async_queue* q = blink1_async_queues;
+    while( q && q->dev != dev ) q = q->next;
+    return q;
+}
+
+static void* blink1_asyncWorker( void* arg )
+{
+    blink1_async_queue* q = arg;
+    blink1_async_op op;
+
+    blink1_mutex_lock( &q->lock );
+    while( 1 ) {
+        while( q->count == 0 && !q->stop ) {
+            blink1_cond_wait( &q->wake, &q->lock );
+        }
+        if( q->count == 0 ) break; // stopped and drained
+
+        op = q->ops[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        q->stats.depth = q->count;
+        q->inflight = op.ticket;
+        blink1_mutex_unlock( &q->lock );
+
+        uint64_t t0 = blink1_micros();
+        int rc;
+        if( op.len ) {
+            rc = blink1_write( q->dev, op.buf, op.len );
+        } else {
+            rc = op.fn( q->dev, op.arg );
+        }
+        uint64_t t1 = blink1_micros();
+        if( op.cb ) op.cb( q->dev, rc, op.userdata );
+
+        blink1_mutex_lock( &q->lock );
+        uint64_t lat = t1 - op.enqueued;
+        q->inflight = 0;
+        q->stats.completed++;
+        q->stats.busyMicros += t1 - t0;
+        q->stats.latencyTotalMicros += lat;
+        if( lat > q->stats.latencyMaxMicros ) q->stats.latencyMaxMicros = lat;
+        if( rc == -1 ) {
+            q->stats.errors++;
+            q->errsSinceFlush++;
+        }
+        blink1_cond_broadcast( &q->done );
     }
-    return rc;
+    blink1_mutex_unlock( &q->lock );
+    return NULL;
 }
 
-// mk2 devices only, mk1 devices save on each writePatternLine()
-int blink1_savePattern( blink1_device *dev )
+// get queue for dev, starting its worker if needed
+static blink1_async_queue* blink1_asyncGet( blink1_device* dev )
 {
-    uint8_t buf[blink1_buf_size];
+    blink1_once( &blink1_async_once, blink1_async_init );
+    blink1_mutex_lock( &blink1_async_lock );
+    blink1_async_queue* q = blink1_asyncFind( dev );
+    if( q == NULL ) {
+        q = calloc( 1, sizeof(blink1_async_queue) );
+        if( q != NULL ) {
+            q->dev = dev;
+            q->started = blink1_micros();
+            blink1_mutex_init( &q->lock );
+            blink1_cond_init( &q->wake );
+            blink1_cond_init( &q->done );
+            if( blink1_thread_create( &q->thread, blink1_asyncWorker, q ) != 0 ) {
+                blink1_mutex_destroy( &q->lock );
+                blink1_cond_destroy( &q->wake );
+                blink1_cond_destroy( &q->done );
+                free(q);
+                q = NULL;
+            }
+            else {
+                q->next = blink1_async_queues;
+                blink1_async_queues = q;
+            }
+        }
+    }
+    blink1_mutex_unlock( &blink1_async_lock );
+    return q;
+}
 
-    buf[0] = blink1_report_id;     // report id
-    buf[1] = 'W';   // command code for "write pattern to flash"
-    buf[2] = 0xBE;
-    buf[3] = 0xEF;
-    buf[4] = 0xCA;
-    buf[5] = 0xFE;
-    buf[6] = 0x00;
-    buf[7] = 0x00;
-    int rc = blink1_write(dev, buf, sizeof(buf) );
-    rc = 0; // assume success
-    // note rc will always return -1
-    // because of issue with flash programming timing out USB
-    return rc;
+// which LED a fade/set report is for, 0 = all, -1 if not coalescable
+static int blink1_asyncFadeLed( blink1_async_op* op )
+{
+    if( !op->fade ) return -1;
+    if( op->buf[1] == 'c' ) return op->buf[7];
+    if( op->buf[1] == 'n' ) return 0;
+    return -1;
 }
 
-// only for devcies with fw val 204+
-int blink1_setLEDN( blink1_device* dev, uint8_t ledn)
+typedef struct {
+    blink1_async_cb cb;
+    void* userdata;
+} blink1_async_dropped;
+
+// drop pending fades superseded by op, call with q->lock held
+// returns number of dropped ops with callbacks put in drops
+static int blink1_asyncCoalesce( blink1_async_queue* q, blink1_async_op* op,
+                                 blink1_async_dropped* drops, int maxdrops )
 {
-    uint8_t buf[blink1_buf_size];
+    int led = blink1_asyncFadeLed( op );
+    int ndrops = 0;
+    if( led < 0 ) return 0;
+
+    for( int i = q->count-1; i >= 0; i-- ) {
+        blink1_async_op* o = &q->ops[(q->head + i) % q->cap];
+        int oled = blink1_asyncFadeLed( o );
+        if( oled < 0 ) break;            // ordered command, don't pass it
+        if( led != 0 && oled != led ) {
+            if( oled == 0 ) break;       // can't move past a fade of all LEDs
+            continue;                    // other LED, order doesn't matter
+        }
+        if( o->cb ) {
+            if( ndrops == maxdrops ) break;
+            drops[ndrops].cb = o->cb;
+            drops[ndrops].userdata = o->userdata;
+            ndrops++;
+        }
+        // close the gap, keeping the ring in submit order
+        for( int j = i; j < q->count-1; j++ ) {
+            q->ops[(q->head + j) % q->cap] = q->ops[(q->head + j + 1) % q->cap];
+        }
+        q->count--;
+        q->stats.completed++;
+        q->stats.coalesced++;
+    }
+    return ndrops;
+}
 
-    buf[0] = blink1_report_id;     // report id
-    buf[1] = 'l';   // command code for "set ledn"
-    buf[2] = ledn;
-    int rc = blink1_write(dev, buf, sizeof(buf) );
-    return rc;
+// add op to dev's queue, returns ticket or -1 on error
+static int64_t blink1_asyncSubmit( blink1_device* dev, blink1_async_op* op )
+{
+    blink1_async_dropped drops[16];
+    int ndrops = 0;
+    if( dev == NULL ) return -1;
+    blink1_async_queue* q = blink1_asyncGet( dev );
+    if( q == NULL ) return -1;
+
+    op->enqueued = blink1_micros();
+    blink1_mutex_lock( &q->lock );
+    if( blink1_async_coalesce ) {
+        ndrops = blink1_asyncCoalesce( q, op, drops, 16 );
+    }
+    if( q->count == q->cap ) {  // grow ring
+        if( q->cap >= blink1_async_maxdepth ) {
+            blink1_mutex_unlock( &q->lock );
+            return -1;
+        }
+        int ncap = (q->cap) ? q->cap * 2 : 16;
+        blink1_async_op* nops = malloc( ncap * sizeof(blink1_async_op) );
+        if( nops == NULL ) {
+            blink1_mutex_unlock( &q->lock );
+            return -1;
+        }
+        for( int i=0; i<q->count; i++ ) {
+            nops[i] = q->ops[(q->head + i) % q->cap];
+        }
+        free( q->ops );
+        q->ops = nops;
+        q->cap = ncap;
+        q->head = 0;
+    }
+    int64_t ticket = ++q->stats.submitted;
+    op->ticket = ticket;
+    q->ops[(q->head + q->count) % q->cap] = *op;
+    q->count++;
+    q->stats.depth = q->count;
+    if( q->count > (int)q->stats.maxDepth ) q->stats.maxDepth = q->count;
+    blink1_cond_signal( &q->wake );
+    if( ndrops ) blink1_cond_broadcast( &q->done );
+    blink1_mutex_unlock( &q->lock );
+
+    for( int i=0; i<ndrops; i++ ) {
+        drops[i].cb( dev, BLINK1_ASYNC_COALESCED, drops[i].userdata );
+    }
+    return ticket;
 }
 
-// only for devices with fw val 206+ or mk3
-int blink1_getStartupParams( blink1_device* dev, uint8_t* bootmode,
-                             uint8_t* playstart, uint8_t* playend, uint8_t* playcount)
+// queue a report, fade is 1 for fade/set reports that may be coalesced
+static int64_t blink1_asyncWriteOp( blink1_device* dev, void* buf, int len, int fade,
+                                    blink1_async_cb cb, void* userdata )
 {
-  uint8_t buf[blink1_buf_size] = { blink1_report_id, 'b', 0,0,0, 0,0, 0 };
+    blink1_async_op op;
+    if( buf == NULL || len <= 0 || len > blink1_buf2_size ) return -1;
+    memcpy( op.buf, buf, len );
+    op.len = len;
+    op.fade = fade;
+    op.cb = cb;
+    op.userdata = userdata;
+    return blink1_asyncSubmit( dev, &op );
+}
 
-  int rc = blink1_read(dev, buf, sizeof(buf) );
-  if( rc != -1 ) {
-    *bootmode  = buf[2];
-    *playstart = buf[3];
-    *playend   = buf[4];
-    *playcount = buf[5];
-  }
-  return rc;
+//
+int64_t blink1_asyncWrite( blink1_device* dev, void* buf, int len,
+                           blink1_async_cb cb, void* userdata )
+{
+    return blink1_asyncWriteOp( dev, buf, len, 0, cb, userdata );
 }
 
-// only for devices with fw val 206+ or mk3
-// FIXME: make 'params' a struct
-int blink1_setStartupParams( blink1_device* dev, uint8_t bootmode,
-                             uint8_t playstart, uint8_t playend, uint8_t playcount)
+//
+int64_t blink1_asyncCall( blink1_device* dev, blink1_async_fn fn, void* arg,
+                          blink1_async_cb cb, void* userdata )
+{
+    blink1_async_op op;
+    if( fn == NULL ) return -1;
+    op.len = 0;
+    op.fade = 0;
+    op.fn = fn;
+    op.arg = arg;
+    op.cb = cb;
+    op.userdata = userdata;
+    return blink1_asyncSubmit( dev, &op );
+}
+
+//
+int64_t blink1_asyncFadeToRGBN( blink1_device* dev, uint16_t fadeMillis,
+                                uint8_t r, uint8_t g, uint8_t b, uint8_t n,
+                                blink1_async_cb cb, void* userdata )
 {
     uint8_t buf[blink1_buf_size];
-    buf[0] =  blink1_report_id;
-    buf[1] = 'B';
-    buf[2] = bootmode;   // (0=normal, 1=play, 2=off)
-    buf[3] = playstart;
-    buf[4] = playend;
-    buf[5] = playcount;
-    buf[6] = 0;          // unused1
-    buf[7] = 0;          // unused2
-    int rc = blink1_write(dev, buf, sizeof(buf) );
-    return rc;
+    blink1_makeFadeReport( dev, buf, fadeMillis, r,g,b, n );
+    return blink1_asyncWriteOp( dev, buf, sizeof(buf), 1, cb, userdata );
 }
 
-// only for mk3
-int blink1_writeNote( blink1_device* dev, uint8_t noteid, const uint8_t* notebuf)
+//
+int64_t blink1_asyncSetRGB( blink1_device* dev, uint8_t r, uint8_t g, uint8_t b,
+                            blink1_async_cb cb, void* userdata )
 {
-  uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'F', noteid };
-  memcpy( buf+3, notebuf, blink1_note_size ); // FIXME: notes are 100 bytes
-  //hexdump(stdout, (char*)notebuf, 15);
-  //hexdump(stdout, buf, 15);
-  int rc = blink1_write(dev, buf, sizeof(buf));
-  if( rc == -1 ) {
-    printf("blink1_writeNote: oops error\n");
-  }
-  return rc;
+    uint8_t buf[blink1_buf_size] = { blink1_report_id, 'n',
+        blink1_degammaFor( dev, 0, r ),
+        blink1_degammaFor( dev, 1, g ),
+        blink1_degammaFor( dev, 2, b ), 0,0,0 };
+    return blink1_asyncWriteOp( dev, buf, sizeof(buf), 1, cb, userdata );
 }
 
-// only for mk3
-int blink1_readNote( blink1_device* dev, uint8_t noteid,  uint8_t** notebuf)
+//
+int64_t blink1_asyncWritePatternLine( blink1_device* dev, uint16_t fadeMillis,
+                                      uint8_t r, uint8_t g, uint8_t b,
+                                      uint8_t pos,
+                                      blink1_async_cb cb, void* userdata )
 {
-    uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'f', noteid  };
+    int dms = fadeMillis/10;  // millis_divided_by_10
+    r = blink1_degammaFor( dev, 0, r );
+    g = blink1_degammaFor( dev, 1, g );
+    b = blink1_degammaFor( dev, 2, b );
 
-    int rc = blink1_read(dev, buf, sizeof(buf) );
-    //int rc = blink1_write(dev, buf, sizeof(buf)-1 ); // why does this need to be one shorter?
-    //rc = blink1_read_nosend(dev, buf, sizeof(buf) );
+    uint8_t buf[blink1_buf_size] =
+        {blink1_report_id, 'P', r,g,b, (dms>>8), (dms & 0xff), pos };
+    return blink1_asyncWrite( dev, buf, sizeof(buf), cb, userdata );
+}
 
-    uint8_t* notedata = buf+3;
-    memcpy( *notebuf, notedata, blink1_note_size); // skip over report id, cmd FIXME: harccoded 100
+//
+int64_t blink1_asyncPlayloop( blink1_device* dev, uint8_t play,
+                              uint8_t startpos, uint8_t endpos, uint8_t count,
+                              blink1_async_cb cb, void* userdata )
+{
+    uint8_t buf[blink1_buf_size] =
+        { blink1_report_id, 'p', play, startpos, endpos, count, 0, 0 };
+    return blink1_asyncWrite( dev, buf, sizeof(buf), cb, userdata );
+}
 
-    return rc;
+//
+void blink1_asyncSetCoalescing( int on )
+{
+    blink1_async_coalesce = on;
 }
 
-/**
- * Tell blink(1) to reset into bootloader.
- * @note: only for mk3+
- */
-int blink1_bootloaderGo( blink1_device* dev )
+//
+int blink1_asyncWait( blink1_device* dev, int64_t ticket )
 {
-  uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'G', 'o','B','o','o','t',0 };
-  int rc = blink1_read(dev, buf, sizeof(buf));
-  if( rc == -1 ) {
-    printf("blink1_bootloaderLock: oops error\n");
-  }
-  else {
-    printf("blink1 response: '%s'\n", buf);
-    if( strncmp("GOBOOT", (char*)buf+1, 6) != 0 ) {
-      printf("blink1_bootloaderLock: bootloader is locked\n");
-      rc = 01; // fail
+    blink1_once( &blink1_async_once, blink1_async_init );
+    blink1_mutex_lock( &blink1_async_lock );
+    blink1_async_queue* q = blink1_asyncFind( dev );
+    blink1_mutex_unlock( &blink1_async_lock );
+    if( q == NULL ) return -1;
+
+    // tickets in the ring are in order, so only the oldest matters
+    blink1_mutex_lock( &q->lock );
+    while( (q->inflight && q->inflight <= ticket) ||
+           (q->count && q->ops[q->head].ticket <= ticket) ) {
+        blink1_cond_wait( &q->done, &q->lock );
     }
-  }
-  return rc;  // >0 on good completion
+    blink1_mutex_unlock( &q->lock );
+    return 0;
 }
 
-/**
- * Lock the ability to go into bootloader.
- * (bootloader then only by hardware modification)
- * @note:  only for mk3+
- */
-int blink1_bootloaderLock( blink1_device* dev )
+//
+int blink1_asyncFlush( blink1_device* dev )
 {
-  uint8_t buf[blink1_buf2_size] = { blink1_report2_id, 'L', 'o','c','k','B','o','o','t','l','o','a','d' };
-  int rc = blink1_read(dev, buf, sizeof(buf));
-  if( rc == -1 ) {
-    printf("blink1_bootlaoderLock: oops error\n");
-  }
-  else {
-    printf("blink1 response: %s\n", buf+1);
-    if( strncmp("LOCKED", (char*)buf+1, 6) != 0 ) {
-      rc = -1;
+    blink1_once( &blink1_async_once, blink1_async_init );
+    blink1_mutex_lock( &blink1_async_lock );
+    blink1_async_queue* q = blink1_asyncFind( dev );
+    blink1_mutex_unlock( &blink1_async_lock );
+    if( q == NULL ) return 0; // nothing was ever queued
+
+    blink1_mutex_lock( &q->lock );
+    while( q->count || q->inflight ) {
+        blink1_cond_wait( &q->done, &q->lock );
     }
-  }
-  return rc;
+    int errs = q->errsSinceFlush;
+    q->errsSinceFlush = 0;
+    blink1_mutex_unlock( &q->lock );
+    return errs;
 }
 
-// only for mk3
-// idbuf must be at least blink1_report2_size-2 big
 //
-int blink1_getId( blink1_device *dev, uint8_t** idbuf )
+int blink1_asyncStop( blink1_device* dev )
 {
-    uint8_t buf[blink1_report2_size] = { blink1_report2_id, 'U', 0,0,0, 0,0,0 };
-    int rc = blink1_read(dev, buf, sizeof(buf));
-    if( rc != -1 ) {
-      memcpy( idbuf, buf+2, blink1_report2_size-2); // skip over report id & cmd
-    }
-    else {
-      printf("getId: read error: rc=%d\n", rc);
+    blink1_once( &blink1_async_once, blink1_async_init );
+    blink1_mutex_lock( &blink1_async_lock );
+    blink1_async_queue** qp = &blink1_async_queues;
+    while( *qp && (*qp)->dev != dev ) qp = &(*qp)->next;
+    blink1_async_queue* q = *qp;
+    if( q ) *qp = q->next;
+    blink1_mutex_unlock( &blink1_async_lock );
+    if( q == NULL ) return 0;
+
+    blink1_mutex_lock( &q->lock );
+    q->stop = 1;
+    blink1_cond_signal( &q->wake );
+    blink1_mutex_unlock( &q->lock );
+    blink1_thread_join( q->thread );  // worker drains queue before exiting
+
+    int errs = q->errsSinceFlush;
+    blink1_mutex_destroy( &q->lock );
+    blink1_cond_destroy( &q->wake );
+    blink1_cond_destroy( &q->done );
+    free( q->ops );
+    free( q );
+    return errs;
+}
+
+//
+int blink1_asyncGetStats( blink1_device* dev, blink1_async_stats* stats )
+{
+    blink1_once( &blink1_async_once, blink1_async_init );
+    blink1_mutex_lock( &blink1_async_lock );
+    blink1_async_queue* q = blink1_asyncFind( dev );
+    blink1_mutex_unlock( &blink1_async_lock );
+    if( q == NULL || stats == NULL ) return -1;
+
+    blink1_mutex_lock( &q->lock );
+    *stats = q->stats;
+    stats->uptimeMicros = blink1_micros() - q->started;
+    blink1_mutex_unlock( &q->lock );
+    return 0;
+}
+
+//
+void blink1_asyncResetStats( blink1_device* dev )
+{
+    blink1_once( &blink1_async_once, blink1_async_init );
+    blink1_mutex_lock( &blink1_async_lock );
+    blink1_async_queue* q = blink1_asyncFind( dev );
+    blink1_mutex_unlock( &blink1_async_lock );
+    if( q == NULL ) return;
+
+    blink1_mutex_lock( &q->lock );
+    // keep submitted/completed, tickets are numbered from submitted
+    q->stats.maxDepth = q->count;
+    q->stats.errors = 0;
+    q->stats.coalesced = 0;
+    q->stats.busyMicros = 0;
+    q->stats.latencyTotalMicros = 0;
+    q->stats.latencyMaxMicros = 0;
+    q->started = blink1_micros();
+    blink1_mutex_unlock( &q->lock );
+}
+
+
+
+//
+// I/O stats
+//
+
+//
+void blink1_ctxSetIoStats( blink1_context* ctx, int on )
+{
+    blink1_lock(ctx);
+    ctx->iostats = on;
+    blink1_unlock(ctx);
+}
+
+//
+void blink1_setIoStats( int on )
+{
+    blink1_ctxSetIoStats( blink1_defaultContext(), on );
+}
+
+// blink1_iostats is nothing but uint64_t counters
+#define blink1_iostats_words  (sizeof(blink1_iostats) / sizeof(uint64_t))
+
+//
+int blink1_getIoStats( blink1_device* dev, blink1_iostats* stats )
+{
+    if( dev == NULL || dev->iostats == NULL || stats == NULL ) return -1;
+    uint64_t* src = (uint64_t*)dev->iostats;
+    uint64_t* dst = (uint64_t*)stats;
+    for( size_t i=0; i < blink1_iostats_words; i++ ) {
+        dst[i] = blink1_atomic_load64( &src[i] );
     }
-    return rc;
+    return 0;
 }
 
 //
-int blink1_testtest( blink1_device *dev, uint8_t reportid )
+void blink1_resetIoStats( blink1_device* dev )
 {
-    uint8_t count = (reportid==1) ? blink1_buf_size : blink1_buf2_size;
-    uint8_t buf[blink1_report2_size] = { reportid, '!', 0,0,0, 0,0,0 };
+    if( dev == NULL || dev->iostats == NULL ) return;
+    uint64_t* p = (uint64_t*)dev->iostats;
+    for( size_t i=0; i < blink1_iostats_words; i++ ) {
+        blink1_atomic_store64( &p[i], 0 );
+    }
+}
 
-    int rc = blink1_write(dev, buf, count );
-    blink1_sleep( 50 ); //FIXME:
-    if( rc != -1 ) { // no error
-        rc = blink1_read(dev, buf, count);
-        for( int i=0; i<count; i++ ) {
-            printf("%2.2x,",(uint8_t)buf[i]);
+//
+uint64_t blink1_ioStatsPercentile( const blink1_iostats_op* op, int pct )
+{
+    uint64_t total = 0;
+    for( int i=0; i < blink1_iostats_buckets; i++ ) total += op->hist[i];
+    if( total == 0 ) return 0;
+    if( pct < 0 ) pct = 0;
+    if( pct > 100 ) pct = 100;
+
+    uint64_t want = (total * pct + 99) / 100;  // rank of the percentile
+    if( want == 0 ) want = 1;
+    uint64_t seen = 0;
+    for( int i=0; i < blink1_iostats_buckets-1; i++ ) {
+        seen += op->hist[i];
+        if( seen >= want ) {
+            uint64_t bound = blink1_iostats_bucket_micros(i);
+            return (op->maxMicros < bound) ? op->maxMicros : bound;
         }
-        printf("\n");
-    }
-    else {
-        printf("testtest error: rc=%d\n", rc);
     }
-    return rc;
+    return op->maxMicros;
 }
 
 
-
 /* ------------------------------------------------------------------------- */
 
+void blink1_ctxEnableDegamma( blink1_context* ctx )
+{
+    ctx->enable_degamma = 1;
+}
+
+void blink1_ctxDisableDegamma( blink1_context* ctx )
+{
+    ctx->enable_degamma = 0;
+}
+
+int blink1_ctxDegammaEnabled( blink1_context* ctx )
+{
+    return ctx->enable_degamma;
+}
+
 void blink1_enableDegamma()
 {
-    blink1_enable_degamma = 1;
+    blink1_ctxEnableDegamma( blink1_defaultContext() );
 }
 
 void blink1_disableDegamma()
 {
-    blink1_enable_degamma = 0;
+    blink1_ctxDisableDegamma( blink1_defaultContext() );
+}
+
+int blink1_degammaEnabled()
+{
+    return blink1_ctxDegammaEnabled( blink1_defaultContext() );
 }
 
 /**
@@ -691,14 +3371,15 @@ int cmp_blink1_info_serial(const void *a, const void *b)
                     serialstrmax);
 }
 
-void blink1_sortCache(void)
+static void blink1_sortCache(blink1_context* ctx)
 {
     size_t elemsize = sizeof( blink1_info ); //
 
-    qsort( blink1_infos,
-           blink1_cached_count,
+    qsort( ctx->infos,
+           ctx->cached_count,
            elemsize,
            cmp_blink1_info_serial);
+    blink1_registryRebuild( ctx );
 }
 
 
@@ -727,6 +3408,62 @@ void blink1_sleep(uint32_t millis)
 #endif
 }
 
+// sleep until blink1_micros() reaches deadline
+static void blink1_sleepUntil( uint64_t deadline )
+{
+#if defined(_WIN32) || defined(__APPLE__)
+    uint64_t now = blink1_micros();
+    if( deadline <= now ) return;
+#ifdef _WIN32
+    Sleep( (DWORD)((deadline - now) / 1000) );  // rounds down, lateness is
+    while( blink1_micros() < deadline ) ;       // at most a scheduler tick
+#else
+    usleep( (useconds_t)(deadline - now) );
+#endif
+#else
+    struct timespec ts;
+    ts.tv_sec  = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR ) ;
+#endif
+}
+
+//
+// timeline scheduler
+//
+// Each step's deadline is the previous step's deadline plus the delay
+// fn asked for, never "now plus delay", so time spent in USB I/O or
+// oversleeping doesn't accumulate.
+//
+
+//
+int blink1_schedRun( blink1_sched_fn fn, void* arg, blink1_sched_stats* stats )
+{
+    blink1_sched_stats st;
+    memset( &st, 0, sizeof(st) );
+    if( stats ) *stats = st;
+    if( fn == NULL ) return -1;
+
+    uint64_t start = blink1_micros();
+    uint64_t deadline = start;
+    for( ;; ) {
+        blink1_sleepUntil( deadline );
+        uint64_t now = blink1_micros();
+        int64_t late = (now > deadline) ? (int64_t)(now - deadline) : 0;
+        st.lateMicros = late;
+        st.lateTotalMicros += late;
+        if( (uint64_t)late > st.lateMaxMicros ) st.lateMaxMicros = late;
+        st.scheduledMicros = deadline - start;
+
+        int64_t next = fn( st.steps++, late, arg );
+        if( next < 0 ) break;
+        deadline += next;
+    }
+    st.elapsedMicros = blink1_micros() - start;
+    if( stats ) *stats = st;
+    return (int)st.steps;
+}
+
 
 //
 // blink1 utility api
@@ -759,13 +3496,16 @@ void hexdump(FILE* fp, uint8_t *buffer, int len)
  */
 int hexread(uint8_t *buffer, char *string, int buflen)
 {
-    char    *s;
+    const char* s = string;
     int     pos = 0;
     if( string==NULL ) return -1;
     memset(buffer,0,buflen);  // bzero() not defined on Win32?
-    while((s = strtok(string, ", ")) != NULL && pos < buflen){
-        string = NULL;
-        buffer[pos++] = (char)strtol(s, NULL, 0);
+    while( pos < buflen ) {
+        s += strspn(s, ", ");
+        if( *s == '\0' ) break;
+        char* end;
+        buffer[pos++] = (char)strtol(s, &end, 0);
+        s = end + strcspn(end, ", ");  // skip the rest of a bad number
     }
     return pos;
 }
@@ -808,91 +3548,641 @@ void hsbtorgb( rgb_t* rgb, uint8_t* hsb )
     rgb->b=b;
 }
 
+#include "blink1-lib-color.h"
+
+// n pixels are 3*n bytes, which the kernels rely on
+typedef char blink1_rgb_t_is_packed[ (sizeof(rgb_t) == 3) ? 1 : -1 ];
+
+//
+void blink1_adjustBrightnessMany( uint8_t brightness, rgb_t* colors, size_t n )
+{
+    if( brightness == 0 || colors == NULL ) return;
+    blink1_brightnessBytes( brightness, (uint8_t*)colors, 3*n );
+}
+
+//
+void blink1_degammaMany( rgb_t* colors, size_t n )
+{
+    if( colors == NULL ) return;
+    blink1_degammaBytes( (uint8_t*)colors, 3*n );
+}
+
+//
+void blink1_hsbtorgbMany( rgb_t* out, const uint8_t* hsb, size_t n )
+{
+    if( out == NULL || hsb == NULL ) return;
+    blink1_hsbtorgbMany_impl( out, hsb, n );
+}
+
 void remove_whitespace(char *str)
 {
-    char *p;
-    size_t len = strlen(str);
+    char* d = str;
+    for( char* p = str; *p; p++ ) {
+        if( !isspace((unsigned char)*p) ) *d++ = *p;
+    }
+    *d = '\0';
+}
+
+//
+// pattern and color parsing
+//
+// Everything works on (pointer, length) views of the input, in one
+// pass, without copying or allocating, so it's safe from any thread.
+// Errors give the byte offset into the input where parsing failed.
+//
+
+static int blink1_isspace( char c )
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static int blink1_hexval( char c )
+{
+    if( c >= '0' && c <= '9' ) return c - '0';
+    if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
 
-    for(p = str; *p; p ++, len --) {
-        while(isspace(*p)) memmove(p, p+1, len--);
+//
+static int blink1_parseFail( blink1_parse_error* err, size_t offset, const char* msg )
+{
+    if( err ) {
+        err->offset = (int)offset;
+        err->msg = msg;
     }
+    return -1;
 }
 
-/**
- * Parse an RGB color from a string in one of the forms:
- * - "#ff00ff"
- * - "FF00FF"
- # - 0xFF00FF
- * - "255,0,255"
- * - "0xff,0x00,0xff"
- * All not case-sensitive
- */
-void parsecolor(rgb_t* color, char* colorstr)
+// trim whitespace off both ends of s[*b..*e)
+static void blink1_trim( const char* s, size_t* b, size_t* e )
 {
-    // parse #0xff00ff by first remove first two chars
-    if(strlen(colorstr) == 8 && colorstr[0]=='0' && tolower(colorstr[1])=='x') {
-        colorstr +=2;
+    while( *b < *e && blink1_isspace( s[*b] ) ) (*b)++;
+    while( *e > *b && blink1_isspace( s[*e-1] ) ) (*e)--;
+}
+
+// integer in s[b..e) like strtol(s,NULL,0): optional sign, then
+// decimal, 0x hex or 0 octal.  Saturates instead of overflowing.
+static int blink1_parseInt( const char* s, size_t b, size_t e, long* val,
+                            blink1_parse_error* err )
+{
+    int neg = 0;
+    int base = 10;
+    unsigned long v = 0;
+    size_t i = b;
+    if( i < e && (s[i] == '-' || s[i] == '+') ) neg = (s[i++] == '-');
+    if( i+1 < e && s[i] == '0' && (s[i+1] == 'x' || s[i+1] == 'X') ) {
+        base = 16;
+        i += 2;
+    }
+    else if( i+1 < e && s[i] == '0' ) {
+        base = 8;
     }
-    // parse hex color code like "#FF00FF" or "FF00FF", case-insensitive
-    if( strchr(colorstr,',')==NULL && (colorstr[0] == '#' || strlen(colorstr)==6) ) {
-        colorstr = (colorstr[0] == '#') ? colorstr+1 : colorstr;
-        uint32_t colorint = strtol(colorstr, NULL, 16);
-        color->r = (colorint >> 16) & 0xff;
-        color->g = (colorint >>  8) & 0xff;
-        color->b = (colorint >>  0) & 0xff;
-    } else { // else it's a list like "0xff,0x00,0xff" or "255,0,255"
-        hexread((uint8_t*)color, colorstr, 3);  // FIXME: hardcoded size
+    if( i >= e ) return blink1_parseFail( err, i, "expected a number" );
+    for( ; i<e; i++ ) {
+        int d = blink1_hexval( s[i] );
+        if( d < 0 || d >= base ) return blink1_parseFail( err, i, "bad digit in number" );
+        if( v < 0x7fffffffUL ) v = v*base + d;
     }
+    if( v > 0x7fffffffUL ) v = 0x7fffffffUL;
+    *val = (neg) ? -(long)v : (long)v;
+    return 0;
 }
 
-/**
- * Parse pattern into an array of patternlines
- * - number repeats
- * - pattern array (contains {color,millis,ledn})
- * Returns pattern length or -1 if badly-formatted pattern
- */
-int parsePattern(char* pattstr, int* repeats, patternline_t* pattern)
+// seconds in s[b..e) like "0.5", "12.25" or "5e-1", to millis.
+// Exact in decimal; anything finer than a milli is dropped.
+static int blink1_parseSecs( const char* s, size_t b, size_t e, uint16_t* millis,
+                             blink1_parse_error* err )
 {
-    char str[1000];
-    sprintf(str, "%s", pattstr);  // FIXME: check size
+    uint32_t m = 0;     // significant digits, without the '.'
+    int pow10 = 3;      // ms = m * 10^pow10
+    int digits = 0;
+    int frac = 0;
+    size_t i = b;
+    for( ; i<e; i++ ) {
+        if( s[i] == '.' && !frac ) {
+            frac = 1;
+            continue;
+        }
+        if( (s[i] == 'e' || s[i] == 'E') && digits ) break;
+        if( s[i] < '0' || s[i] > '9' ) return blink1_parseFail( err, i, "bad digit in time" );
+        digits++;
+        if( m < 100000000 ) {  // 9 digits is plenty for 65.535 s
+            m = m*10 + (s[i]-'0');
+            if( frac ) pow10--;
+        }
+        else if( !frac ) pow10++;
+    }
+    if( digits == 0 ) return blink1_parseFail( err, b, "expected a time" );
+    if( i < e ) {  // exponent
+        int neg = 0, x = 0;
+        if( ++i < e && (s[i] == '-' || s[i] == '+') ) neg = (s[i++] == '-');
+        if( i >= e ) return blink1_parseFail( err, i, "bad exponent in time" );
+        for( ; i<e; i++ ) {
+            if( s[i] < '0' || s[i] > '9' ) return blink1_parseFail( err, i, "bad exponent in time" );
+            if( x < 1000 ) x = x*10 + (s[i]-'0');
+        }
+        pow10 += (neg) ? -x : x;
+    }
+    for( ; pow10 < 0 && m; pow10++ ) m /= 10;
+    for( ; pow10 > 0 && m && m <= 0xffff; pow10-- ) m *= 10;
+    if( m > 0xffff ) return blink1_parseFail( err, b, "time too long" );
+    *millis = (uint16_t)m;
+    return 0;
+}
 
-    remove_whitespace(str);
-    char* s;
-    s = strtok( str, ", ");
-    if(  s != NULL ) {
-      *repeats = strtol(s,NULL,0);
+// color in s[b..e), offsets in errors are relative to s
+static int blink1_parseColorAt( rgb_t* color, const char* s, size_t b, size_t e,
+                                blink1_parse_error* err )
+{
+    blink1_trim( s, &b, &e );
+    if( b == e ) return blink1_parseFail( err, b, "expected a color" );
+    // "0xff00ff" is the same as "ff00ff"
+    if( e-b == 8 && s[b] == '0' && (s[b+1] == 'x' || s[b+1] == 'X') ) b += 2;
+
+    int list = 0;
+    for( size_t i=b; i<e; i++ ) {
+        if( s[i] == ',' || blink1_isspace( s[i] ) ) list = 1;
     }
+    // hex color code like "#FF00FF" or "FF00FF", case-insensitive
+    if( !list && (s[b] == '#' || e-b == 6) ) {
+        if( s[b] == '#' ) b++;
+        if( b == e ) return blink1_parseFail( err, b, "expected hex digits" );
+        if( e-b > 6 ) return blink1_parseFail( err, b+6, "too many hex digits" );
+        uint32_t c = 0;
+        for( size_t i=b; i<e; i++ ) {
+            int d = blink1_hexval( s[i] );
+            if( d < 0 ) return blink1_parseFail( err, i, "bad hex digit" );
+            c = (c << 4) | d;
+        }
+        color->r = (c >> 16) & 0xff;
+        color->g = (c >>  8) & 0xff;
+        color->b = (c >>  0) & 0xff;
+        return 0;
+    }
+    // else it's a list like "0xff,0x00,0xff" or "255 0 255"
+    uint8_t rgb[3] = { 0, 0, 0 };
+    int n = 0;
+    size_t i = b;
+    while( i < e ) {
+        while( i < e && (s[i] == ',' || blink1_isspace( s[i] )) ) i++;
+        if( i == e ) break;
+        size_t j = i;
+        while( j < e && s[j] != ',' && !blink1_isspace( s[j] ) ) j++;
+        if( n == 3 ) return blink1_parseFail( err, i, "more than 3 color values" );
+        long v;
+        if( blink1_parseInt( s, i, j, &v, err ) == -1 ) return -1;
+        rgb[n++] = (uint8_t)v;
+        i = j;
+    }
+    color->r = rgb[0];
+    color->g = rgb[1];
+    color->b = rgb[2];
+    return 0;
+}
+
+//
+int blink1_parseColorN( rgb_t* color, const char* str, size_t len, blink1_parse_error* err )
+{
+    if( err ) { err->offset = -1; err->msg = NULL; }
+    if( color == NULL || str == NULL ) return blink1_parseFail( err, 0, "no color" );
+    return blink1_parseColorAt( color, str, 0, len, err );
+}
+
+// next comma-separated field of s after *pos, trimmed, in [*b,*e)
+// returns 0 if there are no fields left
+static int blink1_nextField( const char* s, size_t len, size_t* pos, size_t* b, size_t* e )
+{
+    if( *pos > len ) return 0;
+    *b = *pos;
+    *e = *pos;
+    while( *e < len && s[*e] != ',' ) (*e)++;
+    *pos = *e + 1;
+    blink1_trim( s, b, e );
+    return 1;
+}
+
+//
+int blink1_parsePatternN( const char* str, size_t len, int* repeats,
+                          patternline_t* pattern, int maxlines, blink1_parse_error* err )
+{
+    size_t pos = 0, b, e;
+    long v;
+    int n = 0;
+    if( err ) { err->offset = -1; err->msg = NULL; }
+    if( str == NULL ) return blink1_parseFail( err, 0, "no pattern" );
 
     // pattern strings are:
     //   "num_repeats,rgbcolor,time,ledn,rgbcolor,time,ledn,..."
     // e.g. '3,#ff0000,0.5,0,#0000ff,0.5,0'
     // means: 3 repeats, red over 0.5 seconds on both leds,
     //        then blue over 0.5 seconds on both leds
-    int i=0;
-    s = strtok(NULL, ","); // prep next parse
-    while( s != NULL ) {
-        parsecolor(&pattern[i].color, s);
+    blink1_nextField( str, len, &pos, &b, &e );
+    if( b == e ) return blink1_parseFail( err, b, "expected repeats" );
+    if( blink1_parseInt( str, b, e, &v, err ) == -1 ) return -1;
+    if( repeats ) *repeats = (int)v;
+
+    while( blink1_nextField( str, len, &pos, &b, &e ) ) {
+        if( b == e && pos > len ) break;  // allow a trailing comma
+        patternline_t line;
+        if( pattern && n == maxlines ) {
+            return blink1_parseFail( err, b, "too many lines" );
+        }
+        if( blink1_parseColorAt( &line.color, str, b, e, err ) == -1 ) return -1;
+
+        if( !blink1_nextField( str, len, &pos, &b, &e ) ) {
+            return blink1_parseFail( err, len, "no time" );
+        }
+        if( blink1_parseSecs( str, b, e, &line.millis, err ) == -1 ) return -1;
+
+        if( !blink1_nextField( str, len, &pos, &b, &e ) ) {
+            return blink1_parseFail( err, len, "no ledn" );
+        }
+        if( b == e ) return blink1_parseFail( err, b, "expected ledn" );
+        if( blink1_parseInt( str, b, e, &v, err ) == -1 ) return -1;
+        if( v < 0 || v > 255 ) return blink1_parseFail( err, b, "ledn out of range" );
+        line.ledn = (uint8_t)v;
 
-        s = strtok(NULL, ",");
-        if( s == NULL ) {
-            msg("bad pattern on line %d: no time\n", i);  return -1;
+        if( pattern ) pattern[n] = line;
+        n++;
+    }
+    return n;
+}
+
+//
+// color calibration
+//
+
+typedef struct blink1_calentry_ {
+    char match[serialstrmax];   // serial, "mk1".."mk4" or "*"
+    blink1_calibration cal;
+} blink1_calentry;
+
+// degamma (or calibrate) channel c (0=r 1=g 2=b) of a color for dev
+static uint8_t blink1_degammaFor( blink1_device* dev, int c, uint8_t v )
+{
+    int on = (blink1_devCtx(dev)->enable_degamma) ? 1 : 0;
+    if( dev && dev->state ) return dev->state->cal[on][c][v];
+    return (on) ? blink1_degamma(v) : v;
+}
+
+// x^e for x in 0-1 and e > 0, so blink1-lib doesn't need libm
+static double blink1_powUnit( double x, double e )
+{
+    const double ln2 = 0.69314718055994530942;
+    if( x <= 0 ) return 0;
+    if( x >= 1 ) return 1;
+    int k = 0;
+    while( x < 0.5 ) { x *= 2; k++; }   // x = m * 2^-k, m in 0.5-1
+    double z = (x - 1) / (x + 1), z2 = z*z, lnm = 0, zn = z;
+    for( int i=1; i<50; i += 2 ) { lnm += zn / i; zn *= z2; }   // ln(m) = 2*atanh(z)
+    double y = e * (2*lnm - k*ln2);     // ln(x^e), <= 0
+    int j = 0;
+    while( y < -ln2 ) { y += ln2; j++; }
+    double r = 1, t = 1;
+    for( int i=1; i<30; i++ ) { t *= y / i; r += t; }
+    while( j-- > 0 ) r *= 0.5;
+    return r;
+}
+
+// rounds down, like GammaE[] was made, so the default profile gives GammaE[]
+static void blink1_calCompile( const blink1_calibration* cal, uint8_t lut[2][3][256] )
+{
+    for( int c=0; c<3; c++ ) {
+        double k = cal->white[c] * cal->maxbright;
+        for( int v=0; v<256; v++ ) {
+            double x = v / 255.0;
+            lut[0][c][v] = (uint8_t)( x * k + 1e-9 );
+            lut[1][c][v] = (uint8_t)( blink1_powUnit( x, cal->gamma[c] ) * k + 1e-9 );
+        }
+    }
+}
+
+// profile for serial: by serial, else by type, else "*", else NULL
+static const blink1_calentry* blink1_calFind( blink1_context* ctx, const char* serial )
+{
+    const char* type = deviceTypeStrings[ blink1_serialToType(serial) ];
+    const blink1_calentry* best = NULL;
+    int bestrank = 0;
+    for( int i=0; i < ctx->ncals; i++ ) {
+        const char* m = ctx->cals[i].match;
+        int rank = (strcasecmp(m, serial) == 0) ? 3 :
+                   (strcasecmp(m, type) == 0) ? 2 :
+                   (strcmp(m, "*") == 0) ? 1 : 0;
+        if( rank > bestrank ) {
+            best = &ctx->cals[i];
+            bestrank = rank;
+        }
+    }
+    return best;
+}
+
+// (re)build st's tables from ctx's profiles.  Called with ctx locked.
+static void blink1_stateCalibrate( blink1_context* ctx, blink1_devstate* st )
+{
+    uint8_t lut[2][3][256];
+    const blink1_calentry* e = blink1_calFind( ctx, st->serial );
+    if( e ) {
+        blink1_calCompile( &e->cal, lut );
+    }
+    else {
+        for( int c=0; c<3; c++ ) {
+            for( int v=0; v<256; v++ ) {
+                lut[0][c][v] = v;
+                lut[1][c][v] = blink1_degamma(v);
+            }
+        }
+    }
+    blink1_mutex_lock( &st->lock );
+    if( memcmp( st->cal, lut, sizeof(lut) ) != 0 ) {
+        memcpy( st->cal, lut, sizeof(lut) );
+        st->patthash = 0;   // pattern RAM was written through the old tables
+    }
+    st->calibrated = (e != NULL);
+    blink1_mutex_unlock( &st->lock );
+}
+
+static void blink1_calibrateAll( blink1_context* ctx )
+{
+    for( int i=0; i < ctx->nstates; i++ ) {
+        blink1_stateCalibrate( ctx, ctx->states[i] );
+    }
+}
+
+static int blink1_calMatchOK( const char* match )
+{
+    size_t n = (match) ? strlen(match) : 0;
+    if( n == 0 || n >= serialstrmax ) return 0;
+    if( strcmp(match, "*") == 0 ) return 1;
+    for( int t = BLINK1_MK1; t <= BLINK1_MK4; t++ ) {
+        if( strcasecmp(match, deviceTypeStrings[t]) == 0 ) return 1;
+    }
+    for( size_t i=0; i<n; i++ ) {
+        if( blink1_hexval(match[i]) < 0 ) return 0;
+    }
+    return 1;
+}
+
+// negated compares so NaNs fail too
+static int blink1_calOK( const blink1_calibration* cal )
+{
+    for( int c=0; c<3; c++ ) {
+        if( !(cal->gamma[c] > 0 && cal->gamma[c] <= 10) ) return 0;
+        if( !(cal->white[c] >= 0 && cal->white[c] <= 1) ) return 0;
+    }
+    return 1;
+}
+
+//
+void blink1_calibrationDefault( blink1_calibration* cal )
+{
+    for( int c=0; c<3; c++ ) {
+        cal->gamma[c] = 1/0.45f;
+        cal->white[c] = 1;
+    }
+    cal->maxbright = 255;
+}
+
+// add or replace in a profile list, returns -1 if out of memory
+static int blink1_calPut( blink1_calentry** cals, int* n, int* cap,
+                          const char* match, const blink1_calibration* cal )
+{
+    for( int i=0; i < *n; i++ ) {
+        if( strcasecmp( (*cals)[i].match, match ) == 0 ) {
+            (*cals)[i].cal = *cal;
+            return 0;
+        }
+    }
+    if( *n == *cap ) {
+        int ncap = (*cap) ? 2 * *cap : 8;
+        blink1_calentry* c = realloc( *cals, ncap * sizeof(blink1_calentry) );
+        if( c == NULL ) return -1;
+        *cals = c;
+        *cap = ncap;
+    }
+    blink1_calentry* e = &(*cals)[(*n)++];
+    memset( e, 0, sizeof(*e) );
+    strncpy( e->match, match, sizeof(e->match)-1 );
+    e->cal = *cal;
+    return 0;
+}
+
+//
+int blink1_ctxSetCalibration( blink1_context* ctx, const char* match,
+                              const blink1_calibration* cal )
+{
+    if( ctx == NULL || !blink1_calMatchOK(match) ) return -1;
+    if( cal && !blink1_calOK(cal) ) return -1;
+    int rc = 0;
+    blink1_lock(ctx);
+    if( cal ) {
+        rc = blink1_calPut( &ctx->cals, &ctx->ncals, &ctx->cals_cap, match, cal );
+    }
+    else {
+        for( int i=0; i < ctx->ncals; i++ ) {
+            if( strcasecmp( ctx->cals[i].match, match ) == 0 ) {
+                ctx->cals[i] = ctx->cals[--ctx->ncals];
+                break;
+            }
+        }
+    }
+    blink1_calibrateAll( ctx );
+    blink1_unlock(ctx);
+    return rc;
+}
+
+//
+int blink1_setCalibration( const char* match, const blink1_calibration* cal )
+{
+    return blink1_ctxSetCalibration( blink1_defaultContext(), match, cal );
+}
+
+//
+void blink1_ctxClearCalibration( blink1_context* ctx )
+{
+    blink1_lock(ctx);
+    ctx->ncals = 0;
+    blink1_calibrateAll( ctx );
+    blink1_unlock(ctx);
+}
+
+// one to three comma-separated numbers in s[b..e), one means all three
+static int blink1_calParseFloats( const char* s, size_t b, size_t e, float* v,
+                                  blink1_parse_error* err )
+{
+    int n = 0;
+    size_t i = b;
+    while( i < e ) {
+        if( n == 3 ) return blink1_parseFail( err, i, "too many values" );
+        char* end;
+        double d = strtod( s + i, &end );
+        size_t j = end - s;
+        if( end == s + i || j > e || (j < e && s[j] != ',') ) {
+            return blink1_parseFail( err, i, "bad number" );
+        }
+        v[n++] = (float)d;
+        i = j + 1;
+    }
+    if( n == 0 ) return blink1_parseFail( err, b, "missing value" );
+    if( n == 2 ) return blink1_parseFail( err, b, "need 1 or 3 values" );
+    if( n == 1 ) v[1] = v[2] = v[0];
+    return 0;
+}
+
+// "<match> key=val ..." in s[b..e)
+static int blink1_calParseLine( const char* s, size_t b, size_t e, char* match,
+                                blink1_calibration* cal, blink1_parse_error* err )
+{
+    size_t tb = b, te;
+    while( tb < e && !blink1_isspace(s[tb]) ) tb++;
+    if( tb - b >= serialstrmax ) return blink1_parseFail( err, b, "bad match" );
+    memcpy( match, s + b, tb - b );
+    match[tb - b] = '\0';
+    if( !blink1_calMatchOK(match) ) return blink1_parseFail( err, b, "bad match" );
+
+    blink1_calibrationDefault( cal );
+    while( 1 ) {
+        while( tb < e && blink1_isspace(s[tb]) ) tb++;
+        if( tb == e ) break;
+        te = tb;
+        while( te < e && !blink1_isspace(s[te]) ) te++;
+        size_t eq = tb;
+        while( eq < te && s[eq] != '=' ) eq++;
+        size_t klen = eq - tb;
+        if( eq == te ) return blink1_parseFail( err, tb, "expected key=value" );
+        if( klen == 5 && strncmp(s + tb, "gamma", 5) == 0 ) {
+            if( blink1_calParseFloats( s, eq+1, te, cal->gamma, err ) == -1 ) return -1;
+        }
+        else if( klen == 5 && strncmp(s + tb, "white", 5) == 0 ) {
+            if( blink1_calParseFloats( s, eq+1, te, cal->white, err ) == -1 ) return -1;
+        }
+        else if( klen == 3 && strncmp(s + tb, "max", 3) == 0 ) {
+            long v;
+            if( blink1_parseInt( s, eq+1, te, &v, err ) == -1 ) return -1;
+            if( v < 0 || v > 255 ) return blink1_parseFail( err, eq+1, "max out of range" );
+            cal->maxbright = v;
         }
-        pattern[i].millis = atof(s) * 1000;
+        else {
+            return blink1_parseFail( err, tb, "unknown key" );
+        }
+        tb = te;
+    }
+    if( !blink1_calOK(cal) ) return blink1_parseFail( err, b, "gamma or white out of range" );
+    return 0;
+}
 
-        s = strtok(NULL, ",");
-        if( s == NULL ) {
-            msg("bad pattern on line %d: no ledn\n",i);  return -1;
+//
+int blink1_ctxParseCalibration( blink1_context* ctx, const char* text,
+                                blink1_parse_error* err )
+{
+    if( err ) { err->offset = -1; err->msg = NULL; }
+    if( ctx == NULL || text == NULL ) return blink1_parseFail( err, 0, "no calibration" );
+    blink1_calentry* cals = NULL;
+    int n = 0, cap = 0;
+    size_t len = strlen(text);
+    size_t pos = 0;
+    while( pos < len ) {
+        size_t b = pos, e = pos;
+        while( e < len && text[e] != '\n' ) e++;
+        pos = e + 1;
+        for( size_t i=b; i<e; i++ ) {
+            if( text[i] == '#' ) { e = i; break; }
+        }
+        blink1_trim( text, &b, &e );
+        if( b == e ) continue;
+        char match[serialstrmax];
+        blink1_calibration cal;
+        if( blink1_calParseLine( text, b, e, match, &cal, err ) == -1 ) {
+            free( cals );
+            return -1;
+        }
+        if( blink1_calPut( &cals, &n, &cap, match, &cal ) == -1 ) {
+            free( cals );
+            return blink1_parseFail( err, b, "out of memory" );
         }
-        pattern[i].ledn = strtol(s,NULL,0);
+    }
+    blink1_lock(ctx);
+    free( ctx->cals );
+    ctx->cals = cals;
+    ctx->ncals = n;
+    ctx->cals_cap = cap;
+    blink1_calibrateAll( ctx );
+    blink1_unlock(ctx);
+    return n;
+}
+
+//
+int blink1_ctxLoadCalibration( blink1_context* ctx, const char* path,
+                               blink1_parse_error* err )
+{
+    FILE* fp = (path) ? fopen( path, "rb" ) : NULL;
+    if( fp == NULL ) return blink1_parseFail( err, 0, "cannot open file" );
+    size_t cap = 4096, len = 0;
+    char* text = malloc( cap );
+    while( text ) {
+        len += fread( text + len, 1, cap - 1 - len, fp );
+        if( len < cap - 1 ) break;
+        char* t = realloc( text, cap *= 2 );
+        if( t == NULL ) free( text );
+        text = t;
+    }
+    fclose( fp );
+    if( text == NULL ) return blink1_parseFail( err, 0, "out of memory" );
+    text[len] = '\0';
+    int rc = blink1_ctxParseCalibration( ctx, text, err );
+    free( text );
+    return rc;
+}
+
+//
+int blink1_loadCalibration( const char* path, blink1_parse_error* err )
+{
+    return blink1_ctxLoadCalibration( blink1_defaultContext(), path, err );
+}
 
-        i++;
+//
+int blink1_getCalibrationTable( blink1_device* dev, uint8_t lut[3][256] )
+{
+    if( dev == NULL || lut == NULL ) return -1;
+    for( int c=0; c<3; c++ ) {
+        for( int v=0; v<256; v++ ) lut[c][v] = blink1_degammaFor( dev, c, v );
+    }
+    return (dev->state && dev->state->calibrated) ? 1 : 0;
+}
 
-        s = strtok(NULL, ",");
-        if( s == NULL ) break;
+/**
+ * Parse an RGB color from a string in one of the forms:
+ * - "#ff00ff"
+ * - "FF00FF"
+ # - 0xFF00FF
+ * - "255,0,255"
+ * - "0xff,0x00,0xff"
+ * All not case-sensitive
+ */
+void parsecolor(rgb_t* color, char* colorstr)
+{
+    color->r = color->g = color->b = 0;
+    if( colorstr == NULL ) return;
+    blink1_parseColorN( color, colorstr, strlen(colorstr), NULL );
+}
 
+/**
+ * Parse pattern into an array of patternlines
+ * - number repeats
+ * - pattern array (contains {color,millis,ledn})
+ * Returns pattern length or -1 if badly-formatted pattern
+ */
+int parsePattern(char* pattstr, int* repeats, patternline_t* pattern)
+{
+    blink1_parse_error err;
+    if( pattstr == NULL ) return -1;
+    // callers hand in room for a full pattern RAM
+    int n = blink1_parsePatternN( pattstr, strlen(pattstr), repeats,
+                                  pattern, blink1_cpattern_max, &err );
+    if( n == -1 ) {
+        msg("bad pattern at char %d: %s\n", err.offset, err.msg);
     }
-    int pattlen = i;
-    return pattlen;
+    return n;
 }
 
 /**
@@ -920,10 +4210,11 @@ int toPatternString(patternline_t* pattern, int pattlen, int repeats, char* patt
  */
 void msg(char* fmt, ...)
 {
+    blink1_context* ctx = blink1_defaultContext();
     va_list args;
     va_start(args,fmt);
-    if( !msg_quiet ) {
-        vprintf(fmt,args);
+    if( !ctx->quiet ) {
+        blink1_vlog(ctx, BLINK1_LOG_INFO, fmt, args);
     }
     va_end(args);
 }
@@ -933,5 +4224,5 @@ void msg(char* fmt, ...)
  */
 void msg_setquiet(int q)
 {
-    msg_quiet = q;
+    blink1_defaultContext()->quiet = q;
 }
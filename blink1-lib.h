@@ -19,13 +19,16 @@
 extern "C" {
 #endif
 
+// legacy: the device cache grows as needed, these are no longer limits
 #define blink1_max_devices 32
-
 #define cache_max blink1_max_devices
-//#define cache_max 16
+
 #define serialstrmax (8 + 1)
 #define pathstrmax 1024
 
+// blink1 ids below this are cache indexes, at or above it serial numbers
+#define blink1mk1_serialstart 0x10000000
+#define blink1_idIsSerial(id) ((uint32_t)(id) >= blink1mk1_serialstart)
 #define blink1mk2_serialstart 0x20000000
 #define blink1mk3_serialstart 0x30000000
 #define blink1mk4_serialstart 0x40000000
@@ -60,14 +63,11 @@ static const int blink1_pattMaxes[] = {
 };
 
 
-#if USE_HIDAPI
-typedef struct hid_device_ blink1_device; /* opaque blink1 structure */
-#elif USE_HIDDATA
-typedef struct usbDevice   blink1_device; /* opaque blink1 structure */
-#else
+#if !USE_HIDAPI && !USE_HIDDATA
 #warning "USE_HIDAPI or USE_HIDDATA wasn't defined, defaulting to USE_HIDAPI"
-typedef struct hid_device_ blink1_device; /* opaque blink1 structure */
 #endif
+typedef struct blink1_device_  blink1_device;  /* opaque blink1 structure */
+typedef struct blink1_context_ blink1_context; /* opaque, see blink1_contextNew() */
 
 
 //
@@ -87,6 +87,212 @@ typedef struct {
     uint8_t ledn;     // number of led, or 0 for all
 } patternline_t;
 
+//
+// -------- contexts ----------
+//
+// A blink1_context owns a device registry (the cache filled by
+// blink1_enumerate(), with its handle pool and hotplug monitor),
+// a degamma setting, and a logging sink.  The plain blink1_*()
+// functions operate on a default context that is created on first use;
+// each has a blink1_ctx*() twin taking an explicit context.
+// A blink1_device remembers the context it was opened in.
+//
+// Thread-safety:
+// - Registry, pool, hotplug and settings calls on a context may be made
+//   from any number of threads at once; each context has its own lock.
+//   Separate contexts share no state (besides the async queue list).
+// - A single blink1_device must not be used by two threads at the same
+//   time.  Different devices may be driven in parallel.  To share one
+//   device between threads, go through its async queue (blink1_async*()).
+// - Strings returned by blink1_getCachedPath()/Serial() and
+//   blink1_getSerialForDev() stay valid until the next enumerate or
+//   hotplug change in that context.
+// - Log callbacks may be called from any thread using the context.
+//
+
+#define BLINK1_LOG_INFO   0  /* msg() output */
+#define BLINK1_LOG_DEBUG  1  /* verbose debug output */
+
+/**
+ * Log sink for a context.
+ * @param level BLINK1_LOG_INFO or BLINK1_LOG_DEBUG
+ * @param line formatted text, may contain a trailing newline
+ * @param userdata as passed to blink1_ctxSetLogger()
+ */
+typedef void (*blink1_log_fn)( int level, const char* line, void* userdata );
+
+/**
+ * Create a new, empty context.  Degamma is on, logging goes to stdout/stderr.
+ * @return new context or NULL if out of memory
+ */
+blink1_context* blink1_contextNew(void);
+
+/**
+ * Close all devices opened in ctx, stop its hotplug monitor and free it.
+ * Does nothing for NULL or the default context.
+ */
+void blink1_contextFree( blink1_context* ctx );
+
+/**
+ * @return the context used by the plain blink1_*() functions
+ */
+blink1_context* blink1_defaultContext(void);
+
+/**
+ * @return context dev was opened in, default context for NULL
+ */
+blink1_context* blink1_getContext( blink1_device* dev );
+
+/**
+ * Send ctx's log output to fn instead of stdout/stderr.
+ * @param fn log function, or NULL to restore stdout/stderr
+ */
+void blink1_ctxSetLogger( blink1_context* ctx, blink1_log_fn fn, void* userdata );
+
+/**
+ * Turn debug output for ctx on or off.
+ * (blink1_lib_verbose still works for the default context)
+ */
+void blink1_ctxSetVerbose( blink1_context* ctx, int verbose );
+
+int             blink1_ctxEnumerate( blink1_context* ctx );
+int             blink1_ctxEnumerateByVidPid( blink1_context* ctx, int vid, int pid );
+blink1_device*  blink1_ctxOpen( blink1_context* ctx );
+blink1_device*  blink1_ctxOpenByPath( blink1_context* ctx, const char* path );
+blink1_device*  blink1_ctxOpenBySerial( blink1_context* ctx, const char* serial );
+blink1_device*  blink1_ctxOpenById( blink1_context* ctx, uint32_t id );
+blink1_device*  blink1_ctxAcquireById( blink1_context* ctx, uint32_t id );
+blink1_device*  blink1_ctxAcquireOpenById( blink1_context* ctx, uint32_t id );
+blink1_device*  blink1_ctxAcquireBySerial( blink1_context* ctx, const char* serial );
+blink1_device*  blink1_ctxAcquireByPath( blink1_context* ctx, const char* path );
+void            blink1_ctxSetPoolIdleMillis( blink1_context* ctx, uint32_t millis );
+int             blink1_ctxPoolFlush( blink1_context* ctx, uint32_t idle_millis );
+int             blink1_ctxGetCachedCount( blink1_context* ctx );
+const char*     blink1_ctxGetCachedPath( blink1_context* ctx, int i );
+const char*     blink1_ctxGetCachedSerial( blink1_context* ctx, int i );
+int             blink1_ctxGetCacheIndexByPath( blink1_context* ctx, const char* path );
+int             blink1_ctxGetCacheIndexById( blink1_context* ctx, uint32_t id );
+int             blink1_ctxGetCacheIndexBySerial( blink1_context* ctx, const char* serial );
+int             blink1_ctxCacheAdd( blink1_context* ctx, const char* path, const char* serial );
+int             blink1_ctxCacheRemove( blink1_context* ctx, int i );
+blink1Type_t    blink1_ctxDeviceTypeById( blink1_context* ctx, int i );
+void            blink1_ctxEnableDegamma( blink1_context* ctx );
+void            blink1_ctxDisableDegamma( blink1_context* ctx );
+int             blink1_ctxDegammaEnabled( blink1_context* ctx );
+int             blink1_ctxHotplugStart( blink1_context* ctx );
+void            blink1_ctxHotplugStop( blink1_context* ctx );
+int             blink1_ctxHotplugPoll( blink1_context* ctx );
+
+//
+// -------- transports ----------
+//
+// A transport moves feature reports between blink1-lib and devices.
+// Each context uses one transport, by default the USB HID one compiled
+// in (hidapi or hiddata).  The virtual transport models blink(1)
+// firmware in software, for tests and benchmarks without hardware.
+// Setting the environment variable BLINK1_VIRTUAL to a device count
+// makes the default context start out with a virtual transport holding
+// that many devices (BLINK1_VIRTUAL_LATENCY sets its per-report latency
+// and BLINK1_VIRTUAL_OPEN_LATENCY its open/close latency, in
+// microseconds), so blink1-tool and blink1-tiny-server can
+// be run without any blink(1) attached.
+//
+
+typedef struct blink1_transport_ blink1_transport;
+
+/**
+ * Called by a transport's enumerate() once per device found.
+ */
+typedef void (*blink1_transport_add_fn)( const char* path, const char* serial, void* arg );
+
+struct blink1_transport_ {
+    const char* name;
+    /** call add() for each device matching vid/pid, return count */
+    int   (*enumerate)( blink1_transport* t, int vid, int pid,
+                        blink1_transport_add_fn add, void* arg );
+    /** open by path, or by serial if path is NULL, return handle or NULL */
+    void* (*open)( blink1_transport* t, const char* path, const char* serial );
+    void  (*close)( blink1_transport* t, void* handle );
+    /** send a feature report, return -1 on error */
+    int   (*write)( blink1_transport* t, void* handle, const void* buf, int len );
+    /** get a feature report, return -1 on error */
+    int   (*read)( blink1_transport* t, void* handle, void* buf, int len );
+    void* priv;  // transport state
+};
+
+/**
+ * @return the compiled-in USB HID transport
+ */
+blink1_transport* blink1_transportHid(void);
+
+/**
+ * Use transport t for devices in ctx.
+ * The device cache is emptied and unheld pooled handles are closed;
+ * devices already opened keep using the transport they were opened with.
+ * Call blink1_ctxEnumerate() afterwards.
+ * @param t transport, or NULL for the USB HID one
+ */
+void blink1_ctxSetTransport( blink1_context* ctx, blink1_transport* t );
+void blink1_setTransport( blink1_transport* t );
+
+/**
+ * @return transport used by ctx
+ */
+blink1_transport* blink1_ctxGetTransport( blink1_context* ctx );
+
+typedef struct {
+    uint64_t writes;        // feature reports sent to the device
+    uint64_t reads;         // feature reports read back
+    uint64_t cmds[128];     // writes by command byte ('c', 'P', ...)
+} blink1_virtual_stats;
+
+/**
+ * Create a virtual transport with no devices.
+ * It understands the 'c' 'n' 'r' 'P' 'R' 'p' 'S' 'l' 'b' 'B' 'F' 'f'
+ * and 'v' commands, keeps per-LED fades, pattern RAM of
+ * blink1_pattMaxes[type] lines, and plays patterns in real time.
+ * @return new transport or NULL if out of memory
+ */
+blink1_transport* blink1_virtualNew(void);
+
+/**
+ * Free a virtual transport.  No devices may still be open on it.
+ */
+void blink1_virtualFree( blink1_transport* t );
+
+/**
+ * Add a virtual blink(1).  Its type comes from the serial number range
+ * (e.g. "3xxxxxxx" is a mk3), its path is "virtual:<index>".
+ * @param serial 8-hex digit serial number
+ * @return index of new device, or -1 on error
+ */
+int blink1_virtualAdd( blink1_transport* t, const char* serial );
+
+/**
+ * @return number of virtual devices in t
+ */
+int blink1_virtualCount( blink1_transport* t );
+
+/**
+ * Make every report sent to or read from t take at least this long,
+ * like a real USB round trip (about 1-4 ms).  Default 0.
+ * @param micros per-report latency in microseconds
+ */
+void blink1_virtualSetLatency( blink1_transport* t, uint32_t micros );
+
+/**
+ * Make every open and every close of a device on t take at least this
+ * long, like a real hid_open()/hid_close() (a few ms).  Default 0.
+ * @param micros open and close latency in microseconds
+ */
+void blink1_virtualSetOpenLatency( blink1_transport* t, uint32_t micros );
+
+/**
+ * Get report counters for virtual device i.
+ * @return 0 on success, -1 if no such device
+ */
+int blink1_virtualGetStats( blink1_transport* t, int i, blink1_virtual_stats* stats );
+
 /**
  * Scan USB for blink(1) devices.
  * @return number of devices found
@@ -123,9 +329,9 @@ blink1_device* blink1_openByPath(const char* path);
 blink1_device* blink1_openBySerial(const char* serial);
 
 /**
- * Open by "id", which if from 0-blink1_max_devices is index
- *  or if >blink1_max_devices, is numerical representation of serial number
- * @param id ordinal 0-15 id of blink1 or numerical rep of 8-hex digit serial
+ * Open by "id", which if below blink1mk1_serialstart (0x10000000) is a
+ *  cache index, otherwise the numerical representation of serial number
+ * @param id ordinal id of blink1 or numerical rep of 8-hex digit serial
  * @return blink1_device or NULL if no blink1 found
  */
 blink1_device* blink1_openById( uint32_t id );
@@ -133,6 +339,7 @@ blink1_device* blink1_openById( uint32_t id );
 /**
  * Close opened blink1 device
  * Safe to call blink1_close on already closed device.
+ * Closing a pooled handle also drops it from the pool.
  * This is macro so dev can get set to NULL
  * FIXME: is there a better way
  */
@@ -145,6 +352,64 @@ blink1_device* blink1_openById( uint32_t id );
  */
 void blink1_close_internal( blink1_device* dev );
 
+/**
+ * Get a pooled handle to blink(1) by "id" (index or serial number, as
+ * blink1_openById()).  Handles are reference-counted and shared, so
+ * acquiring an already-open device does not reopen it.
+ * Pair each acquire with blink1_release().  Released handles are closed
+ * once idle for longer than blink1_setPoolIdleMillis().
+ * @note device must be in the cache, so call blink1_enumerate() first
+ * @param id ordinal id of blink1 or numerical rep of 8-hex digit serial
+ * @return blink1_device or NULL if no blink1 found
+ */
+blink1_device* blink1_acquireById( uint32_t id );
+
+/**
+ * Like blink1_acquireById(), but only if the device already has an
+ * open pooled handle; never opens it.
+ * @param id ordinal id of blink1 or numerical rep of 8-hex digit serial
+ * @return blink1_device or NULL if not open
+ */
+blink1_device* blink1_acquireOpenById( uint32_t id );
+
+/**
+ * Get a pooled handle to blink(1) by 8-digit serial number.
+ * @param serial 8-hex digit serial number
+ * @return blink1_device or NULL if no blink1 found
+ */
+blink1_device* blink1_acquireBySerial( const char* serial );
+
+/**
+ * Get a pooled handle to blink(1) by USB path.
+ * @param path string of platform-specific path to blink1
+ * @return blink1_device or NULL if no blink1 found
+ */
+blink1_device* blink1_acquireByPath( const char* path );
+
+/**
+ * Return a handle gotten from blink1_acquire*() to the pool.
+ * The handle stays open for reuse until it has been idle for the
+ * pool idle time.  Safe to call with NULL.
+ * @param dev blink1_device from blink1_acquire*()
+ */
+void blink1_release( blink1_device* dev );
+
+/**
+ * Set how long a released handle stays open in the pool.
+ * Idle handles are closed during later acquire/release calls
+ * or by blink1_poolFlush().
+ * @param millis idle time in milliseconds, 0 means never auto-close
+ */
+void blink1_setPoolIdleMillis( uint32_t millis );
+
+/**
+ * Close pooled handles that are released and have been idle
+ * for at least idle_millis.  Use 0 to close all released handles.
+ * @param idle_millis idle threshold in milliseconds
+ * @return number of handles closed
+ */
+int blink1_poolFlush( uint32_t idle_millis );
+
 /**
  * Low-level write to blink1 device.
  * Used internally by blink1-lib
@@ -190,6 +455,33 @@ int blink1_fadeToRGB(blink1_device *dev, uint16_t fadeMillis,
  */
 int blink1_fadeToRGBN(blink1_device *dev, uint16_t fadeMillis,
                       uint8_t r, uint8_t g, uint8_t b, uint8_t n );
+
+/**
+ * Fade several blink1 devices to the same RGB color at once.
+ * The fade report is built once and written to all devices
+ * concurrently by a small worker pool, so the total time is about
+ * that of the slowest device rather than the sum of all of them.
+ * @param devs array of opened blink1 devices
+ * @param ndevs number of devices in devs
+ * @param fadeMillis time to fade in milliseconds
+ * @param r red part of RGB color
+ * @param g green part of RGB color
+ * @param b blue part of RGB color
+ * @param n which LED to address (0=all, 1=1st LED, 2=2nd LED)
+ * @param results optional array of ndevs ints, set to -1 on error, 0 on success
+ * @return number of devices that failed, 0 if all succeeded
+ */
+int blink1_fadeToRGBMany(blink1_device** devs, int ndevs, uint16_t fadeMillis,
+                         uint8_t r, uint8_t g, uint8_t b, uint8_t n,
+                         int* results);
+
+/**
+ * Set the maximum number of threads used by blink1_fadeToRGBMany().
+ * Threads are started on first use and then kept for reuse.
+ * @param n number of threads, including the caller; 1 disables fan-out
+ */
+void blink1_setFanoutThreads( int n );
+
 /**
  * Set blink1 immediately to a specific RGB color.
  * @note If mk2, sets all LEDs immediately
@@ -338,6 +630,268 @@ int blink1_savePattern(blink1_device *dev);
  */
 int blink1_setLEDN( blink1_device* dev, uint8_t ledn);
 
+typedef struct {
+    int lines;            // pattern lines asked for
+    int linesWritten;     // lines that differed and were sent
+    int linesSkipped;     // lines the device already held
+    int reportsSent;      // including setLEDN and seed reads
+    int reportsAvoided;   // vs. setLEDN + writePatternLine per line,
+                          // negative if seed reads didn't pay off
+} blink1_pattsync_result;
+
+/**
+ * Make pattern lines 0..n-1 of dev hold pattern[], writing only the
+ * lines that differ from the host's image of dev's pattern RAM, and
+ * only sending setLEDN when the ledn changes.
+ * The image is kept per device (by serial number) for the life of the
+ * context, updated by every pattern write, setLEDN and pattern read,
+ * and dropped when the device goes away.  It assumes nothing else
+ * (e.g. another process) changes the device's pattern RAM.
+ * Colors are degamma'd like blink1_writePatternLine().
+ * @param seed 1 to read lines not in the image yet from the device
+ *             first (worth it for long-running apps, as each line is
+ *             read at most once), 0 to write unknown lines blindly
+ * @param res if not NULL, filled in with what was sent and avoided
+ * @return -1 on error, 0 on success
+ */
+int blink1_patternSync( blink1_device* dev, const patternline_t* pattern, int n,
+                        int seed, blink1_pattsync_result* res );
+
+/**
+ * Forget the host's image of dev's pattern RAM, e.g. after something
+ * outside this context changed it.
+ */
+void blink1_patternForget( blink1_device* dev );
+
+//
+// -------- compiled patterns ----------
+//
+// A pattern parsed once and turned into the reports that play or store
+// it, with brightness and degamma already applied, so replaying it (on
+// any number of devices) is just sending bytes.  The hash identifies
+// the content: equal hashes mean the same reports.  Each device also
+// remembers the hash of the compiled pattern its pattern RAM holds, so
+// writing the same one again costs nothing.
+//
+
+#define blink1_cpattern_max  32  // lines, the largest pattern RAM
+
+// where and why a parse failed
+typedef struct {
+    int offset;        // byte offset into the input, -1 if no error
+    const char* msg;   // static string, NULL if no error
+} blink1_parse_error;
+
+typedef struct {
+    uint64_t hash;         // content hash, never 0
+    int len;               // lines
+    int repeats;           // from the pattern string, 0 means forever
+    uint8_t brightness;    // applied to the reports, 0 for none
+    uint8_t degamma;       // 1 if the reports are degamma'd
+    uint32_t loopMillis;   // one pass through all lines
+    patternline_t lines[blink1_cpattern_max];  // as given, before brightness
+    uint8_t fades[blink1_cpattern_max][blink1_buf_size];   // 'c' fade report per line
+    uint8_t writes[blink1_cpattern_max][blink1_buf_size];  // 'P' report for pattern RAM line i
+} blink1_cpattern;
+
+/**
+ * Compile pattern lines.
+ * @param brightness 0-255 as for blink1_adjustBrightness(), 0 for none
+ * @param degamma 1 to degamma the reports, normally blink1_degammaEnabled()
+ * @return 0 on success, -1 if n is out of range
+ */
+int blink1_cpatternCompile( blink1_cpattern* cp, const patternline_t* pattern, int n,
+                            int repeats, uint8_t brightness, int degamma );
+
+/**
+ * Parse a pattern string (see blink1_parsePatternN()) and compile it.
+ * @param err if not NULL, where and why parsing failed
+ * @return 0 on success, -1 on a bad, empty or too long pattern
+ */
+int blink1_cpatternParse( blink1_cpattern* cp, const char* str, uint8_t brightness, int degamma,
+                          blink1_parse_error* err );
+
+/**
+ * blink1_patternSync() for a compiled pattern: lines 0..len-1 of dev's
+ * pattern RAM end up holding it, only sending what differs.
+ * @return -1 on error, 0 on success
+ */
+int blink1_cpatternWrite( blink1_device* dev, const blink1_cpattern* cp, int seed,
+                          blink1_pattsync_result* res );
+
+/**
+ * Fade dev to line i of cp.
+ * @param fadeMillis fade time, or -1 for the line's own time
+ * @return -1 on error
+ */
+int blink1_cpatternFade( blink1_device* dev, const blink1_cpattern* cp, int i, int fadeMillis );
+
+/**
+ * blink1_cpatternFade() on several devices at once, like
+ * blink1_fadeToRGBMany().
+ * @return number of devices that failed
+ */
+int blink1_cpatternFadeMany( blink1_device** devs, int ndevs, const blink1_cpattern* cp,
+                             int i, int fadeMillis, int* results );
+
+//
+// -------- color calibration ----------
+//
+// Different blink(1)s (and different mk's) don't show the same RGB the
+// same way.  A calibration profile gives a device its own per-channel
+// gamma, white balance and max brightness.  Profiles are compiled into
+// three 256-entry tables per device when it's first seen (or when the
+// profiles change), and those tables replace the usual degamma curve in
+// every report that carries a color, so it costs no more than before.
+// A profile's gamma is only applied while degamma is enabled.
+//
+// Profile files are lines of
+//   <match> [gamma=g|r,g,b] [white=r,g,b] [max=0-255]
+// where <match> is a serial number, a type ("mk1".."mk4"), or "*" for
+// all devices.  Serial beats type beats "*".  '#' starts a comment.
+//   # mk2s are a little green
+//   mk2       white=1,0.85,0.95
+//   3a1b2c3d  gamma=2.4,2.2,2.2 max=200
+// Setting BLINK1_CALIBRATION to a profile file loads it into the
+// default context at startup.
+//
+
+typedef struct {
+    float gamma[3];     // per channel exponent, 2.222 (1/0.45) is blink1_degamma()
+    float white[3];     // per channel gain, 0-1
+    uint8_t maxbright;  // 0-255, scales all channels
+} blink1_calibration;
+
+/**
+ * Fill in a profile that gives the same output as no profile at all.
+ */
+void blink1_calibrationDefault( blink1_calibration* cal );
+
+/**
+ * Add or replace the profile for match (serial, "mk1".."mk4" or "*").
+ * @param cal profile, or NULL to remove the one for match
+ * @return 0 on success, -1 on a bad match or profile
+ */
+int blink1_ctxSetCalibration( blink1_context* ctx, const char* match,
+                              const blink1_calibration* cal );
+int blink1_setCalibration( const char* match, const blink1_calibration* cal );
+
+/**
+ * Remove all profiles from ctx.
+ */
+void blink1_ctxClearCalibration( blink1_context* ctx );
+
+/**
+ * Replace ctx's profiles with the ones in text (see the format above).
+ * Nothing changes if any line is bad.
+ * @param err if not NULL, where and why parsing failed
+ * @return number of profiles, -1 on error
+ */
+int blink1_ctxParseCalibration( blink1_context* ctx, const char* text,
+                                blink1_parse_error* err );
+
+/**
+ * blink1_ctxParseCalibration() on the contents of a file.
+ * @return number of profiles, -1 on error (err->msg says which)
+ */
+int blink1_ctxLoadCalibration( blink1_context* ctx, const char* path,
+                               blink1_parse_error* err );
+int blink1_loadCalibration( const char* path, blink1_parse_error* err );
+
+/**
+ * The tables dev's colors go through right now, e.g. lut[0][r] is
+ * what's sent for red value r.
+ * @return 1 if dev has a profile, 0 if it's the plain degamma curve
+ * (or none, if degamma is disabled), -1 on error
+ */
+int blink1_getCalibrationTable( blink1_device* dev, uint8_t lut[3][256] );
+
+//
+// -------- state shadow ----------
+//
+// Every report sent to or read from a device also updates a host-side
+// shadow of it: the last color commanded for each LED and its fade,
+// pattern RAM, and play state.  The blink1_shadowRead*() functions
+// answer from the shadow when it can be trusted and fall back to
+// asking the device (which refreshes the shadow) when it can't.
+//
+// Staleness policy:
+// - pattern RAM only changes when written, so it's always exact
+// - a commanded color is exact once its fade is done, and estimated
+//   (interpolated) mid-fade or if the play state isn't known yet,
+//   since a pattern playing on the device could have overridden it
+// - while a pattern plays, or after a servertickle fires, LED colors
+//   and play position are unknown
+// - values read back from a device (rather than commanded) are
+//   trusted for blink1_ctxSetShadowMaxAge() millis
+//
+
+#define BLINK1_SHADOW_UNKNOWN   (-1)
+#define BLINK1_SHADOW_EXACT       0
+#define BLINK1_SHADOW_ESTIMATED   1
+
+typedef struct {
+    uint8_t rgb[3];           // color now (post-degamma, like readRGB)
+    uint8_t target[3];        // fade target, the last color commanded
+    uint32_t fadeMillis;      // length of the last fade
+    uint32_t fadeLeftMillis;  // time left in it, 0 if done
+} blink1_shadow_led;
+
+/**
+ * Look up an LED in dev's shadow, without any USB traffic.
+ * @param ledn LED to check, 0 means the first one (as for readRGB)
+ * @param led filled in unless the result is BLINK1_SHADOW_UNKNOWN
+ * @return BLINK1_SHADOW_EXACT, _ESTIMATED or _UNKNOWN
+ */
+int blink1_shadowGetLED( blink1_device* dev, uint8_t ledn, blink1_shadow_led* led );
+
+/**
+ * blink1_readRGB(), answered from the shadow if exact (or estimated
+ * and estimates are allowed).
+ * @return -1 on error
+ */
+int blink1_shadowReadRGB( blink1_device* dev, uint16_t* fadeMillis,
+                          uint8_t* r, uint8_t* g, uint8_t* b, uint8_t ledn );
+
+/**
+ * blink1_readPlayState(), answered from the shadow if the device is
+ * known to be stopped.
+ * @return -1 on error
+ */
+int blink1_shadowReadPlayState( blink1_device* dev, uint8_t* playing,
+                                uint8_t* playstart, uint8_t* playend,
+                                uint8_t* playcount, uint8_t* playpos );
+
+/**
+ * blink1_readPatternLineN(), answered from the shadow if the line
+ * is known.
+ * @return -1 on error
+ */
+int blink1_shadowReadPatternLineN( blink1_device* dev, uint16_t* fadeMillis,
+                                   uint8_t* r, uint8_t* g, uint8_t* b, uint8_t* ledn,
+                                   uint8_t pos );
+
+/**
+ * Throw away dev's shadow and read it all back from the device:
+ * play state, LED colors and pattern RAM (about 2*(3 + pattMax) reports).
+ * @return -1 if any read failed
+ */
+int blink1_shadowResync( blink1_device* dev );
+
+/**
+ * How long values read back from a device are trusted, default 1000.
+ * 0 means a read is only good for the call that made it.
+ */
+void blink1_ctxSetShadowMaxAge( blink1_context* ctx, uint32_t millis );
+void blink1_setShadowMaxAge( uint32_t millis );
+
+/**
+ * Whether blink1_shadowReadRGB() may answer with an estimated color
+ * (default 1), or must ask the device.
+ */
+void blink1_ctxSetShadowEstimates( blink1_context* ctx, int on );
+void blink1_setShadowEstimates( int on );
+
 /**
  * @note only for devices with fw val 206+ or mk3
  */
@@ -381,6 +935,206 @@ int blink1_readNote( blink1_device* dev, uint8_t noteid, uint8_t** notebuf);
 
 char *blink1_error_msg(int errCode);
 
+//
+// async mode
+//
+// Commands submitted with blink1_async*() are queued per device and sent
+// in order by a worker thread, so the caller never blocks on USB.
+// Don't mix sync and async calls on the same device without a
+// blink1_asyncFlush() in between.
+// Pending fade/set commands for the same LED are coalesced, only the
+// newest one gets sent (see blink1_asyncSetCoalescing()).
+//
+
+// rc given to the callback of a command replaced by a newer one
+#define BLINK1_ASYNC_COALESCED  (-2)
+
+/**
+ * Completion callback for async commands, called on the device's
+ * worker thread, or on the submitting thread if the command was
+ * coalesced away.
+ * @param dev blink1 device the command was for
+ * @param rc result of the command, -1 on error,
+ *           BLINK1_ASYNC_COALESCED if replaced by a newer command
+ * @param userdata pointer given at submit time
+ */
+typedef void (*blink1_async_cb)( blink1_device* dev, int rc, void* userdata );
+
+/**
+ * Function run on a device's worker thread by blink1_asyncCall().
+ * @return -1 on error, anything else on success
+ */
+typedef int (*blink1_async_fn)( blink1_device* dev, void* arg );
+
+typedef struct {
+    uint32_t depth;               // commands waiting to be sent
+    uint32_t maxDepth;            // largest depth seen
+    uint64_t submitted;           // commands queued
+    uint64_t completed;           // commands finished (incl. errors, coalesced)
+    uint64_t errors;              // commands that returned -1
+    uint64_t coalesced;           // reports not sent, replaced by newer ones
+    uint64_t latencyTotalMicros;  // sum of enqueue-to-complete times
+    uint64_t latencyMaxMicros;    // worst enqueue-to-complete time
+    uint64_t busyMicros;          // time worker spent doing I/O
+    uint64_t uptimeMicros;        // time since worker start (or stats reset)
+} blink1_async_stats;
+
+/**
+ * Queue a raw report for a device.  The worker is started on first use.
+ * @param dev blink1 device to command
+ * @param buf report bytes (copied), first byte is report id
+ * @param len length of buf, at most blink1_buf2_size
+ * @param cb optional completion callback
+ * @param userdata passed to cb
+ * @return ticket for blink1_asyncWait(), or -1 on error (e.g. queue full)
+ */
+int64_t blink1_asyncWrite( blink1_device* dev, void* buf, int len,
+                           blink1_async_cb cb, void* userdata );
+
+/**
+ * Queue a function to run on the device's worker thread, in order with
+ * the device's other async commands.
+ * @return ticket for blink1_asyncWait(), or -1 on error
+ */
+int64_t blink1_asyncCall( blink1_device* dev, blink1_async_fn fn, void* arg,
+                          blink1_async_cb cb, void* userdata );
+
+/**
+ * Async version of blink1_fadeToRGBN().
+ * @return ticket for blink1_asyncWait(), or -1 on error
+ */
+int64_t blink1_asyncFadeToRGBN( blink1_device* dev, uint16_t fadeMillis,
+                                uint8_t r, uint8_t g, uint8_t b, uint8_t n,
+                                blink1_async_cb cb, void* userdata );
+
+/**
+ * Async version of blink1_setRGB().
+ * @return ticket for blink1_asyncWait(), or -1 on error
+ */
+int64_t blink1_asyncSetRGB( blink1_device* dev, uint8_t r, uint8_t g, uint8_t b,
+                            blink1_async_cb cb, void* userdata );
+
+/**
+ * Async version of blink1_writePatternLine().
+ * @return ticket for blink1_asyncWait(), or -1 on error
+ */
+int64_t blink1_asyncWritePatternLine( blink1_device* dev, uint16_t fadeMillis,
+                                      uint8_t r, uint8_t g, uint8_t b,
+                                      uint8_t pos,
+                                      blink1_async_cb cb, void* userdata );
+
+/**
+ * Async version of blink1_playloop().
+ * @return ticket for blink1_asyncWait(), or -1 on error
+ */
+int64_t blink1_asyncPlayloop( blink1_device* dev, uint8_t play,
+                              uint8_t startpos, uint8_t endpos, uint8_t count,
+                              blink1_async_cb cb, void* userdata );
+
+/**
+ * Turn last-writer-wins coalescing of pending fade/set commands on or off.
+ * On by default.  Ordered commands (pattern writes, playloop, raw
+ * reports, calls) are never coalesced or reordered.
+ * @param on 1 to enable, 0 to send every fade
+ */
+void blink1_asyncSetCoalescing( int on );
+
+/**
+ * Wait until the command with the given ticket (and all before it)
+ * has completed.
+ * @return 0 on success, -1 if dev has no async queue
+ */
+int blink1_asyncWait( blink1_device* dev, int64_t ticket );
+
+/**
+ * Barrier: wait until every command queued so far for dev is done.
+ * @return number of commands that failed since the last flush
+ */
+int blink1_asyncFlush( blink1_device* dev );
+
+/**
+ * Drain dev's queue and stop its worker thread.
+ * Called by blink1_close().  Must not be called from a completion callback.
+ * @return number of commands that failed since the last flush
+ */
+int blink1_asyncStop( blink1_device* dev );
+
+/**
+ * Read queue depth, latency and worker utilization for dev's queue.
+ * Utilization is busyMicros / uptimeMicros.
+ * @return 0 on success, -1 if dev has no async queue
+ */
+int blink1_asyncGetStats( blink1_device* dev, blink1_async_stats* stats );
+
+/**
+ * Reset max depth, error, coalesced, latency and utilization counters
+ * for dev's queue.
+ */
+void blink1_asyncResetStats( blink1_device* dev );
+
+//
+// I/O stats
+//
+// With I/O stats on, every report that goes through blink1_write(),
+// blink1_read() and blink1_read_nosend() is counted and timed, per device
+// and per command byte.  Counters are updated with atomics, so any thread
+// may take a snapshot while others do I/O.  With stats off (the default)
+// the cost is one branch per report.
+//
+
+#define blink1_iostats_buckets  16
+
+/**
+ * Latency histogram bucket i holds reports that took less than
+ * (32us << i), the last bucket holds everything slower.
+ */
+#define blink1_iostats_bucket_micros(i)  (32ULL << (i))
+
+typedef struct {
+    uint64_t count;         // reports sent (or read)
+    uint64_t errors;        // reports the transport failed on
+    uint64_t totalMicros;   // sum of latencies
+    uint64_t maxMicros;     // worst latency
+    uint64_t hist[blink1_iostats_buckets];
+} blink1_iostats_op;
+
+typedef struct {
+    blink1_iostats_op write;  // blink1_write()
+    blink1_iostats_op read;   // blink1_read_nosend(), by request cmd byte
+} blink1_iostats_cmd;
+
+typedef struct {
+    blink1_iostats_cmd cmds[128];  // by command byte ('c', 'r', 'P', ...)
+} blink1_iostats;
+
+/**
+ * Turn I/O stats on or off for devices opened in ctx from now on.
+ * Devices already open keep their setting until closed.
+ */
+void blink1_ctxSetIoStats( blink1_context* ctx, int on );
+void blink1_setIoStats( int on );
+
+/**
+ * Snapshot dev's I/O stats.  Each counter is read atomically,
+ * but the snapshot as a whole is not.
+ * @return 0 on success, -1 if dev doesn't have I/O stats on
+ */
+int blink1_getIoStats( blink1_device* dev, blink1_iostats* stats );
+
+/**
+ * Zero dev's I/O stats.
+ */
+void blink1_resetIoStats( blink1_device* dev );
+
+/**
+ * Estimate a latency percentile from an op's histogram.
+ * @param pct percentile, 0-100
+ * @return upper bound in microseconds of the bucket holding it
+ *         (capped at maxMicros), 0 if nothing was counted
+ */
+uint64_t blink1_ioStatsPercentile( const blink1_iostats_op* op, int pct );
+
+
 /**
  * Enable blink1-lib gamma curve.
  */
@@ -391,6 +1145,11 @@ void blink1_enableDegamma();
  * @note should probably always have it disabled
  */
 void blink1_disableDegamma();
+
+/**
+ * @return 1 if blink1-lib gamma curve is on
+ */
+int blink1_degammaEnabled();
 int blink1_degamma(int n);
 
 /**
@@ -400,12 +1159,54 @@ int blink1_degamma(int n);
  */
 void blink1_adjustBrightness( uint8_t brightness, uint8_t* r, uint8_t* g, uint8_t* b);
 
+/**
+ * blink1_adjustBrightness() on an array of colors, in place.
+ * Uses SIMD where the CPU has it; results are identical either way.
+ * @param brightness 0-255, if 0, no changes occur
+ */
+void blink1_adjustBrightnessMany( uint8_t brightness, rgb_t* colors, size_t n );
+
+/**
+ * blink1_degamma() on every channel of an array of colors, in place.
+ * Applies the curve regardless of blink1_degammaEnabled().
+ */
+void blink1_degammaMany( rgb_t* colors, size_t n );
+
 /**
  * Simple wrapper for cross-platform millisecond delay.
  * @param delayMillis number of milliseconds to wait
  */
 void blink1_sleep(uint32_t delayMillis);
 
+/**
+ * Called by blink1_schedRun() for each step, at the step's deadline.
+ * @param step step number, starting at 0
+ * @param lateMicros how far past its deadline this step started
+ * @param arg pointer given to blink1_schedRun()
+ * @return microseconds from this step's deadline to the next one's,
+ *         or -1 to stop
+ */
+typedef int64_t (*blink1_sched_fn)( uint64_t step, int64_t lateMicros, void* arg );
+
+typedef struct {
+    uint64_t steps;            // steps run
+    int64_t  lateMicros;       // lateness of the last step
+    uint64_t lateMaxMicros;    // worst lateness
+    uint64_t lateTotalMicros;  // sum of lateness, for the average
+    uint64_t scheduledMicros;  // last step's deadline, from the start
+    uint64_t elapsedMicros;    // wall time of the whole run
+} blink1_sched_stats;
+
+/**
+ * Run fn as a timeline of steps on absolute deadlines of a monotonic
+ * clock, so time spent in fn (e.g. USB I/O) doesn't add up to drift:
+ * a step that runs late makes the next delay shorter.
+ * Blocks until fn returns -1.
+ * @param stats filled in at the end if not NULL
+ * @return number of steps run, -1 on error
+ */
+int blink1_schedRun( blink1_sched_fn fn, void* arg, blink1_sched_stats* stats );
+
 /**
  * Vendor ID for blink1 devices.
  * @return blink1 VID
@@ -439,7 +1240,7 @@ const char*  blink1_getCachedSerial(int i);
 int          blink1_getCacheIndexByPath( const char* path );
 /**
  * Return cache index for a given blink1 id (0-max or serial number as uint32)
- * @param i blink1 id (0-blink1_max_devices or serial as uint32)
+ * @param i blink1 id (cache index or serial as uint32, see blink1_idIsSerial)
  * @return cache index or -1 if not found
  */
 int          blink1_getCacheIndexById( uint32_t i );
@@ -462,6 +1263,77 @@ int          blink1_getCacheIndexByDev( blink1_device* dev );
  */
 int          blink1_clearCacheDev( blink1_device* dev );
 
+/**
+ * Add a device to the blink1 device cache without a full enumerate,
+ * e.g. from a hotplug notification.  Existing cache indexes don't change.
+ * @param path platform-specific path string
+ * @param serial 8-hexdigit serial number string
+ * @return cache index of the (possibly already present) device, or -1
+ */
+int          blink1_cacheAdd( const char* path, const char* serial );
+
+#define BLINK1_HOTPLUG_ADDED   1
+#define BLINK1_HOTPLUG_REMOVED 0
+
+/**
+ * Hotplug callback, called from blink1_hotplugPoll().
+ * The cache has already been updated when it is called.
+ * @param event BLINK1_HOTPLUG_ADDED or BLINK1_HOTPLUG_REMOVED
+ * @param serial 8-hexdigit serial number of the device
+ * @param path platform-specific path of the device
+ * @param userdata pointer given to blink1_hotplugRegister()
+ */
+typedef void (*blink1_hotplug_cb)( int event, const char* serial,
+                                   const char* path, void* userdata );
+
+/**
+ * Start tracking blink(1) plug/unplug events, then enumerate once.
+ * Afterwards blink1_hotplugPoll() keeps the device cache current one
+ * device at a time, without closing handles of other devices.
+ * @note Linux (hidraw) only for now, elsewhere use blink1_enumerate()
+ * @return file descriptor that becomes readable when events are pending,
+ *         or -1 if hotplug isn't available
+ */
+int          blink1_hotplugStart(void);
+
+/**
+ * Stop tracking plug/unplug events.
+ */
+void         blink1_hotplugStop(void);
+
+/**
+ * Apply pending plug/unplug events to the device cache and call
+ * registered callbacks.  Never blocks.  A removed device's pooled
+ * handle is closed if it isn't held, otherwise on its last release.
+ * @return number of events handled
+ */
+int          blink1_hotplugPoll(void);
+
+/**
+ * Register a hotplug callback.
+ * @param cb function to call on plug/unplug
+ * @param userdata passed to cb
+ * @return id for blink1_hotplugUnregister(), or -1 on error
+ */
+int          blink1_hotplugRegister( blink1_hotplug_cb cb, void* userdata );
+
+/**
+ * Unregister a hotplug callback.
+ * @param id from blink1_hotplugRegister()
+ */
+void         blink1_hotplugUnregister( int id );
+
+int          blink1_ctxHotplugRegister( blink1_context* ctx, blink1_hotplug_cb cb, void* userdata );
+void         blink1_ctxHotplugUnregister( blink1_context* ctx, int id );
+
+/**
+ * Remove the device at cache index i from the blink1 device cache.
+ * Devices after it move down one index.  Does not close its handle.
+ * @param i cache index
+ * @return i, or -1 if out of range
+ */
+int          blink1_cacheRemove( int i );
+
 /**
  * Return serial number string for give blink1 device.
  * @param dev blink device to lookup
@@ -541,6 +1413,13 @@ int hexread(uint8_t *buffer, char *string, int buflen);
  */
 void hsbtorgb( rgb_t* rgb, uint8_t* hsb );
 
+/**
+ * hsbtorgb() on n pixels at once, using SIMD where the CPU has it.
+ * Output is identical to calling hsbtorgb() on each.
+ * @param hsb n packed h,s,b byte triples
+ */
+void blink1_hsbtorgbMany( rgb_t* out, const uint8_t* hsb, size_t n );
+
 /**
  * Parse an RGB color from a string in one of the forms:
  * - "#ff00ff"
@@ -554,11 +1433,33 @@ void parsecolor(rgb_t* color, char* colorstr);
 /**
  * Parse pattern into an array of patternlines
  * - number repeats
- * - pattern array (contains {color,millis,ledn})
+ * - pattern array (contains {color,millis,ledn}), room for
+ *   blink1_cpattern_max lines
  * Returns pattern length or -1 if badly-formatted pattern
  */
 int parsePattern( char* str, int* repeats, patternline_t* pattern );
 
+/**
+ * Parse a color, as parsecolor(), from str[0..len-1].  No NUL needed.
+ * Re-entrant and allocation-free.
+ * @param err if not NULL, where and why parsing failed
+ * @return 0 on success, -1 on error (color is left alone)
+ */
+int blink1_parseColorN( rgb_t* color, const char* str, size_t len, blink1_parse_error* err );
+
+/**
+ * Parse a pattern string like "3,#ff0000,0.5,0,#0000ff,0.5,2" (repeats,
+ * then color,seconds,ledn per line) from str[0..len-1], in one pass.
+ * Seconds are decimal, optionally with an exponent ("5e-1"), and are
+ * rounded down to millis.  No NUL needed.  Re-entrant and allocation-free.
+ * @param pattern where to put the lines, or NULL to just count them
+ * @param maxlines room in pattern, more lines than that is an error
+ * @param err if not NULL, where and why parsing failed
+ * @return number of lines, -1 on error
+ */
+int blink1_parsePatternN( const char* str, size_t len, int* repeats,
+                          patternline_t* pattern, int maxlines, blink1_parse_error* err );
+
 /**
  * Given a list of pattern lines, create the pattern string representation.
  * The pased in str must be big enough to hold the string rep.
@@ -44,10 +44,14 @@ int32_t delayMillis = -1;
 int numDevicesToUse = 1;
 
 blink1_device* dev = NULL;
-uint32_t  deviceIds[blink1_max_devices];
+uint32_t  deviceIdsDefault[1] = { 0 };
+uint32_t* deviceIds = deviceIdsDefault;  // malloc'd if more than one
 
 int verbose;
 int quiet=0;
+int showstats=0;
+blink1_sched_stats schedstats;  // from the last effect run, for --stats
+int schedran=0;
 
 /*
   TBD: replace printf()s with something like this
@@ -122,6 +126,8 @@ static void usage(char *myName)
 "  -l <led>, --led=<led>       Which LED to use, 0=all/1=top/2=bottom (mk2+)\n"
 "  --ledn 1,3,5,7              Specify a list of LEDs to light\n"
 "  -v, --verbose               verbose debugging msgs\n"
+"  --stats                     Print per-command report counts & latencies at end\n"
+"  --calibration <file>        Load per-device color calibration profiles\n"
 "\n"
 "Examples: \n"
 "  blink1-tool -m 100 --rgb=255,0,255    # Fade to #FF00FF in 0.1 seconds \n"
@@ -227,26 +233,232 @@ enum {
 //
 // Fade to RGB for multiple blink1 devices.
 // Uses globals numDevicesToUse, deviceIds, quiet
+// Devices come from the handle pool, so repeated calls don't reopen them,
+// and are written to concurrently with blink1_fadeToRGBMany()
+// (or blink1_cpatternFadeMany() if cp is given, fading to its line i).
 //
-int blink1_fadeToRGBForDevices( uint16_t mils, uint8_t rr,uint8_t gg, uint8_t bb, uint8_t nn ) {
-    blink1_device* d;
-    int rc;
-    for( int i=0; i< numDevicesToUse; i++ ) {
-        d = blink1_openById( deviceIds[i] );
+static int fadeForDevices( uint16_t mils, uint8_t rr,uint8_t gg, uint8_t bb, uint8_t nn,
+                           const blink1_cpattern* cp, int i ) {
+    blink1_device** devs = malloc( numDevicesToUse * sizeof(blink1_device*) );
+    uint32_t* ids = malloc( numDevicesToUse * sizeof(uint32_t) );
+    int* results = malloc( numDevicesToUse * sizeof(int) );
+    int n = 0;
+    if( devs == NULL || ids == NULL || results == NULL ) {
+        free(devs); free(ids); free(results);
+        return -1;
+    }
+    for( int j=0; j< numDevicesToUse; j++ ) {
+        blink1_device* d = blink1_acquireById( deviceIds[j] );
         if( d == NULL ) continue;
         msg("set dev:%X:%d to rgb:0x%02x,0x%02x,0x%02x over %d msec\n",
-            deviceIds[i], nn, rr,gg,bb, mils);
-        if( nn==0 ) {
-            rc = blink1_fadeToRGB(d, mils, rr,gg,bb);
-        } else {
-            rc = blink1_fadeToRGBN(d,mils, rr,gg,bb, nn);
+            deviceIds[j], nn, rr,gg,bb, mils);
+        ids[n] = deviceIds[j];
+        devs[n++] = d;
+    }
+    int failed = (cp) ? blink1_cpatternFadeMany( devs, n, cp, i, mils, results ) :
+                        blink1_fadeToRGBMany( devs, n, mils, rr,gg,bb, nn, results );
+    for( int j=0; j< n; j++ ) {
+        if( results[j] == -1 && !quiet ) { // on error, do something, anything.
+            printf("error on fadeToRGBForDevices, dev:%X\n", ids[j]);
         }
-        if( rc == -1 && !quiet ) { // on error, do something, anything.
-            printf("error on fadeToRGBForDevices\n");
+        blink1_release( devs[j] );
+    }
+    free(devs); free(ids); free(results);
+    return (failed) ? -1 : 0;
+}
+
+int blink1_fadeToRGBForDevices( uint16_t mils, uint8_t rr,uint8_t gg, uint8_t bb, uint8_t nn ) {
+    return fadeForDevices( mils, rr,gg,bb, nn, NULL, 0 );
+}
+
+// fade to line i of a compiled pattern, brightness is already in it
+int fadeToLineForDevices( uint16_t mils, const blink1_cpattern* cp, int i ) {
+    rgb_t c = cp->lines[i].color;  // only for the msg()
+    blink1_adjustBrightness( cp->brightness, &c.r, &c.g, &c.b );
+    return fadeForDevices( mils, c.r, c.g, c.b, cp->lines[i].ledn, cp, i );
+}
+
+//
+// Print I/O stats for every device used, see --stats
+// Devices the command didn't open have none, and aren't opened here.
+//
+void print_iostats( int count ) {
+    blink1_iostats st;
+    for( int i=0; i< count; i++ ) {
+        blink1_device* d = blink1_acquireOpenById( i );
+        if( d == NULL ) continue;
+        int rc = blink1_getIoStats( d, &st );
+        blink1_release( d );
+        if( rc == -1 ) continue;
+
+        int header = 0;
+        for( int c=0; c<128; c++ ) {
+            for( int w=0; w<2; w++ ) {
+                blink1_iostats_op* op = (w==0) ? &st.cmds[c].write : &st.cmds[c].read;
+                if( op->count == 0 ) continue;
+                if( !header ) {
+                    printf("stats id:%d serialnum:%s\n", i, blink1_getCachedSerial(i));
+                    printf("  cmd  op     count  errors  avg_us  p50_us  p99_us  max_us\n");
+                    header = 1;
+                }
+                printf("  '%c'  %-5s %6llu  %6llu  %6llu  %6llu  %6llu  %6llu\n",
+                       (c >= ' ' && c < 127) ? c : '?', (w==0) ? "write" : "read",
+                       (unsigned long long)op->count,
+                       (unsigned long long)op->errors,
+                       (unsigned long long)(op->totalMicros / op->count),
+                       (unsigned long long)blink1_ioStatsPercentile(op, 50),
+                       (unsigned long long)blink1_ioStatsPercentile(op, 99),
+                       (unsigned long long)op->maxMicros);
+            }
         }
-        blink1_close( d );
     }
-    return 0; // FIXME
+}
+
+//
+// Effects run as blink1_schedRun() steps, so USB latency doesn't add
+// up over long runs.
+//
+
+// run an effect and keep its lateness numbers for --stats
+void run_effect( blink1_sched_fn fn, void* arg ) {
+    blink1_schedRun( fn, arg, &schedstats );
+    schedran = 1;
+}
+
+//
+void print_schedstats(void) {
+    blink1_sched_stats* st = &schedstats;
+    printf("timeline: %llu steps over %llu ms, late avg:%llu us max:%llu us last:%lld us\n",
+           (unsigned long long)st->steps,
+           (unsigned long long)(st->scheduledMicros / 1000),
+           (unsigned long long)(st->steps ? st->lateTotalMicros / st->steps : 0),
+           (unsigned long long)st->lateMaxMicros,
+           (long long)st->lateMicros);
+}
+
+typedef struct {
+    int count;       // times to change color
+    int ledn;        // 0 for all LEDs, else pick one from 1..ledn
+    uint8_t brightness;
+} random_effect;
+
+static int64_t random_step( uint64_t step, int64_t late, void* arg ) {
+    (void)late;
+    random_effect* e = (random_effect*)arg;
+    int cnt = blink1_getCachedCount();
+    uint8_t r = rand()%255;
+    uint8_t g = rand()%255;
+    uint8_t b = rand()%255 ;
+    uint8_t id = rand() % cnt;
+    int rc;
+
+    blink1_adjustBrightness( e->brightness, &r, &g, &b);
+
+    msg("%d: %d/%d : %2.2x,%2.2x,%2.2x \n", (int)step, id, cnt, r,g,b);
+
+    blink1_device* mydev = dev;
+    if( cnt > 1 ) mydev = blink1_acquireById( id );
+    if( e->ledn == 0 ) {
+        rc = blink1_fadeToRGB(mydev, millis,r,g,b);
+    } else {
+        uint8_t n = 1 + rand() % e->ledn;
+        rc = blink1_fadeToRGBN(mydev, millis,r,g,b,n);
+    }
+    if( rc == -1 && !quiet ) { // on error, do something, anything.
+        printf("error during random\n");
+    }
+    if( cnt > 1 ) blink1_release( mydev );
+
+    return ( (int)step+1 < e->count ) ? (int64_t)delayMillis * 1000 : -1;
+}
+
+typedef struct {
+    int loopcnt;            // times to go around, -1 for forever
+    uint8_t led_start;
+    int chase_length;
+    uint8_t brightness;
+    uint8_t led_grad[256][3];  // 256 covers the full uint8_t LED index range
+} chase_effect;
+
+static int64_t chase_step( uint64_t step, int64_t late, void* arg ) {
+    (void)late;
+    chase_effect* e = (chase_effect*)arg;
+    int i = step % e->chase_length;  // i = front led lit
+    uint64_t loop = step / e->chase_length;
+    for( int j = 0; j<e->chase_length; ++j) {
+        int grad_index=i-j;
+        if (grad_index < 0) grad_index+=e->chase_length;
+        uint8_t r = e->led_grad[grad_index][0];
+        uint8_t g = e->led_grad[grad_index][1];
+        uint8_t b = e->led_grad[grad_index][2];
+        blink1_adjustBrightness( e->brightness, &r, &g, &b);
+        if ((j <= i) || (loop > 0)) {
+            blink1_fadeToRGBN(dev, 10 + (millis/e->chase_length), r,g,b,e->led_start+j);
+        }
+    }
+    if( e->loopcnt != -1 && i == e->chase_length-1 && loop >= (uint64_t)e->loopcnt ) {
+        return -1;
+    }
+    return (int64_t)delayMillis * 1000 / e->chase_length;
+}
+
+typedef struct {
+    int count;  // blinks, -1 for forever
+    uint8_t r, g, b;
+    int ledn;
+} blink_effect;
+
+static int64_t blink_step( uint64_t step, int64_t late, void* arg ) {
+    (void)late;
+    blink_effect* e = (blink_effect*)arg;
+    if( step % 2 == 0 ) {
+        blink1_fadeToRGBForDevices( millis, e->r,e->g,e->b, e->ledn);
+    } else {
+        blink1_fadeToRGBForDevices( millis, 0,0,0, e->ledn);
+        if( e->count != -1 && step/2 + 1 >= (uint64_t)e->count ) return -1;
+    }
+    return (int64_t)delayMillis * 1000;
+}
+
+typedef struct {
+    int count;
+    uint8_t r, g, b;
+} glimmer_effect;
+
+static int64_t glimmer_step( uint64_t step, int64_t late, void* arg ) {
+    (void)late;
+    glimmer_effect* e = (glimmer_effect*)arg;
+    uint8_t r = e->r, g = e->g, b = e->b;
+    if( step == 2 * (uint64_t)e->count ) {  // turn them both off
+        blink1_fadeToRGBN(dev, millis, 0,0,0, 1);
+        blink1_fadeToRGBN(dev, millis, 0,0,0, 2);
+        return -1;
+    }
+    if( step % 2 == 0 ) {
+        blink1_fadeToRGBN(dev, millis,r,g,b, 1);
+        blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 2);
+    } else {
+        blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 1);
+        blink1_fadeToRGBN(dev, millis,r,g,b, 2);
+    }
+    return (int64_t)delayMillis * 1000 / 2;
+}
+
+typedef struct {
+    blink1_cpattern cp;  // brightness already applied
+    int repeats;         // -1 for forever
+} playpattern_effect;
+
+static int64_t playpattern_step( uint64_t step, int64_t late, void* arg ) {
+    (void)late;
+    playpattern_effect* e = (playpattern_effect*)arg;
+    int i = step % e->cp.len;
+    fadeToLineForDevices( millis, &e->cp, i );
+    if( e->repeats != -1 && i == e->cp.len-1 &&
+        step / e->cp.len + 1 >= (uint64_t)e->repeats ) {
+        return -1;
+    }
+    return (int64_t)e->cp.lines[i].millis * 1000;
 }
 
 #if __linux__
@@ -367,6 +579,8 @@ int main(int argc, char** argv)
         {"getstartup", no_argument,       &cmd,   CMD_GETSTARTUP},
         {"testtest",   no_argument,       &cmd,   CMD_TESTTEST },
         {"reportid",   required_argument, 0,      'i' },
+        {"stats",      no_argument,       0,      's' },
+        {"calibration",required_argument, 0,      'C' },
         {"writenote",  required_argument, &cmd,   CMD_WRITENOTE},
         {"readnote",   required_argument, &cmd,   CMD_READNOTE},
         {"readnotes",  no_argument,       &cmd,   CMD_READNOTES_ALL},
@@ -489,21 +703,34 @@ int main(int argc, char** argv)
         case 'i': // report id, for testing
           reportid = strtol(optarg,NULL,10);
           break;
+        case 'C': { // load calibration profiles, before any device is opened
+            blink1_parse_error err;
+            if( blink1_loadCalibration( optarg, &err ) == -1 ) {
+                msg("calibration %s: %s at char %d\n", optarg, err.msg, err.offset);
+                exit(1);
+            }
+            break;
+        }
+        case 's': // print I/O stats at end
+            showstats = 1;
+            blink1_setIoStats(1);
+            break;
         case 'd':  // devices to use
             if( strcmp(optarg,"all") == 0 ) {
-                numDevicesToUse = 0; //blink1_max_devices;
-                for( int i=0; i< blink1_max_devices; i++) {
-                    deviceIds[i] = i;
-                }
+                numDevicesToUse = 0; // filled in after enumerate
             }
             else { // if( strcmp(optarg,",") != -1 ) { // comma-separated list
                 char* pch;
                 //int base = 0;
+                int n = 1;
+                for( char* c = optarg; *c; c++ ) if( *c==',' || *c==' ' ) n++;
+                deviceIds = malloc( n * sizeof(uint32_t) );
+                if( deviceIds == NULL ) exit(1);
                 pch = strtok( optarg, " ,");
                 numDevicesToUse = 0;
                 while( pch != NULL ) {
                     int base = (strlen(pch)==8) ? 16:0;
-                    deviceIds[numDevicesToUse++] = strtol(pch,NULL,base);
+                    deviceIds[numDevicesToUse++] = strtoul(pch,NULL,base);
                     pch = strtok(NULL, " ,");
                 }
                 //if( !quiet ) {
@@ -540,12 +767,16 @@ int main(int argc, char** argv)
     }
 #endif
 
+    // keep pooled handles open for the life of the command,
+    // they're all closed by blink1_poolFlush() at exit
+    blink1_setPoolIdleMillis(0);
+
     if( cmd == CMD_VERSION ) {
         char verbuf[40] = "";
         if( count ) {
-            dev = blink1_openById( deviceIds[0] );
+            dev = blink1_acquireById( deviceIds[0] );
             rc = blink1_getVersion(dev);
-            blink1_close(dev);
+            blink1_release(dev);
             snprintf(verbuf, sizeof(verbuf), ", fw version: %d", rc);
         }
         msg("blink1-tool version: %s%s\n",BLINK1_VERSION,verbuf);
@@ -567,7 +798,14 @@ int main(int argc, char** argv)
         exit(1);
     }
 
-    if( numDevicesToUse == 0 ) numDevicesToUse = count;
+    if( numDevicesToUse == 0 ) { // "-d all"
+        numDevicesToUse = count;
+        deviceIds = malloc( count * sizeof(uint32_t) );
+        if( deviceIds == NULL ) exit(1);
+        for( int i=0; i< count; i++) {
+            deviceIds[i] = i;
+        }
+    }
 
     if( verbose ) {
         printf("deviceId[0] = %X\n", deviceIds[0]);
@@ -580,7 +818,7 @@ int main(int argc, char** argv)
 
     // actually open up the device to start talking to it
     if(verbose) printf("openById: %X\n", deviceIds[0]);
-    dev = blink1_openById( deviceIds[0] );
+    dev = blink1_acquireById( deviceIds[0] );
 
     if( dev == NULL ) {
         msg("cannot open blink(1), bad id or serial number\n");
@@ -620,12 +858,11 @@ int main(int argc, char** argv)
     // begin command processing
 
     if( cmd == CMD_LIST ) {
-        blink1_close(dev);
         printf("blink(1) list: \n");
         for( int i=0; i< count; i++ ) {
-            dev = blink1_openBySerial( blink1_getCachedSerial(i) );
-            rc = blink1_getVersion(dev);
-            blink1_close(dev);
+            blink1_device* d = blink1_acquireBySerial( blink1_getCachedSerial(i) );
+            rc = blink1_getVersion(d);
+            blink1_release(d);
             const char* t = blink1_deviceTypeToStr(blink1_deviceTypeById(i));
             printf("id:%d - serialnum:%s (%s) fw version:%d\n",
                    i, blink1_getCachedSerial(i), t, rc);
@@ -654,22 +891,19 @@ int main(int argc, char** argv)
     }
     */
     else if( cmd == CMD_FWVERSION ) {
-        blink1_close(dev);
         for( int i=0; i<count; i++ ) {
-            dev = blink1_openBySerial( blink1_getCachedSerial(i) );
-            if( dev == NULL ) continue;
-            rc = blink1_getVersion(dev);
+            blink1_device* d = blink1_acquireBySerial( blink1_getCachedSerial(i) );
+            if( d == NULL ) continue;
+            rc = blink1_getVersion(d);
             printf("id:%d - firmware:%d serialnum:%s %s\n", i, rc,
                    blink1_getCachedSerial(i),
                    (blink1_isMk2ById(i)) ? "(mk2)":"");
-            blink1_close(dev);
+            blink1_release(d);
         }
     }
     else if( cmd == CMD_RGB || cmd == CMD_ON  || cmd == CMD_OFF ||
              cmd == CMD_RED || cmd == CMD_BLU || cmd == CMD_GRN ||
              cmd == CMD_CYAN || cmd == CMD_MAGENTA || cmd == CMD_YELLOW ) {
-        blink1_close(dev); // close global device, open as needed
-
         uint8_t r = rgbbuf.r;
         uint8_t g = rgbbuf.g;
         uint8_t b = rgbbuf.b;
@@ -755,46 +989,22 @@ int main(int argc, char** argv)
         printf("r,g,b = 0x%2.2x,0x%2.2x,0x%2.2x (%d) ms:%d\n", r,g,b, n, msecs);
     }
     else if( cmd == CMD_RANDOM ) {
-        int cnt = blink1_getCachedCount();
-        if( arg==0 ) arg = 1;
-        if( cnt>1 ) blink1_close(dev); // close global device, open as needed
-        msg("random %d times: \n", arg);
-        for( int i=0; i<arg; i++ ) {
-            uint8_t r = rand()%255;
-            uint8_t g = rand()%255;
-            uint8_t b = rand()%255 ;
-            uint8_t id = rand() % blink1_getCachedCount();
-
-            blink1_adjustBrightness( brightness, &r, &g, &b);
-
-            msg("%d: %d/%d : %2.2x,%2.2x,%2.2x \n",
-                i, id, blink1_getCachedCount(), r,g,b);
-
-            blink1_device* mydev = dev;
-            if( cnt > 1 ) mydev = blink1_openById( id );
-            if( ledn == 0 ) {
-                rc = blink1_fadeToRGB(mydev, millis,r,g,b);
-            } else {
-                uint8_t n = 1 + rand() % ledn;
-                rc = blink1_fadeToRGBN(mydev, millis,r,g,b,n);
-            }
-            if( rc == -1 && !quiet ) { // on error, do something, anything.
-                printf("error during random\n");
-                //break;
-            }
-            if( cnt > 1 ) blink1_close( mydev );
-
-            blink1_sleep(delayMillis);
-        }
+        random_effect e = { arg, ledn, brightness };
+        if( e.count==0 ) e.count = 1;
+        msg("random %d times: \n", e.count);
+        run_effect( random_step, &e );
     }
     // this whole thing is a huge mess currently // FIXME
     else if( cmd == CMD_CHASE) {
         if( ledn == 0 ) ledn = 18;
 
-        int loopcnt       = (chasebuf[0] > 0) ? ((int)(chasebuf[0]))-1 : -1;
-        uint8_t led_start = (chasebuf[1]) ? chasebuf[1] : 1;
+        chase_effect e;
+        e.loopcnt         = (chasebuf[0] > 0) ? ((int)(chasebuf[0]))-1 : -1;
+        e.led_start       = (chasebuf[1]) ? chasebuf[1] : 1;
         uint8_t led_end   = (chasebuf[2]) ? chasebuf[2] : 18;
-        int chase_length  = led_end-led_start+1;
+        e.chase_length    = led_end-e.led_start+1;
+        e.brightness      = brightness;
+        int chase_length  = e.chase_length;
 
         // pick the color
         uint8_t do_rand = 0;
@@ -807,80 +1017,40 @@ int main(int argc, char** argv)
         snprintf(ledstr, sizeof(ledstr), "#%2.2x%2.2x%2.2x",
             rgbbuf.r,rgbbuf.g,rgbbuf.b);
         msg("chase effect %d to %d (with %d leds), color %s, ",
-            led_start, led_end, chase_length,
+            e.led_start, led_end, chase_length,
             ((do_rand) ? "random" : ledstr));
-        if (loopcnt < 0) msg("forever\n");
-        else             msg("%d times\n", loopcnt+1);
+        if (e.loopcnt < 0) msg("forever\n");
+        else               msg("%d times\n", e.loopcnt+1);
 
-        // make gradient (256 covers the full uint8_t LED index range; avoids VLA)
-        uint8_t led_grad[256][3];
+        // make gradient
         for( int i=0; i<chase_length; i++ ) {
             int temp = chase_length-i-1;
-            led_grad[temp][0] = c[0] * i / chase_length;
-            led_grad[temp][1] = c[1] * i / chase_length;
-            led_grad[temp][2] = c[2] * i / chase_length;
+            e.led_grad[temp][0] = c[0] * i / chase_length;
+            e.led_grad[temp][1] = c[1] * i / chase_length;
+            e.led_grad[temp][2] = c[2] * i / chase_length;
         }
 
         // do the animation
-        uint8_t first=1;
-        do {
-            for( int i=0; i < chase_length; ++i) { // i = front led lit
-                for( int j = 0; j<chase_length; ++j) {
-                    int grad_index=i-j;
-                    if (grad_index < 0) grad_index+=chase_length;
-                    uint8_t r = led_grad[grad_index][0];
-                    uint8_t g = led_grad[grad_index][1];
-                    uint8_t b = led_grad[grad_index][2];
-                    blink1_adjustBrightness( brightness, &r, &g, &b);
-                    if ((j <= i) || (!first)) {
-                        rc = blink1_fadeToRGBN(dev, 10 + (millis/chase_length), r,g,b,led_start+j);
-                    }
-                }
-                blink1_sleep(delayMillis/chase_length);
-            }
-            first = 0;
-        } while( loopcnt == -1 || loopcnt-- );
+        if( chase_length > 0 ) run_effect( chase_step, &e );
     }
     else if( cmd == CMD_BLINK ) {
-        int16_t n = arg;
-        uint8_t r = rgbbuf.r;
-        uint8_t g = rgbbuf.g;
-        uint8_t b = rgbbuf.b;
-        if( r == 0 && b == 0 && g == 0 ) {
-            r = g = b = 255;
+        blink_effect e = { arg, rgbbuf.r, rgbbuf.g, rgbbuf.b, ledn };
+        if( e.r == 0 && e.b == 0 && e.g == 0 ) {
+            e.r = e.g = e.b = 255;
         }
-        blink1_close(dev);
-        blink1_adjustBrightness( brightness, &r, &g, &b);
-        msg("blink %d times rgb:%2.2x,%2.2x,%2.2x: \n", n,r,g,b);
-        if( n == 0 ) n = -1; // repeat forever
-        while( n==-1 || n-- ) {
-            rc = blink1_fadeToRGBForDevices( millis,r,g,b,ledn);
-            blink1_sleep(delayMillis);
-            rc = blink1_fadeToRGBForDevices( millis,0,0,0,ledn);
-            blink1_sleep(delayMillis);
-         }
+        blink1_adjustBrightness( brightness, &e.r, &e.g, &e.b);
+        msg("blink %d times rgb:%2.2x,%2.2x,%2.2x: \n", e.count, e.r,e.g,e.b);
+        if( e.count == 0 ) e.count = -1; // repeat forever
+        run_effect( blink_step, &e );
     }
     else if( cmd == CMD_GLIMMER ) {
-        uint8_t n = arg;
-        uint8_t r = rgbbuf.r;
-        uint8_t g = rgbbuf.g;
-        uint8_t b = rgbbuf.b;
-        if( n == 0 ) n = 3;
-        if( r == 0 && b == 0 && g == 0 ) {
-            r = g = b = 127;
+        glimmer_effect e = { (uint8_t)arg, rgbbuf.r, rgbbuf.g, rgbbuf.b };
+        if( e.count == 0 ) e.count = 3;
+        if( e.r == 0 && e.b == 0 && e.g == 0 ) {
+            e.r = e.g = e.b = 127;
         }
-        msg("glimmering %d times rgb:#%2.2x%2.2x%2.2x: \n", n,r,g,b);
-        for( int i=0; i<n; i++ ) {
-            blink1_fadeToRGBN(dev, millis,r,g,b, 1);
-            blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 2);
-            blink1_sleep(delayMillis/2);
-            blink1_fadeToRGBN(dev, millis,r/2,g/2,b/2, 1);
-            blink1_fadeToRGBN(dev, millis,r,g,b, 2);
-            blink1_sleep(delayMillis/2);
-        }
-        // turn them both off
-        blink1_fadeToRGBN(dev, millis, 0,0,0, 1);
-        blink1_fadeToRGBN(dev, millis, 0,0,0, 2);
+        msg("glimmering %d times rgb:#%2.2x%2.2x%2.2x: \n", e.count, e.r,e.g,e.b);
+        run_effect( glimmer_step, &e );
     }
     else if( cmd == CMD_SERVERDOWN ) {
         int on = cmdbuf[0];
@@ -894,53 +1064,44 @@ int main(int argc, char** argv)
         blink1_serverdown( dev, on, delayMillis, st, start_pos, end_pos );
     }
     else if( cmd == CMD_PLAYPATTERN ) {
-        blink1_close(dev);
         msg("play pattern: %s\n",argbuf);
 
-        int repeats = -1;
-        patternline_t pattern[32];
-        int pattlen = parsePattern( (char*)argbuf, &repeats, pattern);
-        if( pattlen == -1 ) {  // bad pattern
-            msg("bad pattern\n");
+        playpattern_effect e;
+        blink1_parse_error err;
+        if( blink1_cpatternParse( &e.cp, argbuf, brightness,
+                                  blink1_degammaEnabled(), &err ) == -1 ) {  // bad pattern
+            msg("bad pattern at char %d: %s\n", err.offset, err.msg);
         }
         else {  // good pattern
-            msg("repeats: %d\n", repeats);
-            if( repeats==0 ) repeats=-1;
-
-            while( repeats==-1 || repeats-- ) {
-                for( int i=0; i<pattlen; i++ ) {
-                    patternline_t pat = pattern[i];
-                    //msg("%d: %2.2x,%2.2x,%2.2x : %d : %d\n", i, pat.color.r,pat.color.r,pat.color.b, pat.millis,pat.ledn );
-                    //msg("%d:",repeats);
-                    uint16_t m = millis;
-                    uint8_t r = pat.color.r;
-                    uint8_t g = pat.color.g;
-                    uint8_t b = pat.color.b;
-                    blink1_adjustBrightness( brightness, &r, &g, &b);
-                    blink1_fadeToRGBForDevices( m, r,g,b, pat.ledn);
-                    blink1_sleep( pat.millis );
-                }
-            }
+            e.repeats = e.cp.repeats;
+            msg("repeats: %d\n", e.repeats);
+            if( e.repeats==0 ) e.repeats=-1;
+            run_effect( playpattern_step, &e );
         } // good pattern
     }
     else if( cmd == CMD_WRITEPATTERN ) {
         msg("write pattern: %s\n", argbuf);
 
-        int repeats = -1;
-        patternline_t pattern[32];  // FIXME: patt_max
-        int pattlen = parsePattern( (char*)argbuf, &repeats, pattern);
-        //msg("repeats: %d is ignored for writepattern\n", repeats);
-        if( pattlen == -1 ) {  // bad pattern
-            msg("bad pattern\n");
+        blink1_cpattern cp;
+        blink1_parse_error err;
+        // repeats is ignored for writepattern
+        if( blink1_cpatternParse( &cp, argbuf, 0, blink1_degammaEnabled(), &err ) == -1 ) {
+            msg("bad pattern at char %d: %s\n", err.offset, err.msg);
         }
         else {  // good pattern
-            for( int i=0; i<pattlen; i++ ) {
-                patternline_t pat = pattern[i];
-                msg("writing line %d: %2.2x,%2.2x,%2.2x : %d : %d\n",
+            for( int i=0; i<cp.len; i++ ) {
+                patternline_t pat = cp.lines[i];
+                msg("line %d: %2.2x,%2.2x,%2.2x : %d : %d\n",
                     i, pat.color.r, pat.color.g, pat.color.b, pat.millis,pat.ledn);
-                blink1_setLEDN(dev, pat.ledn);
-                rc = blink1_writePatternLine(dev, pat.millis, pat.color.r, pat.color.g, pat.color.b, i);
             }
+            // nothing to diff against in a fresh process, so don't seed
+            blink1_pattsync_result res;
+            rc = blink1_cpatternWrite(dev, &cp, 0, &res);
+            if( rc == -1 && !quiet ) {
+                printf("error on writepattern\n");
+            }
+            msg("wrote %d lines, %d reports, %d reports avoided\n",
+                res.linesWritten, res.reportsSent, res.reportsAvoided);
         } // good pattern
     }
     else if( cmd == CMD_CLEARPATTERN ) {
@@ -962,7 +1123,7 @@ int main(int argc, char** argv)
         char strline[64];   // ",#rrggbb,0.00,d" is ~20 chars; 64 is ample
         //strcat(str, "{0"); // repeats forever
         for( int i=0; i<patt_max; i++ ) {
-            rc = blink1_readPatternLineN(dev, &msecs, &r,&g,&b, &n, i );
+            rc = blink1_shadowReadPatternLineN(dev, &msecs, &r,&g,&b, &n, i );
             //if( !(msecs==0 && r==0 && g==0 && b==0) ) {
             snprintf(strline, sizeof(strline), ",#%2.2x%2.2x%2.2x,%0.2f,%d", r,g,b, (msecs/1000.0),n);
             strcat(str,strline);
@@ -1076,6 +1237,12 @@ int main(int argc, char** argv)
     }
 
 
-    blink1_close(dev);
+    if( showstats ) {
+        print_iostats(count);
+        if( schedran ) print_schedstats();
+    }
+
+    blink1_release(dev);
+    blink1_poolFlush(0);
     return 0;
 }
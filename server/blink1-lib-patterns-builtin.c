@@ -0,0 +1,246 @@
+// generated from blink1-lib-patterns.def by server/gen-patterns.c, do not edit
+
+#include "blink1-lib-patterns.h"
+
+static const patternline_t lines0[] = {
+    { {0xff,0x00,0x00}, 500, 0 },
+    { {0x00,0x00,0x00}, 500, 0 },
+};
+static const patternline_t lines1[] = {
+    { {0x00,0xff,0x00}, 500, 0 },
+    { {0x00,0x00,0x00}, 500, 0 },
+};
+static const patternline_t lines2[] = {
+    { {0x00,0x00,0xff}, 500, 0 },
+    { {0x00,0x00,0x00}, 500, 0 },
+};
+static const patternline_t lines3[] = {
+    { {0xff,0xff,0xff}, 500, 0 },
+    { {0x00,0x00,0x00}, 500, 0 },
+};
+static const patternline_t lines4[] = {
+    { {0xff,0xff,0x00}, 500, 0 },
+    { {0x00,0x00,0x00}, 500, 0 },
+};
+static const patternline_t lines5[] = {
+    { {0xff,0x00,0xff}, 500, 0 },
+    { {0x00,0x00,0x00}, 500, 0 },
+};
+static const patternline_t lines6[] = {
+    { {0xff,0x4c,0xff}, 1000, 0 },
+    { {0x63,0x00,0x00}, 200, 0 },
+    { {0x00,0x00,0xff}, 100, 0 },
+};
+static const patternline_t lines7[] = {
+    { {0x00,0x00,0x00}, 100, 0 },
+};
+static const patternline_t lines8[] = {
+    { {0xff,0x00,0x00}, 300, 1 },
+    { {0x00,0x00,0xff}, 300, 2 },
+    { {0x00,0x00,0x00}, 100, 0 },
+    { {0xff,0x00,0x00}, 300, 2 },
+    { {0x00,0x00,0xff}, 300, 1 },
+    { {0x00,0x00,0x00}, 100, 0 },
+};
+static const patternline_t lines9[] = {
+    { {0xff,0x00,0x00}, 300, 1 },
+    { {0xff,0x00,0x00}, 300, 2 },
+    { {0x00,0x00,0x00}, 100, 0 },
+    { {0xff,0x00,0x00}, 300, 2 },
+    { {0xff,0x00,0x00}, 300, 1 },
+    { {0x00,0x00,0x00}, 100, 0 },
+};
+static const patternline_t lines10[] = {
+    { {0xe7,0x00,0x9a}, 1000, 0 },
+    { {0x3d,0x00,0xe7}, 1000, 0 },
+    { {0x00,0xb8,0xe7}, 1000, 0 },
+    { {0x00,0xe7,0x1e}, 1000, 0 },
+    { {0xd7,0xe7,0x00}, 1000, 0 },
+    { {0xe7,0x00,0x00}, 1000, 0 },
+    { {0xe7,0xe7,0xe7}, 1000, 0 },
+};
+static const patternline_t lines11[] = {
+    { {0x00,0xff,0xf2}, 800, 0 },
+    { {0x00,0x00,0x00}, 300, 0 },
+    { {0x65,0x00,0x3c}, 800, 0 },
+    { {0x00,0x00,0x00}, 300, 0 },
+    { {0xff,0xd9,0x05}, 800, 0 },
+    { {0x00,0x00,0x00}, 100, 0 },
+    { {0x00,0x00,0x00}, 700, 0 },
+};
+static const patternline_t lines12[] = {
+    { {0xff,0x00,0x00}, 800, 0 },
+    { {0x00,0x00,0x00}, 300, 0 },
+    { {0x00,0xff,0x00}, 800, 0 },
+    { {0x00,0x00,0x00}, 300, 0 },
+    { {0x00,0x00,0xff}, 800, 0 },
+    { {0x00,0x00,0x00}, 300, 0 },
+};
+static const patternline_t lines13[] = {
+    { {0x82,0x15,0x00}, 1000, 0 },
+    { {0x63,0x41,0x00}, 1000, 0 },
+    { {0x55,0x4f,0x00}, 1000, 0 },
+    { {0x39,0x58,0x00}, 1000, 0 },
+    { {0x00,0x58,0x0b}, 1000, 0 },
+    { {0x00,0x50,0x25}, 1000, 0 },
+    { {0x00,0x58,0x44}, 1000, 0 },
+    { {0x00,0x46,0x5a}, 1000, 0 },
+};
+static const patternline_t lines14[] = {
+    { {0x75,0x11,0x00}, 0, 1 },
+    { {0xff,0x1d,0x00}, 0, 2 },
+    { {0xff,0x10,0x00}, 400, 1 },
+    { {0x68,0x03,0x00}, 400, 2 },
+    { {0x00,0x00,0x00}, 900, 1 },
+    { {0xe0,0x12,0x00}, 0, 0 },
+    { {0x00,0x00,0x00}, 2000, 0 },
+};
+static const patternline_t lines15[] = {
+    { {0xff,0x00,0x00}, 200, 1 },
+    { {0xff,0x00,0x00}, 200, 2 },
+    { {0xbd,0x00,0x00}, 100, 1 },
+    { {0xbd,0x00,0x00}, 100, 2 },
+    { {0x69,0x00,0x00}, 100, 1 },
+    { {0x69,0x00,0x00}, 100, 2 },
+    { {0x3f,0x00,0x00}, 200, 1 },
+    { {0x3f,0x00,0x00}, 200, 2 },
+};
+static const patternline_t lines16[] = {
+    { {0x6f,0x75,0x6f}, 0, 1 },
+    { {0xff,0xff,0xff}, 0, 2 },
+    { {0xff,0xff,0xff}, 400, 1 },
+    { {0x68,0x68,0x68}, 400, 2 },
+    { {0x00,0x00,0x00}, 900, 1 },
+    { {0xe0,0xe0,0xe0}, 0, 0 },
+    { {0x00,0x00,0x00}, 2000, 0 },
+};
+static const patternline_t lines17[] = {
+    { {0x0a,0x01,0xff}, 100, 1 },
+    { {0x04,0x00,0x4f}, 0, 1 },
+    { {0x17,0x01,0xff}, 400, 2 },
+    { {0x04,0x00,0x4f}, 0, 2 },
+    { {0x00,0x19,0xff}, 300, 1 },
+    { {0x04,0x00,0x4f}, 300, 1 },
+    { {0x1b,0x01,0xff}, 300, 2 },
+    { {0x04,0x00,0x4f}, 0, 2 },
+};
+static const patternline_t lines18[] = {
+    { {0x00,0x19,0x80}, 1000, 0 },
+    { {0x00,0x00,0x00}, 10000, 0 },
+};
+static const patternline_t lines19[] = {
+    { {0x00,0x00,0x00}, 1000, 0 },
+    { {0xff,0x68,0x00}, 15000, 0 },
+};
+static const patternline_t lines20[] = {
+    { {0xff,0x00,0x04}, 100, 1 },
+    { {0xff,0x00,0x04}, 100, 2 },
+    { {0xf2,0xff,0x00}, 100, 1 },
+    { {0xf2,0xff,0x00}, 100, 2 },
+    { {0x00,0xff,0x37}, 100, 1 },
+    { {0x00,0xff,0x2a}, 100, 2 },
+    { {0xff,0x00,0xaa}, 100, 1 },
+    { {0xff,0x00,0xb6}, 100, 2 },
+};
+static const patternline_t lines21[] = {
+    { {0x8b,0x88,0x00}, 0, 0 },
+    { {0x01,0x0b,0x9e}, 100, 0 },
+    { {0x00,0x9b,0x00}, 100, 0 },
+    { {0xa5,0x00,0x8c}, 100, 0 },
+    { {0x01,0x99,0x8e}, 100, 0 },
+    { {0x9b,0x00,0x07}, 100, 0 },
+    { {0x01,0x14,0xa5}, 100, 0 },
+    { {0x8c,0x8d,0x85}, 100, 0 },
+};
+static const patternline_t lines22[] = {
+    { {0xe7,0x00,0x9a}, 400, 1 },
+    { {0xff,0x00,0x7b}, 0, 2 },
+    { {0xff,0x00,0xdc}, 400, 1 },
+    { {0x68,0x00,0x29}, 400, 2 },
+    { {0x00,0x00,0x00}, 900, 1 },
+    { {0xe0,0x00,0x6c}, 0, 0 },
+    { {0x53,0x00,0x4d}, 2000, 0 },
+};
+static const patternline_t lines23[] = {
+    { {0x00,0xff,0x33}, 2000, 1 },
+    { {0xff,0x00,0xe9}, 2000, 2 },
+    { {0xff,0x00,0x04}, 2000, 1 },
+    { {0x00,0x3f,0xff}, 2000, 2 },
+    { {0xfa,0xff,0x00}, 2000, 1 },
+    { {0xff,0xff,0xff}, 2000, 1 },
+};
+static const patternline_t lines24[] = {
+    { {0xff,0x7c,0x01}, 0, 2 },
+    { {0x73,0x2f,0x00}, 100, 0 },
+    { {0xff,0x7e,0x00}, 0, 1 },
+    { {0x60,0x27,0x00}, 300, 1 },
+};
+static const patternline_t lines25[] = {
+    { {0x7a,0x00,0x00}, 100, 0 },
+    { {0x00,0x00,0x00}, 0, 0 },
+    { {0x7e,0x00,0x00}, 100, 0 },
+    { {0x00,0x00,0x00}, 100, 0 },
+    { {0x00,0x00,0x00}, 3000, 0 },
+};
+static const patternline_t lines26[] = {
+    { {0x0c,0x4f,0x00}, 0, 0 },
+    { {0x29,0xff,0x00}, 0, 0 },
+    { {0x0c,0x4f,0x00}, 100, 0 },
+    { {0x29,0xff,0x00}, 100, 0 },
+    { {0x0c,0x4f,0x00}, 2100, 0 },
+};
+static const patternline_t lines27[] = {
+    { {0xff,0x4c,0xff}, 700, 0 },
+    { {0x63,0x00,0x00}, 200, 0 },
+    { {0x00,0xff,0x00}, 100, 0 },
+};
+static const patternline_t lines28[] = {
+    { {0xff,0x4c,0xff}, 700, 0 },
+    { {0x63,0x00,0x00}, 200, 0 },
+    { {0x00,0x00,0xff}, 100, 0 },
+};
+
+static const blink1_pattern_info patterns[29] = {
+    { "red flash", "9,#ff0000,0.5,0,#000000,0.5,0", 9, 2, lines0 },
+    { "green flash", "9,#00ff00,0.5,0,#000000,0.5,0", 9, 2, lines1 },
+    { "blue flash", "9,#0000ff,0.5,0,#000000,0.5,0", 9, 2, lines2 },
+    { "white flash", "9,#ffffff,0.5,0,#000000,0.5,0", 9, 2, lines3 },
+    { "yellow flash", "9,#ffff00,0.5,0,#000000,0.5,0", 9, 2, lines4 },
+    { "purple flash", "9,#ff00ff,0.5,0,#000000,0.5,0", 9, 2, lines5 },
+    { "groovy", "3,#ff4cff,1.0,0,#630000,0.2,0,#0000ff,0.1,0", 3, 3, lines6 },
+    { "off", "1,#000000,0.1,0", 1, 1, lines7 },
+    { "policecar", "6,#ff0000,0.3,1,#0000ff,0.3,2,#000000,0.1,0,#ff0000,0.3,2,#0000ff,0.3,1,#000000,0.1,0", 6, 6, lines8 },
+    { "fireengine", "6,#ff0000,0.3,1,#ff0000,0.3,2,#000000,0.1,0,#ff0000,0.3,2,#ff0000,0.3,1,#000000,0.1,0", 6, 6, lines9 },
+    { "palette colors", "3,#e7009a,1,0,#3d00e7,1,0,#00b8e7,1,0,#00e71e,1,0,#d7e700,1,0,#e70000,1,0,#e7e7e7,1,0", 3, 7, lines10 },
+    { "CMYK", "3,#00fff2,0.8,0,#000000,0.3,0,#65003c,0.8,0,#000000,0.3,0,#ffd905,0.8,0,#000000,0.1,0,#000000,0.7,0", 3, 7, lines11 },
+    { "RGB", "3,#ff0000,0.8,0,#000000,0.3,0,#00ff00,0.8,0,#000000,0.3,0,#0000ff,0.8,0,#000000,0.3,0", 3, 6, lines12 },
+    { "undervolt", "1,#821500,1,0,#634100,1,0,#554f00,1,0,#395800,1,0,#00580b,1,0,#005025,1,0,#005844,1,0,#00465a,1,0", 1, 8, lines13 },
+    { "fire shrine", "3,#751100,0,1,#ff1d00,0,2,#ff1000,0.4,1,#680300,0.4,2,#000000,0.9,1,#e01200,0,0,#000000,2,0", 3, 7, lines14 },
+    { "molten lava", "3,#ff0000,0.2,1,#ff0000,0.2,2,#bd0000,0.1,1,#bd0000,0.1,2,#690000,0.1,1,#690000,0.1,2,#3f0000,0.2,1,#3f0000,0.2,2", 3, 8, lines15 },
+    { "lighting storm", "3,#6f756f,0,1,#ffffff,0,2,#ffffff,0.4,1,#686868,0.4,2,#000000,0.9,1,#e0e0e0,0,0,#000000,2,0", 3, 7, lines16 },
+    { "rain", "1,#0a01ff,0.1,1,#04004f,0,1,#1701ff,0.4,2,#04004f,0,2,#0019ff,0.3,1,#04004f,0.3,1,#1b01ff,0.3,2,#04004f,0,2", 1, 8, lines17 },
+    { "nightfall", "1,#001980,1,0,#000000,10,0", 1, 2, lines18 },
+    { "dawn", "1,#000000,1,0,#ff6800,15,0", 1, 2, lines19 },
+    { "dancefloor", "6,#ff0004,0.1,1,#ff0004,0.1,2,#f2ff00,0.1,1,#f2ff00,0.1,2,#00ff37,0.1,1,#00ff2a,0.1,2,#ff00aa,0.1,1,#ff00b6,0.1,2", 6, 8, lines20 },
+    { "rave", "6,#8b8800,0,0,#010b9e,0.1,0,#009b00,0.1,0,#a5008c,0.1,0,#01998e,0.1,0,#9b0007,0.1,0,#0114a5,0.1,0,#8c8d85,0.1,0", 6, 8, lines21 },
+    { "sexy", "3,#e7009a,0.4,1,#ff007b,0,2,#ff00dc,0.4,1,#680029,0.4,2,#000000,0.9,1,#e0006c,0,0,#53004d,2,0", 3, 7, lines22 },
+    { "calmdown", "3,#00ff33,2,1,#ff00e9,2,2,#ff0004,2,1,#003fff,2,2,#faff00,2,1,#ffffff,2,1", 3, 6, lines23 },
+    { "emergency", "3,#ff7c01,0,2,#732f00,0.1,0,#ff7e00,0,1,#602700,0.3,1", 3, 4, lines24 },
+    { "lowbattery", "3,#7a0000,0.1,0,#000000,0,0,#7e0000,0.1,0,#000000,0.1,0,#000000,3,0", 3, 5, lines25 },
+    { "EKG", "5,#0c4f00,0,0,#29ff00,0,0,#0c4f00,0.1,0,#29ff00,0.1,0,#0c4f00,2.1,0", 5, 5, lines26 },
+    { "patternA", "3,#ff4cff,0.7,0,#630000,0.2,0,#00ff00,0.1,0", 3, 3, lines27 },
+    { "patternB", "3,#ff4cff,0.7,0,#630000,0.2,0,#0000ff,0.1,0", 3, 3, lines28 },
+};
+
+static const int16_t slots[29] = {
+    16, 9, 27, 14, 12, 23, 5, 24, 21, 8, 6, 25, 15, 3, 22, 19,
+    1, 17, 11, 26, 13, 0, 20, 28, 7, 2, 18, 4, 10
+};
+
+static const uint16_t disp[15] = {
+    0, 24, 7, 18, 6, 3, 2, 1, 0, 4, 4, 8, 20, 9, 84
+};
+
+const blink1_pattern_table blink1_builtin_patterns = {
+    patterns, 29, slots, disp, 15
+};
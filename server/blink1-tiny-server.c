@@ -17,6 +17,12 @@
  *  localhost:8934/blink1/patterns
  *  localhost:8934/blink1/pattern/add?pname=todtest&pattern=3,%23FF00FF,0.5,0,%23000000,0.5,0
  *  localhost:8934/blink1/pattern/del?pname=todtest
+ *  localhost:8934/blink1/blinkserver?rgb=%23ff0000&millis=400&count=50
+ *  localhost:8934/blink1/effects
+ *  localhost:8934/blink1/effects/cancel?effect_id=1
+ *  ws://localhost:8934/blink1/ws
+ *  localhost:8934/blink1/events?id=0
+ *  POST localhost:8934/blink1/batch  [{"op":"fade","id":0,"rgb":"#ff0000"}, ...]
  *
  */
 
@@ -27,6 +33,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>   // for strcasecmp()
 #include <time.h>
 #include <unistd.h>
 
@@ -35,6 +42,7 @@
 
 #include "blink1-lib.h"
 #include "blink1-lib-patterns.h"
+#include "blink1-lib-thread.h"
 
 // normally this is obtained from git tags and filled out by the Makefile
 #ifndef BLINK1_VERSION
@@ -51,20 +59,53 @@ static char http_listen_host[120] = "localhost";  // or 0.0.0.0 for any
 static int http_listen_port = 8934;               // was 8000
 static char http_listen_url[100];                 // will be "http://localhost:8934"
 
-typedef struct cache_info_ {
-    blink1_device* dev;  // device, if opened, NULL otherwise
-    int64_t atime;  // time last used
-} cache_info;
-
-static int64_t idle_atime = 1000  /* milliseconds */;
-static cache_info cache_infos[cache_max];
+static uint32_t idle_atime = 1000  /* milliseconds */;
+static bool hotplug = false;  // device list kept current by blink1_hotplugPoll()
 
 static rgb_t last_rgb = {0,0,0};
 
 static char patterns_json_fname[120]; // file of color patterns, like "patterns-example.json"
 
-JSON_Value* json_patterns_obj_val;
-JSON_Object* json_patterns_obj;
+// color patterns by name, in the order added.  Kept compiled, so
+// playing one is just sending its reports.
+typedef struct {
+    char* name;
+    char* str;            // as given, for /blink1/patterns and the patterns file
+    char* verify;         // str as read back from the compiled form
+    int ok;               // str parsed
+    blink1_parse_error err;  // why it didn't
+    blink1_cpattern cp;   // compiled without brightness
+} server_pattern;
+
+static server_pattern* patterns;
+static int patterns_count;
+static int patterns_cap;
+static blink1_pattern_index patterns_ix;  // name -> index into patterns
+
+// effects the server plays itself, like /blink1/blinkserver.  Each is a
+// run of steps on absolute deadlines, advanced from the main loop between
+// mg_mgr_poll()s, so a long one doesn't hold up other requests.
+typedef enum { EFFECT_BLINK, EFFECT_RANDOM } effect_kind;
+
+typedef struct {
+    int id;               // for /blink1/effects/cancel
+    effect_kind kind;
+    uint32_t devid;       // which blink1, as given by the 'id' arg
+    rgb_t rgb;
+    uint16_t period;      // millis per step, also the fade time
+    uint8_t ledn;
+    uint8_t bright;
+    int step;             // next step to run
+    int steps;
+    uint64_t start;       // mg_millis() of step 0
+} server_effect;
+
+static const char* effect_names[] = { "blinkserver", "random" };
+
+static server_effect* effects;
+static int effects_count;
+static int effects_cap;
+static int effects_last_id;
 
 typedef struct _url_info {
     char url[100];  char desc[100];
@@ -91,586 +132,2452 @@ static const url_info supported_urls[]
     {"/blink1/pattern/add",   "Add a color pattern to the server in-memory list"},
     {"/blink1/pattern/del",   "Delete a color pattern from the server in-memory list"},
     {"/blink1/random",        "turn the blink(1) a random color"},
+    {"/blink1/blinkserver",   "Blink like /blink1/blink, but played by the server"},
+    {"/blink1/effects",       "List effects the server is playing"},
+    {"/blink1/effects/cancel","Stop effect 'effect_id', or all effects"},
     {"/blink1/servertickle/on","Enable servertickle, uses 'millis' or 'time' arg"},
-    {"/blink1/servertickle/off","Disable servertickle"}
+    {"/blink1/servertickle/off","Disable servertickle"},
+    {"/blink1/ws",            "WebSocket, stream fades as JSON or binary messages"},
+    {"/blink1/events",        "Server-Sent Events of color, pattern, servertickle and hotplug changes"},
+    {"/blink1/batch",         "POST a JSON array of fade, blink, play and stop operations"}
+};
+
+void usage()
+{
+    fprintf(stderr,
+"Usage: \n"
+"  %s [options]\n"
+"where [options] can be:\n"
+"  --port port, -p port       port to listen on (default %d)\n"
+"  --host host, -H host       host to listen on ('127.0.0.1' or '0.0.0.0')\n"
+"  --no-html                  do not serve static HTML help\n"
+"  --logging, -l              log accesses to stdout\n"
+"  --patternsjson <fn>, -j <fn>  filepath to JSON color pattern list, see patterns-example.json\n"
+"  --quiet, -q                quiet non-logging messages (useful with --logging)\n"            
+"  --version                  version of this program\n"
+"  --help, -h                 this help page\n"
+"\n",
+        blink1_server_name, http_listen_port);
+
+    fprintf(stderr,
+"Supported URIs:\n");
+    for( size_t i=0; i< sizeof(supported_urls)/sizeof(url_info); i++ ) {
+        fprintf(stderr,"  %s -- %s\n", supported_urls[i].url, supported_urls[i].desc);
+    }
+    fprintf(stderr,"\n");
+    fprintf(stderr,
+"Supported query arguments: (not all urls support all args)\n"
+"  'rgb'    -- hex RGB color code. e.g. 'rgb=FF9900' or 'rgb=%%23FF9900\n"
+"  'time'   -- time in seconds to fade or blink, e.g. 'time=0.5' \n"
+"  'millis' -- milliseconds to fade or blink, e.g. 'millis=500'\n"
+"  'bright' -- brightness, 1-255, 0=full e.g. half-bright 'bright=127'\n"
+"  'ledn'   -- which LED to set. 0=all/1=top/2=bot, e.g. 'ledn=0'\n"
+"  'id' or 'blink1_id' -- which blink(1) to set, can be index or blink1 serialnum\n"
+"  'count'  -- number of times to blink or repeat, for /blink1/blink, e.g. 'count=3'\n"
+"  'pattern'-- color pattern string (e.g. '3,00ffff,0.2,0,000000,0.2,0')\n"
+"  'pname'  -- color pattern name from pattern list (e.g. 'red flash') \n"
+"  'effect_id' -- effect to cancel, as returned by /blink1/blinkserver or /blink1/random\n"
+"\n"
+"Examples: \n"
+"  /blink1/blue?bright=127 -- set blink1 blue, at half-intensity \n"
+"  /blink1/fadeToRGB?rgb=FF00FF&millis=500 -- fade to purple over 500ms\n"
+"  /blink1/pattern/play?pattern=3,00ffff,0.2,0,000000,0.2,0 -- blink cyan 3 times\n"
+"  /blink1/servertickle?on=1&millis=5000 -- turn servertickle on with 5 sec timer\n"
+"  /blink1/green?id=1 -- turn 2nd blink(1) green\n"
+"\n"
+        );
+}
+
+static void devices_sync(void);
+
+// device handles come from blink1-lib's handle pool.
+// with hotplug the device list is always current, so a missing device is
+// just missing; otherwise re-enumerate once if the device isn't found
+blink1_device* cache_getDeviceById(uint32_t id)
+{
+    if( hotplug ) {
+        blink1_hotplugPoll();
+        return blink1_acquireById(id);
+    }
+    blink1_device* dev = blink1_acquireById(id);
+    if( !dev ) {
+        blink1_poolFlush(0);
+        blink1_enumerate();
+        devices_sync();
+        dev = blink1_acquireById(id);
+    }
+    return dev;
+}
+
+static void device_plugged(int event, const char* serial);
+
+// log devices coming and going, and tell /blink1/events
+static void hotplug_handler(int event, const char* serial, const char* path, void* userdata)
+{
+    (void)userdata;
+    if( enable_logging ) {
+        printf("blink(1) %s: %s %s\n",
+               (event == BLINK1_HOTPLUG_ADDED) ? "added" : "removed", serial, path);
+    }
+    device_plugged(event, serial);
+}
+
+#define cache_return(dev) { blink1_release(dev); dev=NULL; }
+
+//
+static server_pattern* pattern_find(const char* name)
+{
+    int i = blink1_patternIndexGet(&patterns_ix, name);
+    return (i < 0) ? NULL : &patterns[i];
+}
+
+// sp->str and sp->verify, once sp->cp and sp->ok are set
+static void pattern_strings(server_pattern* sp, const char* str)
+{
+    char verify[1000];   // hack
+    free(sp->str);
+    free(sp->verify);
+    sp->str = strdup(str);
+    verify[0] = 0;
+    if( sp->ok ) toPatternString(sp->cp.lines, sp->cp.len, sp->cp.repeats, verify);
+    sp->verify = strdup(verify);
+}
+
+// compile a pattern string into sp, which may already hold one
+static void pattern_compile(server_pattern* sp, const char* str)
+{
+    sp->ok = (blink1_cpatternParse(&sp->cp, str, 0, blink1_degammaEnabled(), &sp->err) == 0);
+    pattern_strings(sp, str);
+}
+
+// the pattern called name, added empty if there isn't one
+static server_pattern* pattern_slot(const char* name)
+{
+    server_pattern* sp = pattern_find(name);
+    if( sp == NULL ) {
+        if( patterns_count == patterns_cap ) {
+            int cap = (patterns_cap) ? 2*patterns_cap : 32;
+            server_pattern* ps = realloc(patterns, cap * sizeof(server_pattern));
+            if( ps == NULL ) return NULL;
+            patterns = ps;
+            patterns_cap = cap;
+        }
+        sp = &patterns[patterns_count];
+        memset(sp, 0, sizeof(server_pattern));
+        sp->name = strdup(name);
+        if( blink1_patternIndexPut(&patterns_ix, sp->name, patterns_count) != 0 ) {
+            free(sp->name);
+            return NULL;
+        }
+        patterns_count++;
+    }
+    return sp;
+}
+
+// add a pattern, or replace the one with the same name
+static void pattern_set(const char* name, const char* str)
+{
+    server_pattern* sp = pattern_slot(name);
+    if( sp ) pattern_compile(sp, str);
+}
+
+// add a built-in pattern, already parsed when the server was built
+static void pattern_set_builtin(const blink1_pattern_info* info)
+{
+    server_pattern* sp = pattern_slot(info->name);
+    if( sp == NULL ) return;
+    sp->ok = (blink1_cpatternCompile(&sp->cp, info->lines, info->len, info->repeats,
+                                     0, blink1_degammaEnabled()) == 0);
+    pattern_strings(sp, info->str);
+}
+
+//
+static void pattern_del(const char* name)
+{
+    server_pattern* sp = pattern_find(name);
+    if( sp == NULL ) return;
+    int i = sp - patterns;
+    blink1_patternIndexDel(&patterns_ix, name);  // name may be sp->name
+    free(sp->name); free(sp->str); free(sp->verify);
+    memmove(&patterns[i], &patterns[i+1], (patterns_count-i-1) * sizeof(server_pattern));
+    patterns_count--;
+    for( int j=i; j<patterns_count; j++ ) {   // keep the order they were added in
+        blink1_patternIndexPut(&patterns_ix, patterns[j].name, j);
+    }
+}
+
+// the patterns as a JSON dict of name:string, like the patterns file
+static JSON_Value* patterns_to_json(void)
+{
+    JSON_Value* val = json_value_init_object();
+    JSON_Object* obj = json_object(val);
+    for( int i=0; i<patterns_count; i++ ) {
+        json_object_set_string(obj, patterns[i].name, patterns[i].str);
+    }
+    return val;
+}
+
+//
+static void patterns_free(void)
+{
+    while( patterns_count > 0 ) pattern_del(patterns[0].name);
+    free(patterns);
+    patterns = NULL;
+    patterns_cap = 0;
+    blink1_patternIndexFree(&patterns_ix);
+}
+
+// Log HTTP requests in Common Log Format, enabled with "--logging"
+static void log_access(struct mg_connection *c, char* uri_str, int resp_code) {
+    //CLF format: 127.0.0.1 - frank [10/Oct/2000:13:55:36 -0700] "GET /apache_pb.gif HTTP/1.0" 200 2326
+    time_t rawtime;
+    time( &rawtime );
+    char date_str[100];
+    strftime(date_str, sizeof(date_str), "%d/%b/%Y:%H:%M:%S %z", localtime(&rawtime));
+    char ip_str[20];
+    mg_snprintf(ip_str, 20, "%d.%d.%d.%d", c->rem.ip[0],c->rem.ip[1],c->rem.ip[2],c->rem.ip[3] );
+    printf("%s - [%s] \"%s %s HTTP/1.1\" %d %d\n", ip_str, date_str, "GET", uri_str, resp_code, 0 ); // can't get response length I guess
+}
+
+
+// ----------------------------------------------------------------------
+// replies
+//
+// A reply is the list of top-level fields a request sets, with any
+// strings copied into the request's arena.  When it's sent it is written
+// as JSON straight into the connection's send buffer, compact and with a
+// Content-Length, or indented if the request has 'pretty=1'.  Replies
+// are pooled, so once the server is warm a request mallocs nothing itself.
+//
+
+#define ARENA_FIRST  2048   // inline in each reply, enough for most requests
+#define ARENA_BLOCK  4096   // smallest block malloc()d when that runs out
+
+typedef struct arena_block_ {
+    struct arena_block_* next;
+    char data[];
+} arena_block;
+
+// bump allocator, everything in it is freed at once
+typedef struct {
+    char* ptr;              // block being allocated from
+    size_t used;
+    size_t size;
+    arena_block* blocks;    // malloc()d ones, freed by arena_reset()
+    char first[ARENA_FIRST];
+} server_arena;
+
+//
+static void arena_init(server_arena* a)
+{
+    a->ptr = a->first;
+    a->used = 0;
+    a->size = sizeof(a->first);
+    a->blocks = NULL;
+}
+
+// free everything allocated from a
+static void arena_reset(server_arena* a)
+{
+    while( a->blocks ) {
+        arena_block* b = a->blocks;
+        a->blocks = b->next;
+        free(b);
+    }
+    arena_init(a);
+}
+
+// n bytes, 8-byte aligned, NULL if out of memory
+static void* arena_alloc(server_arena* a, size_t n)
+{
+    n = (n + 7) & ~(size_t)7;
+    if( a->used + n > a->size ) {
+        size_t size = (n > ARENA_BLOCK) ? n : ARENA_BLOCK;
+        arena_block* b = malloc(sizeof(arena_block) + size);
+        if( b == NULL ) return NULL;
+        b->next = a->blocks;
+        a->blocks = b;
+        a->ptr = b->data;
+        a->used = 0;
+        a->size = size;
+    }
+    void* p = a->ptr + a->used;
+    a->used += n;
+    return p;
+}
+
+//
+static char* arena_strdup(server_arena* a, const char* s)
+{
+    size_t n = strlen(s) + 1;
+    char* p = arena_alloc(a, n);
+    if( p ) memcpy(p, s, n);
+    return p;
+}
+
+#define JSON_MAX_DEPTH  8
+
+// writes JSON into a connection's send buffer as it goes
+typedef struct {
+    struct mg_connection* c;
+    int pretty;             // indent 4 spaces per level, like parson's pretty
+    int depth;
+    uint32_t arrays;        // bit per depth, set if it's an array
+    uint32_t nonempty;      // bit per depth, set once it has a member
+} json_writer;
+
+//
+static void jw_send(json_writer* w, const char* s, size_t n)
+{
+    if( n > 0 ) mg_send(w->c, s, n);
+}
+
+// comma, newline and indent before each member
+static void jw_member(json_writer* w)
+{
+    static const char indent[] = "\n                                ";
+    uint32_t bit = 1u << w->depth;
+    if( w->nonempty & bit ) jw_send(w, ",", 1);
+    w->nonempty |= bit;
+    if( w->pretty ) jw_send(w, indent, 1 + 4*w->depth);
+}
+
+// before a value: in an array it's a member, in an object jw_key() did that
+static void jw_value(json_writer* w)
+{
+    if( w->arrays & (1u << w->depth) ) jw_member(w);
+}
+
+//
+static void jw_open(json_writer* w, int array)
+{
+    jw_value(w);
+    jw_send(w, (array) ? "[" : "{", 1);
+    if( w->depth + 1 >= JSON_MAX_DEPTH ) return;  // doesn't happen, keeps the bits in range
+    uint32_t bit = 1u << ++w->depth;
+    w->nonempty &= ~bit;
+    if( array ) w->arrays |= bit;
+    else        w->arrays &= ~bit;
+}
+
+static void jw_object(json_writer* w) { jw_open(w, 0); }
+static void jw_array(json_writer* w)  { jw_open(w, 1); }
+
+// close the innermost object or array
+static void jw_end(json_writer* w)
+{
+    static const char indent[] = "\n                                ";
+    uint32_t bit = 1u << w->depth;
+    w->depth--;
+    if( w->pretty && (w->nonempty & bit) ) jw_send(w, indent, 1 + 4*w->depth);
+    jw_send(w, (w->arrays & bit) ? "]" : "}", 1);
+}
+
+// s in quotes, escaped
+static void jw_quote(json_writer* w, const char* s)
+{
+    jw_send(w, "\"", 1);
+    const char* run = s;   // not yet sent, needs no escaping
+    for( ; *s; s++ ) {
+        unsigned char ch = *s;
+        if( ch >= 0x20 && ch != '"' && ch != '\\' ) continue;
+        jw_send(w, run, s - run);
+        char esc[8];
+        switch( ch ) {
+        case '"':  strcpy(esc, "\\\""); break;
+        case '\\': strcpy(esc, "\\\\"); break;
+        case '\n': strcpy(esc, "\\n");  break;
+        case '\r': strcpy(esc, "\\r");  break;
+        case '\t': strcpy(esc, "\\t");  break;
+        default:   snprintf(esc, sizeof(esc), "\\u%04x", ch); break;
+        }
+        jw_send(w, esc, strlen(esc));
+        run = s + 1;
+    }
+    jw_send(w, run, s - run);
+    jw_send(w, "\"", 1);
+}
+
+//
+static void jw_string(json_writer* w, const char* s)
+{
+    jw_value(w);
+    jw_quote(w, s);
+}
+
+//
+static void jw_number(json_writer* w, long n)
+{
+    char buf[24];
+    jw_value(w);
+    jw_send(w, buf, snprintf(buf, sizeof(buf), "%ld", n));
+}
+
+//
+static void jw_bool(json_writer* w, int b)
+{
+    jw_value(w);
+    jw_send(w, (b) ? "true" : "false", (b) ? 4 : 5);
+}
+
+//
+static void jw_null(json_writer* w)
+{
+    jw_value(w);
+    jw_send(w, "null", 4);
+}
+
+// key of the next member of an object, its value comes next
+static void jw_key(json_writer* w, const char* key)
+{
+    jw_member(w);
+    jw_quote(w, key);
+    jw_send(w, (w->pretty) ? ": " : ":", (w->pretty) ? 2 : 1);
+}
+
+typedef enum { FIELD_NUMBER, FIELD_STRING, FIELD_WRITER } field_kind;
+
+typedef struct reply_field_ reply_field;
+struct reply_field_ {
+    const char* key;        // not copied, a literal
+    field_kind kind;
+    long num;
+    const char* str;        // in the reply's arena
+    void (*write)(json_writer* w, const void* arg);  // writes the value when the reply is sent
+    const void* arg;
+    reply_field* next;
+};
+
+typedef struct server_reply_ server_reply;
+struct server_reply_ {
+    reply_field* fields;    // in the order first set
+    reply_field** tail;
+    int pretty;
+    server_reply* next;     // in reply_pool
+    server_arena arena;     // the fields, their strings, the request's query
+};
+
+static server_reply* reply_pool;  // free replies
+
+// an empty reply, NULL if out of memory
+static server_reply* reply_new(void)
+{
+    server_reply* reply = reply_pool;
+    if( reply ) reply_pool = reply->next;
+    else if( (reply = malloc(sizeof(server_reply))) == NULL ) return NULL;
+    arena_init(&reply->arena);
+    reply->fields = NULL;
+    reply->tail = &reply->fields;
+    reply->pretty = 0;
+    return reply;
+}
+
+// back to the pool, with everything in its arena
+static void reply_free(server_reply* reply)
+{
+    arena_reset(&reply->arena);
+    reply->next = reply_pool;
+    reply_pool = reply;
+}
+
+//
+static void reply_pool_free(void)
+{
+    while( reply_pool ) {
+        server_reply* reply = reply_pool;
+        reply_pool = reply->next;
+        free(reply);
+    }
+}
+
+// the field called key, added if it's new.  Setting a key again changes
+// its value but not its place, like json_object_set_*()
+static reply_field* reply_field_set(server_reply* reply, const char* key, field_kind kind)
+{
+    reply_field* f;
+    for( f = reply->fields; f; f = f->next ) {
+        if( strcmp(f->key, key) == 0 ) break;
+    }
+    if( f == NULL ) {
+        if( (f = arena_alloc(&reply->arena, sizeof(reply_field))) == NULL ) return NULL;
+        f->key = key;
+        f->next = NULL;
+        *reply->tail = f;
+        reply->tail = &f->next;
+    }
+    f->kind = kind;
+    return f;
+}
+
+//
+static void reply_set_number(server_reply* reply, const char* key, long num)
+{
+    reply_field* f = reply_field_set(reply, key, FIELD_NUMBER);
+    if( f ) f->num = num;
+}
+
+//
+static void reply_set_string(server_reply* reply, const char* key, const char* str)
+{
+    char* s = arena_strdup(&reply->arena, str);
+    reply_field* f = (s) ? reply_field_set(reply, key, FIELD_STRING) : NULL;
+    if( f ) f->str = s;
+}
+
+// a field whose value write() writes when the reply is sent, for arrays
+// and objects, so they're never built up in memory
+static void reply_set_writer(server_reply* reply, const char* key,
+                             void (*write)(json_writer* w, const void* arg), const void* arg)
+{
+    reply_field* f = reply_field_set(reply, key, FIELD_WRITER);
+    if( f ) { f->write = write; f->arg = arg; }
+}
+
+//
+static void reply_write(json_writer* w, const server_reply* reply)
+{
+    jw_object(w);
+    for( const reply_field* f = reply->fields; f; f = f->next ) {
+        jw_key(w, f->key);
+        switch( f->kind ) {
+        case FIELD_NUMBER: jw_number(w, f->num); break;
+        case FIELD_STRING: jw_string(w, f->str); break;
+        case FIELD_WRITER: f->write(w, f->arg); break;
+        }
+    }
+    jw_end(w);
+}
+
+// reply to an HTTP request with reply, which this frees
+static void send_json(struct mg_connection* c, server_reply* reply, const char* status,
+                      rgb_t rgb, uint16_t millis)
+{
+    char tmpstr[10];
+    // set JSON values that exist for all requests
+    reply_set_string(reply, "status", status);
+    reply_set_string(reply, "version", blink1_server_version);
+    sprintf(tmpstr, "#%02x%02x%02x", rgb.r, rgb.g, rgb.b);
+    reply_set_string(reply, "rgb", tmpstr);
+    reply_set_number(reply, "millis", millis);
+
+    static const char head[] =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-type: application/json\r\n"
+        "X-Content-Type-Options: nosniff\r\n"
+        "Content-Length: ";
+    mg_send(c, head, sizeof(head)-1);
+    size_t len_at = c->send.len;   // filled in once the body's written
+    mg_send(c, "          \r\n\r\n", 14);
+    size_t body_at = c->send.len;
+
+    json_writer w = { c, reply->pretty, 0, 0, 0 };
+    reply_write(&w, reply);
+    reply_free(reply);
+
+    if( body_at == len_at + 14 ) {  // else out of memory, nothing to fill in
+        char lenstr[11];
+        snprintf(lenstr, sizeof(lenstr), "%-10lu", (unsigned long)(c->send.len - body_at));
+        memcpy(c->send.buf + len_at, lenstr, 10);
+    }
+    c->is_resp = 0;  // done, mongoose can go on to the next request
+}
+
+// blink1 I/O for one request, or one effect step.  It runs on the
+// device's blink1-lib async worker (blink1_asyncCall()), in order with the
+// device's other jobs, so the event loop never waits on USB and separate
+// blink1s work in parallel.  Workers push finished jobs on a lock-free
+// list and mg_wakeup() the event loop, which finishes the HTTP response.
+typedef struct server_job_ server_job;
+typedef struct server_batch_ server_batch;
+struct server_job_ {
+    int (*io)(server_job* job);        // on the worker, -1 on error
+    void (*finish)(server_job* job);   // on the event loop, after io, may be NULL
+    blink1_device* dev;                // acquired for the job, released after finish
+    unsigned long conn_id;             // connection waiting for the reply, 0 if none
+    server_reply* reply;               // sent after finish, NULL if finish replies itself
+    char status[1000];
+    char uri_str[1000];
+    rgb_t reply_rgb;
+    uint16_t reply_millis;
+    rgb_t rgb;                         // io's arguments
+    uint16_t millis;
+    uint8_t ledn;
+    uint8_t count;
+    uint8_t on;
+    int effect_id;
+    uint32_t devid;                    // for /blink1/ws acks
+    uint16_t seq;
+    uint8_t binary;
+    server_batch* batch;               // for /blink1/batch, the batch it's part of
+    int batch_op;
+    char pname[64];                    // pattern played, for /blink1/events
+    blink1_cpattern cp;
+    blink1_pattsync_result res;        // io's results
+    int rc;
+    server_job* next;
 };
 
-void usage()
+static struct mg_mgr* server_mgr;
+static unsigned long server_wakeup_id;  // the listener, mg_wakeup() needs a connection
+static void* jobs_done;                 // server_job list, pushed by workers, taken by the event loop
+static int jobs_pending;                // submitted and not yet finished
+static server_job* job_pool;            // free jobs, only touched by the event loop
+
+static void batch_op_done(server_job* job);
+static void state_job_done(server_job* job);
+
+// the open connection with this id, NULL if it's gone or closing
+static struct mg_connection* conn_find(unsigned long id)
+{
+    for( struct mg_connection* c = server_mgr->conns; c && id; c = c->next ) {
+        if( c->id == id ) return (c->is_closing) ? NULL : c;
+    }
+    return NULL;
+}
+
+// a job for blink1 id, NULL if there's no such blink1
+static server_job* job_new(uint32_t id)
+{
+    blink1_device* dev = cache_getDeviceById(id);
+    if( !dev ) return NULL;
+    server_job* job = job_pool;
+    if( job ) job_pool = job->next;
+    else if( (job = malloc(sizeof(server_job))) == NULL ) { cache_return(dev); return NULL; }
+    memset(job, 0, sizeof(server_job));
+    job->dev = dev;
+    return job;
+}
+
+//
+static void job_pool_free(void)
+{
+    while( job_pool ) {
+        server_job* job = job_pool;
+        job_pool = job->next;
+        free(job);
+    }
+}
+
+// send the reply, if anyone's still waiting for it, and free the job
+static void job_end(server_job* job)
+{
+    if( job->finish ) job->finish(job);
+    if( job->rc != -1 ) state_job_done(job);
+    if( job->batch ) batch_op_done(job);
+    if( job->reply ) {
+        struct mg_connection* c = conn_find(job->conn_id);
+        if( c ) {
+            send_json(c, job->reply, job->status, job->reply_rgb, job->reply_millis);
+            if( enable_logging ) log_access(c, job->uri_str, 200);
+        }
+        else {
+            reply_free(job->reply);
+        }
+    }
+    cache_return(job->dev);
+    job->next = job_pool;
+    job_pool = job;
+    jobs_pending--;
+}
+
+// on the worker
+static int job_io(blink1_device* dev, void* arg)
+{
+    (void)dev;
+    server_job* job = arg;
+    return job->io(job);
+}
+
+// on the worker: a lock-free push, then wake the event loop
+static void job_done(blink1_device* dev, int rc, void* userdata)
+{
+    (void)dev;
+    server_job* job = userdata;
+    job->rc = rc;
+    void* head = blink1_atomic_loadptr(&jobs_done);
+    for(;;) {
+        job->next = head;
+        void* prev = blink1_atomic_casptr(&jobs_done, head, job);
+        if( prev == head ) break;
+        head = prev;
+    }
+    mg_wakeup(server_mgr, server_wakeup_id, "", 0);
+}
+
+//
+static void job_submit(server_job* job)
+{
+    jobs_pending++;
+    if( blink1_asyncCall(job->dev, job_io, job, job_done, job) == -1 ) {
+        job->rc = -1;
+        job_end(job);
+    }
+}
+
+// after a reply sent from outside mg_mgr_poll(), parse any requests
+// pipelined behind it.  mongoose only does that itself when a handler it
+// called during the poll ends the reply
+static void conn_resume(struct mg_connection* c)
+{
+    if( c == NULL || c->is_resp || c->is_websocket || c->recv.len == 0 ) return;
+    long n = 0;
+    mg_call(c, MG_EV_READ, &n);
+}
+
+// finish the jobs the workers are done with, in the order they were done
+static void jobs_finish(void)
+{
+    server_job* list = blink1_atomic_xchgptr(&jobs_done, NULL);
+    server_job* fifo = NULL;
+    while( list ) {
+        server_job* next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while( fifo ) {
+        server_job* next = fifo->next;
+        unsigned long conn_id = fifo->conn_id;
+        job_end(fifo);
+        conn_resume(conn_find(conn_id));
+        fifo = next;
+    }
+}
+
+// job io functions, run on the device's worker
+static int job_fade(server_job* job)
+{
+    return blink1_fadeToRGBN(job->dev, job->millis, job->rgb.r, job->rgb.g, job->rgb.b, job->ledn);
+}
+
+static int job_read(server_job* job)
+{
+    uint16_t msecs = 0;
+    // from the state shadow, only goes to USB if it's stale
+    return blink1_shadowReadRGB(job->dev, &msecs, &job->rgb.r, &job->rgb.g, &job->rgb.b, 0);
+}
+
+// only rewrites lines the blink1 doesn't already have, then plays them
+static int job_play(server_job* job)
+{
+    blink1_cpatternWrite(job->dev, &job->cp, 1, &job->res);
+    return blink1_playloop(job->dev, 1 /*play/pause*/, 0 /*startpos*/,
+                           job->cp.len-1 /*endpos*/, job->count /*count*/);
+}
+
+static int job_stop(server_job* job)
+{
+    return blink1_playloop(job->dev, 0 /*play/pause*/, 0/*startpos*/, 0/*endpos*/, 0/*count*/);
+}
+
+static int job_servertickle(server_job* job)
+{
+    uint8_t start_pos = 0;
+    uint8_t end_pos = 0;
+    uint8_t st_off_state = 0;
+    return blink1_serverdown(job->dev, job->on, job->millis, st_off_state, start_pos, end_pos);
+}
+
+// when effect e's step runs, or when it ends if step == steps
+static uint64_t effect_deadline(const server_effect* e, int step)
+{
+    return e->start + (uint64_t)step * e->period;
+}
+
+//
+static void effect_remove(int i)
+{
+    memmove(&effects[i], &effects[i+1], (effects_count-i-1) * sizeof(server_effect));
+    effects_count--;
+}
+
+// stop the effect with this id, or all of them if id is 0
+// @return number of effects stopped
+static int effects_cancel(int id)
+{
+    int n = 0;
+    for( int i=effects_count-1; i>=0; i-- ) {
+        if( id == 0 || effects[i].id == id ) { effect_remove(i); n++; }
+    }
+    return n;
+}
+
+// stop anything playing on blink1 devid, before something else sets its color
+static void effects_cancel_dev(uint32_t devid)
+{
+    for( int i=effects_count-1; i>=0; i-- ) {
+        if( effects[i].devid == devid ) effect_remove(i);
+    }
+}
+
+// a step failed, stop its effect
+static void effect_step_done(server_job* job)
+{
+    if( job->rc == -1 ) effects_cancel(job->effect_id);
+}
+
+// queue e's next step
+// @return -1 if its blink1 is gone
+static int effect_step(server_effect* e)
+{
+    server_job* job = job_new(e->devid);
+    if( !job ) return -1;
+    rgb_t c = e->rgb;
+    if( e->kind == EFFECT_RANDOM ) {
+        c.r = rand() % 255;
+        c.g = rand() % 255;
+        c.b = rand() % 255;
+    }
+    else if( e->step & 1 ) {  // blink: on, off, on, off...
+        c.r = 0; c.g = 0; c.b = 0;
+    }
+    blink1_adjustBrightness( e->bright, &c.r, &c.g, &c.b);
+    job->io = job_fade;
+    job->finish = effect_step_done;
+    job->rgb = c;
+    job->millis = e->period;
+    job->ledn = e->ledn;
+    job->effect_id = e->id;
+    e->step++;
+    job_submit(job);
+    return 0;
+}
+
+// start an effect, replacing any playing on the same blink1.
+// its first step runs now, so a missing blink1 is reported right away
+// @return the effect's id, -1 if no blink1 or its first step couldn't be queued
+static int effect_start(effect_kind kind, uint32_t devid, rgb_t rgb, uint16_t period,
+                        uint8_t ledn, uint8_t bright, int steps)
+{
+    effects_cancel_dev(devid);
+    if( effects_count == effects_cap ) {
+        int cap = (effects_cap) ? 2*effects_cap : 8;
+        server_effect* es = realloc(effects, cap * sizeof(server_effect));
+        if( es == NULL ) return -1;
+        effects = es;
+        effects_cap = cap;
+    }
+    server_effect* e = &effects[effects_count];
+    memset(e, 0, sizeof(server_effect));
+    e->id = ++effects_last_id;
+    e->kind = kind;
+    e->devid = devid;
+    e->rgb = rgb;
+    e->period = period;
+    e->ledn = ledn;
+    e->bright = bright;
+    e->steps = steps;
+    e->start = mg_millis();
+    int id = e->id;
+    effects_count++;  // before the step, so a step that fails right away can cancel it
+    if( effect_step(e) == -1 ) {
+        effects_cancel(id);
+        return -1;
+    }
+    for( int i=0; i<effects_count; i++ ) {
+        if( effects[i].id == id ) return id;
+    }
+    return -1;  // cancelled by its first step
+}
+
+// run the steps that are due, and retire finished effects
+static void effects_run(void)
+{
+    uint64_t now = mg_millis();
+    for( int i=effects_count-1; i>=0; i-- ) {
+        server_effect* e = &effects[i];
+        if( now < effect_deadline(e, e->step) ) continue;
+        // one step per pass; a late effect catches up without drifting
+        if( e->step == e->steps || effect_step(e) == -1 ) effect_remove(i);
+    }
+}
+
+// how long mg_mgr_poll() may wait before an effect is due, at most maxms
+static int effects_wait(int maxms)
+{
+    uint64_t now = mg_millis();
+    for( int i=0; i<effects_count; i++ ) {
+        uint64_t t = effect_deadline(&effects[i], effects[i].step);
+        int ms = (t > now) ? (int)(t - now) : 0;
+        if( ms < maxms ) maxms = ms;
+    }
+    return maxms;
+}
+
+// the effects as a JSON array, for /blink1/effects
+static void effects_write(json_writer* w, const void* arg)
+{
+    (void)arg;
+    uint64_t now = mg_millis();
+    char rgbstr[10];
+    jw_array(w);
+    for( int i=0; i<effects_count; i++ ) {
+        const server_effect* e = &effects[i];
+        uint64_t end = effect_deadline(e, e->steps);
+        jw_object(w);
+        jw_key(w, "effect_id");  jw_number(w, e->id);
+        jw_key(w, "effect");     jw_string(w, effect_names[e->kind]);
+        jw_key(w, "blink1_id");  jw_number(w, e->devid);
+        sprintf(rgbstr, "#%02x%02x%02x", e->rgb.r, e->rgb.g, e->rgb.b);
+        jw_key(w, "rgb");        jw_string(w, rgbstr);
+        jw_key(w, "millis");     jw_number(w, e->period);
+        jw_key(w, "ledn");       jw_number(w, e->ledn);
+        jw_key(w, "step");       jw_number(w, e->step);
+        jw_key(w, "steps");      jw_number(w, e->steps);
+        jw_key(w, "remaining_millis"); jw_number(w, (end > now) ? (long)(end - now) : 0);
+        jw_end(w);
+    }
+    jw_end(w);
+}
+
+//
+static void effects_free(void)
+{
+    free(effects);
+    effects = NULL;
+    effects_count = 0;
+    effects_cap = 0;
+}
+
+//
+static void finish_color(server_job* job)
+{
+    if( job->rc == -1 ) {
+        fprintf(stderr, "error, couldn't fadeToRGB on blink1\n");
+        sprintf(job->status+strlen(job->status), ": error, couldn't fadeToRGB on blink1");
+    }
+    else {
+        sprintf(job->status, "blink1 set color #%02x%02x%02x", job->rgb.r,job->rgb.g,job->rgb.b);
+    }
+}
+
+// the job that fades blink1 id to rgb, NULL if there's no blink1
+server_job* blink1_do_color(rgb_t rgb, uint32_t millis, uint32_t id,
+                            uint8_t ledn, uint8_t bright, char* status)
+{
+    last_rgb.r = rgb.r; 
+    last_rgb.g = rgb.g; 
+    last_rgb.b = rgb.b;
+
+    effects_cancel_dev(id);
+    server_job* job = job_new(id);
+    if( !job ) {
+        sprintf(status+strlen(status), ": error: no blink1 found");
+        return NULL;
+    }
+    
+    blink1_adjustBrightness( bright, &rgb.r, &rgb.g, &rgb.b);
+    if( millis==0 ) { millis = 200; }
+    job->io = job_fade;
+    job->finish = finish_color;
+    job->rgb = rgb;
+    job->millis = millis;
+    job->ledn = ledn;
+    return job;
+}
+
+//
+static void finish_read(server_job* job)
+{
+    if( job->rc==-1 ) {
+        printf("error on readRGB\n");
+    }
+    job->reply_rgb = job->rgb;
+}
+
+//
+static void finish_pattern_play(server_job* job)
+{
+    if( job->reply == NULL ) return;  // part of a batch
+    reply_set_number(job->reply, "lines_written", job->res.linesWritten);
+    reply_set_number(job->reply, "reports_avoided", job->res.reportsAvoided);
+}
+
+
+// ----------------------------------------------------------------------
+// request routing
+//
+// Each endpoint is a route_*() function, found by path in routes_ix, a
+// hash index built from routes[] at startup.  A route lists the query
+// args it takes and only those are looked up, from a query string that
+// is split and decoded once, the first time an arg is asked for.
+//
+
+// query args a route can take
+enum {
+    ARG_MILLIS    = 1 << 0,   // 'millis' or 'time'
+    ARG_RGB       = 1 << 1,
+    ARG_COUNT     = 1 << 2,
+    ARG_ID        = 1 << 3,   // 'id' or 'blink1_id'
+    ARG_LEDN      = 1 << 4,
+    ARG_BRIGHT    = 1 << 5,
+    ARG_PATTERN   = 1 << 6,
+    ARG_PNAME     = 1 << 7,
+    ARG_EFFECT_ID = 1 << 8,
+};
+#define ARGS_FADE  (ARG_MILLIS|ARG_ID|ARG_LEDN|ARG_BRIGHT)
+
+#define QUERY_MAX_VARS 16
+
+// a query string, split into name/value pairs on first use
+typedef struct {
+    struct mg_str str;      // as received
+    server_arena* arena;    // where it's split into
+    char* buf;              // decoded copy of str, holds names and values
+    int nvars;              // -1 until split
+    const char* names[QUERY_MAX_VARS];
+    char* values[QUERY_MAX_VARS];
+} server_query;
+
+// one request, as the route functions see it
+typedef struct _server_route server_route;
+typedef struct {
+    const server_route* route;
+    server_query query;
+    server_reply* reply;
+    char status[1000];
+    uint32_t id;
+    uint16_t millis;
+    rgb_t rgb;
+    uint8_t count;
+    uint8_t ledn;
+    uint8_t bright;
+    const char* pattern;    // "" if not given
+    const char* pname;      // "" if not given
+    int effect_id;
+    server_job* job;        // blink1 I/O to do before replying
+} server_request;
+
+struct _server_route {
+    const char* path;
+    void (*fn)(server_request* r);
+    unsigned args;          // ARG_* it takes
+};
+
+static blink1_pattern_index routes_ix;  // path -> index into routes
+
+// q's names and values will be in arena
+static void query_init(server_query* q, struct mg_str str, server_arena* arena)
+{
+    q->str = str;
+    q->arena = arena;
+    q->buf = NULL;
+    q->nvars = -1;
+}
+
+// split "a=1&b=2" in one pass, decoding names and values in place
+static void query_split(server_query* q)
+{
+    q->nvars = 0;
+    if( q->str.len == 0 ) return;
+    q->buf = arena_alloc(q->arena, q->str.len + 1);
+    if( q->buf == NULL ) return;
+    memcpy(q->buf, q->str.ptr, q->str.len);
+    q->buf[q->str.len] = 0;
+    char* p = q->buf;
+    while( *p && q->nvars < QUERY_MAX_VARS ) {
+        size_t n = strcspn(p, "&");
+        char* next = (p[n]) ? p + n + 1 : p + n;
+        size_t k = strcspn(p, "=");
+        if( k < n ) {
+            char* v = p + k + 1;
+            p[k] = 0;
+            // like mg_http_get_var(), a badly escaped value isn't there
+            int vlen = mg_url_decode(v, n - k - 1, v, n - k, 1);
+            if( mg_url_decode(p, k, p, k + 1, 1) >= 0 ) {
+                q->names[q->nvars] = p;
+                q->values[q->nvars] = (vlen > 0) ? v : NULL;
+                q->nvars++;
+            }
+        }
+        p = next;
+    }
+}
+
+// value of the first arg called name, NULL if it's not there or empty
+static char* query_get(server_query* q, const char* name)
+{
+    if( q->nvars < 0 ) query_split(q);
+    for( int i=0; i < q->nvars; i++ ) {
+        if( strcasecmp(q->names[i], name) == 0 ) return q->values[i];
+    }
+    return NULL;
+}
+
+// index or serial number, the first of a comma-separated list
+static void query_id(const char* v, uint32_t* id)
+{
+    v += strspn(v, " ,");
+    size_t n = strcspn(v, " ,");
+    if( n > 0 ) {
+        int base = (n==8) ? 16:0;
+        *id = strtol(v,NULL,base);
+    }
+}
+
+// fill in the args r's route takes, and echo most of them in the reply
+static void request_args(server_request* r, unsigned args)
+{
+    char* v;
+    if( args & ARG_MILLIS ) {
+        if( (v = query_get(&r->query, "millis")) ) {
+            r->millis = strtod(v,NULL);
+            reply_set_number(r->reply, "millis", r->millis);
+        }
+        if( (v = query_get(&r->query, "time")) ) {
+            r->millis = 1000 * strtof(v,NULL);
+            reply_set_number(r->reply, "millis", r->millis);
+        }
+    }
+    if( (args & ARG_RGB) && (v = query_get(&r->query, "rgb")) ) {
+        reply_set_string(r->reply, "rgb", v);
+        parsecolor( &r->rgb, v);
+    }
+    if( (args & ARG_COUNT) && (v = query_get(&r->query, "count")) ) {
+        r->count = strtod(v,NULL);
+        reply_set_number(r->reply, "count", r->count);
+    }
+    if( args & ARG_ID ) {
+        if( (v = query_get(&r->query, "id")) ) query_id(v, &r->id);
+        if( (v = query_get(&r->query, "blink1_id")) ) query_id(v, &r->id);
+    }
+    if( (args & ARG_LEDN) && (v = query_get(&r->query, "ledn")) ) {
+        r->ledn = strtod(v,NULL);
+        reply_set_number(r->reply, "ledn", r->ledn);
+    }
+    if( (args & ARG_BRIGHT) && (v = query_get(&r->query, "bright")) ) {
+        r->bright = strtod(v,NULL);
+        reply_set_number(r->reply, "bright", r->bright);
+    }
+    if( (args & ARG_PATTERN) && (v = query_get(&r->query, "pattern")) ) {
+        r->pattern = v;
+        reply_set_string(r->reply, "pattern", v);
+    }
+    if( (args & ARG_PNAME) && (v = query_get(&r->query, "pname")) ) {
+        r->pname = v;
+        reply_set_string(r->reply, "pname", v);
+    }
+    if( (args & ARG_EFFECT_ID) && (v = query_get(&r->query, "effect_id")) ) {
+        r->effect_id = strtol(v,NULL,0);
+        reply_set_number(r->reply, "effect_id", r->effect_id);
+    }
+}
+
+//
+static void route_status(server_request* r)
+{
+    sprintf(r->status, "blink1 status");
+    r->job = job_new(r->id);
+    if( r->job ) {
+        r->job->io = job_read;
+        r->job->finish = finish_read;
+    }
+}
+
+//
+static void route_lastcolor(server_request* r)
+{
+    char tmpstr[10];
+    sprintf(r->status, "blink1 lastColor");
+    r->job = job_new(r->id);
+    if( r->job ) {
+        r->job->io = job_read;
+        r->job->finish = finish_read;
+    }
+    sprintf(tmpstr, "#%02x%02x%02x", last_rgb.r, last_rgb.g, last_rgb.b);
+    reply_set_string(r->reply, "lastColor", tmpstr);
+}
+
+// the serial numbers of the blink1s found, as a JSON array
+static void serials_write(json_writer* w, const void* arg)
+{
+    (void)arg;
+    jw_array(w);
+    for( int i=0; i < blink1_getCachedCount(); i++ ) {
+        jw_string(w, blink1_getCachedSerial(i));
+    }
+    jw_end(w);
+}
+
+//
+static void route_id(server_request* r)
+{
+    char tmpstr[40];
+    sprintf(r->status, "blink1 id");
+    if( hotplug && strcmp(r->route->path, "/blink1/enumerate") != 0 ) {
+        blink1_hotplugPoll();
+    }
+    else {
+        blink1_poolFlush(0);
+        blink1_enumerate();
+        devices_sync();
+    }
+    reply_set_writer(r->reply, "blink1_serialnums", serials_write, NULL);
+
+    const char* blink1_serialnum = blink1_getCachedSerial(0);
+    if( blink1_serialnum ) {
+        snprintf(tmpstr, sizeof(tmpstr), "%s00000000", blink1_serialnum);
+        reply_set_string(r->reply, "blink1_id", tmpstr);
+    }
+}
+
+// fade to one of the named colors
+static void route_solid(server_request* r, const char* name, uint8_t red, uint8_t grn, uint8_t blu)
+{
+    sprintf(r->status, "blink1 %s", name);
+    r->rgb.r = red; r->rgb.g = grn; r->rgb.b = blu;
+    r->job = blink1_do_color(r->rgb, r->millis, r->id, r->ledn, r->bright, r->status);
+}
+
+static void route_off(server_request* r)     { route_solid(r, "off",       0,  0,  0); }
+static void route_on(server_request* r)      { route_solid(r, "on",      255,255,255); }
+static void route_red(server_request* r)     { route_solid(r, "red",     255,  0,  0); }
+static void route_green(server_request* r)   { route_solid(r, "green",     0,255,  0); }
+static void route_blue(server_request* r)    { route_solid(r, "blue",      0,  0,255); }
+static void route_cyan(server_request* r)    { route_solid(r, "cyan",      0,255,255); }
+static void route_yellow(server_request* r)  { route_solid(r, "yellow",  255,255,  0); }
+static void route_magenta(server_request* r) { route_solid(r, "magenta", 255,  0,255); }
+
+//
+static void route_fadetorgb(server_request* r)
+{
+    sprintf(r->status, "blink1 fadeToRGB");
+    r->job = blink1_do_color(r->rgb, r->millis, r->id, r->ledn, r->bright, r->status);
+}
+
+//
+static void route_blink(server_request* r)
+{
+    sprintf(r->status, "blink1 blink");
+    rgb_t rgb = r->rgb;
+    if( rgb.r==0 && rgb.g==0 && rgb.b==0 ) { rgb.r=255; rgb.g=255; rgb.b=255; }
+    if( r->count==0 ) { r->count = 3; }
+    if( r->millis==0 ) { r->millis = 300; }
+    blink1_adjustBrightness(r->bright, &rgb.r, &rgb.g, &rgb.b);
+    r->rgb = rgb;
+    patternline_t lines[2] = { { rgb, r->millis, r->ledn }, { {0,0,0}, r->millis, 0 } };
+    msg("blink #%02x%02x%02x %d times, %d ms, ledn %d\n",
+        rgb.r,rgb.g,rgb.b, r->count, r->millis, r->ledn);
+
+    effects_cancel_dev(r->id);
+    r->job = job_new(r->id);
+    if( r->job ) {
+        blink1_cpatternCompile(&r->job->cp, lines, 2, r->count, 0, blink1_degammaEnabled());
+        r->job->io = job_play;
+        r->job->count = r->count;
+    }
+    else { sprintf(r->status+strlen(r->status), ": no blink1 found"); }
+}
+
+// the pattern list as a JSON array of {name, pattern}
+static void patterns_write(json_writer* w, const void* arg)
+{
+    (void)arg;
+    jw_array(w);
+    for( int i=0; i < patterns_count; i++ ) {
+        jw_object(w);
+        jw_key(w, "name");     jw_string(w, patterns[i].name);
+        jw_key(w, "pattern");  jw_string(w, patterns[i].str);
+        jw_end(w);
+    }
+    jw_end(w);
+}
+
+// the pattern list as a JSON dict of name:string, like patterns_to_json()
+static void patterns_dump_write(json_writer* w, const void* arg)
+{
+    (void)arg;
+    jw_object(w);
+    for( int i=0; i < patterns_count; i++ ) {
+        jw_key(w, patterns[i].name);
+        jw_string(w, patterns[i].str);
+    }
+    jw_end(w);
+}
+
+//
+static void route_patterns(server_request* r)
+{
+    sprintf(r->status, "blink1 pattern list");
+    reply_set_writer(r->reply, "patterns", patterns_write, NULL);
+}
+
+//
+static void route_pattern_dump(server_request* r)
+{
+    sprintf(r->status, "blink1 patterns dump");
+    reply_set_writer(r->reply, "pattern_dump", patterns_dump_write, NULL);
+}
+
+// add a pattern to the server's in-memory pattern list
+static void route_pattern_add(server_request* r)
+{
+    sprintf(r->status, "blink1 pattern add");
+    if( r->pname[0] != 0 && r->pattern[0] != 0 ) {
+        // add entry to the global patterns list, compiled
+        pattern_set(r->pname, r->pattern);
+        // add the resulting pattern to the JSON response
+        reply_set_string(r->reply, "pattern", r->pattern);
+    }
+    else {
+        sprintf(r->status, "blink1 pattern add: error must specifiy both 'pname' and 'pattern' query args");
+    }
+}
+
+//
+static void route_pattern_del(server_request* r)
+{
+    sprintf(r->status, "blink1 pattern del");
+    if( r->pname[0] != 0 ) {
+        pattern_del(r->pname);
+    }
+    else {
+        sprintf(r->status, "blink1 pattern del: error must specifiy 'pname' query arg");
+    }
+}
+
+// play a pattern on the blink1, from blink(1)'s RAM buffer
+// note: this behavior is different than Blink1Control, where the
+// app is playing the pattern, leaving the blink(1)'s RAM pattern alone
+static void route_pattern_play(server_request* r)
+{
+    sprintf(r->status, "blink1 pattern play");
+    server_pattern* sp = NULL;
+    server_pattern inline_sp;
+    memset(&inline_sp, 0, sizeof(inline_sp));
+
+    // neither 'pname' or 'pattern' is specified
+    if( r->pname[0] == 0 && r->pattern[0] == 0 ) {
+        sprintf(r->status, "blink1 pattern play error: 'pname' or 'pattern' query args not specified");
+    }
+    // 'pname' specified, look up by name, it's already compiled
+    else if( r->pname[0] != 0 ) {
+        sp = pattern_find(r->pname);
+        // no pattern with that pname
+        if( sp == NULL ) {
+            snprintf(r->status, sizeof(r->status), "blink1 pattern play error: no pattern for pname '%s'", r->pname);
+        }
+    }
+    // 'pattern' query arg, compile it
+    else {
+        pattern_compile(&inline_sp, r->pattern);
+        sp = &inline_sp;
+    }
+
+    if( sp != NULL && !sp->ok ) {
+        snprintf(r->status, sizeof(r->status), "blink1 pattern play error: bad pattern at char %d: %s",
+                 sp->err.offset, sp->err.msg);
+    }
+    else if( sp != NULL ) {
+        const blink1_cpattern* cp = &sp->cp;
+        uint8_t count = r->count;
+        if( count==0 ) { count = cp->repeats; }
+
+        reply_set_string(r->reply, "pattern", sp->verify);
+        effects_cancel_dev(r->id);
+        r->job = job_new(r->id);
+        if( r->job ) {
+            if( r->bright ) {  // brightness is part of the compiled reports
+                blink1_cpatternCompile(&r->job->cp, cp->lines, cp->len, cp->repeats, r->bright, cp->degamma);
+            }
+            else {
+                r->job->cp = *cp;
+            }
+            r->job->io = job_play;
+            r->job->finish = finish_pattern_play;
+            r->job->count = count;
+            snprintf(r->job->pname, sizeof(r->job->pname), "%s", r->pname);
+            msg("  playing pattern '%s' %d times on blink1\n",sp->verify,count);
+        }
+    }
+    free(inline_sp.str);
+    free(inline_sp.verify);
+}
+
+// since patterns play on the blink1, just stop any pattern playing
+static void route_pattern_stop(server_request* r)
+{
+    sprintf(r->status, "blink1 pattern stop");
+    effects_cancel_dev(r->id);
+    r->job = job_new(r->id);
+    if( r->job ) {
+        r->job->io = job_stop;
+    }
+    else { sprintf(r->status+strlen(r->status), ": no blink1 found"); }
+}
+
+// like "/blink1/blink" but played by the server, as an effect.
+// returns right away with the effect's id
+static void route_blinkserver(server_request* r)
+{
+    sprintf(r->status, "blink1 blinkserver");
+    if( r->millis==0 ) { r->millis = 200; }
+    if( r->count > 0 ) {
+        int eid = effect_start(EFFECT_BLINK, r->id, r->rgb, r->millis/2, r->ledn, r->bright, 2*r->count);
+        if( eid != -1 ) { reply_set_number(r->reply, "effect_id", eid); }
+        else { sprintf(r->status+strlen(r->status), ": no blink1 found"); }
+    }
+}
+
+//
+static void route_servertickle(server_request* r, bool st_on)
+{
+    if( r->millis==0 ) { r->millis = 2000; }
+    sprintf(r->status, "blink1 servertickle %s", st_on? "on":"off");
+    r->job = job_new(r->id);
+    if( r->job ) {
+        r->job->io = job_servertickle;
+        r->job->on = st_on;
+        r->job->millis = r->millis;
+    }
+    else { sprintf(r->status+strlen(r->status), ": no blink1 found"); }
+    reply_set_string(r->reply, "on", st_on? "1":"0");
+}
+
+static void route_servertickle_on(server_request* r)  { route_servertickle(r, true); }
+static void route_servertickle_off(server_request* r) { route_servertickle(r, false); }
+
+//
+static void route_random(server_request* r)
+{
+    sprintf(r->status, "blink1 random");
+    if( r->count==0 ) { r->count = 1; }
+    if( r->millis==0 ) { r->millis = 200; }
+    int eid = effect_start(EFFECT_RANDOM, r->id, r->rgb, r->millis/2, r->ledn, r->bright, r->count);
+    if( eid != -1 ) { reply_set_number(r->reply, "effect_id", eid); }
+    else { sprintf(r->status+strlen(r->status), ": no blink1 found"); }
+}
+
+//
+static void route_effects(server_request* r)
+{
+    sprintf(r->status, "blink1 effects");
+    reply_set_writer(r->reply, "effects", effects_write, NULL);
+}
+
+//
+static void route_effects_cancel(server_request* r)
+{
+    sprintf(r->status, "blink1 effects cancel");
+    int n = effects_cancel(r->effect_id);
+    if( r->effect_id != 0 && n == 0 ) {
+        sprintf(r->status+strlen(r->status), ": error: no effect %d", r->effect_id);
+    }
+    reply_set_number(r->reply, "cancelled", n);
+}
+
+static const server_route routes[] = {
+    {"/blink1",                  route_status,           ARG_ID},
+    {"/blink1/",                 route_status,           ARG_ID},
+    {"/blink1/lastColor",        route_lastcolor,        ARG_ID},
+    {"/blink1/lastcolor",        route_lastcolor,        ARG_ID},
+    {"/blink1/id",               route_id,               0},
+    {"/blink1/id/",              route_id,               0},
+    {"/blink1/list",             route_id,               0},
+    {"/blink1/list/",            route_id,               0},
+    {"/blink1/enumerate",        route_id,               0},
+    {"/blink1/off",              route_off,              ARGS_FADE},
+    {"/blink1/on",               route_on,               ARGS_FADE},
+    {"/blink1/red",              route_red,              ARGS_FADE},
+    {"/blink1/green",            route_green,            ARGS_FADE},
+    {"/blink1/blue",             route_blue,             ARGS_FADE},
+    {"/blink1/cyan",             route_cyan,             ARGS_FADE},
+    {"/blink1/yellow",           route_yellow,           ARGS_FADE},
+    {"/blink1/magenta",          route_magenta,          ARGS_FADE},
+    {"/blink1/fadeToRGB",        route_fadetorgb,        ARGS_FADE|ARG_RGB},
+    {"/blink1/blink",            route_blink,            ARGS_FADE|ARG_RGB|ARG_COUNT},
+    {"/blink1/pattern",          route_patterns,         0},
+    {"/blink1/patterns",         route_patterns,         0},
+    {"/blink1/pattern/",         route_patterns,         0},
+    {"/blink1/patterns/",        route_patterns,         0},
+    {"/blink1/pattern/dump",     route_pattern_dump,     0},
+    {"/blink1/pattern/add",      route_pattern_add,      ARG_PNAME|ARG_PATTERN},
+    {"/blink1/pattern/del",      route_pattern_del,      ARG_PNAME},
+    {"/blink1/pattern/play",     route_pattern_play,     ARG_PNAME|ARG_PATTERN|ARG_ID|ARG_COUNT|ARG_BRIGHT},
+    {"/blink1/pattern/stop",     route_pattern_stop,     ARG_ID},
+    {"/blink1/blinkserver",      route_blinkserver,      ARGS_FADE|ARG_RGB|ARG_COUNT},
+    {"/blink1/servertickle/on",  route_servertickle_on,  ARG_MILLIS|ARG_ID},
+    {"/blink1/servertickle/off", route_servertickle_off, ARG_MILLIS|ARG_ID},
+    {"/blink1/random",           route_random,           ARGS_FADE|ARG_COUNT},
+    {"/blink1/effects",          route_effects,          0},
+    {"/blink1/effects/",         route_effects,          0},
+    {"/blink1/effects/cancel",   route_effects_cancel,   ARG_EFFECT_ID},
+};
+
+#define ROUTES_COUNT  ((int)(sizeof(routes) / sizeof(routes[0])))
+#define ROUTE_PATH_MAX  64   // longer than any route
+
+//
+static int routes_init(void)
+{
+    blink1_patternIndexInit(&routes_ix);
+    for( int i=0; i < ROUTES_COUNT; i++ ) {
+        if( blink1_patternIndexPut(&routes_ix, routes[i].path, i) != 0 ) return -1;
+    }
+    return 0;
+}
+
+//
+static void routes_free(void)
+{
+    blink1_patternIndexFree(&routes_ix);
+}
+
+// the route for uri, NULL if it isn't one
+static const server_route* route_find(struct mg_str uri)
+{
+    char path[ROUTE_PATH_MAX];
+    if( uri.len >= sizeof(path) ) return NULL;
+    memcpy(path, uri.ptr, uri.len);
+    path[uri.len] = 0;
+    int i = blink1_patternIndexGet(&routes_ix, path);
+    return (i < 0) ? NULL : &routes[i];
+}
+
+// r with no args yet, for route, replying with reply
+static void request_clear(server_request* r, const server_route* route, server_reply* reply,
+                          struct mg_str query)
+{
+    r->route = route;
+    r->reply = reply;
+    query_init(&r->query, query, &reply->arena);
+    r->status[0] = 0;
+    r->id = 0;
+    r->millis = 0;
+    r->rgb.r = 0; r->rgb.g = 0; r->rgb.b = 0;
+    r->count = 0;
+    r->ledn = 0;
+    r->bright = 0;
+    r->pattern = "";
+    r->pname = "";
+    r->effect_id = 0;
+    r->job = NULL;
+}
+
+// find hm's route and parse the args it takes into r
+// @return the route, NULL if hm isn't for one, or out of memory (and r is untouched)
+static const server_route* request_init(server_request* r, struct mg_http_message* hm)
+{
+    const server_route* route = route_find(hm->uri);
+    if( route == NULL ) return NULL;
+    server_reply* reply = reply_new();
+    if( reply == NULL ) return NULL;
+    request_clear(r, route, reply, hm->query);
+    const char* v = query_get(&r->query, "pretty");
+    reply->pretty = (v && strcmp(v, "0") != 0);
+    request_args(r, route->args);
+    return route;
+}
+
+
+// a JSON string token's contents, unescaped, "" if it isn't a string
+static void json_tok_str(struct mg_str tok, char* buf, size_t size)
+{
+    buf[0] = 0;
+    if( tok.len >= 2 && tok.ptr[0] == '"' ) {
+        mg_json_unescape(mg_str_n(tok.ptr + 1, tok.len - 2), buf, size);
+    }
+}
+
+// obj's 'id', a number or a string like the 'id' arg, 0 if it has none
+static uint32_t json_get_id(struct mg_str obj)
+{
+    char buf[40];
+    uint32_t id = 0;
+    struct mg_str tok = mg_json_get_tok(obj, "$.id");
+    if( tok.len > 0 && tok.ptr[0] == '"' ) {
+        json_tok_str(tok, buf, sizeof(buf));
+        query_id(buf, &id);
+    }
+    else if( tok.len > 0 ) {
+        id = mg_json_get_long(obj, "$.id", 0);
+    }
+    return id;
+}
+
+
+// ----------------------------------------------------------------------
+// /blink1/ws, a WebSocket for streaming colors
+//
+// Each message is one or more fades of (id, ledn, rgb, millis), as JSON
+// text or packed binary.  They run as the same blink1 jobs as
+// /blink1/fadeToRGB, but only one fade per blink1 and ledn is on its
+// worker at a time.  While it is, the newest fade to arrive waits and
+// any older waiting one is dropped, so a client sending faster than USB
+// keeps up only loses colors that would have been overwritten anyway.
+// Every fade is acked on the socket it came from, in the same format.
+//
+
+// binary messages are a run of these, little-endian:
+//   0  uint32 id      blink1 index or serial number, like the 'id' arg
+//   4  uint8  ledn
+//   5  uint8  r, g, b
+//   8  uint16 millis
+//  10  uint16 seq     echoed in the ack
+// and acks are the same, with millis replaced by status and a 0 byte
+#define WS_RECORD_SIZE  12
+
+enum { WS_APPLIED, WS_DROPPED, WS_ERROR };
+static const char* ws_status_names[] = { "ok", "dropped", "error" };
+
+typedef struct {
+    unsigned long conn_id;  // where to ack it
+    uint32_t id;
+    uint8_t ledn;
+    rgb_t rgb;
+    uint16_t millis;
+    uint16_t seq;
+    uint8_t binary;         // ack in binary
+} ws_fade;
+
+// a blink1 and ledn with a fade on its worker, and maybe one waiting
+typedef struct {
+    uint32_t id;
+    uint8_t ledn;
+    bool waiting;
+    ws_fade next;
+} ws_stream;
+
+static ws_stream* ws_streams;
+static int ws_streams_count;
+static int ws_streams_cap;
+
+//
+static int ws_stream_find(uint32_t id, uint8_t ledn)
+{
+    for( int i=0; i<ws_streams_count; i++ ) {
+        if( ws_streams[i].id == id && ws_streams[i].ledn == ledn ) return i;
+    }
+    return -1;
+}
+
+// @return its index, -1 if out of memory
+static int ws_stream_add(uint32_t id, uint8_t ledn)
+{
+    if( ws_streams_count == ws_streams_cap ) {
+        int cap = (ws_streams_cap) ? 2*ws_streams_cap : 8;
+        ws_stream* ss = realloc(ws_streams, cap * sizeof(ws_stream));
+        if( ss == NULL ) return -1;
+        ws_streams = ss;
+        ws_streams_cap = cap;
+    }
+    ws_stream* s = &ws_streams[ws_streams_count];
+    s->id = id;
+    s->ledn = ledn;
+    s->waiting = false;
+    return ws_streams_count++;
+}
+
+//
+static void ws_stream_remove(int i)
 {
-    fprintf(stderr,
-"Usage: \n"
-"  %s [options]\n"
-"where [options] can be:\n"
-"  --port port, -p port       port to listen on (default %d)\n"
-"  --host host, -H host       host to listen on ('127.0.0.1' or '0.0.0.0')\n"
-"  --no-html                  do not serve static HTML help\n"
-"  --logging, -l              log accesses to stdout\n"
-"  --patternsjson <fn>, -j <fn>  filepath to JSON color pattern list, see patterns-example.json\n"
-"  --quiet, -q                quiet non-logging messages (useful with --logging)\n"            
-"  --version                  version of this program\n"
-"  --help, -h                 this help page\n"
-"\n",
-        blink1_server_name, http_listen_port);
+    memmove(&ws_streams[i], &ws_streams[i+1], (ws_streams_count-i-1) * sizeof(ws_stream));
+    ws_streams_count--;
+}
 
-    fprintf(stderr,
-"Supported URIs:\n");
-    for( size_t i=0; i< sizeof(supported_urls)/sizeof(url_info); i++ ) {
-        fprintf(stderr,"  %s -- %s\n", supported_urls[i].url, supported_urls[i].desc);
+//
+static void ws_streams_free(void)
+{
+    free(ws_streams);
+    ws_streams = NULL;
+    ws_streams_count = 0;
+    ws_streams_cap = 0;
+}
+
+//
+static void put_le16(uint8_t* p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put_le32(uint8_t* p, uint32_t v) { put_le16(p, v); put_le16(p+2, v >> 16); }
+static uint16_t get_le16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+static uint32_t get_le32(const uint8_t* p) { return get_le16(p) | ((uint32_t)get_le16(p+2) << 16); }
+
+// tell f's sender what became of it, if it's still connected
+static void ws_ack(const ws_fade* f, int status)
+{
+    struct mg_connection* c = conn_find(f->conn_id);
+    if( c == NULL ) return;
+    if( f->binary ) {
+        uint8_t rec[WS_RECORD_SIZE];
+        put_le32(rec, f->id);
+        rec[4] = f->ledn;
+        rec[5] = f->rgb.r;  rec[6] = f->rgb.g;  rec[7] = f->rgb.b;
+        rec[8] = status;
+        rec[9] = 0;
+        put_le16(rec+10, f->seq);
+        mg_ws_send(c, rec, sizeof(rec), WEBSOCKET_OP_BINARY);
+        return;
     }
-    fprintf(stderr,"\n");
-    fprintf(stderr,
-"Supported query arguments: (not all urls support all args)\n"
-"  'rgb'    -- hex RGB color code. e.g. 'rgb=FF9900' or 'rgb=%%23FF9900\n"
-"  'time'   -- time in seconds to fade or blink, e.g. 'time=0.5' \n"
-"  'millis' -- milliseconds to fade or blink, e.g. 'millis=500'\n"
-"  'bright' -- brightness, 1-255, 0=full e.g. half-bright 'bright=127'\n"
-"  'ledn'   -- which LED to set. 0=all/1=top/2=bot, e.g. 'ledn=0'\n"
-"  'id' or 'blink1_id' -- which blink(1) to set, can be index or blink1 serialnum\n"
-"  'count'  -- number of times to blink or repeat, for /blink1/blink, e.g. 'count=3'\n"
-"  'pattern'-- color pattern string (e.g. '3,00ffff,0.2,0,000000,0.2,0')\n"
-"  'pname'  -- color pattern name from pattern list (e.g. 'red flash') \n"
-"\n"
-"Examples: \n"
-"  /blink1/blue?bright=127 -- set blink1 blue, at half-intensity \n"
-"  /blink1/fadeToRGB?rgb=FF00FF&millis=500 -- fade to purple over 500ms\n"
-"  /blink1/pattern/play?pattern=3,00ffff,0.2,0,000000,0.2,0 -- blink cyan 3 times\n"
-"  /blink1/servertickle?on=1&millis=5000 -- turn servertickle on with 5 sec timer\n"
-"  /blink1/green?id=1 -- turn 2nd blink(1) green\n"
-"\n"
-        );
+    char rgbstr[10];
+    sprintf(rgbstr, "#%02x%02x%02x", f->rgb.r, f->rgb.g, f->rgb.b);
+    size_t at = c->send.len;
+    json_writer w = { c, 0, 0, 0, 0 };
+    jw_object(&w);
+    jw_key(&w, "ack");     jw_number(&w, f->seq);
+    jw_key(&w, "id");      jw_number(&w, f->id);
+    jw_key(&w, "ledn");    jw_number(&w, f->ledn);
+    jw_key(&w, "rgb");     jw_string(&w, rgbstr);
+    jw_key(&w, "status");  jw_string(&w, ws_status_names[status]);
+    jw_end(&w);
+    mg_ws_wrap(c, c->send.len - at, WEBSOCKET_OP_TEXT);
 }
 
-void cache_flush(int idle_threshold_millis);
+static void ws_fade_done(server_job* job);
 
-blink1_device* cache_getDeviceById(uint32_t id)
+// start f on its blink1's worker
+// @return -1 if there's no such blink1
+static int ws_submit(const ws_fade* f)
+{
+    effects_cancel_dev(f->id);
+    server_job* job = job_new(f->id);
+    if( !job ) return -1;
+    last_rgb = f->rgb;
+    job->io = job_fade;
+    job->finish = ws_fade_done;
+    job->conn_id = f->conn_id;
+    job->devid = f->id;
+    job->ledn = f->ledn;
+    job->rgb = f->rgb;
+    job->millis = f->millis;
+    job->seq = f->seq;
+    job->binary = f->binary;
+    job_submit(job);
+    return 0;
+}
+
+// a fade is done: ack it, then start the one waiting, if any
+static void ws_fade_done(server_job* job)
 {
-    int i = blink1_getCacheIndexById(id);
-    blink1_device* dev=NULL;
-    if( i>=0 ) {
-        dev = cache_infos[i].dev;
+    ws_fade f = { job->conn_id, job->devid, job->ledn, job->rgb, job->millis, job->seq, job->binary };
+    ws_ack(&f, (job->rc == -1) ? WS_ERROR : WS_APPLIED);
+    int i = ws_stream_find(f.id, f.ledn);
+    if( i < 0 ) return;
+    while( ws_streams[i].waiting ) {
+        ws_fade next = ws_streams[i].next;
+        ws_streams[i].waiting = false;
+        if( ws_submit(&next) == 0 ) return;  // the stream stays, for next
+        ws_ack(&next, WS_ERROR);
     }
-    // printf("cache_getDeviceById: %p from %d at %d\n", dev, id, i);
-    if( !dev ) {
-        dev = blink1_openById(id);
-        if( !dev ) {
-            cache_flush(0);
-            blink1_enumerate();
-            dev = blink1_openById(id);
-            if( !dev ) {
-                return NULL;
+    ws_stream_remove(i);
+}
+
+// a fade from a client
+static void ws_fade_in(const ws_fade* f)
+{
+    int i = ws_stream_find(f->id, f->ledn);
+    if( i >= 0 ) {  // one's on the worker, f waits for it
+        if( ws_streams[i].waiting ) ws_ack(&ws_streams[i].next, WS_DROPPED);
+        ws_streams[i].next = *f;
+        ws_streams[i].waiting = true;
+        return;
+    }
+    if( (i = ws_stream_add(f->id, f->ledn)) < 0 ) {
+        ws_ack(f, WS_ERROR);
+    }
+    else if( ws_submit(f) == -1 ) {
+        ws_stream_remove(i);
+        ws_ack(f, WS_ERROR);
+    }
+}
+
+// a fade from a JSON object like {"id":0,"ledn":0,"rgb":"#ff00ff","millis":50,"seq":1}.
+// 'rgb' is needed, the rest default to 0.  'id' can be a number or a
+// string, as with the 'id' arg
+// @return -1 if obj isn't a fade
+static int ws_json_fade(struct mg_str obj, ws_fade* f)
+{
+    char buf[40];
+    json_tok_str(mg_json_get_tok(obj, "$.rgb"), buf, sizeof(buf));
+    if( buf[0] == 0 ) return -1;
+    parsecolor(&f->rgb, buf);
+    f->id = json_get_id(obj);
+    f->ledn = mg_json_get_long(obj, "$.ledn", 0);
+    f->millis = mg_json_get_long(obj, "$.millis", 0);
+    f->seq = mg_json_get_long(obj, "$.seq", 0);
+    return 0;
+}
+
+// tell c it sent something that isn't fades
+static void ws_error(struct mg_connection* c, const char* msg)
+{
+    size_t at = c->send.len;
+    json_writer w = { c, 0, 0, 0, 0 };
+    jw_object(&w);
+    jw_key(&w, "error");  jw_string(&w, msg);
+    jw_end(&w);
+    mg_ws_wrap(c, c->send.len - at, WEBSOCKET_OP_TEXT);
+}
+
+// a message from a client: fades, as binary records or as a JSON
+// object or array of them
+static void ws_message(struct mg_connection* c, struct mg_ws_message* wm)
+{
+    ws_fade f;
+    memset(&f, 0, sizeof(f));
+    f.conn_id = c->id;
+    int op = wm->flags & 0x0f;
+    if( op == WEBSOCKET_OP_BINARY ) {
+        if( wm->data.len == 0 || wm->data.len % WS_RECORD_SIZE != 0 ) {
+            ws_error(c, "binary messages are 12-byte records");
+            return;
+        }
+        f.binary = 1;
+        for( size_t i=0; i < wm->data.len; i += WS_RECORD_SIZE ) {
+            const uint8_t* rec = (const uint8_t*)wm->data.ptr + i;
+            f.id = get_le32(rec);
+            f.ledn = rec[4];
+            f.rgb.r = rec[5];  f.rgb.g = rec[6];  f.rgb.b = rec[7];
+            f.millis = get_le16(rec+8);
+            f.seq = get_le16(rec+10);
+            ws_fade_in(&f);
+        }
+    }
+    else if( op == WEBSOCKET_OP_TEXT ) {
+        struct mg_str data = mg_strstrip(wm->data);
+        if( data.len > 0 && data.ptr[0] == '[' ) {
+            struct mg_str val;
+            size_t ofs = 0;
+            while( (ofs = mg_json_next(data, ofs, NULL, &val)) > 0 ) {
+                if( ws_json_fade(val, &f) == 0 ) ws_fade_in(&f);
+                else ws_error(c, "fades need an 'rgb'");
             }
         }
-        i = blink1_getCacheIndexByDev(dev);
-        // printf("cache_getDeviceById: %p to %d \n", dev, i);
-        if( i>=0 ) {
-            cache_infos[i].dev = dev;
+        else if( ws_json_fade(data, &f) == 0 ) {
+            ws_fade_in(&f);
+        }
+        else {
+            ws_error(c, "fades need an 'rgb'");
         }
     }
-    // printf("cache_getDeviceById: return %p\n", dev);
-    return dev;
 }
 
-#define cache_return(dev) { cache_return_internal(dev); dev=NULL; }
+// state for a new client: the blink1s there are, and the last color set
+static void ws_open(struct mg_connection* c)
+{
+    char rgbstr[10];
+    if( hotplug ) blink1_hotplugPoll();
+    else if( blink1_getCachedCount() == 0 ) { blink1_enumerate(); devices_sync(); }
+    sprintf(rgbstr, "#%02x%02x%02x", last_rgb.r, last_rgb.g, last_rgb.b);
+    size_t at = c->send.len;
+    json_writer w = { c, 0, 0, 0, 0 };
+    jw_object(&w);
+    jw_key(&w, "blink1_serialnums");  serials_write(&w, NULL);
+    jw_key(&w, "lastColor");          jw_string(&w, rgbstr);
+    jw_key(&w, "version");            jw_string(&w, blink1_server_version);
+    jw_end(&w);
+    mg_ws_wrap(c, c->send.len - at, WEBSOCKET_OP_TEXT);
+}
+
+
+// ----------------------------------------------------------------------
+// POST /blink1/batch, many operations in one request
+//
+// The body is a JSON array of operations like
+//   {"op":"fade", "id":1, "rgb":"#ff0000", "millis":200}
+// each run by the same route_*() as its single-request endpoint, with
+// the same args.  All of them are started in one pass, so ones for
+// different blink1s run on their workers in parallel, and ones for the
+// same blink1 run in order.  The reply is sent once they're all done,
+// with a result per operation, in order.  The batch and its results
+// live in the reply's arena.
+//
+
+#define BATCH_MAX_OPS  1024
+
+typedef struct {
+    const char* op;         // a batch_ops[] name, "?" if it isn't one
+    uint32_t id;
+    const char* status;     // in the reply's arena, NULL until done
+} batch_result;
+
+struct server_batch_ {
+    unsigned long conn_id;
+    server_reply* reply;    // sent when the last operation is done
+    int count;
+    int pending;            // operations not done, plus 1 while they're being started
+    batch_result* results;
+};
+
+static const struct {
+    const char* name;
+    void (*fn)(server_request* r);
+} batch_ops[] = {
+    {"fade",  route_fadetorgb},
+    {"blink", route_blink},
+    {"play",  route_pattern_play},
+    {"stop",  route_pattern_stop},
+};
+
+#define BATCH_OPS_COUNT  ((int)(sizeof(batch_ops) / sizeof(batch_ops[0])))
+
+// a JSON string token, unescaped, copied into arena.  "" if it isn't a string
+static const char* json_tok_strdup(struct mg_str tok, server_arena* arena)
+{
+    if( tok.len < 2 || tok.ptr[0] != '"' ) return "";
+    char* s = arena_alloc(arena, tok.len - 1);
+    if( s == NULL ) return "";
+    json_tok_str(tok, s, tok.len - 1);
+    return s;
+}
+
+// an operation's args from its JSON object, as request_args() gets them
+// from a query string.  Strings go in r's reply's arena
+static void batch_args(server_request* r, struct mg_str obj)
+{
+    char buf[40];
+    double d;
+    r->id = json_get_id(obj);
+    if( mg_json_get_num(obj, "$.millis", &d) ) r->millis = d;
+    if( mg_json_get_num(obj, "$.time", &d) )   r->millis = 1000 * d;
+    json_tok_str(mg_json_get_tok(obj, "$.rgb"), buf, sizeof(buf));
+    if( buf[0] ) parsecolor(&r->rgb, buf);
+    r->count = mg_json_get_long(obj, "$.count", 0);
+    r->ledn = mg_json_get_long(obj, "$.ledn", 0);
+    r->bright = mg_json_get_long(obj, "$.bright", 0);
+    r->pattern = json_tok_strdup(mg_json_get_tok(obj, "$.pattern"), &r->reply->arena);
+    r->pname = json_tok_strdup(mg_json_get_tok(obj, "$.pname"), &r->reply->arena);
+}
+
+//
+static void batch_results_write(json_writer* w, const void* arg)
+{
+    const server_batch* b = arg;
+    jw_array(w);
+    for( int i=0; i < b->count; i++ ) {
+        const batch_result* res = &b->results[i];
+        jw_object(w);
+        jw_key(w, "op");      jw_string(w, res->op);
+        jw_key(w, "id");      jw_number(w, res->id);
+        jw_key(w, "status");  jw_string(w, (res->status) ? res->status : "error: out of memory");
+        jw_end(w);
+    }
+    jw_end(w);
+}
 
-void cache_return_internal( blink1_device* dev )
+// one less operation to wait for, reply if that was the last
+static void batch_release(server_batch* b)
 {
-    int i = blink1_getCacheIndexByDev(dev);
-    // printf("cache_return_internal: %p at %d\n", dev, i);
-    if( i>=0 ) {
-        cache_infos[i].atime = mg_millis();
+    if( --b->pending > 0 ) return;
+    rgb_t rgb = {0,0,0};
+    struct mg_connection* c = conn_find(b->conn_id);
+    if( c ) {
+        send_json(c, b->reply, "blink1 batch", rgb, 0);
+        if( enable_logging ) log_access(c, "/blink1/batch", 200);
     }
     else {
-        blink1_close(dev);
+        reply_free(b->reply);
     }
 }
 
-void cache_flush(int idle_threshold_millis)
+// from job_end(), after the job's finish
+static void batch_op_done(server_job* job)
 {
-    int64_t deadline = mg_millis() - idle_threshold_millis;
-    int count = blink1_getCachedCount();
-    for( int i=0; i< count; i++ ) {
-        if( cache_infos[i].dev && cache_infos[i].atime < deadline ) {
-            // printf("DEBUG cache_flush: id=%d handle=%p atime=%lld\n", i, cache_infos[i].dev, cache_infos[i].atime);
-            blink1_close(cache_infos[i].dev);
-            cache_infos[i].dev = NULL;
-            cache_infos[i].atime = 0;
-        }
+    server_batch* b = job->batch;
+    if( job->rc == -1 && strstr(job->status, "error") == NULL ) {
+        snprintf(job->status+strlen(job->status), sizeof(job->status)-strlen(job->status),
+                 ": error, blink1 I/O failed");
     }
+    b->results[job->batch_op].status = arena_strdup(&b->reply->arena, job->status);
+    batch_release(b);
 }
 
-void blink1_do_color(rgb_t rgb, uint32_t millis, uint32_t id,
-                    uint8_t ledn, uint8_t bright, char* status)
+// run operation i, from its JSON object
+static void batch_op_start(server_batch* b, int i, struct mg_str obj)
 {
-    last_rgb.r = rgb.r; 
-    last_rgb.g = rgb.g; 
-    last_rgb.b = rgb.b;
-    
-    blink1_device* dev = cache_getDeviceById(id);
-    if( !dev ) {
-        sprintf(status+strlen(status), ": error: no blink1 found");
+    char name[16];
+    batch_result* res = &b->results[i];
+    res->op = "?";
+    res->id = json_get_id(obj);
+    res->status = NULL;
+    json_tok_str(mg_json_get_tok(obj, "$.op"), name, sizeof(name));
+    int k;
+    for( k=0; k < BATCH_OPS_COUNT; k++ ) {
+        if( strcmp(name, batch_ops[k].name) == 0 ) break;
+    }
+    if( k == BATCH_OPS_COUNT ) {
+        res->status = "error: 'op' must be fade, blink, play or stop";
         return;
     }
-    
-    blink1_adjustBrightness( bright, &rgb.r, &rgb.g, &rgb.b);
-    if( millis==0 ) { millis = 200; }
-    int rc = blink1_fadeToRGBN( dev, millis, rgb.r,rgb.g,rgb.b, ledn );
-    if( rc == -1 ) {
-        fprintf(stderr, "error, couldn't fadeToRGB on blink1\n");
-        sprintf(status+strlen(status), ": error, couldn't fadeToRGB on blink1");
+    res->op = batch_ops[k].name;
+    server_reply* scratch = reply_new();  // for the args and what the route echoes
+    if( scratch == NULL ) return;
+    server_request r;
+    request_clear(&r, NULL, scratch, mg_str_n(NULL, 0));
+    batch_args(&r, obj);
+    batch_ops[k].fn(&r);
+    if( r.job ) {
+        r.job->conn_id = b->conn_id;
+        r.job->batch = b;
+        r.job->batch_op = i;
+        snprintf(r.job->status, sizeof(r.job->status), "%s", r.status);
+        b->pending++;
+        job_submit(r.job);
     }
     else {
-        sprintf(status, "blink1 set color #%02x%02x%02x", rgb.r,rgb.g,rgb.b);
+        res->status = arena_strdup(&b->reply->arena, r.status);
     }
-    cache_return(dev);
+    reply_free(scratch);
 }
 
+//
+static void batch_start(struct mg_connection* c, struct mg_http_message* hm)
+{
+    rgb_t rgb = {0,0,0};
+    server_reply* reply = reply_new();
+    if( reply == NULL ) {
+        mg_http_reply(c, 500, NULL, "out of memory\n");
+        return;
+    }
+    server_query query;
+    query_init(&query, hm->query, &reply->arena);
+    const char* v = query_get(&query, "pretty");
+    reply->pretty = (v && strcmp(v, "0") != 0);
 
-// Log HTTP requests in Common Log Format, enabled with "--logging"
-static void log_access(struct mg_connection *c, char* uri_str, int resp_code) {
-    //CLF format: 127.0.0.1 - frank [10/Oct/2000:13:55:36 -0700] "GET /apache_pb.gif HTTP/1.0" 200 2326
-    time_t rawtime;
-    time( &rawtime );
-    char date_str[100];
-    strftime(date_str, sizeof(date_str), "%d/%b/%Y:%H:%M:%S %z", localtime(&rawtime));
-    char ip_str[20];
-    mg_snprintf(ip_str, 20, "%d.%d.%d.%d", c->rem.ip[0],c->rem.ip[1],c->rem.ip[2],c->rem.ip[3] );
-    printf("%s - [%s] \"%s %s HTTP/1.1\" %d %d\n", ip_str, date_str, "GET", uri_str, resp_code, 0 ); // can't get response length I guess
+    struct mg_str body = mg_strstrip(hm->body);
+    struct mg_str val;
+    size_t ofs = 0;
+    int n = 0;
+    if( mg_vcmp(&hm->method, "POST") != 0 || body.len == 0 || body.ptr[0] != '[' ) {
+        send_json(c, reply, "blink1 batch: error: POST a JSON array of operations", rgb, 0);
+        return;
+    }
+    while( (ofs = mg_json_next(body, ofs, NULL, &val)) > 0 ) n++;
+    if( n > BATCH_MAX_OPS ) {
+        send_json(c, reply, "blink1 batch: error: too many operations", rgb, 0);
+        return;
+    }
+    server_batch* b = arena_alloc(&reply->arena, sizeof(server_batch));
+    batch_result* results = arena_alloc(&reply->arena, (n ? n : 1) * sizeof(batch_result));
+    if( b == NULL || results == NULL ) {
+        reply_free(reply);
+        mg_http_reply(c, 500, NULL, "out of memory\n");
+        return;
+    }
+    b->conn_id = c->id;
+    b->reply = reply;
+    b->count = n;
+    b->pending = 1;
+    b->results = results;
+    reply_set_number(reply, "count", n);
+    reply_set_writer(reply, "results", batch_results_write, b);
+    for( int i=0; i < n; i++ ) {
+        ofs = mg_json_next(body, ofs, NULL, &val);
+        batch_op_start(b, i, val);
+    }
+    batch_release(b);
 }
 
 
-static void ev_handler(struct mg_connection *c, int ev, void *ev_data)
+// ----------------------------------------------------------------------
+// /blink1/events, Server-Sent Events of blink1 state
+//
+// The server keeps what it last did to each blink1, by serial number:
+// the colors its fades left on each LED, the pattern it started, and
+// servertickle.  That's updated as jobs finish and as blink1s come and
+// go, so watching costs no USB traffic.  A stream starts with a "state"
+// event of all of it, then gets "color", "pattern", "servertickle" and
+// "hotplug" events as they happen, optionally only for some blink1s.
+// Each event is written once, into the first stream that wants it, and
+// copied to the others.  A stream that falls too far behind is closed;
+// EventSource reconnects and gets a fresh "state".
+//
+
+#define EVENTS_MAX_BACKLOG  (64*1024)  // unsent bytes before a stream is dropped
+#define EVENTS_PING_MILLIS  15000      // a comment this often, so proxies keep the stream open
+#define EVENTS_MAX_IDS      7
+
+// a stream's filter, kept in its connection's c->data
+typedef struct {
+    uint8_t subscribed;
+    uint8_t nserials;                  // 0 for every blink1
+    uint32_t serials[EVENTS_MAX_IDS];
+} events_filter;
+
+typedef char events_filter_fits[(sizeof(events_filter) <= MG_DATA_SIZE) ? 1 : -1];
+
+typedef struct {
+    char serial[16];
+    uint32_t serialnum;     // serial as a number, like an 'id' arg, for filters
+    uint8_t known;          // bit per LED whose color is in leds
+    rgb_t leds[2];
+    uint8_t playing;
+    uint8_t count;
+    uint8_t lines;
+    char pname[64];         // "" for an inline pattern or a blink
+    uint8_t tickle_on;
+    uint16_t tickle_millis;
+} device_state;
+
+static device_state* devices;
+static int devices_count;
+static int devices_cap;
+static int events_streams;  // connections subscribed
+
+//
+static device_state* device_find(const char* serial)
 {
-    if(ev != MG_EV_HTTP_MSG) {
-        return;
+    for( int i=0; i < devices_count; i++ ) {
+        if( strcmp(devices[i].serial, serial) == 0 ) return &devices[i];
     }
+    return NULL;
+}
 
-    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+// find or add serial's state, NULL if out of memory
+static device_state* device_add(const char* serial)
+{
+    device_state* d = device_find(serial);
+    if( d ) return d;
+    if( devices_count == devices_cap ) {
+        int cap = (devices_cap) ? 2*devices_cap : 8;
+        device_state* ds = realloc(devices, cap * sizeof(device_state));
+        if( ds == NULL ) return NULL;
+        devices = ds;
+        devices_cap = cap;
+    }
+    d = &devices[devices_count++];
+    memset(d, 0, sizeof(device_state));
+    snprintf(d->serial, sizeof(d->serial), "%s", serial);
+    d->serialnum = strtoul(serial, NULL, 16);
+    return d;
+}
 
-    uint32_t id=0;
-    uint8_t ledn=0, bright=0;
-    char status[1000] = "";
-    char uri_str[1000] = "";
-    char tmpstr[1000] = "";
-    char pattstr[1000] = "";
-    char pnamestr[1000] = "";
-
-    uint16_t millis = 0;
-    rgb_t rgb = {0,0,0}; // for parsecolor
-    uint8_t count = 0;
-    int resp_code = 404;  // no found by default
+//
+static void devices_free(void)
+{
+    free(devices);
+    devices = NULL;
+    devices_count = 0;
+    devices_cap = 0;
+}
 
-    JSON_Value *json_root_val = json_value_init_object();
-    JSON_Object *json_root_obj = json_value_get_object(json_root_val);
+// d's state, as members of an object
+static void device_write(json_writer* w, const device_state* d)
+{
+    char rgbstr[10];
+    jw_key(w, "id");      jw_number(w, blink1_getCacheIndexBySerial(d->serial));
+    jw_key(w, "serial");  jw_string(w, d->serial);
+    jw_key(w, "leds");
+    jw_array(w);
+    for( int i=0; i < 2; i++ ) {
+        if( d->known & (1 << i) ) {
+            sprintf(rgbstr, "#%02x%02x%02x", d->leds[i].r, d->leds[i].g, d->leds[i].b);
+            jw_string(w, rgbstr);
+        }
+        else {
+            jw_null(w);
+        }
+    }
+    jw_end(w);
+    jw_key(w, "playing");  jw_bool(w, d->playing);
+    jw_key(w, "pname");    jw_string(w, d->pname);
+    jw_key(w, "count");    jw_number(w, d->count);
+    jw_key(w, "lines");    jw_number(w, d->lines);
+    jw_key(w, "servertickle");         jw_bool(w, d->tickle_on);
+    jw_key(w, "servertickle_millis");  jw_number(w, d->tickle_millis);
+}
 
-    struct mg_str* uri = &hm->uri;
-    struct mg_str* querystr = &hm->query;
+//
+static int events_wants(const struct mg_connection* c, uint32_t serialnum)
+{
+    const events_filter* f = (const events_filter*)c->data;
+    if( !f->subscribed || c->is_closing ) return 0;
+    if( f->nserials == 0 ) return 1;
+    for( int i=0; i < f->nserials; i++ ) {
+        if( f->serials[i] == serialnum ) return 1;
+    }
+    return 0;
+}
+
+// start event name about serialnum in the first stream that wants it,
+// w writes its data and events_end() sends it to the rest
+// @return 0 if no stream wants it
+static int events_begin(json_writer* w, size_t* at, const char* name, uint32_t serialnum)
+{
+    if( events_streams == 0 ) return 0;
+    for( struct mg_connection* c = server_mgr->conns; c; c = c->next ) {
+        if( !events_wants(c, serialnum) ) continue;
+        json_writer cw = { c, 0, 0, 0, 0 };
+        *w = cw;
+        *at = c->send.len;
+        mg_printf(c, "event: %s\ndata: ", name);
+        return 1;
+    }
+    return 0;
+}
 
-    mg_snprintf(uri_str, sizeof(uri_str), "%s", uri->ptr); // uri->ptr gives us char ptr
+//
+static void events_end(json_writer* w, size_t at, uint32_t serialnum)
+{
+    struct mg_connection* first = w->c;
+    mg_send(first, "\n\n", 2);
+    for( struct mg_connection* c = first; c; c = c->next ) {
+        if( !events_wants(c, serialnum) ) continue;
+        if( c != first ) mg_send(c, first->send.buf + at, first->send.len - at);
+        if( c->send.len > EVENTS_MAX_BACKLOG ) c->is_closing = 1;
+    }
+}
 
-    // handle parsing all possible query args
-    if( mg_http_get_var(querystr, "millis", tmpstr, sizeof(tmpstr)) > 0 ) {
-        millis = strtod(tmpstr,NULL);
-        json_object_set_number(json_root_obj, "millis", millis);
+// serial was plugged in or unplugged
+static void device_plugged(int event, const char* serial)
+{
+    device_state* d = device_find(serial);
+    if( event == BLINK1_HOTPLUG_ADDED ) {
+        if( d ) return;  // already known
+        if( (d = device_add(serial)) == NULL ) return;
     }
-    if( mg_http_get_var(querystr, "time", tmpstr, sizeof(tmpstr)) > 0 ) {
-        millis = 1000 * strtof(tmpstr,NULL);
-        json_object_set_number(json_root_obj, "millis", millis);
+    else if( d == NULL ) {
+        return;
     }
-    if( mg_http_get_var(querystr, "rgb", tmpstr, sizeof(tmpstr)) > 0 ) {
-        parsecolor( &rgb, tmpstr);
-        json_object_set_string(json_root_obj, "rgb", tmpstr);
+    json_writer w;
+    size_t at = 0;
+    if( events_begin(&w, &at, "hotplug", d->serialnum) ) {
+        jw_object(&w);
+        jw_key(&w, "event");  jw_string(&w, (event == BLINK1_HOTPLUG_ADDED) ? "added" : "removed");
+        device_write(&w, d);
+        jw_end(&w);
+        events_end(&w, at, d->serialnum);
     }
-    if( mg_http_get_var(querystr, "count", tmpstr, sizeof(tmpstr)) > 0 ) {
-        count = strtod(tmpstr,NULL);
-        json_object_set_number(json_root_obj, "count", count);
+    if( event != BLINK1_HOTPLUG_ADDED ) {
+        memmove(d, d+1, (devices_count - (d - devices) - 1) * sizeof(device_state));
+        devices_count--;
     }
-    if( mg_http_get_var(querystr, "id", tmpstr, sizeof(tmpstr)) > 0 ) {
-        char* pch;
-        pch = strtok(tmpstr, " ,");
-        if( pch != NULL ) {
-            int base = (strlen(pch)==8) ? 16:0;
-            id = strtol(pch,NULL,base);
+}
+
+// after an enumerate, hotplug events for what changed since the last one
+static void devices_sync(void)
+{
+    for( int i=devices_count-1; i>=0; i-- ) {
+        if( blink1_getCacheIndexBySerial(devices[i].serial) < 0 ) {
+            device_plugged(BLINK1_HOTPLUG_REMOVED, devices[i].serial);
         }
     }
-    if( mg_http_get_var(querystr, "blink1_id", tmpstr, sizeof(tmpstr)) > 0 ) {
-        char* pch;
-        pch = strtok(tmpstr, " ,");
-        if( pch != NULL ) {
-            int base = (strlen(pch)==8) ? 16:0;
-            id = strtol(pch,NULL,base);
+    for( int i=0; i < blink1_getCachedCount(); i++ ) {
+        const char* serial = blink1_getCachedSerial(i);
+        if( serial ) device_plugged(BLINK1_HOTPLUG_ADDED, serial);
+    }
+}
+
+// from job_end(), for a job that worked
+static void state_job_done(server_job* job)
+{
+    const char* serial = blink1_getSerialForDev(job->dev);
+    if( serial == NULL ) return;
+    device_state* d = device_add(serial);
+    if( d == NULL ) return;
+    const char* name;
+    if( job->io == job_fade ) {
+        for( int i=0; i < 2; i++ ) {
+            if( job->ledn != 0 && job->ledn != i+1 ) continue;
+            d->leds[i] = job->rgb;
+            d->known |= 1 << i;
         }
+        name = "color";
     }
-    if( mg_http_get_var(querystr, "ledn", tmpstr, sizeof(tmpstr)) > 0 ) {
-        ledn = strtod(tmpstr,NULL);
-        json_object_set_number(json_root_obj, "ledn", ledn);
+    else if( job->io == job_play ) {
+        d->known = 0;  // the pattern changes them
+        d->playing = 1;
+        d->count = job->count;
+        d->lines = job->cp.len;
+        snprintf(d->pname, sizeof(d->pname), "%s", job->pname);
+        name = "pattern";
     }
-    if( mg_http_get_var(querystr, "bright", tmpstr, sizeof(tmpstr)) > 0 ) {
-        bright = strtod(tmpstr,NULL);
-        json_object_set_number(json_root_obj, "bright", bright);
+    else if( job->io == job_stop ) {
+        d->playing = 0;
+        d->count = 0;
+        d->lines = 0;
+        d->pname[0] = 0;
+        name = "pattern";
     }
-    if( mg_http_get_var(querystr, "pattern", tmpstr, sizeof(tmpstr)) > 0 ) {
-        strcpy(pattstr, tmpstr);
-        json_object_set_string(json_root_obj, "pattern", pattstr);
+    else if( job->io == job_servertickle ) {
+        d->tickle_on = job->on;
+        d->tickle_millis = job->millis;
+        name = "servertickle";
     }
-    if( mg_http_get_var(querystr, "pname", tmpstr, sizeof(tmpstr)) > 0 ) {
-        strcpy(pnamestr, tmpstr);
-        json_object_set_string(json_root_obj, "pname", pnamestr);
+    else {
+        return;  // a read, changes nothing
     }
-    
-    // handle URI endpoints
-    if( mg_vcmp( uri, "/blink1") == 0 ||
-             mg_vcmp( uri, "/blink1/") == 0  ) {
-        sprintf(status, "blink1 status");
-        uint16_t msecs = 0;
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            int rc = blink1_readRGB(dev, &msecs, &rgb.r,&rgb.g,&rgb.b, 0);
-            if( rc==-1 ) {
-                printf("error on readRGB\n");
-            }
-            cache_return(dev);
-        }
+    json_writer w;
+    size_t at = 0;
+    if( !events_begin(&w, &at, name, d->serialnum) ) return;
+    jw_object(&w);
+    device_write(&w, d);
+    if( job->io == job_fade ) {  // the fade itself
+        char rgbstr[10];
+        sprintf(rgbstr, "#%02x%02x%02x", job->rgb.r, job->rgb.g, job->rgb.b);
+        jw_key(&w, "ledn");    jw_number(&w, job->ledn);
+        jw_key(&w, "rgb");     jw_string(&w, rgbstr);
+        jw_key(&w, "millis");  jw_number(&w, job->millis);
     }
-    else if( mg_vcmp( uri, "/blink1/lastColor") == 0 ||
-             mg_vcmp( uri, "/blink1/lastcolor") == 0 ) {
-        sprintf(status, "blink1 lastColor");
-        
-        uint16_t msecs = 0;
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-           int rc = blink1_readRGB(dev, &msecs, &rgb.r, &rgb.g, &rgb.b, 0);
-           if( rc==-1 ) {
-               printf("error on readRGB\n");
-           }
-           cache_return(dev);
-        }
-        
-        sprintf(tmpstr, "#%02x%02x%02x", last_rgb.r, last_rgb.g, last_rgb.b);
-        json_object_set_string(json_root_obj, "lastColor", tmpstr);
-    }
-    else if( mg_vcmp( uri, "/blink1/id") == 0 ||
-             mg_vcmp( uri, "/blink1/id/") == 0 ||
-             mg_vcmp( uri, "/blink1/list") == 0 ||
-             mg_vcmp( uri, "/blink1/list/") == 0 ||
-             mg_vcmp( uri, "/blink1/enumerate") == 0 ) {
-        sprintf(status, "blink1 id");
-        cache_flush(0);
-        int c = blink1_enumerate();
-
-        JSON_Value* json_serials_val = json_value_init_array();
-        JSON_Array * json_serials_arr = json_array(json_serials_val);
-        for( int i=0; i< c; i++ ) {
-            sprintf(tmpstr, "%s", blink1_getCachedSerial(i));
-            json_array_append_string(json_serials_arr, tmpstr);
-        }
-        json_object_set_value(json_root_obj, "blink1_serialnums", json_serials_val);
+    jw_end(&w);
+    events_end(&w, at, d->serialnum);
+}
 
-        const char* blink1_serialnum = blink1_getCachedSerial(0);
-        if( blink1_serialnum ) {
-            sprintf(tmpstr, "%s00000000", blink1_serialnum);
-            json_object_set_string(json_root_obj, "blink1_id", tmpstr);
-        }
-    }
-    else if( mg_vcmp( uri, "/blink1/off") == 0 ) {
-        sprintf(status, "blink1 off");
-        rgb.r = 0; rgb.g = 0; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/on") == 0 ) {
-        sprintf(status, "blink1 on");
-        rgb.r = 255; rgb.g = 255; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/red") == 0 ) {
-        sprintf(status, "blink1 red");
-        rgb.r = 255; rgb.g = 0; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/green") == 0 ) {
-        sprintf(status, "blink1 green");
-        rgb.r = 0; rgb.g = 255; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/blue") == 0 ) {
-        sprintf(status, "blink1 blue");
-        rgb.r = 0; rgb.g = 0; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/cyan") == 0 ) {
-        sprintf(status, "blink1 cyan");
-        rgb.r = 0; rgb.g = 255; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/yellow") == 0 ) {
-        sprintf(status, "blink1 yellow");
-        rgb.r = 255; rgb.g = 255; rgb.b = 0;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/magenta") == 0 ) {
-        sprintf(status, "blink1 magenta");
-        rgb.r = 255; rgb.g = 0; rgb.b = 255;
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp( uri, "/blink1/fadeToRGB") == 0 ) {
-        sprintf(status, "blink1 fadeToRGB");
-        blink1_do_color(rgb, millis, id, ledn, bright, status);
-    }
-    else if( mg_vcmp(uri, "/blink1/blink") == 0 ) {
-        sprintf(status, "blink1 blink");
-        if( rgb.r==0 && rgb.g==0 && rgb.b==0 ) { rgb.r=255; rgb.g=255; rgb.b=255; }
-        if( count==0 ) { count = 3; }
-        if( millis==0 ) { millis = 300; }
-        int repeats = -1;
-        patternline_t pattern[32];
-        blink1_adjustBrightness(bright, &rgb.r, &rgb.g, &rgb.b);
-        sprintf(tmpstr, "%d,#%02x%02x%02x,%.3f,%d,#000000,%.3f,0",
-                count, rgb.r,rgb.g,rgb.b, (float)millis/1000.0, ledn,
-                (float)millis/1000.0);
-        msg("blink pattstr:%s\n", tmpstr);
-        int pattlen = parsePattern(tmpstr, &repeats, pattern);
-
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            for( int i=0; i<pattlen; i++ ) {
-                patternline_t pat = pattern[i];
-                blink1_setLEDN(dev, pat.ledn);
-                msg("  writing line %d: %02x,%02x,%02x : %d : %d\n",
-                      i, pat.color.r,pat.color.g,pat.color.b, pat.millis, pat.ledn );
-                blink1_writePatternLine(dev, pat.millis, pat.color.r, pat.color.g, pat.color.b, i);
-            }
-            blink1_playloop(dev, 1, 0/*startpos*/, pattlen-1/*endpos*/, count/*count*/);
-            cache_return(dev);
-        }
-        else { sprintf(status+strlen(status), ": no blink1 found"); }
+// keep idle streams open through proxies
+static void events_ping(void* arg)
+{
+    (void)arg;
+    if( events_streams == 0 ) return;
+    for( struct mg_connection* c = server_mgr->conns; c; c = c->next ) {
+        const events_filter* f = (const events_filter*)c->data;
+        if( f->subscribed && !c->is_closing ) mg_send(c, ": ping\n\n", 8);
     }
+}
 
-    else if( mg_vcmp(uri, "/blink1/pattern") == 0 ||
-             mg_vcmp(uri, "/blink1/patterns") == 0 ||
-             mg_vcmp(uri, "/blink1/pattern/") == 0 ||
-             mg_vcmp(uri, "/blink1/patterns/") == 0 ) {       
-        sprintf(status, "blink1 pattern list");
+// subscribe c, 'id' is a list of blink1 ids or serials like "0,1" to filter on
+static void events_start(struct mg_connection* c, struct mg_http_message* hm)
+{
+    rgb_t rgb = {0,0,0};
+    server_reply* reply = reply_new();  // for the query, and an error
+    if( reply == NULL ) {
+        mg_http_reply(c, 500, NULL, "out of memory\n");
+        return;
+    }
+    if( hotplug ) blink1_hotplugPoll();
+    else if( blink1_getCachedCount() == 0 ) blink1_enumerate();
+    devices_sync();
 
-        // convert JSON_Object pattern dict to a JSON_Array for output
-        JSON_Value* array_val = json_value_init_array();
-        JSON_Array * array = json_value_get_array(array_val);
-        size_t n = json_object_get_count(json_patterns_obj);
-        for (size_t i = 0; i < n; i++) {
-            const char *key = json_object_get_name(json_patterns_obj, i);
-            const char *val = json_object_get_string(json_patterns_obj, key);
-            // Create a new object with key/value
-            JSON_Value *elem_val = json_value_init_object();
-            JSON_Object *elem_obj = json_value_get_object(elem_val);
-            json_object_set_string(elem_obj, "name", key);
-            json_object_set_string(elem_obj, "pattern", val);
-            json_array_append_value(array, elem_val);  // Add to array
+    events_filter f;
+    memset(&f, 0, sizeof(f));
+    f.subscribed = 1;
+    server_query query;
+    query_init(&query, hm->query, &reply->arena);
+    const char* v = query_get(&query, "id");
+    while( v && *(v += strspn(v, " ,")) ) {
+        uint32_t id = 0;
+        query_id(v, &id);
+        v += strcspn(v, " ,");
+        const char* serial = blink1_getCachedSerial(blink1_getCacheIndexById(id));
+        if( f.nserials == EVENTS_MAX_IDS ) {
+            send_json(c, reply, "blink1 events: error: too many ids", rgb, 0);
+            return;
         }
-
-        json_object_set_value(json_root_obj, "patterns", array_val);
-    }
-    else if( mg_vcmp(uri, "/blink1/pattern/dump") == 0 ) {
-        sprintf(status, "blink1 patterns dump");
-        json_object_set_value(json_root_obj, "pattern_dump", json_value_deep_copy(json_patterns_obj_val));
-    }
-    // add a pattern to the server's in-memory pattern list
-    else if( mg_vcmp(uri, "/blink1/pattern/add") == 0 ) {
-        sprintf(status, "blink1 pattern add");
-        if( pnamestr[0] != 0 && pattstr[0] != 0 ) {
-            // add entry to the global patterns list
-            json_object_set_string(json_patterns_obj, pnamestr, pattstr);            
-            // add the resulting pattern to the JSON response
-            json_object_set_string(json_root_obj, "pattern", pattstr);
+        else if( blink1_idIsSerial(id) ) {  // may not be plugged in yet
+            f.serials[f.nserials++] = id;
         }
-        else {
-            sprintf(status, "blink1 pattern add: error must specifiy both 'pname' and 'pattern' query args");
-        }        
-    }
-    else if( mg_vcmp(uri, "/blink1/pattern/del") == 0 ) {
-        sprintf(status, "blink1 pattern del");
-        if( pnamestr[0] != 0 ) { 
-            json_object_remove(json_patterns_obj, pnamestr);
+        else if( serial ) {
+            f.serials[f.nserials++] = strtoul(serial, NULL, 16);
         }
         else {
-            sprintf(status, "blink1 pattern del: error must specifiy 'pname' query arg");
+            send_json(c, reply, "blink1 events: error: no blink1 found", rgb, 0);
+            return;
         }
     }
-        
-    // play a pattern on the blink1, from blink(1)'s RAM buffer
-    // note: this behavior is different than Blink1Control, where the
-    // app is playing the pattern, leaving the blink(1)'s RAM pattern alone
-    else if( mg_vcmp(uri, "/blink1/pattern/play") == 0 ) {
-        sprintf(status, "blink1 pattern play");
+    reply_free(reply);
 
-        // neither 'pname' or 'pattern' is specified
-        if( pnamestr[0] == 0 && pattstr[0] == 0 ) {
-            sprintf(status, "blink1 pattern play error: 'pname' or 'pattern' query args not specified");
-        }
-        // 'pname' specified
-        else if( pnamestr[0] != 0 ) { 
-            // look up by name with 'pname' query arg
-            const char* pstr = json_object_get_string(json_patterns_obj, pnamestr);
-            snprintf(pattstr, sizeof(pattstr), "%s", pstr ? pstr : "");
-            // no pattern with that pname
-            if( pattstr[0] == 0 ) { 
-                snprintf(status, sizeof(status), "blink1 pattern play error: no pattern for pname '%s'", pnamestr);
-            }
-        }
-        
-        if( pattstr[0] != 0 ) { 
-            // lookup worked or using 'pattern' query arg, so parse the pattern str
-            patternline_t pattern[32];
-            int repeats = -1;
-            int pattlen = parsePattern(pattstr, &repeats, pattern);
-            char pattstr_verify[1000];   // hack
-            // verify we get back the same pattern string we put in
-            toPatternString(pattern, pattlen, repeats, pattstr_verify);
-            if( count==0 ) { count = repeats; }
-        
-            //msg("pname:%s pattstr:%s pattstr_verify:%s pattlen:%d, repeats:%d\n",
-            //    pnamestr, pattstr, pattstr_verify, pattlen, repeats);
-        
-            json_object_set_string(json_root_obj, "pattern", pattstr_verify);
-            blink1_device* dev = cache_getDeviceById(id);
-            if( dev ) {
-                for( int i=0; i<pattlen; i++ ) {
-                    patternline_t pat = pattern[i];
-                    rgb = pat.color;
-                    blink1_adjustBrightness(bright, &rgb.r, &rgb.g, &rgb.b);
-                    blink1_setLEDN(dev, pat.ledn);
-                    //msg("    writing line %d: %02x,%02x,%02x : %d : %d\n",
-                    //    i, pat.color.r,pat.color.g,pat.color.b, pat.millis, pat.ledn );
-                    blink1_writePatternLine(dev, pat.millis, rgb.r, rgb.g, rgb.b, i);
-                }
-                msg("  playing pattern '%s' %d times on blink1\n",pattstr_verify,count);
-                blink1_playloop(dev, 1 /*play/pause*/, 0 /*startpos*/, pattlen-1 /*endpos*/, count /*count*/);
-                cache_return(dev);
-            }
-        }
+    mg_printf(c, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/event-stream\r\n"
+                 "Cache-Control: no-cache\r\n\r\n");
+    memcpy(c->data, &f, sizeof(f));
+    events_streams++;
+
+    char rgbstr[10];
+    sprintf(rgbstr, "#%02x%02x%02x", last_rgb.r, last_rgb.g, last_rgb.b);
+    json_writer w = { c, 0, 0, 0, 0 };
+    mg_printf(c, "event: state\ndata: ");
+    jw_object(&w);
+    jw_key(&w, "blink1s");
+    jw_array(&w);
+    for( int i=0; i < blink1_getCachedCount(); i++ ) {
+        const char* serial = blink1_getCachedSerial(i);
+        device_state* d = (serial) ? device_add(serial) : NULL;
+        if( d == NULL || !events_wants(c, d->serialnum) ) continue;
+        jw_object(&w);
+        device_write(&w, d);
+        jw_end(&w);
     }
-    // since patterns play on the blink1, just stop any pattern playing
-    else if( mg_vcmp(uri, "/blink1/pattern/stop") == 0 ) {
-        sprintf(status, "blink1 pattern stop");
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            blink1_playloop(dev, 0 /*play/pause*/, 0/*startpos*/, 0/*endpos*/, 0/*count*/);
-            cache_return(dev);
-        }
-        else { sprintf(status+strlen(status), ": no blink1 found"); }
-    }
-    // like "/blink1/blink" but does it on the server
-    else if( mg_vcmp( uri, "/blink1/blinkserver") == 0 ) {
-        sprintf(status, "blink1 blinkserver");
-        //if( r==0 && g==0 && b==0 ) { r = 255; g = 255; b = 255; }
-        if( millis==0 ) { millis = 200; }
-
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            blink1_adjustBrightness( bright, &rgb.r, &rgb.g, &rgb.b);
-            //msg("rgb:%d,%d,%d\n",r,g,b);
-            for( int i=0; i<count; i++ ) {
-                blink1_fadeToRGBN( dev, millis/2, rgb.r,rgb.g,rgb.b, ledn );
-                blink1_sleep( millis/2 ); // fixme
-                blink1_fadeToRGBN( dev, millis/2, 0,0,0, ledn );
-                blink1_sleep( millis/2 ); // fixme
-            }
-            cache_return(dev);
-        }
-        else { sprintf(status+strlen(status), ": no blink1 found"); }
-    }
-    //else if( mg_http_match_uri(hm, "/blink1/servertickle/*")) { 
-    else if( mg_vcmp( uri, "/blink1/servertickle/on") == 0 ||
-             mg_vcmp( uri, "/blink1/servertickle/off") == 0 ) {
-        bool st_on = (mg_vcmp(uri, "/blink1/servertickle/on") == 0);
-        if( millis==0 ) { millis = 2000; }
-        sprintf(status, "blink1 servertickle %s", st_on? "on":"off");
-        uint8_t start_pos = 0;
-        uint8_t end_pos = 0;
-        uint8_t st_off_state = 0;
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            blink1_serverdown( dev, st_on, millis, st_off_state, start_pos, end_pos );
-            cache_return(dev);
-        }
-        else { sprintf(status+strlen(status), ": no blink1 found"); }
-        json_object_set_string(json_root_obj, "on", st_on? "1":"0");
-    }
-    else if( mg_vcmp( uri, "/blink1/random") == 0 ) {
-        sprintf(status, "blink1 random");
-        if( count==0 ) { count = 1; }
-        if( millis==0 ) { millis = 200; }
-        blink1_device* dev = cache_getDeviceById(id);
-        if( dev ) {
-            for( int i=0; i<count; i++ ) {
-                uint8_t r = rand() % 255;
-                uint8_t g = rand() % 255;
-                uint8_t b = rand() % 255 ;
-                blink1_adjustBrightness( bright, &r, &g, &b);
-                blink1_fadeToRGBN( dev, millis/2, r,g,b, ledn );
-                blink1_sleep( millis/2 ); // fixme
-            }
-            cache_return(dev);
-        }
-        else { sprintf(status+strlen(status), ": no blink1 found"); }
+    jw_end(&w);
+    jw_key(&w, "lastColor");  jw_string(&w, rgbstr);
+    jw_key(&w, "version");    jw_string(&w, blink1_server_version);
+    jw_end(&w);
+    mg_send(c, "\n\n", 2);
+}
+
+static void ev_handler(struct mg_connection *c, int ev, void *ev_data)
+{
+    if( ev == MG_EV_WS_OPEN ) {
+        ws_open(c);
+        return;
+    }
+    if( ev == MG_EV_WS_MSG ) {
+        ws_message(c, (struct mg_ws_message*) ev_data);
+        return;
+    }
+    if( ev == MG_EV_CLOSE ) {
+        if( ((events_filter*)c->data)->subscribed ) events_streams--;
+        return;
+    }
+    if(ev != MG_EV_HTTP_MSG) {
+        return;
     }
 
-    // set JSON values that exist for all requests
-    json_object_set_string(json_root_obj, "status", status);
-    json_object_set_string(json_root_obj, "version", blink1_server_version);
-    sprintf(tmpstr, "#%02x%02x%02x", rgb.r, rgb.g, rgb.b);
-    json_object_set_string(json_root_obj, "rgb", tmpstr);
-    json_object_set_number(json_root_obj, "millis", millis);
+    struct mg_http_message *hm = (struct mg_http_message *) ev_data;
+    struct mg_str* uri = &hm->uri;
+    int resp_code = 404;  // no found by default
+    server_request r;
 
-    
-    // check if we've handled json        
-    if( status[0] != '\0' ) {  // status set, json was handled
+    if( mg_vcmp( uri, "/blink1/ws") == 0 ) {
+        resp_code = 101;
+        mg_ws_upgrade(c, hm, NULL);
+    }
+    else if( mg_vcmp( uri, "/blink1/events") == 0 ) {
         resp_code = 200;
-        sprintf(tmpstr, "#%02x%02x%02x", rgb.r,rgb.g,rgb.b );
-        mg_printf(c, "HTTP/1.1 %d OK\r\n", resp_code);
-        mg_printf(c, "Content-type: application/json\r\n");
-        mg_printf(c, "X-Content-Type-Options: nosniff\r\n");
-        mg_printf(c, "Transfer-Encoding: chunked\r\n\r\n");
-        
-        char* json_string = json_serialize_to_string_pretty(json_root_val);
-        mg_http_printf_chunk(c, json_string);
-
-        json_free_serialized_string(json_string);
-        json_value_free(json_root_val);
-    
-        mg_http_write_chunk(c, "", 0); /* Send empty chunk, the end of response */
+        events_start(c, hm);
     }
-    else {
-        json_value_free(json_root_val);
-        if( show_html ) {
-            if( mg_vcmp( uri, "/") == 0 ) {
-                resp_code = 302;
-                mg_http_reply(c, resp_code, "Location: /index.html\r\n", "");
-            }
-            else {
-                struct mg_http_serve_opts opts = {
-                    .root_dir = "/",
-                    .fs = &mg_fs_packed
-                };
-                mg_http_serve_dir(c, ev_data, &opts);
-            }
+    else if( mg_vcmp( uri, "/blink1/batch") == 0 ) {
+        batch_start(c, hm);  // replies, and logs, once its operations are done
+        return;
+    }
+    else if( request_init(&r, hm) ) {
+        r.route->fn(&r);
+
+        // reply once the blink1 is done, see jobs_finish()
+        if( r.job != NULL ) {
+            r.job->conn_id = c->id;
+            r.job->reply = r.reply;
+            snprintf(r.job->status, sizeof(r.job->status), "%s", r.status);
+            snprintf(r.job->uri_str, sizeof(r.job->uri_str), "%.*s", (int)uri->len, uri->ptr);
+            r.job->reply_rgb = r.rgb;
+            r.job->reply_millis = r.millis;
+            job_submit(r.job);
+            return;
         }
-        else if ( mg_vcmp( uri, "/") == 0 ) { // non-html request for homepage
-            resp_code = 200;
-            mg_http_reply(c, resp_code, "",
-                          "Welcome to %s api server. All endpoints start with '/blink1'.\r\n",
-                          blink1_server_name);
+        resp_code = 200;
+        send_json(c, r.reply, r.status, r.rgb, r.millis);
+    }
+    else if( show_html ) {
+        if( mg_vcmp( uri, "/") == 0 ) {
+            resp_code = 302;
+            mg_http_reply(c, resp_code, "Location: /index.html\r\n", "");
         }
         else {
-            mg_http_reply(c, 404, NULL, "Not found\n");        
+            struct mg_http_serve_opts opts = {
+                .root_dir = "/",
+                .fs = &mg_fs_packed
+            };
+            mg_http_serve_dir(c, ev_data, &opts);
         }
     }
+    else if ( mg_vcmp( uri, "/") == 0 ) { // non-html request for homepage
+        resp_code = 200;
+        mg_http_reply(c, resp_code, "",
+                      "Welcome to %s api server. All endpoints start with '/blink1'.\r\n",
+                      blink1_server_name);
+    }
+    else {
+        mg_http_reply(c, 404, NULL, "Not found\n");        
+    }
 
     // access logging
     if( enable_logging ) { 
+        char uri_str[1000];
+        snprintf(uri_str, sizeof(uri_str), "%.*s", (int)uri->len, uri->ptr);
         log_access(c, uri_str, resp_code);
     }
 }
 
 // ----------------------------------------------------------------------
 
+// tests/bench-blink1-tiny-server.c includes this file without main()
+#ifndef BLINK1_SERVER_NO_MAIN
+
 // Handle interrupts, like Ctrl-C
 static int s_signo;
 static void signal_handler(int signo) {
@@ -762,24 +2669,26 @@ int main(int argc, char *argv[]) {
         snprintf(pattern_status, sizeof(pattern_status), "bad patterns file");
         patterns_json_fname[0] = 0;  // fall through to built-in patterns
     }
-    json_patterns_obj_val = json_parse_file(patterns_json_fname);
-    json_patterns_obj     = json_value_get_object(json_patterns_obj_val);
+    JSON_Value* json_patterns_val = json_parse_file(patterns_json_fname);
+    JSON_Object* json_patterns_obj = json_value_get_object(json_patterns_val);
            
-    if( json_patterns_obj_val == NULL ) {  // error or no file
-        // populate the system patterns array into a JSON dict object
-        int cnt = sizeof(blink1_patterns)/sizeof(blink1_pattern_info);
-        json_patterns_obj_val = json_value_init_object();
-        json_patterns_obj = json_object(json_patterns_obj_val);
-        for(int i=0; i<cnt; i++) { 
-            json_object_set_string(json_patterns_obj,
-                                   blink1_patterns[i].name,
-                                   blink1_patterns[i].str);
+    if( json_patterns_obj == NULL ) {  // error or no file
+        // the built-in patterns, parsed at build time
+        for(int i=0; i<blink1_builtin_patterns.count; i++) {
+            pattern_set_builtin(&blink1_builtin_patterns.patterns[i]);
         }
         snprintf(pattern_status, sizeof(pattern_status), "built-in-patterns");
     }
     else {
+        size_t n = json_object_get_count(json_patterns_obj);
+        for(size_t i=0; i<n; i++) { 
+            const char* name = json_object_get_name(json_patterns_obj, i);
+            const char* str  = json_object_get_string(json_patterns_obj, name);
+            if( str ) pattern_set(name, str);
+        }
         snprintf(pattern_status, sizeof(pattern_status), "patterns:%s", patterns_json_fname);
     }
+    json_value_free(json_patterns_val);
 
     
     printf("%s version %s: running on http://%s:%d/ (%s, %s)\n",
@@ -794,24 +2703,57 @@ int main(int argc, char *argv[]) {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
+    if( routes_init() != 0 ) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    blink1_setPoolIdleMillis(idle_atime);
+    blink1_hotplugRegister(hotplug_handler, NULL);
+    hotplug = (blink1_hotplugStart() >= 0);
+
     mg_mgr_init(&mgr);
 
     if ((c = mg_http_listen(&mgr, http_listen_url, ev_handler, &mgr)) == NULL) {
         MG_LOG(MG_LL_ERROR, ("Cannot listen on %s.", http_listen_url));
         exit(EXIT_FAILURE);
     }
+    // blink1 I/O workers wake the event loop when they finish a job
+    if( !mg_wakeup_init(&mgr) ) {
+        MG_LOG(MG_LL_ERROR, ("Cannot set up wakeups."));
+        exit(EXIT_FAILURE);
+    }
+    server_mgr = &mgr;
+    server_wakeup_id = c->id;
+    mg_timer_add(&mgr, EVENTS_PING_MILLIS, MG_TIMER_REPEAT, events_ping, NULL);
 
     while (s_signo == 0) {
-        mg_mgr_poll(&mgr, 1000);
-        cache_flush(idle_atime);
+        mg_mgr_poll(&mgr, effects_wait(1000));
+        jobs_finish();
+        effects_run();
+        blink1_hotplugPoll();
+        blink1_poolFlush(idle_atime);
+    }
+    effects_free();
+    while( jobs_pending > 0 ) {  // let blink1s finish what they were sent
+        mg_mgr_poll(&mgr, 50);
+        jobs_finish();
     }
     mg_mgr_free(&mgr);
+    blink1_hotplugStop();
 
     if(patterns_json_fname[0] !=0 ) {
         printf("Saving patterns to %s\n", patterns_json_fname);
-        json_serialize_to_file_pretty(json_patterns_obj_val, patterns_json_fname);
+        JSON_Value* json_patterns_val = patterns_to_json();
+        json_serialize_to_file_pretty(json_patterns_val, patterns_json_fname);
+        json_value_free(json_patterns_val);
     }
-    json_value_free(json_patterns_obj_val);
+    patterns_free();
+    routes_free();
+    ws_streams_free();
+    devices_free();
+    job_pool_free();
+    reply_pool_free();
 
     return 0;
 }
+#endif // BLINK1_SERVER_NO_MAIN
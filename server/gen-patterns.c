@@ -0,0 +1,111 @@
+/*
+ * gen-patterns -- turn blink1-lib-patterns.def into C
+ *
+ * Parses every built-in pattern with blink1_parsePatternN() and builds
+ * a minimal perfect hash over their names with blink1_patternTableBuild(),
+ * then writes both out as blink1_builtin_patterns (see blink1-lib-patterns.h)
+ *
+ * usage: gen-patterns <output.c>
+ *
+ * Its output, server/blink1-lib-patterns-builtin.c, is checked in so cross
+ * builds don't need to run it; regenerate it after editing the .def with
+ * "make patterns-builtin" or the CMake patterns-builtin target
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blink1-lib.h"
+#include "blink1-lib-patterns.h"
+
+static const char* const names[] = {
+#define BLINK1_PATTERN(name, str) name,
+#include "blink1-lib-patterns.def"
+#undef BLINK1_PATTERN
+};
+
+static const char* const strs[] = {
+#define BLINK1_PATTERN(name, str) str,
+#include "blink1-lib-patterns.def"
+#undef BLINK1_PATTERN
+};
+
+#define npatterns  ((int)(sizeof(names) / sizeof(names[0])))
+
+// s as a C string literal
+static void put_str( FILE* fp, const char* s )
+{
+    fputc( '"', fp );
+    for( ; *s; s++ ) {
+        if( *s == '"' || *s == '\\' ) fputc( '\\', fp );
+        fputc( *s, fp );
+    }
+    fputc( '"', fp );
+}
+
+int main( int argc, char** argv )
+{
+    if( argc != 2 ) {
+        fprintf(stderr, "usage: gen-patterns <output.c>\n");
+        return 1;
+    }
+    patternline_t lines[npatterns][blink1_cpattern_max];
+    int lens[npatterns], repeats[npatterns];
+    for( int i=0; i < npatterns; i++ ) {
+        blink1_parse_error err;
+        lens[i] = blink1_parsePatternN( strs[i], strlen(strs[i]), &repeats[i],
+                                        lines[i], blink1_cpattern_max, &err );
+        if( lens[i] < 1 ) {
+            fprintf(stderr, "gen-patterns: pattern '%s': %s at char %d\n",
+                    names[i], (err.msg) ? err.msg : "no lines", err.offset);
+            return 1;
+        }
+    }
+
+    int nbuckets = npatterns/2 + 1;
+    uint16_t disp[npatterns/2 + 1];
+    int16_t slots[npatterns];
+    if( blink1_patternTableBuild( names, npatterns, nbuckets, disp, slots ) != 0 ) {
+        fprintf(stderr, "gen-patterns: no perfect hash, are two names the same?\n");
+        return 1;
+    }
+
+    FILE* fp = fopen( argv[1], "w" );
+    if( fp == NULL ) {
+        perror( argv[1] );
+        return 1;
+    }
+    fprintf(fp, "// generated from blink1-lib-patterns.def by server/gen-patterns.c, do not edit\n\n");
+    fprintf(fp, "#include \"blink1-lib-patterns.h\"\n\n");
+    for( int i=0; i < npatterns; i++ ) {
+        fprintf(fp, "static const patternline_t lines%d[] = {\n", i);
+        for( int j=0; j < lens[i]; j++ ) {
+            patternline_t* p = &lines[i][j];
+            fprintf(fp, "    { {0x%02x,0x%02x,0x%02x}, %u, %u },\n",
+                    p->color.r, p->color.g, p->color.b, p->millis, p->ledn);
+        }
+        fprintf(fp, "};\n");
+    }
+    fprintf(fp, "\nstatic const blink1_pattern_info patterns[%d] = {\n", npatterns);
+    for( int i=0; i < npatterns; i++ ) {
+        fprintf(fp, "    { ");
+        put_str( fp, names[i] );
+        fprintf(fp, ", ");
+        put_str( fp, strs[i] );
+        fprintf(fp, ", %d, %d, lines%d },\n", repeats[i], lens[i], i);
+    }
+    fprintf(fp, "};\n\nstatic const int16_t slots[%d] = {", npatterns);
+    for( int i=0; i < npatterns; i++ ) fprintf(fp, "%s%s%d", (i) ? "," : "", (i % 16) ? " " : "\n    ", slots[i]);
+    fprintf(fp, "\n};\n\nstatic const uint16_t disp[%d] = {", nbuckets);
+    for( int i=0; i < nbuckets; i++ ) fprintf(fp, "%s%s%u", (i) ? "," : "", (i % 16) ? " " : "\n    ", disp[i]);
+    fprintf(fp, "\n};\n\n");
+    fprintf(fp, "const blink1_pattern_table blink1_builtin_patterns = {\n");
+    fprintf(fp, "    patterns, %d, slots, disp, %d\n};\n", npatterns, nbuckets);
+    if( fclose( fp ) != 0 ) {
+        perror( argv[1] );
+        return 1;
+    }
+    return 0;
+}
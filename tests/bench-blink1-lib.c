@@ -0,0 +1,547 @@
+/*
+ * tests/bench-blink1-lib.c -- throughput benchmarks for blink1-lib
+ *
+ * Build & run via: make bench-blink1-lib
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../blink1-lib.h"
+#include "../blink1-lib-patterns.h"
+
+// ---------------------------------------------------------------------------
+// Minimal bench harness
+// ---------------------------------------------------------------------------
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define REPORT(label, n, secs) \
+    printf("%-40s %8d ops %8.3f s %12.1f ops/sec\n", label, (int)(n), secs, (n)/(secs))
+
+// ---------------------------------------------------------------------------
+// registry lookups vs number of devices (no hardware needed)
+// ---------------------------------------------------------------------------
+
+static void bench_registry_fill(int ndevs)
+{
+    char path[32], serial[16];
+    while( blink1_getCachedCount() ) blink1_cacheRemove(0);
+    for( int i=0; i<ndevs; i++ ) {
+        snprintf(path, sizeof(path), "virtual:%d", i);
+        snprintf(serial, sizeof(serial), "%X", 0x30000000 + i*7919);
+        blink1_cacheAdd(path, serial);
+    }
+}
+
+#define BENCH_MAX_DEVICES 500
+
+static void bench_registry(void)
+{
+    const int sizes[] = { 1, 4, 16, 32, 128, BENCH_MAX_DEVICES };
+    const int n = 1000000;
+    static char serials[BENCH_MAX_DEVICES][16];
+    static char paths[BENCH_MAX_DEVICES][32];
+    static blink1_device* devs[BENCH_MAX_DEVICES];
+    volatile int sink = 0;
+    double t;
+
+    // virtual devices so there are real handles to look up
+    blink1_transport* vt = blink1_virtualNew();
+    for( int i=0; i<BENCH_MAX_DEVICES; i++ ) {
+        snprintf(serials[i], sizeof(serials[i]), "%X", 0x30000000 + i*7919);
+        blink1_virtualAdd(vt, serials[i]);
+    }
+    blink1_setTransport(vt);
+
+    t = now_secs();
+    bench_registry_fill(BENCH_MAX_DEVICES);
+    REPORT("cacheAdd, 500 devices", BENCH_MAX_DEVICES, now_secs() - t);
+
+    printf("%-10s %14s %14s %14s\n", "devices", "bySerial ns", "byPath ns", "byDev ns");
+    for( unsigned s=0; s < sizeof(sizes)/sizeof(sizes[0]); s++ ) {
+        int ndevs = sizes[s];
+        bench_registry_fill(ndevs);
+        for( int i=0; i<ndevs; i++ ) {
+            strcpy(serials[i], blink1_getCachedSerial(i));
+            strcpy(paths[i], blink1_getCachedPath(i));
+            devs[i] = blink1_openByPath(paths[i]);
+        }
+        double t0 = now_secs();
+        for( int i=0; i<n; i++ ) sink += blink1_getCacheIndexBySerial(serials[i % ndevs]);
+        double t1 = now_secs();
+        for( int i=0; i<n; i++ ) sink += blink1_getCacheIndexByPath(paths[i % ndevs]);
+        double t2 = now_secs();
+        for( int i=0; i<n; i++ ) sink += blink1_getCacheIndexByDev(devs[i % ndevs]);
+        double t3 = now_secs();
+        printf("%-10d %14.1f %14.1f %14.1f\n", ndevs,
+               (t1-t0)*1e9/n, (t2-t1)*1e9/n, (t3-t2)*1e9/n);
+        for( int i=0; i<ndevs; i++ ) blink1_close(devs[i]);
+    }
+    blink1_setTransport(NULL);
+    blink1_virtualFree(vt);
+    (void)sink;
+}
+
+// ---------------------------------------------------------------------------
+// enumerate and open many virtual devices
+// ---------------------------------------------------------------------------
+
+static void bench_virtual_open(void)
+{
+    const int ndevs = BENCH_MAX_DEVICES;
+    char serial[16];
+    double t;
+
+    blink1_transport* vt = blink1_virtualNew();
+    for( int i=0; i<ndevs; i++ ) {
+        snprintf(serial, sizeof(serial), "%X", 0x30000000 + i);
+        blink1_virtualAdd(vt, serial);
+    }
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+
+    t = now_secs();
+    int found = blink1_ctxEnumerate(ctx);
+    REPORT("enumerate, 500 virtual devices", found, now_secs() - t);
+
+    blink1_device** devs = malloc( ndevs * sizeof(blink1_device*) );
+    t = now_secs();
+    int opened = 0;
+    for( int i=0; i<ndevs; i++ ) {
+        devs[i] = blink1_ctxOpenById(ctx, i);
+        if( devs[i] ) opened++;
+    }
+    REPORT("openById, 500 virtual devices", opened, now_secs() - t);
+
+    t = now_secs();
+    blink1_fadeToRGBMany(devs, ndevs, 0, 255, 0, 0, 0, NULL);
+    REPORT("fadeToRGBMany, 500 virtual devices", ndevs, now_secs() - t);
+
+    for( int i=0; i<ndevs; i++ ) blink1_close(devs[i]);
+    free(devs);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// ---------------------------------------------------------------------------
+// blink1_write() cost with I/O stats off vs on (zero-latency virtual device)
+// ---------------------------------------------------------------------------
+
+static void bench_iostats(void)
+{
+    const int n = 1000000;
+    double t;
+
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "30000000");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+
+    for( int on=0; on<2; on++ ) {
+        blink1_ctxSetIoStats(ctx, on);
+        blink1_device* dev = blink1_ctxOpenById(ctx, 0);
+        t = now_secs();
+        for( int i=0; i<n; i++ ) blink1_fadeToRGB(dev, 0, i, 0, 0);
+        REPORT( (on) ? "fadeToRGB, I/O stats on" : "fadeToRGB, I/O stats off",
+                n, now_secs() - t );
+        blink1_close(dev);
+    }
+
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// ---------------------------------------------------------------------------
+// pattern parsing: blink1_parsePatternN() vs the strtok()-based parser it
+// replaced, copied here as-is so there's something to compare against
+// ---------------------------------------------------------------------------
+
+#include <ctype.h>
+
+static int old_hexread(uint8_t *buffer, char *string, int buflen)
+{
+    char    *s;
+    int     pos = 0;
+    if( string==NULL ) return -1;
+    memset(buffer,0,buflen);
+    while((s = strtok(string, ", ")) != NULL && pos < buflen){
+        string = NULL;
+        buffer[pos++] = (char)strtol(s, NULL, 0);
+    }
+    return pos;
+}
+
+static void old_remove_whitespace(char *str)
+{
+    char *p;
+    size_t len = strlen(str);
+
+    for(p = str; *p; p ++, len --) {
+        while(isspace(*p)) memmove(p, p+1, len--);
+    }
+}
+
+static void old_parsecolor(rgb_t* color, char* colorstr)
+{
+    if(strlen(colorstr) == 8 && colorstr[0]=='0' && tolower(colorstr[1])=='x') {
+        colorstr +=2;
+    }
+    if( strchr(colorstr,',')==NULL && (colorstr[0] == '#' || strlen(colorstr)==6) ) {
+        colorstr = (colorstr[0] == '#') ? colorstr+1 : colorstr;
+        uint32_t colorint = strtol(colorstr, NULL, 16);
+        color->r = (colorint >> 16) & 0xff;
+        color->g = (colorint >>  8) & 0xff;
+        color->b = (colorint >>  0) & 0xff;
+    } else {
+        old_hexread((uint8_t*)color, colorstr, 3);
+    }
+}
+
+static int old_parsePattern(char* pattstr, int* repeats, patternline_t* pattern)
+{
+    char str[1000];
+    sprintf(str, "%s", pattstr);
+
+    old_remove_whitespace(str);
+    char* s;
+    s = strtok( str, ", ");
+    if(  s != NULL ) {
+      *repeats = strtol(s,NULL,0);
+    }
+    int i=0;
+    s = strtok(NULL, ",");
+    while( s != NULL ) {
+        old_parsecolor(&pattern[i].color, s);
+        s = strtok(NULL, ",");
+        if( s == NULL ) return -1;
+        pattern[i].millis = atof(s) * 1000;
+        s = strtok(NULL, ",");
+        if( s == NULL ) return -1;
+        pattern[i].ledn = strtol(s,NULL,0);
+        i++;
+        s = strtok(NULL, ",");
+        if( s == NULL ) break;
+    }
+    return i;
+}
+
+static void bench_parse(void)
+{
+    const int n = 200000;
+    static char big[1000];
+    patternline_t pattern[32];
+    int repeats;
+    volatile int sink = 0;
+    double t;
+
+    const char* shortpatt = "3,#ff0000,0.5,0,#000000,0.5,0";
+    strcpy(big, "6");
+    for( int i=0; i<32; i++ ) strcat(big, (i & 1) ? ", #00ff80, 0.25, 2" : ",#ff0000,0.3,1");
+    const char* patts[2] = { shortpatt, big };
+    const char* names[2] = { "2 lines", "32 lines, with spaces" };
+
+    for( int p=0; p<2; p++ ) {
+        char label[80];
+        size_t len = strlen(patts[p]);
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += old_parsePattern((char*)patts[p], &repeats, pattern);
+        snprintf(label, sizeof(label), "old parsePattern, %s", names[p]);
+        REPORT(label, n, now_secs() - t);
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += blink1_parsePatternN(patts[p], len, &repeats, pattern, 32, NULL);
+        snprintf(label, sizeof(label), "parsePatternN, %s", names[p]);
+        REPORT(label, n, now_secs() - t);
+    }
+    (void)sink;
+}
+
+// ---------------------------------------------------------------------------
+// named pattern lookup: linear strcmp() scan vs perfect hash vs runtime index
+// ---------------------------------------------------------------------------
+
+static const char* const bench_pattnames[] = {
+#define BLINK1_PATTERN(name, str) name,
+#include "../blink1-lib-patterns.def"
+#undef BLINK1_PATTERN
+};
+#define bench_npatts  ((int)(sizeof(bench_pattnames) / sizeof(bench_pattnames[0])))
+
+// what blink1_pattern_find() did before
+static int old_pattern_find(const char* name)
+{
+    for( int i=0; i < bench_npatts; i++ ) {
+        if( strcmp(bench_pattnames[i], name) == 0 ) return i;
+    }
+    return -1;
+}
+
+static void bench_patterns(void)
+{
+    const int n = 2000000;
+    static blink1_pattern_info infos[64];
+    static uint16_t disp[64];
+    static int16_t slots[64];
+    static char missbuf[64][24];
+    const char* misses[64];
+    volatile int sink = 0;
+    double t;
+
+    for( int i=0; i < bench_npatts; i++ ) {
+        infos[i].name = bench_pattnames[i];
+        snprintf(missbuf[i], sizeof(missbuf[i]), "%s_", bench_pattnames[i]);
+        misses[i] = missbuf[i];
+    }
+    int nbuckets = bench_npatts/2 + 1;
+    blink1_patternTableBuild(bench_pattnames, bench_npatts, nbuckets, disp, slots);
+    blink1_pattern_table table = { infos, bench_npatts, slots, disp, nbuckets };
+    blink1_pattern_index ix;
+    blink1_patternIndexInit(&ix);
+    for( int i=0; i < bench_npatts; i++ ) blink1_patternIndexPut(&ix, bench_pattnames[i], i);
+
+    for( int m=0; m<2; m++ ) {
+        const char* const* keys = (m) ? misses : bench_pattnames;
+        const char* what = (m) ? "miss" : "hit";
+        char label[80];
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += old_pattern_find(keys[i % bench_npatts]);
+        snprintf(label, sizeof(label), "pattern by name, strcmp scan, %s", what);
+        REPORT(label, n, now_secs() - t);
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += blink1_patternTableGet(&table, keys[i % bench_npatts]);
+        snprintf(label, sizeof(label), "pattern by name, perfect hash, %s", what);
+        REPORT(label, n, now_secs() - t);
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += blink1_patternIndexGet(&ix, keys[i % bench_npatts]);
+        snprintf(label, sizeof(label), "pattern by name, index, %s", what);
+        REPORT(label, n, now_secs() - t);
+    }
+    blink1_patternIndexFree(&ix);
+    (void)sink;
+}
+
+// ---------------------------------------------------------------------------
+// color pipeline: batch kernels vs the one-pixel functions, in pixels/sec
+// ---------------------------------------------------------------------------
+
+#define PREPORT(label, n, secs) \
+    printf("%-40s %8d px  %8.3f s %12.1f Mpx/sec\n", label, (int)(n), secs, (n)/(secs)/1e6)
+
+static void bench_color(void)
+{
+    const int npx = 4096, reps = 2000;
+    const double total = (double)npx * reps;
+    static uint8_t hsb[4096*3];
+    static rgb_t px[4096];
+    volatile int sink = 0;
+    double t;
+
+    srand(1);
+    for( int i=0; i<npx*3; i++ ) hsb[i] = rand() & 0xff;
+
+    t = now_secs();
+    for( int k=0; k<reps; k++ ) {
+        for( int i=0; i<npx; i++ ) hsbtorgb( &px[i], &hsb[3*i] );
+        sink += px[k % npx].r;
+    }
+    PREPORT("hsbtorgb, per pixel", total, now_secs() - t);
+    t = now_secs();
+    for( int k=0; k<reps; k++ ) {
+        blink1_hsbtorgbMany( px, hsb, npx );
+        sink += px[k % npx].r;
+    }
+    PREPORT("hsbtorgbMany", total, now_secs() - t);
+
+    t = now_secs();
+    for( int k=0; k<reps; k++ ) {
+        for( int i=0; i<npx; i++ ) blink1_adjustBrightness( 200, &px[i].r, &px[i].g, &px[i].b );
+        sink += px[k % npx].r;
+    }
+    PREPORT("adjustBrightness, per pixel", total, now_secs() - t);
+    t = now_secs();
+    for( int k=0; k<reps; k++ ) {
+        blink1_adjustBrightnessMany( 200, px, npx );
+        sink += px[k % npx].r;
+    }
+    PREPORT("adjustBrightnessMany", total, now_secs() - t);
+
+    t = now_secs();
+    for( int k=0; k<reps; k++ ) {
+        for( int i=0; i<npx; i++ ) {
+            px[i].r = blink1_degamma( px[i].r );
+            px[i].g = blink1_degamma( px[i].g );
+            px[i].b = blink1_degamma( px[i].b );
+        }
+        sink += px[k % npx].r;
+    }
+    PREPORT("degamma, per pixel", total, now_secs() - t);
+    t = now_secs();
+    for( int k=0; k<reps; k++ ) {
+        blink1_degammaMany( px, npx );
+        sink += px[k % npx].r;
+    }
+    PREPORT("degammaMany", total, now_secs() - t);
+    (void)sink;
+}
+
+// use attached blink(1)s if there are any, else virtual ones that take
+// about as long per report as a real USB round trip, and per open or
+// close as a real hid_open()/hid_close()
+#define BENCH_VIRTUAL_DEVICES 24
+#define BENCH_VIRTUAL_LATENCY 1000
+#define BENCH_VIRTUAL_OPEN_LATENCY 3000
+
+static void bench_setup(void)
+{
+    int n = blink1_enumerate();
+    if( n > 0 ) {
+        printf("using %d blink(1) device(s)\n", n);
+        return;
+    }
+    char serial[16];
+    blink1_transport* vt = blink1_virtualNew();
+    for( int i=0; i<BENCH_VIRTUAL_DEVICES; i++ ) {
+        snprintf(serial, sizeof(serial), "%X", 0x30000000 + i);
+        blink1_virtualAdd(vt, serial);
+    }
+    blink1_virtualSetLatency(vt, BENCH_VIRTUAL_LATENCY);
+    blink1_virtualSetOpenLatency(vt, BENCH_VIRTUAL_OPEN_LATENCY);
+    blink1_setTransport(vt);
+    printf("no blink(1) found, using %d virtual devices, "
+           "%d us per report, %d us per open/close\n",
+           BENCH_VIRTUAL_DEVICES, BENCH_VIRTUAL_LATENCY, BENCH_VIRTUAL_OPEN_LATENCY);
+}
+
+// ---------------------------------------------------------------------------
+// handle pool vs open/close per command
+// ---------------------------------------------------------------------------
+
+static void bench_pool(void)
+{
+    const int n = 200;
+    double t;
+
+    if( blink1_enumerate() == 0 ) {
+        printf("bench_pool: no blink(1) found, skipping\n");
+        return;
+    }
+
+    t = now_secs();
+    for( int i=0; i<n; i++ ) {
+        blink1_device* dev = blink1_openById(0);
+        blink1_fadeToRGB(dev, 0, i&0xff, 0, 0);
+        blink1_close(dev);
+    }
+    REPORT("fadeToRGB, open/close per command", n, now_secs() - t);
+
+    t = now_secs();
+    for( int i=0; i<n; i++ ) {
+        blink1_device* dev = blink1_acquireById(0);
+        blink1_fadeToRGB(dev, 0, 0, i&0xff, 0);
+        blink1_release(dev);
+    }
+    REPORT("fadeToRGB, pooled handle", n, now_secs() - t);
+
+    blink1_poolFlush(0);
+}
+
+// ---------------------------------------------------------------------------
+// multi-device fade, sequential vs fan-out
+// ---------------------------------------------------------------------------
+
+static void bench_fanout(void)
+{
+    const int n = 100;
+    int ndevs = blink1_enumerate();
+    double t;
+
+    if( ndevs < 2 ) {
+        printf("bench_fanout: need 2+ blink(1)s, skipping\n");
+        return;
+    }
+    blink1_device** devs = malloc( ndevs * sizeof(blink1_device*) );
+    for( int i=0; i<ndevs; i++ ) devs[i] = blink1_acquireById(i);
+
+    t = now_secs();
+    for( int i=0; i<n; i++ ) {
+        for( int j=0; j<ndevs; j++ ) blink1_fadeToRGBN(devs[j], 0, i&0xff, 0, 0, 0);
+    }
+    REPORT("fadeToRGBN, each device in turn", n, now_secs() - t);
+
+    t = now_secs();
+    for( int i=0; i<n; i++ ) {
+        blink1_fadeToRGBMany(devs, ndevs, 0, 0, i&0xff, 0, 0, NULL);
+    }
+    REPORT("fadeToRGBMany, all devices", n, now_secs() - t);
+
+    for( int i=0; i<ndevs; i++ ) blink1_release(devs[i]);
+    free(devs);
+    blink1_poolFlush(0);
+}
+
+// ---------------------------------------------------------------------------
+// burst of fades: sync vs async queue with coalescing
+// ---------------------------------------------------------------------------
+
+static void bench_coalesce(void)
+{
+    const int n = 1000;
+    blink1_async_stats st;
+    double t;
+
+    if( blink1_enumerate() == 0 ) {
+        printf("bench_coalesce: no blink(1) found, skipping\n");
+        return;
+    }
+    blink1_device* dev = blink1_acquireById(0);
+
+    t = now_secs();
+    for( int i=0; i<n; i++ ) {
+        blink1_fadeToRGBN(dev, 100, i&0xff, 0, 0, 1);
+    }
+    REPORT("fadeToRGBN burst, sync", n, now_secs() - t);
+
+    t = now_secs();
+    for( int i=0; i<n; i++ ) {
+        blink1_asyncFadeToRGBN(dev, 100, 0, i&0xff, 0, 1, NULL, NULL);
+    }
+    blink1_asyncFlush(dev);
+    REPORT("fadeToRGBN burst, async coalesced", n, now_secs() - t);
+    blink1_asyncGetStats(dev, &st);
+    printf("  %d fades, %llu reports sent, %llu coalesced, max latency %llu us\n",
+           n, (unsigned long long)(st.completed - st.coalesced),
+           (unsigned long long)st.coalesced,
+           (unsigned long long)st.latencyMaxMicros);
+
+    blink1_asyncStop(dev);
+    blink1_release(dev);
+    blink1_poolFlush(0);
+}
+
+// ---------------------------------------------------------------------------
+
+int main(void)
+{
+    msg_setquiet(1);
+
+    bench_parse();
+    bench_patterns();
+    bench_color();
+    bench_registry();
+    bench_virtual_open();
+    bench_iostats();
+    bench_setup();
+    bench_pool();
+    bench_fanout();
+    bench_coalesce();
+
+    return 0;
+}
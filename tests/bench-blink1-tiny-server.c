@@ -0,0 +1,248 @@
+/*
+ * tests/bench-blink1-tiny-server.c -- request benchmarks for
+ * blink1-tiny-server: finding the route and parsing its query args, and
+ * writing the JSON reply, without running the route, so no blink(1) I/O
+ * is timed
+ *
+ * Build & run via: make bench-blink1-tiny-server
+ */
+
+#define BLINK1_SERVER_NO_MAIN
+// only the routing part of the server is used here
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wunused-variable"
+#include "../server/blink1-tiny-server.c"
+
+// ---------------------------------------------------------------------------
+// Minimal bench harness
+// ---------------------------------------------------------------------------
+
+static double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define REPORT(label, n, secs) \
+    printf("%-40s %8d ops %8.3f s %12.1f ops/sec\n", label, (int)(n), secs, (n)/(secs))
+
+// ---------------------------------------------------------------------------
+// what ev_handler() did before routes[]: every arg looked for with its own
+// mg_http_get_var() pass, then a chain of mg_vcmp()s for the endpoint
+// ---------------------------------------------------------------------------
+
+static const char* const old_paths[] = {
+    "/blink1", "/blink1/", "/blink1/lastColor", "/blink1/lastcolor",
+    "/blink1/id", "/blink1/id/", "/blink1/list", "/blink1/list/", "/blink1/enumerate",
+    "/blink1/off", "/blink1/on", "/blink1/red", "/blink1/green", "/blink1/blue",
+    "/blink1/cyan", "/blink1/yellow", "/blink1/magenta", "/blink1/fadeToRGB",
+    "/blink1/blink", "/blink1/pattern", "/blink1/patterns", "/blink1/pattern/",
+    "/blink1/patterns/", "/blink1/pattern/dump", "/blink1/pattern/add",
+    "/blink1/pattern/del", "/blink1/pattern/play", "/blink1/pattern/stop",
+    "/blink1/blinkserver", "/blink1/servertickle/on", "/blink1/servertickle/off",
+    "/blink1/random", "/blink1/effects", "/blink1/effects/", "/blink1/effects/cancel",
+};
+
+static int old_dispatch(struct mg_http_message* hm)
+{
+    uint32_t id=0;
+    uint8_t ledn=0, bright=0;
+    char tmpstr[1000] = "";
+    char pattstr[1000] = "";
+    char pnamestr[1000] = "";
+    int effect_id = 0;
+    uint16_t millis = 0;
+    rgb_t rgb = {0,0,0};
+    uint8_t count = 0;
+
+    JSON_Value *json_root_val = json_value_init_object();
+    JSON_Object *json_root_obj = json_value_get_object(json_root_val);
+    struct mg_str* uri = &hm->uri;
+    struct mg_str* querystr = &hm->query;
+
+    if( mg_http_get_var(querystr, "millis", tmpstr, sizeof(tmpstr)) > 0 ) {
+        millis = strtod(tmpstr,NULL);
+        json_object_set_number(json_root_obj, "millis", millis);
+    }
+    if( mg_http_get_var(querystr, "time", tmpstr, sizeof(tmpstr)) > 0 ) {
+        millis = 1000 * strtof(tmpstr,NULL);
+        json_object_set_number(json_root_obj, "millis", millis);
+    }
+    if( mg_http_get_var(querystr, "rgb", tmpstr, sizeof(tmpstr)) > 0 ) {
+        parsecolor( &rgb, tmpstr);
+        json_object_set_string(json_root_obj, "rgb", tmpstr);
+    }
+    if( mg_http_get_var(querystr, "count", tmpstr, sizeof(tmpstr)) > 0 ) {
+        count = strtod(tmpstr,NULL);
+        json_object_set_number(json_root_obj, "count", count);
+    }
+    if( mg_http_get_var(querystr, "id", tmpstr, sizeof(tmpstr)) > 0 ) {
+        char* pch = strtok(tmpstr, " ,");
+        if( pch != NULL ) id = strtol(pch,NULL,(strlen(pch)==8) ? 16:0);
+    }
+    if( mg_http_get_var(querystr, "blink1_id", tmpstr, sizeof(tmpstr)) > 0 ) {
+        char* pch = strtok(tmpstr, " ,");
+        if( pch != NULL ) id = strtol(pch,NULL,(strlen(pch)==8) ? 16:0);
+    }
+    if( mg_http_get_var(querystr, "ledn", tmpstr, sizeof(tmpstr)) > 0 ) {
+        ledn = strtod(tmpstr,NULL);
+        json_object_set_number(json_root_obj, "ledn", ledn);
+    }
+    if( mg_http_get_var(querystr, "bright", tmpstr, sizeof(tmpstr)) > 0 ) {
+        bright = strtod(tmpstr,NULL);
+        json_object_set_number(json_root_obj, "bright", bright);
+    }
+    if( mg_http_get_var(querystr, "pattern", tmpstr, sizeof(tmpstr)) > 0 ) {
+        strcpy(pattstr, tmpstr);
+        json_object_set_string(json_root_obj, "pattern", pattstr);
+    }
+    if( mg_http_get_var(querystr, "pname", tmpstr, sizeof(tmpstr)) > 0 ) {
+        strcpy(pnamestr, tmpstr);
+        json_object_set_string(json_root_obj, "pname", pnamestr);
+    }
+    if( mg_http_get_var(querystr, "effect_id", tmpstr, sizeof(tmpstr)) > 0 ) {
+        effect_id = strtol(tmpstr,NULL,0);
+        json_object_set_number(json_root_obj, "effect_id", effect_id);
+    }
+
+    int route = -1;
+    for( int i=0; i < (int)(sizeof(old_paths)/sizeof(old_paths[0])); i++ ) {
+        if( mg_vcmp(uri, old_paths[i]) == 0 ) { route = i; break; }
+    }
+    json_value_free(json_root_val);
+    return route + id + ledn + bright + count + millis + effect_id + rgb.r;
+}
+
+static int new_dispatch(struct mg_http_message* hm)
+{
+    server_request r;
+    if( request_init(&r, hm) == NULL ) return -1;
+    int n = r.id + r.ledn + r.bright + r.count + r.millis + r.effect_id + r.rgb.r;
+    reply_free(r.reply);
+    return n;
+}
+
+// ---------------------------------------------------------------------------
+// what send_json() did before replies: a parson tree, serialized pretty,
+// sent as one chunk and an empty one
+// ---------------------------------------------------------------------------
+
+static void old_reply(struct mg_connection* c)
+{
+    char tmpstr[10];
+    JSON_Value* root = json_value_init_object();
+    JSON_Object* obj = json_value_get_object(root);
+    json_object_set_string(obj, "rgb", "#ff00ff");
+    json_object_set_number(obj, "millis", 100);
+    JSON_Value* array_val = json_value_init_array();
+    JSON_Array* array = json_value_get_array(array_val);
+    for( int i = 0; i < patterns_count; i++ ) {
+        JSON_Value* elem_val = json_value_init_object();
+        JSON_Object* elem_obj = json_value_get_object(elem_val);
+        json_object_set_string(elem_obj, "name", patterns[i].name);
+        json_object_set_string(elem_obj, "pattern", patterns[i].str);
+        json_array_append_value(array, elem_val);
+    }
+    json_object_set_value(obj, "patterns", array_val);
+    json_object_set_string(obj, "status", "blink1 pattern list");
+    json_object_set_string(obj, "version", blink1_server_version);
+    sprintf(tmpstr, "#%02x%02x%02x", 255, 0, 255);
+    json_object_set_string(obj, "rgb", tmpstr);
+    json_object_set_number(obj, "millis", 100);
+
+    mg_printf(c, "HTTP/1.1 %d OK\r\n", 200);
+    mg_printf(c, "Content-type: application/json\r\n");
+    mg_printf(c, "X-Content-Type-Options: nosniff\r\n");
+    mg_printf(c, "Transfer-Encoding: chunked\r\n\r\n");
+    char* json_string = json_serialize_to_string_pretty(root);
+    mg_http_printf_chunk(c, json_string);
+    json_free_serialized_string(json_string);
+    json_value_free(root);
+    mg_http_write_chunk(c, "", 0);
+}
+
+static void new_reply(struct mg_connection* c)
+{
+    rgb_t rgb = {255, 0, 255};
+    server_reply* reply = reply_new();
+    reply_set_string(reply, "rgb", "#ff00ff");
+    reply_set_number(reply, "millis", 100);
+    reply_set_writer(reply, "patterns", patterns_write, NULL);
+    send_json(c, reply, "blink1 pattern list", rgb, 100);
+}
+
+// ---------------------------------------------------------------------------
+// dispatch cost, per kind of request
+// ---------------------------------------------------------------------------
+
+static const struct { const char* uri; const char* query; const char* label; } reqs[] = {
+    { "/blink1/id",             "",                                       "/blink1/id" },
+    { "/blink1/fadeToRGB",      "rgb=%23ff00ff&time=1.0&id=0",            "/blink1/fadeToRGB, 3 args" },
+    { "/blink1/magenta",        "bright=127&ledn=2",                      "/blink1/magenta, 2 args" },
+    { "/blink1/pattern/play",   "pname=red+flash&count=3",                "/blink1/pattern/play, 2 args" },
+    { "/blink1/effects/cancel", "effect_id=3",                            "/blink1/effects/cancel, 1 arg" },
+    { "/index.html",            "",                                       "/index.html (not a route)" },
+};
+#define NREQS  ((int)(sizeof(reqs) / sizeof(reqs[0])))
+
+int main(void)
+{
+    const int n = 500000;
+    struct mg_http_message hms[NREQS];
+    volatile int sink = 0;
+    char label[80];
+    double t, t_old = 0, t_new = 0;
+
+    msg_setquiet(1);
+    routes_init();
+    memset(hms, 0, sizeof(hms));
+    for( int k=0; k < NREQS; k++ ) {
+        hms[k].uri = mg_str(reqs[k].uri);
+        hms[k].query = mg_str(reqs[k].query);
+    }
+
+    for( int k=0; k < NREQS; k++ ) {
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += old_dispatch(&hms[k]);
+        t = now_secs() - t;
+        t_old += t;
+        snprintf(label, sizeof(label), "old %s", reqs[k].label);
+        REPORT(label, n, t);
+        t = now_secs();
+        for( int i=0; i<n; i++ ) sink += new_dispatch(&hms[k]);
+        t = now_secs() - t;
+        t_new += t;
+        snprintf(label, sizeof(label), "new %s", reqs[k].label);
+        REPORT(label, n, t);
+    }
+    REPORT("old, all of the above", n * NREQS, t_old);
+    REPORT("new, all of the above", n * NREQS, t_new);
+
+    // /blink1/patterns reply, the biggest one, into a connection's send buffer
+    struct mg_connection c;
+    memset(&c, 0, sizeof(c));
+    c.send.align = MG_IO_SIZE;
+    for( int i=0; i < blink1_builtin_patterns.count; i++ ) {
+        pattern_set_builtin(&blink1_builtin_patterns.patterns[i]);
+    }
+    const int nr = 50000;
+    t = now_secs();
+    for( int i=0; i<nr; i++ ) { old_reply(&c); c.send.len = 0; }
+    REPORT("old /blink1/patterns reply", nr, now_secs() - t);
+    t = now_secs();
+    for( int i=0; i<nr; i++ ) { new_reply(&c); c.send.len = 0; }
+    REPORT("new /blink1/patterns reply", nr, now_secs() - t);
+    old_reply(&c);
+    size_t old_len = c.send.len;
+    c.send.len = 0;
+    new_reply(&c);
+    printf("reply is %d bytes, was %d\n", (int)c.send.len, (int)old_len);
+
+    mg_iobuf_free(&c.send);
+    patterns_free();
+    reply_pool_free();
+    routes_free();
+    (void)sink;
+    return 0;
+}
@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+#
+# load_blink1_tiny_server.py -- simple load generator for blink1-tiny-server
+#
+# Sends requests over keep-alive connections from several threads and
+# reports requests/sec and latency.  Start the server first, e.g.:
+#   BLINK1_VIRTUAL=2 ./blink1-tiny-server --port 8000 --quiet &
+#   python3 tests/load_blink1_tiny_server.py --port 8000 --requests 20000
+#
+# With --ws it streams fades to /blink1/ws instead, at --rate per blink1
+# (0 for as fast as it can), and reports the rate fades were applied at
+# and the latency from sending one to its ack:
+#   python3 tests/load_blink1_tiny_server.py --port 8000 --ws --ids 0,1 --rate 60
+#
+# With --batch N each request is a POST to /blink1/batch of N fades spread
+# over --ids, to compare with N fadeToRGB requests:
+#   python3 tests/load_blink1_tiny_server.py --port 8000 --batch 20 --ids 0,1 --requests 200
+#
+
+import argparse
+import base64
+import http.client
+import json
+import os
+import socket
+import struct
+import threading
+import time
+
+DEFAULT_PATHS = [
+    "/blink1/id",
+    "/blink1/patterns",
+    "/blink1/fadeToRGB?rgb=%23ff00ff&millis=100",
+    "/blink1/lastColor",
+]
+
+def worker(host, port, paths, count, latencies, errors, body=None):
+    conn = http.client.HTTPConnection(host, port)
+    for i in range(count):
+        path = paths[i % len(paths)]
+        t = time.perf_counter()
+        try:
+            if body:
+                conn.request("POST", path, body)
+            else:
+                conn.request("GET", path)
+            resp = conn.getresponse()
+            resp.read()
+            if resp.status != 200:
+                errors.append(resp.status)
+        except (http.client.HTTPException, OSError) as e:
+            errors.append(str(e))
+            conn.close()
+            conn = http.client.HTTPConnection(host, port)
+            continue
+        latencies.append(time.perf_counter() - t)
+    conn.close()
+
+def report_latency(latencies):
+    latencies.sort()
+    n = len(latencies)
+    if n:
+        print(f"latency p50 {latencies[n//2]*1000:.2f} ms, p99 {latencies[min(n-1, n*99//100)]*1000:.2f} ms")
+
+def http_load(args):
+    paths = args.path or DEFAULT_PATHS
+    body = None
+    if args.batch:
+        ids = [int(i, 0) for i in args.ids.split(",")]
+        paths = ["/blink1/batch"]
+        body = json.dumps([{"op": "fade", "id": ids[i % len(ids)], "rgb": f"#{i:02x}00ff",
+                            "millis": args.millis} for i in range(args.batch)])
+    per_conn = args.requests // args.connections
+    latencies, errors = [], []
+    threads = [threading.Thread(target=worker,
+                                args=(args.host, args.port, paths, per_conn, latencies, errors, body))
+               for _ in range(args.connections)]
+    t = time.perf_counter()
+    for th in threads:
+        th.start()
+    for th in threads:
+        th.join()
+    secs = time.perf_counter() - t
+
+    n = len(latencies)
+    print(f"{n} requests, {args.connections} connections, {secs:.2f} s: {n/secs:.0f} req/sec")
+    if args.batch:
+        print(f"{n*args.batch/secs:.0f} fades/sec in batches of {args.batch}")
+    report_latency(latencies)
+    if errors:
+        print(f"{len(errors)} errors, first: {errors[0]}")
+
+#
+# --- WebSocket ----------------------------------------------------------------
+#
+
+class WebSocket:
+    """Just enough of a WebSocket client for /blink1/ws."""
+
+    def __init__(self, host, port, path):
+        self.sock = socket.create_connection((host, port))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        key = base64.b64encode(os.urandom(16)).decode()
+        self.sock.sendall((f"GET {path} HTTP/1.1\r\nHost: {host}:{port}\r\n"
+                           "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                           f"Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n\r\n").encode())
+        self.buf = b""
+        while b"\r\n\r\n" not in self.buf:
+            self._fill()
+        head, self.buf = self.buf.split(b"\r\n\r\n", 1)
+        if b" 101 " not in head.split(b"\r\n")[0]:
+            raise RuntimeError(f"no WebSocket upgrade: {head[:80]}")
+
+    def _fill(self):
+        data = self.sock.recv(65536)
+        if not data:
+            raise EOFError("connection closed")
+        self.buf += data
+
+    def _take(self, n):
+        while len(self.buf) < n:
+            self._fill()
+        data, self.buf = self.buf[:n], self.buf[n:]
+        return data
+
+    def send(self, data, binary):
+        if isinstance(data, str):
+            data = data.encode()
+        n = len(data)
+        head = bytes([0x80 | (2 if binary else 1)])
+        if n < 126:
+            head += bytes([0x80 | n])
+        elif n < 65536:
+            head += bytes([0x80 | 126]) + struct.pack(">H", n)
+        else:
+            head += bytes([0x80 | 127]) + struct.pack(">Q", n)
+        mask = os.urandom(4)
+        masked = (int.from_bytes(data, "big") ^
+                  int.from_bytes((mask * (n // 4 + 1))[:n], "big")).to_bytes(n, "big")
+        self.sock.sendall(head + mask + masked)
+
+    def recv(self):
+        """Return (opcode, payload) of the next message."""
+        b0, b1 = self._take(2)
+        n = b1 & 0x7f
+        if n == 126:
+            n = struct.unpack(">H", self._take(2))[0]
+        elif n == 127:
+            n = struct.unpack(">Q", self._take(8))[0]
+        return b0 & 0x0f, self._take(n)
+
+    def close(self):
+        self.sock.close()
+
+WS_STATUS = ["ok", "dropped", "error"]
+
+def ws_load(args):
+    ids = [int(i, 0) for i in args.ids.split(",")]
+    ws = WebSocket(args.host, args.port, "/blink1/ws")
+    op, hello = ws.recv()
+    print("server:", hello.decode())
+
+    sent = {}          # (id, seq) -> send time
+    counts = {"ok": 0, "dropped": 0, "error": 0}
+    latencies = []
+    nsent = 0
+    done = threading.Event()
+
+    def receiver():
+        while not done.is_set() or len(sent) > 0:
+            try:
+                op, msg = ws.recv()
+            except (EOFError, OSError):
+                return
+            now = time.perf_counter()
+            if op == 2:
+                acks = [struct.unpack("<IBBBBBBH", msg[i:i+12]) for i in range(0, len(msg), 12)]
+                acks = [(a[0], a[7], WS_STATUS[a[5]]) for a in acks]
+            else:
+                js = json.loads(msg)
+                if "ack" not in js:
+                    print("server:", js)
+                    continue
+                acks = [(js["id"], js["ack"], js["status"])]
+            for id, seq, status in acks:
+                counts[status] += 1
+                t = sent.pop((id, seq), None)
+                if t is not None and status == "ok":
+                    latencies.append(now - t)
+
+    rx = threading.Thread(target=receiver, daemon=True)
+    rx.start()
+    period = 1.0 / args.rate if args.rate > 0 else 0
+    t0 = time.perf_counter()
+    next_t = t0
+    seq = 0
+    while time.perf_counter() - t0 < args.seconds:
+        seq = (seq + 1) & 0xffff
+        r, g, b = (seq * 7) & 0xff, (seq * 13) & 0xff, (seq * 29) & 0xff
+        now = time.perf_counter()
+        for id in ids:
+            sent[(id, seq)] = now
+        if args.json:
+            msg = [{"id": id, "ledn": 0, "rgb": f"#{r:02x}{g:02x}{b:02x}",
+                    "millis": args.millis, "seq": seq} for id in ids]
+            ws.send(json.dumps(msg[0] if len(msg) == 1 else msg, separators=(",", ":")), False)
+        else:
+            ws.send(b"".join(struct.pack("<IBBBBHH", id, 0, r, g, b, args.millis, seq)
+                             for id in ids), True)
+        nsent += len(ids)
+        if period:
+            next_t += period
+            delay = next_t - time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+    secs = time.perf_counter() - t0
+    done.set()
+    rx.join(timeout=2)
+    ws.close()
+
+    print(f"{nsent} fades to {len(ids)} blink1s in {secs:.2f} s: sent {nsent/secs:.0f}/sec, "
+          f"applied {counts['ok']/secs:.0f}/sec ({counts['ok']/secs/len(ids):.0f}/sec per blink1)")
+    print(f"acks: {counts['ok']} applied, {counts['dropped']} dropped as stale, "
+          f"{counts['error']} errors, {len(sent)} missing")
+    report_latency(latencies)
+
+def main():
+    ap = argparse.ArgumentParser(description="load test blink1-tiny-server")
+    ap.add_argument("--host", default="localhost")
+    ap.add_argument("--port", type=int, default=8934)
+    ap.add_argument("--requests", type=int, default=10000, help="total requests")
+    ap.add_argument("--connections", type=int, default=4, help="keep-alive connections")
+    ap.add_argument("--path", action="append", help="path to request, may be repeated")
+    ap.add_argument("--ws", action="store_true", help="stream fades to /blink1/ws instead")
+    ap.add_argument("--batch", type=int, default=0, help="POST batches of this many fades instead")
+    ap.add_argument("--ids", default="0", help="--ws, --batch: comma-separated blink1 ids")
+    ap.add_argument("--rate", type=float, default=60, help="--ws: fades/sec per blink1, 0 for flat out")
+    ap.add_argument("--seconds", type=float, default=5, help="--ws: how long to stream")
+    ap.add_argument("--millis", type=int, default=0, help="--ws, --batch: fade time")
+    ap.add_argument("--json", action="store_true", help="--ws: JSON messages instead of binary")
+    args = ap.parse_args()
+    if args.ws:
+        ws_load(args)
+    else:
+        http_load(args)
+
+if __name__ == "__main__":
+    main()
@@ -9,6 +9,8 @@
 #include <stdint.h>
 #include <string.h>
 #include "../blink1-lib.h"
+#include "../blink1-lib-thread.h"
+#include "../blink1-lib-patterns.h"
 
 // ---------------------------------------------------------------------------
 // Minimal test harness
@@ -228,6 +230,66 @@ static void test_parsePattern(void)
     CHECK("parsePattern missing time → -1", n == -1);
 }
 
+// ---------------------------------------------------------------------------
+// blink1_parseColorN / blink1_parsePatternN
+// ---------------------------------------------------------------------------
+
+static void test_parseN(void)
+{
+    rgb_t c;
+    blink1_parse_error err;
+    patternline_t pattern[4];
+    int repeats, n;
+
+    CHECK("parseColorN view", blink1_parseColorN(&c, "#ff8001zzz", 7, &err) == 0 &&
+          c.r == 0xff && c.g == 0x80 && c.b == 1 && err.offset == -1);
+    CHECK("parseColorN list", blink1_parseColorN(&c, " 10, 0x20 030 ", 14, NULL) == 0 &&
+          c.r == 10 && c.g == 0x20 && c.b == 030);
+    CHECK("parseColorN bad hex offset", blink1_parseColorN(&c, "#ff0g00", 7, &err) == -1 &&
+          err.offset == 4);
+    CHECK("parseColorN too many values", blink1_parseColorN(&c, "1,2,3,4", 7, &err) == -1 &&
+          err.offset == 6);
+
+    const char* p = "3, #ff0000 ,0.5 , 1,#0000ff,1.2345,2,";
+    n = blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err);
+    CHECK("parsePatternN spaces, trailing comma", n == 2 && repeats == 3 &&
+          pattern[0].color.r == 255 && pattern[0].millis == 500 && pattern[0].ledn == 1);
+    CHECK("parsePatternN millis precision", pattern[1].millis == 1234 && pattern[1].ledn == 2);
+    CHECK("parsePatternN view", blink1_parsePatternN(p, 19, &repeats, pattern, 4, NULL) == 1);
+
+    p = "3,#ff0000,0.5x,0";
+    CHECK("parsePatternN bad time offset",
+          blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err) == -1 && err.offset == 13);
+    p = "3,#ff0000,1e-1,0,#0000ff,2.5E+1,1,#00ff00,125e-3,2";
+    n = blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err);
+    CHECK("parsePatternN time exponent", n == 3 && pattern[0].millis == 100 &&
+          pattern[1].millis == 25000 && pattern[2].millis == 125);
+    p = "3,#ff0000,1e,0";
+    CHECK("parsePatternN bad time exponent",
+          blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err) == -1 && err.offset == 12);
+    p = "3,#ff0000,1e5,0";
+    CHECK("parsePatternN time exponent too long",
+          blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err) == -1 && err.offset == 10);
+    p = "3,#ff0000,70,0";
+    CHECK("parsePatternN time too long",
+          blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err) == -1 && err.offset == 10);
+    p = "3,#ff0000,0.5,300";
+    CHECK("parsePatternN ledn range",
+          blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err) == -1 && err.offset == 14);
+    p = "x,#ff0000,0.5,0";
+    CHECK("parsePatternN bad repeats",
+          blink1_parsePatternN(p, strlen(p), &repeats, pattern, 4, &err) == -1 && err.offset == 0);
+
+    // any length when just counting, an error past maxlines
+    static char big[100*16 + 2];
+    strcpy(big, "0");
+    for( int i=0; i<100; i++ ) strcat(big, ",#010203,0.1,0");
+    CHECK("parsePatternN count", blink1_parsePatternN(big, strlen(big), &repeats, NULL, 0, NULL) == 100);
+    CHECK("parsePatternN maxlines",
+          blink1_parsePatternN(big, strlen(big), &repeats, pattern, 4, &err) == -1 &&
+          err.offset == 1 + 4*14 + 1);
+}
+
 // ---------------------------------------------------------------------------
 // toPatternString
 // ---------------------------------------------------------------------------
@@ -294,6 +356,930 @@ static void test_hsbtorgb(void)
     CHECK("hsbtorgb grayscale b=128", rgb.b == 128);
 }
 
+// ---------------------------------------------------------------------------
+// batch color kernels must match the one-pixel functions byte for byte
+// ---------------------------------------------------------------------------
+
+static void test_colorMany(void)
+{
+    // every h,s for one v at a time covers all 2^24 inputs
+    static uint8_t hsb[65536*3 + 3];
+    static rgb_t outm[65536 + 1], out1[65536 + 1];
+    int hsbOK = 1;
+    for( int v=0; v<256; v++ ) {
+        for( int i=0; i<65536; i++ ) {
+            hsb[3*i] = i >> 8; hsb[3*i+1] = i & 0xff; hsb[3*i+2] = v;
+        }
+        blink1_hsbtorgbMany( outm, hsb, 65536 );
+        for( int i=0; i<65536; i++ ) hsbtorgb( &out1[i], &hsb[3*i] );
+        if( memcmp(outm, out1, sizeof(rgb_t)*65536) != 0 ) { hsbOK = 0; break; }
+    }
+    CHECK("hsbtorgbMany matches hsbtorgb for all inputs", hsbOK);
+
+    // odd lengths and offsets exercise the scalar tails
+    int tailOK = 1;
+    for( size_t off=0; off<3; off++ ) {
+        for( size_t n=0; n<40; n++ ) {
+            memset( outm, 0xaa, sizeof(rgb_t)*48 );
+            blink1_hsbtorgbMany( outm + off, hsb + 3*(1000+off), n );
+            for( size_t i=0; i<n; i++ ) {
+                rgb_t c;
+                hsbtorgb( &c, &hsb[3*(1000+off+i)] );
+                if( memcmp(&c, &outm[off+i], sizeof(c)) != 0 ) tailOK = 0;
+            }
+            if( outm[off+n].r != 0xaa ) tailOK = 0;  // wrote past the end
+        }
+    }
+    CHECK("hsbtorgbMany tails and offsets", tailOK);
+
+    // every brightness on every channel value, with a ragged length
+    static rgb_t cols[257], ref[257];
+    int brightOK = 1;
+    for( int bright=0; bright<256; bright++ ) {
+        for( int i=0; i<257; i++ ) {
+            cols[i] = ref[i] = (rgb_t){ i & 0xff, (i*7) & 0xff, (255-i) & 0xff };
+            blink1_adjustBrightness( bright, &ref[i].r, &ref[i].g, &ref[i].b );
+        }
+        blink1_adjustBrightnessMany( bright, cols + 1, 256 );
+        if( memcmp(cols + 1, ref + 1, sizeof(rgb_t)*256) != 0 ) brightOK = 0;
+        if( cols[0].r != 0 || cols[0].g != 0 || cols[0].b != 255 ) brightOK = 0;
+    }
+    CHECK("adjustBrightnessMany matches adjustBrightness", brightOK);
+
+    int gammaOK = 1;
+    for( int n=0; n<=257; n += 1 + n/8 ) {
+        for( int i=0; i<257; i++ ) cols[i] = (rgb_t){ i & 0xff, (i*13) & 0xff, (i*101) & 0xff };
+        blink1_degammaMany( cols, n );
+        for( int i=0; i<257; i++ ) {
+            rgb_t c = { i & 0xff, (i*13) & 0xff, (i*101) & 0xff };
+            if( i < n ) c = (rgb_t){ blink1_degamma(c.r), blink1_degamma(c.g), blink1_degamma(c.b) };
+            if( memcmp(&c, &cols[i], sizeof(c)) != 0 ) gammaOK = 0;
+        }
+    }
+    CHECK("degammaMany matches degamma", gammaOK);
+
+    blink1_adjustBrightnessMany( 128, NULL, 5 );
+    blink1_degammaMany( NULL, 5 );
+    blink1_hsbtorgbMany( NULL, hsb, 5 );
+    CHECK("color batch NULL is a no-op", 1);
+}
+
+// ---------------------------------------------------------------------------
+// device registry (cache) lookups
+// ---------------------------------------------------------------------------
+
+static void test_registry(void)
+{
+    CHECK("cacheAdd a", blink1_cacheAdd("/dev/test-a", "2000ABCD") == 0);
+    CHECK("cacheAdd b", blink1_cacheAdd("/dev/test-b", "30001234") == 1);
+    CHECK("cacheAdd c", blink1_cacheAdd("/dev/test-c", "40000001") == 2);
+    CHECK("cacheAdd dup path", blink1_cacheAdd("/dev/test-b", "30001234") == 1);
+    CHECK("cached count 3", blink1_getCachedCount() == 3);
+
+    CHECK("bySerial", blink1_getCacheIndexBySerial("30001234") == 1);
+    CHECK("bySerial nocase", blink1_getCacheIndexBySerial("2000abcd") == 0);
+    CHECK("bySerial miss", blink1_getCacheIndexBySerial("12345678") == -1);
+    CHECK("byPath", blink1_getCacheIndexByPath("/dev/test-c") == 2);
+    CHECK("byPath miss", blink1_getCacheIndexByPath("/dev/nope") == -1);
+    CHECK("byPath empty", blink1_getCacheIndexByPath("") == -1);
+    CHECK("byId serial", blink1_getCacheIndexById(0x40000001) == 2);
+    CHECK("byDev NULL", blink1_getCacheIndexByDev(NULL) == -1);
+    CHECK("type from serial mk2", blink1_deviceTypeById(0) == BLINK1_MK2);
+    CHECK("type from serial mk4", blink1_deviceTypeById(2) == BLINK1_MK4);
+    CHECK("type bad index", blink1_deviceTypeById(-1) == BLINK1_UNKNOWN);
+
+    CHECK("cacheRemove", blink1_cacheRemove(0) == 0);
+    CHECK("cacheRemove shifts down", blink1_getCacheIndexBySerial("30001234") == 0);
+    CHECK("cacheRemove gone", blink1_getCacheIndexByPath("/dev/test-a") == -1);
+    CHECK("cacheRemove bad index", blink1_cacheRemove(5) == -1);
+
+    // grow past initial index size
+    char path[32], serial[16];
+    int ok = 1;
+    for( int i=0; i<20; i++ ) {
+        snprintf(path, sizeof(path), "/dev/grow%d", i);
+        snprintf(serial, sizeof(serial), "%X", 0x20000000 + i);
+        if( blink1_cacheAdd(path, serial) < 0 ) ok = 0;
+    }
+    for( int i=0; i<20; i++ ) {
+        snprintf(serial, sizeof(serial), "%X", 0x20000000 + i);
+        if( blink1_getCacheIndexBySerial(serial) != i+2 ) ok = 0;
+    }
+    CHECK("registry grows", ok);
+
+    // no 32 device limit
+    ok = 1;
+    for( int i=20; i<600; i++ ) {
+        snprintf(path, sizeof(path), "/dev/grow%d", i);
+        snprintf(serial, sizeof(serial), "%X", 0x20000000 + i);
+        if( blink1_cacheAdd(path, serial) != i+2 ) ok = 0;
+    }
+    CHECK("registry holds 600 devices", ok && blink1_getCachedCount() == 602);
+    CHECK("bySerial at 600", blink1_getCacheIndexBySerial("20000257") == 0x257+2);
+    CHECK("byId index past 32", blink1_getCacheIndexById(500) == 500);
+    CHECK("byId index past count", blink1_getCacheIndexById(602) == -1);
+    CHECK("byId serial", blink1_getCacheIndexById(0x20000257) == 0x257+2);
+    CHECK("idIsSerial mk1", blink1_idIsSerial(0x1000ABCD));
+    CHECK("idIsSerial index", !blink1_idIsSerial(33));
+
+    while( blink1_getCachedCount() ) blink1_cacheRemove(0);
+    CHECK("registry empty", blink1_getCacheIndexByPath("/dev/test-b") == -1);
+}
+
+// ---------------------------------------------------------------------------
+// async queue (uses blink1_asyncCall, so no device I/O happens)
+// ---------------------------------------------------------------------------
+
+static int async_order[100];
+static int async_ran = 0;
+static int async_cbs = 0;
+
+static int async_record(blink1_device* dev, void* arg)
+{
+    (void)dev;
+    async_order[async_ran++] = (int)(intptr_t)arg;
+    return ((intptr_t)arg == 7) ? -1 : 0;  // make one "fail"
+}
+
+static void async_done(blink1_device* dev, int rc, void* userdata)
+{
+    (void)dev; (void)rc; (void)userdata;
+    async_cbs++;
+}
+
+static void test_async(void)
+{
+    static int fakedev;
+    blink1_device* dev = (blink1_device*)&fakedev;
+    blink1_async_stats st;
+    int64_t t = 0;
+
+    CHECK("async flush with no queue", blink1_asyncFlush(dev) == 0);
+    CHECK("async stats with no queue", blink1_asyncGetStats(dev, &st) == -1);
+    CHECK("async call NULL dev", blink1_asyncCall(NULL, async_record, 0, NULL, NULL) == -1);
+
+    for( int i=0; i<100; i++ ) {
+        t = blink1_asyncCall(dev, async_record, (void*)(intptr_t)i, async_done, NULL);
+    }
+    CHECK("async ticket is submit count", t == 100);
+    CHECK("async wait", blink1_asyncWait(dev, t) == 0);
+    CHECK("async all ran", async_ran == 100);
+    CHECK("async all callbacks", async_cbs == 100);
+    int inorder = 1;
+    for( int i=0; i<100; i++ ) if( async_order[i] != i ) inorder = 0;
+    CHECK("async FIFO order", inorder);
+    CHECK("async flush returns error count", blink1_asyncFlush(dev) == 1);
+    CHECK("async flush resets error count", blink1_asyncFlush(dev) == 0);
+
+    CHECK("async stats", blink1_asyncGetStats(dev, &st) == 0);
+    CHECK("async stats submitted", st.submitted == 100);
+    CHECK("async stats completed", st.completed == 100);
+    CHECK("async stats errors",    st.errors == 1);
+    CHECK("async stats depth",     st.depth == 0);
+    CHECK("async stats maxDepth",  st.maxDepth >= 1 && st.maxDepth <= 100);
+    CHECK("async stats busy <= uptime", st.busyMicros <= st.uptimeMicros);
+
+    CHECK("async stop", blink1_asyncStop(dev) == 0);
+    CHECK("async stats after stop", blink1_asyncGetStats(dev, &st) == -1);
+}
+
+// ---------------------------------------------------------------------------
+// contexts
+// ---------------------------------------------------------------------------
+
+static int ctx_loglines = 0;
+
+static void ctx_logger(int level, const char* line, void* userdata)
+{
+    (void)level; (void)line;
+    (*(int*)userdata)++;
+}
+
+typedef struct {
+    blink1_context* ctx;
+    int base;
+    int ok;
+} ctx_thread_arg;
+
+static void* ctx_thread(void* arg)
+{
+    ctx_thread_arg* a = arg;
+    char path[32], serial[16];
+    a->ok = 1;
+    for( int i=0; i<200; i++ ) {
+        snprintf(path, sizeof(path), "/dev/t%d-%d", a->base, i);
+        snprintf(serial, sizeof(serial), "%X", 0x20000000 + a->base*1000 + i);
+        if( blink1_ctxCacheAdd(a->ctx, path, serial) != i ) a->ok = 0;
+    }
+    for( int i=0; i<200; i++ ) {
+        snprintf(serial, sizeof(serial), "%X", 0x20000000 + a->base*1000 + i);
+        if( blink1_ctxGetCacheIndexBySerial(a->ctx, serial) != i ) a->ok = 0;
+    }
+    return NULL;
+}
+
+static void test_context(void)
+{
+    blink1_context* a = blink1_contextNew();
+    blink1_context* b = blink1_contextNew();
+    CHECK("contextNew", a != NULL && b != NULL && a != b);
+    CHECK("default context", blink1_defaultContext() != a);
+    CHECK("getContext NULL is default", blink1_getContext(NULL) == blink1_defaultContext());
+
+    CHECK("ctx cacheAdd", blink1_ctxCacheAdd(a, "/dev/ctx-a", "2000ABCD") == 0);
+    CHECK("ctx registries separate", blink1_ctxGetCachedCount(b) == 0);
+    CHECK("ctx not in default", blink1_getCacheIndexByPath("/dev/ctx-a") == -1);
+    CHECK("ctx lookup", blink1_ctxGetCacheIndexBySerial(a, "2000abcd") == 0);
+    CHECK("ctx lookup other ctx", blink1_ctxGetCacheIndexBySerial(b, "2000abcd") == -1);
+
+    blink1_ctxSetLogger(a, ctx_logger, &ctx_loglines);
+    blink1_ctxSetVerbose(a, 1);
+    blink1_ctxEnumerate(a);
+    CHECK("ctx logger gets debug output", ctx_loglines > 0);
+    blink1_ctxSetVerbose(a, 0);
+    ctx_loglines = 0;
+    blink1_ctxEnumerate(a);
+    CHECK("ctx logger quiet when not verbose", ctx_loglines == 0);
+
+    // one context per thread, no shared state
+    blink1_contextFree(a);
+    blink1_contextFree(b);
+    blink1_thread_t threads[4];
+    ctx_thread_arg args[4];
+    for( int i=0; i<4; i++ ) {
+        args[i].ctx = blink1_contextNew();
+        args[i].base = i;
+        blink1_thread_create(&threads[i], ctx_thread, &args[i]);
+    }
+    int ok = 1;
+    for( int i=0; i<4; i++ ) {
+        blink1_thread_join(threads[i]);
+        if( !args[i].ok || blink1_ctxGetCachedCount(args[i].ctx) != 200 ) ok = 0;
+        blink1_contextFree(args[i].ctx);
+    }
+    CHECK("ctx per thread", ok);
+
+    // many threads, one context
+    blink1_context* shared = blink1_contextNew();
+    for( int i=0; i<4; i++ ) {
+        args[i].ctx = shared;
+        args[i].base = i;
+        blink1_thread_create(&threads[i], ctx_thread, &args[i]);
+    }
+    for( int i=0; i<4; i++ ) blink1_thread_join(threads[i]);
+    ok = (blink1_ctxGetCachedCount(shared) == 800);
+    char serial[16];
+    for( int t=0; t<4; t++ ) {
+        for( int i=0; i<200; i++ ) {
+            snprintf(serial, sizeof(serial), "%X", 0x20000000 + t*1000 + i);
+            if( blink1_ctxGetCacheIndexBySerial(shared, serial) < 0 ) ok = 0;
+        }
+    }
+    CHECK("ctx shared between threads", ok);
+    blink1_contextFree(shared);
+
+    blink1_contextFree(NULL);
+    blink1_contextFree(blink1_defaultContext());  // no-op
+    CHECK("default context survives free", blink1_getCachedCount() == 0);
+}
+
+// ---------------------------------------------------------------------------
+// virtual transport
+// ---------------------------------------------------------------------------
+
+static void test_virtual(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    CHECK("virtualNew", vt != NULL);
+    CHECK("virtualAdd mk3", blink1_virtualAdd(vt, "3000ABCD") == 0);
+    CHECK("virtualAdd mk2", blink1_virtualAdd(vt, "20001234") == 1);
+    CHECK("virtualAdd bad serial", blink1_virtualAdd(vt, "") == -1);
+    CHECK("virtualCount", blink1_virtualCount(vt) == 2);
+
+    blink1_context* ctx = blink1_contextNew();
+    CHECK("default transport is hid", blink1_ctxGetTransport(ctx) == blink1_transportHid());
+    blink1_ctxSetTransport(ctx, vt);
+    CHECK("ctx uses virtual", blink1_ctxGetTransport(ctx) == vt);
+    CHECK("virtual enumerate", blink1_ctxEnumerate(ctx) == 2);
+    CHECK("virtual sorted by serial", blink1_ctxGetCacheIndexBySerial(ctx, "20001234") == 0);
+    CHECK("virtual path", strcmp(blink1_ctxGetCachedPath(ctx, 1), "virtual:0") == 0);
+
+    blink1_device* dev = blink1_ctxOpenBySerial(ctx, "3000abcd");
+    CHECK("virtual openBySerial", dev != NULL);
+    CHECK("virtual type", blink1_deviceType(dev) == BLINK1_MK3);
+    CHECK("virtual pattmax", blink1_getPattMax(dev) == 32);
+    CHECK("virtual version", blink1_getVersion(dev) == 309);
+
+    uint8_t r, g, b, ledn;
+    uint16_t millis;
+    blink1_ctxDisableDegamma(ctx);
+    CHECK("virtual setRGB", blink1_setRGB(dev, 10, 20, 30) != -1);
+    CHECK("virtual readRGB", blink1_readRGB(dev, &millis, &r, &g, &b, 0) != -1);
+    CHECK("virtual readRGB color", r == 10 && g == 20 && b == 30);
+    blink1_fadeToRGBN(dev, 0, 255, 0, 0, 2);
+    blink1_readRGB(dev, &millis, &r, &g, &b, 2);
+    CHECK("virtual fade led 2", r == 255 && g == 0 && b == 0);
+    blink1_readRGB(dev, &millis, &r, &g, &b, 1);
+    CHECK("virtual led 1 unchanged", r == 10 && g == 20 && b == 30);
+    blink1_fadeToRGBN(dev, 10000, 0, 0, 200, 1);
+    blink1_readRGB(dev, &millis, &r, &g, &b, 1);
+    CHECK("virtual fade in progress", b < 200 && millis == 10000);
+    blink1_ctxEnableDegamma(ctx);
+    blink1_setRGB(dev, 128, 128, 128);
+    blink1_readRGB(dev, &millis, &r, &g, &b, 1);
+    CHECK("virtual degamma applied", r == blink1_degamma(128));
+    blink1_ctxDisableDegamma(ctx);
+
+    blink1_setLEDN(dev, 2);
+    blink1_writePatternLine(dev, 500, 1, 2, 3, 31);
+    blink1_readPatternLineN(dev, &millis, &r, &g, &b, &ledn, 31);
+    CHECK("virtual pattern line", r == 1 && g == 2 && b == 3 && millis == 500 && ledn == 2);
+    blink1_writePatternLine(dev, 500, 9, 9, 9, 32);  // past pattern RAM
+    blink1_readPatternLineN(dev, &millis, &r, &g, &b, &ledn, 32);
+    CHECK("virtual pattern RAM bound", r == 0 && millis == 0);
+
+    uint8_t playing, start, end, count, pos;
+    blink1_setLEDN(dev, 0);
+    blink1_writePatternLine(dev, 10000, 0, 255, 0, 0);
+    blink1_writePatternLine(dev, 10000, 0, 0, 255, 1);
+    blink1_playloop(dev, 1, 0, 2, 0);
+    blink1_readPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("virtual playing", playing == 1 && start == 0 && end == 2 && pos == 1);
+    blink1_play(dev, 0, 0);
+    blink1_readPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("virtual stopped", playing == 0);
+
+    uint8_t bootmode, bstart, bend, bcount;
+    blink1_setStartupParams(dev, 1, 2, 3, 4);
+    blink1_getStartupParams(dev, &bootmode, &bstart, &bend, &bcount);
+    CHECK("virtual startup params", bootmode == 1 && bstart == 2 && bend == 3 && bcount == 4);
+
+    uint8_t note[blink1_note_size], readback[blink1_note_size];
+    uint8_t* readp = readback;
+    for( int i=0; i<blink1_note_size; i++ ) note[i] = i+1;
+    blink1_writeNote(dev, 3, note);
+    blink1_readNote(dev, 3, &readp);
+    CHECK("virtual note", memcmp(note, readback, blink1_note_size) == 0);
+
+    blink1_virtual_stats st;
+    CHECK("virtual stats", blink1_virtualGetStats(vt, 0, &st) == 0);
+    CHECK("virtual stats counts", st.cmds['c'] == 2 && st.cmds['n'] == 2 && st.reads > 0);
+    CHECK("virtual stats bad index", blink1_virtualGetStats(vt, 5, &st) == -1);
+
+    blink1_close(dev);
+    CHECK("virtual openById", (dev = blink1_ctxOpenById(ctx, 0)) != NULL);
+    blink1_close(dev);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+static int async_hold = 1;
+
+// keeps the worker busy, so reports queue up behind it
+static int async_wait_release(blink1_device* dev, void* arg)
+{
+    (void)dev; (void)arg;
+    while( __atomic_load_n(&async_hold, __ATOMIC_ACQUIRE) ) blink1_sleep(1);
+    return 0;
+}
+
+// fades coalesce, raw reports that look like fades don't
+static void test_asyncCoalesce(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+    blink1_device* dev = blink1_ctxOpenById(ctx, 0);
+    uint8_t raw[blink1_buf_size] = { blink1_report_id, 'c', 1,2,3, 0,0, 0 };
+    blink1_async_stats st;
+    blink1_virtual_stats vs;
+
+    blink1_asyncCall(dev, async_wait_release, NULL, NULL, NULL);
+    blink1_asyncWrite(dev, raw, sizeof(raw), NULL, NULL);
+    blink1_asyncWrite(dev, raw, sizeof(raw), NULL, NULL);
+    blink1_asyncFadeToRGBN(dev, 0, 10, 20, 30, 0, NULL, NULL);
+    int64_t t = blink1_asyncFadeToRGBN(dev, 0, 40, 50, 60, 0, NULL, NULL);
+    __atomic_store_n(&async_hold, 0, __ATOMIC_RELEASE);
+    blink1_asyncWait(dev, t);
+    blink1_asyncGetStats(dev, &st);
+    CHECK("async coalesces fades only", st.coalesced == 1);
+    blink1_virtualGetStats(vt, 0, &vs);
+    CHECK("async raw reports all sent", vs.cmds['c'] == 3);
+
+    blink1_close(dev);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// delta pattern upload, checked against what the virtual device received
+static void test_patternSync(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+    blink1_ctxDisableDegamma(ctx);
+
+    patternline_t patt[4] = {
+        { {255,0,0}, 500, 0 }, { {0,0,0}, 500, 0 },
+        { {0,255,0}, 300, 0 }, { {0,0,0}, 300, 0 },
+    };
+    blink1_pattsync_result res;
+    blink1_virtual_stats vs;
+    blink1_device* dev = blink1_ctxOpenById(ctx, 0);
+
+    CHECK("patternSync first", blink1_patternSync(dev, patt, 4, 0, &res) == 0);
+    CHECK("patternSync first writes all, one setLEDN",
+          res.linesWritten == 4 && res.reportsSent == 5 && res.reportsAvoided == 3);
+    uint8_t r, g, b, ledn;
+    uint16_t millis;
+    blink1_readPatternLineN(dev, &millis, &r, &g, &b, &ledn, 2);
+    CHECK("patternSync line on device", g == 255 && millis == 300);
+
+    blink1_patternSync(dev, patt, 4, 0, &res);
+    CHECK("patternSync same pattern sends nothing",
+          res.linesSkipped == 4 && res.reportsSent == 0 && res.reportsAvoided == 8);
+
+    patt[1].color.b = 99;
+    patt[3].ledn = 2;
+    blink1_patternSync(dev, patt, 4, 0, &res);
+    CHECK("patternSync only changed lines",
+          res.linesWritten == 2 && res.reportsSent == 3);
+
+    blink1_writePatternLine(dev, 100, 1, 2, 3, 0);  // behind patternSync's back
+    blink1_patternSync(dev, patt, 4, 0, &res);
+    CHECK("patternSync sees direct writes", res.linesWritten == 1);
+
+    blink1_close(dev);
+    dev = blink1_ctxOpenById(ctx, 0);
+    blink1_virtualGetStats(vt, 0, &vs);
+    uint64_t pwrites = vs.cmds['P'];
+    blink1_patternSync(dev, patt, 4, 0, &res);
+    blink1_virtualGetStats(vt, 0, &vs);
+    CHECK("patternSync image outlives handle", res.reportsSent == 0 && vs.cmds['P'] == pwrites);
+
+    blink1_patternForget(dev);
+    blink1_patternSync(dev, patt, 4, 1, &res);
+    CHECK("patternSync seeds from device",
+          res.linesSkipped == 4 && res.reportsSent == 8 && res.reportsAvoided == 0);
+    blink1_patternSync(dev, patt, 4, 1, &res);
+    CHECK("patternSync seeds once", res.reportsSent == 0);
+
+    blink1_close(dev);
+    blink1_ctxCacheRemove(ctx, 0);  // as if unplugged
+    blink1_ctxEnumerate(ctx);
+    dev = blink1_ctxOpenById(ctx, 0);
+    blink1_patternSync(dev, patt, 4, 0, &res);
+    CHECK("patternSync forgets unplugged devices", res.linesWritten == 4);
+
+    CHECK("patternSync NULL dev", blink1_patternSync(NULL, patt, 4, 0, &res) == -1);
+
+    blink1_close(dev);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// state shadow, checked by counting reports the virtual device answers
+static void test_shadow(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+    blink1_ctxDisableDegamma(ctx);
+    blink1_device* dev = blink1_ctxOpenById(ctx, 0);
+
+    blink1_shadow_led led;
+    blink1_virtual_stats vs;
+    uint8_t r, g, b, n, playing, start, end, count, pos;
+    uint16_t millis;
+    uint64_t reads;
+    #define VREADS() (blink1_virtualGetStats(vt, 0, &vs), vs.reads)
+
+    CHECK("shadow starts unknown", blink1_shadowGetLED(dev, 1, &led) == BLINK1_SHADOW_UNKNOWN);
+    blink1_setRGB(dev, 10, 20, 30);
+    CHECK("shadow estimated until play state known",
+          blink1_shadowGetLED(dev, 1, &led) == BLINK1_SHADOW_ESTIMATED);
+    CHECK("shadow commanded color", led.rgb[0] == 10 && led.rgb[1] == 20 && led.rgb[2] == 30);
+
+    reads = VREADS();
+    blink1_shadowReadRGB(dev, &millis, &r, &g, &b, 0);
+    CHECK("shadowReadRGB no USB", VREADS() == reads && r == 10 && b == 30);
+    blink1_ctxSetShadowEstimates(ctx, 0);
+    blink1_shadowReadRGB(dev, &millis, &r, &g, &b, 0);
+    CHECK("shadowReadRGB asks device without estimates", VREADS() == reads+1 && g == 20);
+    blink1_ctxSetShadowEstimates(ctx, 1);
+
+    blink1_shadowReadPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("shadowReadPlayState asks device first", VREADS() == reads+2 && playing == 0);
+    blink1_shadowReadPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("shadowReadPlayState stopped from shadow", VREADS() == reads+2);
+    CHECK("shadow exact once stopped", blink1_shadowGetLED(dev, 2, &led) == BLINK1_SHADOW_EXACT);
+
+    blink1_fadeToRGBN(dev, 10000, 0, 0, 200, 1);
+    CHECK("shadow mid-fade estimated", blink1_shadowGetLED(dev, 1, &led) == BLINK1_SHADOW_ESTIMATED);
+    CHECK("shadow fade target", led.target[2] == 200 && led.rgb[2] < 200 &&
+          led.fadeMillis == 10000 && led.fadeLeftMillis > 0);
+    CHECK("shadow other LED untouched", blink1_shadowGetLED(dev, 2, &led) == BLINK1_SHADOW_EXACT &&
+          led.rgb[0] == 10);
+
+    blink1_setLEDN(dev, 0);  // a line's ledn is only known once 'l' was sent
+    blink1_writePatternLine(dev, 100, 1, 2, 3, 0);
+    reads = VREADS();
+    blink1_shadowReadPatternLineN(dev, &millis, &r, &g, &b, &n, 0);
+    CHECK("shadowReadPatternLineN no USB", VREADS() == reads && r == 1 && b == 3 && millis == 100);
+    blink1_shadowReadPatternLineN(dev, &millis, &r, &g, &b, &n, 5);
+    CHECK("shadowReadPatternLineN unknown line asks device", VREADS() == reads+1);
+
+    blink1_playloop(dev, 1, 0, 1, 0);
+    CHECK("shadow unknown while playing", blink1_shadowGetLED(dev, 2, &led) == BLINK1_SHADOW_UNKNOWN);
+    reads = VREADS();
+    blink1_shadowReadPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("shadowReadPlayState asks device while playing", VREADS() == reads+1 && playing == 1);
+    blink1_play(dev, 0, 0);
+    blink1_shadowReadPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("shadowReadPlayState stopped", VREADS() == reads+1 && playing == 0);
+
+    blink1_setRGB(dev, 5, 5, 5);
+    blink1_serverdown(dev, 1, 0, 0, 0, 0);  // fires right away
+    CHECK("shadow unknown once servertickle fires",
+          blink1_shadowGetLED(dev, 1, &led) == BLINK1_SHADOW_UNKNOWN);
+    blink1_serverdown(dev, 0, 0, 0, 0, 0);
+    CHECK("shadow still unknown after servertickle off",
+          blink1_shadowGetLED(dev, 1, &led) == BLINK1_SHADOW_UNKNOWN);
+
+    CHECK("shadowResync", blink1_shadowResync(dev) == 0);
+    CHECK("shadowResync reads LEDs", blink1_shadowGetLED(dev, 2, &led) == BLINK1_SHADOW_EXACT &&
+          led.rgb[0] == 5);
+    reads = VREADS();
+    blink1_shadowReadPatternLineN(dev, &millis, &r, &g, &b, &n, 31);
+    blink1_shadowReadPlayState(dev, &playing, &start, &end, &count, &pos);
+    CHECK("shadowResync fills pattern and play state", VREADS() == reads);
+    blink1_ctxSetShadowMaxAge(ctx, 0);
+    blink1_sleep(2);
+    CHECK("shadow read values age out", blink1_shadowGetLED(dev, 2, &led) == BLINK1_SHADOW_UNKNOWN);
+
+    CHECK("shadow NULL dev", blink1_shadowGetLED(NULL, 0, &led) == BLINK1_SHADOW_UNKNOWN);
+    #undef VREADS
+
+    blink1_close(dev);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// compiled patterns, written to and played on virtual devices
+static void test_cpattern(void)
+{
+    blink1_cpattern cp, cp2;
+    uint8_t r, g, b, n;
+    CHECK("cpatternParse", blink1_cpatternParse(&cp, "3,#ff0000,0.5,1,#000080,0.25,2", 0, 1, NULL) == 0);
+    CHECK("cpattern lines", cp.len == 2 && cp.repeats == 3 && cp.loopMillis == 750);
+    CHECK("cpattern fade report", cp.fades[0][1] == 'c' && cp.fades[0][2] == blink1_degamma(255) &&
+          cp.fades[0][6] == 50 && cp.fades[0][7] == 1);
+    CHECK("cpattern write report", cp.writes[1][1] == 'P' && cp.writes[1][4] == blink1_degamma(0x80) &&
+          cp.writes[1][6] == 25 && cp.writes[1][7] == 1);
+    CHECK("cpattern hash", cp.hash != 0);
+    blink1_cpatternCompile(&cp2, cp.lines, cp.len, cp.repeats, 0, 1);
+    CHECK("cpattern same content same hash", cp2.hash == cp.hash);
+    blink1_cpatternCompile(&cp2, cp.lines, cp.len, cp.repeats, 128, 1);
+    r = 255; g = 0; b = 0;
+    blink1_adjustBrightness(128, &r, &g, &b);
+    CHECK("cpattern brightness applied", cp2.hash != cp.hash &&
+          cp2.writes[0][2] == blink1_degamma(r));
+    blink1_parse_error err;
+    CHECK("cpattern bad", blink1_cpatternParse(&cp2, "3,#ff0000", 0, 1, &err) == -1 &&
+          err.offset == 9);
+    char big[600] = "1";
+    for( int i=0; i<33; i++ ) strcat(big, ",#ff0000,0.1,0");
+    CHECK("cpattern too long", blink1_cpatternParse(&cp2, big, 0, 1, &err) == -1 &&
+          err.offset == 1 + 32*14 + 1);
+    CHECK("cpattern no lines", blink1_cpatternParse(&cp2, "3", 0, 1, &err) == -1);
+
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_virtualAdd(vt, "3000ABCE");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+    blink1_device* devs[2] = { blink1_ctxOpenById(ctx, 0), blink1_ctxOpenById(ctx, 1) };
+
+    blink1_pattsync_result res;
+    uint16_t millis;
+    CHECK("cpatternWrite", blink1_cpatternWrite(devs[0], &cp, 0, &res) == 0 &&
+          res.linesWritten == 2);
+    blink1_readPatternLineN(devs[0], &millis, &r, &g, &b, &n, 1);
+    CHECK("cpatternWrite line", b == blink1_degamma(0x80) && millis == 250 && n == 2);
+    blink1_cpatternWrite(devs[0], &cp, 0, &res);
+    CHECK("cpatternWrite again sends nothing", res.reportsSent == 0 && res.linesSkipped == 2);
+    blink1_writePatternLine(devs[0], 100, 1, 2, 3, 0);
+    blink1_cpatternWrite(devs[0], &cp, 0, &res);
+    CHECK("cpatternWrite rewrites changed line", res.linesWritten == 1 && res.linesSkipped == 1);
+    CHECK("cpatternWrite other device", blink1_cpatternWrite(devs[1], &cp, 0, &res) == 0 &&
+          res.linesWritten == 2);
+
+    blink1_ctxDisableDegamma(ctx);
+    blink1_cpatternWrite(devs[1], &cp, 0, &res);
+    blink1_readPatternLineN(devs[1], &millis, &r, &g, &b, &n, 1);
+    // full red is the same either way, only line 1 changes
+    CHECK("cpatternWrite follows device degamma", res.linesWritten == 1 && b == 0x80);
+
+    int results[2];
+    CHECK("cpatternFadeMany", blink1_cpatternFadeMany(devs, 2, &cp, 1, 0, results) == 0 &&
+          results[0] == 0 && results[1] == 0);
+    blink1_readRGB(devs[0], &millis, &r, &g, &b, 2);
+    CHECK("cpatternFade color", r == 0 && b == 0x80);
+    CHECK("cpatternFade bad line", blink1_cpatternFade(devs[0], &cp, 2, 0) == -1);
+
+    blink1_close(devs[0]);
+    blink1_close(devs[1]);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// perfect-hash table and runtime index for named patterns
+static void test_patternIndex(void)
+{
+    static const char* const defnames[] = {
+#define BLINK1_PATTERN(name, str) name,
+#include "../blink1-lib-patterns.def"
+#undef BLINK1_PATTERN
+    };
+    const int ndef = sizeof(defnames) / sizeof(defnames[0]);
+    enum { nsyn = 500 };
+    static char synbuf[nsyn][16];
+    static const char* names[nsyn + 64];
+    static blink1_pattern_info infos[nsyn + 64];
+    static uint16_t disp[(nsyn + 64)/2 + 1];
+    static int16_t slots[nsyn + 64];
+    int n = 0;
+    for( int i=0; i<ndef; i++ ) names[n++] = defnames[i];
+    for( int i=0; i<nsyn; i++ ) {
+        snprintf(synbuf[i], sizeof(synbuf[i]), "user%d", i);
+        names[n++] = synbuf[i];
+    }
+    for( int i=0; i<n; i++ ) infos[i].name = names[i];
+
+    CHECK("patternTableBuild", blink1_patternTableBuild(names, n, n/2 + 1, disp, slots) == 0);
+    blink1_pattern_table t = { infos, n, slots, disp, n/2 + 1 };
+    int found = 0;
+    for( int i=0; i<n; i++ ) found += (blink1_patternTableGet(&t, names[i]) == i);
+    CHECK("patternTableGet finds every name", found == n);
+    CHECK("patternTableGet miss", blink1_patternTableGet(&t, "nosuchpattern") == -1 &&
+          blink1_patternTableGet(&t, "") == -1 && blink1_patternTableGet(&t, "user500") == -1);
+    blink1_pattern_table tdef = { infos, ndef, slots, disp, ndef/2 + 1 };
+    CHECK("patternTableBuild .def", blink1_patternTableBuild(names, ndef, ndef/2 + 1, disp, slots) == 0 &&
+          blink1_patternTableGet(&tdef, "policecar") >= 0 &&
+          blink1_patternTableGet(&tdef, "user0") == -1);
+    names[ndef] = defnames[3];
+    CHECK("patternTableBuild duplicate", blink1_patternTableBuild(names, ndef + 1, ndef/2 + 1, disp, slots) == -1);
+    names[ndef] = synbuf[0];
+
+    blink1_pattern_index ix;
+    blink1_patternIndexInit(&ix);
+    CHECK("patternIndex empty", blink1_patternIndexGet(&ix, "a") == -1 &&
+          blink1_patternIndexDel(&ix, "a") == -1);
+    for( int i=0; i<n; i++ ) blink1_patternIndexPut(&ix, names[i], i);
+    found = 0;
+    for( int i=0; i<n; i++ ) found += (blink1_patternIndexGet(&ix, names[i]) == i);
+    CHECK("patternIndex grows", found == n && ix.count == n && ix.mask + 1 >= 2 * (uint32_t)n);
+    char copy[16] = "user7";   // a different pointer, same string
+    blink1_patternIndexPut(&ix, copy, 7000);
+    CHECK("patternIndex replace", ix.count == n && blink1_patternIndexGet(&ix, "user7") == 7000);
+    blink1_patternIndexPut(&ix, synbuf[7], ndef + 7);
+
+    // delete every third name, the rest must all still be found
+    int ok = 1;
+    for( int i=0; i<n; i += 3 ) ok &= (blink1_patternIndexDel(&ix, names[i]) == i);
+    CHECK("patternIndexDel", ok);
+    int live = 0;
+    found = 0;
+    for( int i=0; i<n; i++ ) {
+        int want = (i % 3) ? i : -1;
+        found += (blink1_patternIndexGet(&ix, names[i]) == want);
+        live += (i % 3) != 0;
+    }
+    CHECK("patternIndex after deletes", found == n && ix.count == live);
+    CHECK("patternIndexDel twice", blink1_patternIndexDel(&ix, names[0]) == -1);
+    for( int i=0; i<n; i += 3 ) blink1_patternIndexPut(&ix, names[i], i + 1);
+    found = 0;
+    for( int i=0; i<n; i++ ) found += (blink1_patternIndexGet(&ix, names[i]) == ((i % 3) ? i : i + 1));
+    CHECK("patternIndex put after delete", found == n && ix.count == n);
+    blink1_patternIndexFree(&ix);
+    CHECK("patternIndexFree", ix.slots == NULL && ix.count == 0);
+}
+
+// per-device calibration profiles
+static void test_calibration(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_virtualAdd(vt, "2000ABCE");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+    blink1_device* mk3 = blink1_ctxOpenBySerial(ctx, "3000ABCD");
+    blink1_device* mk2 = blink1_ctxOpenBySerial(ctx, "2000ABCE");
+    uint8_t lut[3][256];
+    uint8_t r, g, b, n;
+    uint16_t millis;
+
+    int same = 1;
+    CHECK("calibration none", blink1_getCalibrationTable(mk3, lut) == 0);
+    for( int v=0; v<256; v++ ) same &= (lut[0][v] == blink1_degamma(v) && lut[2][v] == blink1_degamma(v));
+    CHECK("calibration none is the degamma curve", same);
+
+    blink1_calibration cal;
+    blink1_calibrationDefault(&cal);
+    CHECK("calibration set default", blink1_ctxSetCalibration(ctx, "*", &cal) == 0);
+    CHECK("calibration default matches", blink1_getCalibrationTable(mk3, lut) == 1);
+    same = 1;
+    for( int v=0; v<256; v++ ) same &= (lut[1][v] == blink1_degamma(v));
+    CHECK("calibration default profile gives GammaE", same);
+    blink1_ctxDisableDegamma(ctx);
+    blink1_getCalibrationTable(mk3, lut);
+    same = 1;
+    for( int v=0; v<256; v++ ) same &= (lut[1][v] == v);
+    CHECK("calibration default profile, degamma off", same);
+    blink1_ctxEnableDegamma(ctx);
+
+    const char* text =
+        "# test profiles\n"
+        "mk3  gamma=1 white=1,0.5,0   # half green, no blue\n"
+        "\n"
+        "  2000abce gamma=1,1,1 max=128\n"
+        "mk2  white=0,0,0\n";
+    blink1_parse_error err;
+    CHECK("calibration parse", blink1_ctxParseCalibration(ctx, text, &err) == 3 && err.offset == -1);
+    blink1_fadeToRGB(mk3, 0, 255, 255, 255);
+    blink1_readRGB(mk3, &millis, &r, &g, &b, 0);
+    CHECK("calibration by type in fadeToRGB", r == 255 && g == 127 && b == 0);
+    blink1_fadeToRGB(mk2, 0, 255, 100, 0);
+    blink1_readRGB(mk2, &millis, &r, &g, &b, 0);
+    CHECK("calibration serial beats type", r == 128 && g == 50 && b == 0);
+    blink1_writePatternLine(mk3, 100, 200, 200, 200, 1);
+    blink1_readPatternLineN(mk3, &millis, &r, &g, &b, &n, 1);
+    CHECK("calibration in writePatternLine", r == 200 && g == 100 && b == 0);
+
+    blink1_cpattern cp;
+    blink1_pattsync_result res;
+    blink1_cpatternParse(&cp, "0,#ffffff,0.1,0,#808080,0.1,0", 0, 1, NULL);
+    blink1_cpatternWrite(mk3, &cp, 0, &res);
+    blink1_readPatternLineN(mk3, &millis, &r, &g, &b, &n, 0);
+    CHECK("calibration in cpatternWrite", r == 255 && g == 127 && b == 0);
+    blink1_cpatternWrite(mk3, &cp, 0, &res);
+    CHECK("calibration cpatternWrite again sends nothing", res.reportsSent == 0);
+    blink1_calibrationDefault(&cal);
+    cal.gamma[0] = cal.gamma[1] = cal.gamma[2] = 1;
+    blink1_ctxSetCalibration(ctx, "3000abcd", &cal);
+    blink1_cpatternWrite(mk3, &cp, 0, &res);
+    blink1_readPatternLineN(mk3, &millis, &r, &g, &b, &n, 0);
+    CHECK("calibration change rewrites pattern", res.linesWritten == 2 && r == 255 && b == 255);
+    CHECK("calibration remove", blink1_ctxSetCalibration(ctx, "3000ABCD", NULL) == 0);
+    blink1_getCalibrationTable(mk3, lut);
+    CHECK("calibration remove falls back to type", lut[1][255] == 127);
+
+    CHECK("calibration bad match", blink1_ctxParseCalibration(ctx, "mk9 max=1", &err) == -1 &&
+          err.offset == 0);
+    CHECK("calibration two values", blink1_ctxParseCalibration(ctx, "* max=1\n* gamma=2,2", &err) == -1 &&
+          err.offset == 16);
+    CHECK("calibration unknown key", blink1_ctxParseCalibration(ctx, "* foo=1", &err) == -1 &&
+          err.offset == 2);
+    CHECK("calibration max range", blink1_ctxParseCalibration(ctx, "* max=300", &err) == -1);
+    CHECK("calibration white range", blink1_ctxParseCalibration(ctx, "* white=2", &err) == -1);
+    CHECK("calibration bad number", blink1_ctxParseCalibration(ctx, "* gamma=2x", &err) == -1 &&
+          err.offset == 8);
+    blink1_getCalibrationTable(mk3, lut);
+    CHECK("calibration unchanged after bad parse", lut[1][255] == 127);
+    CHECK("calibration missing file",
+          blink1_ctxLoadCalibration(ctx, "/nonexistent/blink1cal", &err) == -1 && err.msg != NULL);
+    blink1_calibrationDefault(&cal);
+    cal.white[0] = -1;
+    CHECK("calibration set bad", blink1_ctxSetCalibration(ctx, "*", &cal) == -1 &&
+          blink1_ctxSetCalibration(ctx, "xyz", NULL) == -1);
+
+    blink1_ctxClearCalibration(ctx);
+    CHECK("calibration clear", blink1_getCalibrationTable(mk3, lut) == 0 &&
+          lut[1][255] == 255);
+
+    blink1_close(mk3);
+    blink1_close(mk2);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// timeline scheduler against a virtual device with USB-like latency
+typedef struct {
+    blink1_device* dev;
+    uint64_t steps;
+    int64_t lateMax;
+} sched_test;
+
+static int64_t sched_test_step( uint64_t step, int64_t late, void* arg )
+{
+    sched_test* t = (sched_test*)arg;
+    if( late > t->lateMax ) t->lateMax = late;
+    blink1_fadeToRGBN(t->dev, 0, step & 0xff, 0, 0, 1);
+    if( step % 500 == 499 ) blink1_sleep(5);  // a hiccup longer than a step
+    return ( step+1 < t->steps ) ? 1000 : -1;
+}
+
+static void test_sched(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_virtualSetLatency(vt, 300);
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+
+    sched_test t = { blink1_ctxOpenById(ctx, 0), 2000, 0 };
+    blink1_sched_stats st;
+    blink1_virtual_stats vs;
+    int n = blink1_schedRun(sched_test_step, &t, &st);
+    blink1_virtualGetStats(vt, 0, &vs);
+
+    // sleeping 1 ms after each report would have drifted by
+    // 2000 * 300 us of latency plus 4 * 5 ms of hiccups
+    CHECK("sched ran every step", n == 2000 && st.steps == 2000 && vs.cmds['c'] == 2000);
+    CHECK("sched deadlines exact", st.scheduledMicros == 1999 * 1000);
+    CHECK("sched no cumulative drift", st.elapsedMicros - st.scheduledMicros < 20000);
+    CHECK("sched recovers from hiccups", st.lateMicros < 5000);
+    CHECK("sched reports lateness", st.lateMaxMicros >= 4000 &&
+          (int64_t)st.lateMaxMicros == t.lateMax);
+    CHECK("sched NULL fn", blink1_schedRun(NULL, NULL, &st) == -1 && st.steps == 0);
+
+    blink1_close(t.dev);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
+// I/O stats, counted on virtual devices
+static void test_iostats(void)
+{
+    blink1_transport* vt = blink1_virtualNew();
+    blink1_virtualAdd(vt, "3000ABCD");
+    blink1_context* ctx = blink1_contextNew();
+    blink1_ctxSetTransport(ctx, vt);
+    blink1_ctxEnumerate(ctx);
+
+    blink1_iostats st;
+    blink1_device* dev = blink1_ctxOpenById(ctx, 0);
+    CHECK("iostats off by default", blink1_getIoStats(dev, &st) == -1);
+    blink1_close(dev);
+
+    blink1_ctxSetIoStats(ctx, 1);
+    dev = blink1_ctxOpenById(ctx, 0);
+    CHECK("iostats on", blink1_getIoStats(dev, &st) == 0);
+    CHECK("iostats start empty", st.cmds['c'].write.count == 0);
+
+    uint8_t r, g, b;
+    uint16_t millis;
+    for( int i=0; i<3; i++ ) blink1_fadeToRGB(dev, 0, i, i, i);
+    blink1_readRGB(dev, &millis, &r, &g, &b, 0);
+    uint8_t shortbuf[blink1_buf_size] = { blink1_report_id };
+    CHECK("iostats short write fails", blink1_write(dev, shortbuf, 1) == -1);
+
+    blink1_getIoStats(dev, &st);
+    blink1_iostats_op* fades = &st.cmds['c'].write;
+    CHECK("iostats write count", fades->count == 3 && fades->errors == 0);
+    CHECK("iostats read counted by request cmd",
+          st.cmds['r'].write.count == 1 && st.cmds['r'].read.count == 1);
+    CHECK("iostats errors", st.cmds[0].write.count == 1 && st.cmds[0].write.errors == 1);
+    uint64_t hsum = 0;
+    for( int i=0; i<blink1_iostats_buckets; i++ ) hsum += fades->hist[i];
+    CHECK("iostats histogram sums to count", hsum == fades->count);
+    CHECK("iostats max <= total", fades->maxMicros <= fades->totalMicros);
+    CHECK("iostats percentile <= max", blink1_ioStatsPercentile(fades, 99) <= fades->maxMicros);
+
+    blink1_iostats_op op;
+    memset(&op, 0, sizeof(op));
+    CHECK("iostats percentile empty", blink1_ioStatsPercentile(&op, 50) == 0);
+    op.count = 4; op.maxMicros = 5000;
+    op.hist[0] = 3; op.hist[blink1_iostats_buckets-1] = 1;
+    CHECK("iostats p50 in first bucket",
+          blink1_ioStatsPercentile(&op, 50) == blink1_iostats_bucket_micros(0));
+    CHECK("iostats p99 in last bucket is max", blink1_ioStatsPercentile(&op, 99) == 5000);
+
+    blink1_resetIoStats(dev);
+    blink1_getIoStats(dev, &st);
+    CHECK("iostats reset", st.cmds['c'].write.count == 0 && st.cmds['r'].read.count == 0);
+
+    blink1_close(dev);
+    CHECK("acquireOpen doesn't open", blink1_ctxAcquireOpenById(ctx, 0) == NULL);
+    dev = blink1_ctxAcquireById(ctx, 0);
+    blink1_release(dev);
+    blink1_device* got = blink1_ctxAcquireOpenById(ctx, 0);
+    CHECK("acquireOpen finds pooled handle", got != NULL && got == dev);
+    blink1_release(got);
+    blink1_ctxPoolFlush(ctx, 0);
+    blink1_contextFree(ctx);
+    blink1_virtualFree(vt);
+}
+
 // ---------------------------------------------------------------------------
 
 int main(void)
@@ -305,8 +1291,22 @@ int main(void)
     test_adjustBrightness();
     test_degamma();
     test_parsePattern();
+    test_parseN();
     test_toPatternString();
     test_hsbtorgb();
+    test_colorMany();
+    test_registry();
+    test_async();
+    test_context();
+    test_virtual();
+    test_asyncCoalesce();
+    test_iostats();
+    test_patternSync();
+    test_shadow();
+    test_cpattern();
+    test_patternIndex();
+    test_calibration();
+    test_sched();
 
     printf("\n%d/%d tests passed\n", tests_run - tests_failed, tests_run);
     return (tests_failed > 0) ? 1 : 0;
@@ -4,11 +4,17 @@
 # 21 Nov 2025 - @todbot / Tod Kurt
 #
 
+import os
 import subprocess
+import threading
 import time
 import json
 import sys
 import signal
+import socket
+import struct
+import base64
+import http.client
 import urllib.request
 import urllib.error
 
@@ -60,6 +66,75 @@ def http_get_json(path):
     except json.JSONDecodeError as e:
         raise RuntimeError(f"Invalid JSON from {path}: {e}\nOutput was:\n{out}")
 
+def http_post_json(path, body):
+    """POST body as JSON, parse the JSON reply."""
+    req = urllib.request.Request(BASE_URL + path, data=json.dumps(body).encode(), method="POST")
+    with urllib.request.urlopen(req) as resp:
+        return json.loads(resp.read().decode())
+
+def ws_connect(path):
+    """Open a WebSocket, return the socket after the upgrade."""
+    port = int(BASE_URL.rsplit(":", 1)[1])
+    sock = socket.create_connection(("localhost", port), timeout=5)
+    key = base64.b64encode(os.urandom(16)).decode()
+    sock.sendall((f"GET {path} HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                  f"Connection: Upgrade\r\nSec-WebSocket-Key: {key}\r\n"
+                  "Sec-WebSocket-Version: 13\r\n\r\n").encode())
+    head = b""
+    while not head.endswith(b"\r\n\r\n"):
+        head += sock.recv(1)
+    if b" 101 " not in head.split(b"\r\n")[0]:
+        raise AssertionError(f"No WebSocket upgrade for {path}: {head[:80]}")
+    return sock
+
+def ws_send(sock, data, binary=False):
+    """Send one masked message, short ones only."""
+    data = data if binary else data.encode()
+    mask = os.urandom(4)
+    sock.sendall(bytes([0x82 if binary else 0x81, 0x80 | len(data)]) + mask +
+                 bytes(b ^ mask[i % 4] for i, b in enumerate(data)))
+
+def ws_recv(sock):
+    """Return (opcode, payload) of the next message."""
+    def take(n):
+        data = b""
+        while len(data) < n:
+            data += sock.recv(n - len(data))
+        return data
+    b0, b1 = take(2)
+    n = b1 & 0x7f
+    if n == 126:
+        n = struct.unpack(">H", take(2))[0]
+    elif n == 127:
+        n = struct.unpack(">Q", take(8))[0]
+    return b0 & 0x0f, take(n)
+
+def sse_connect(path):
+    """Open a Server-Sent Events stream, return a file reading it after the headers."""
+    port = int(BASE_URL.rsplit(":", 1)[1])
+    sock = socket.create_connection(("localhost", port), timeout=5)
+    sock.sendall(f"GET {path} HTTP/1.1\r\nHost: localhost\r\nAccept: text/event-stream\r\n\r\n".encode())
+    f = sock.makefile("rb")
+    head = f.readline()
+    if b" 200 " not in head:
+        raise AssertionError(f"No event stream for {path}: {head[:80]}")
+    while f.readline() not in (b"\r\n", b""):
+        pass
+    return f
+
+def sse_next(f):
+    """Return (event, data as JSON) of the next event, skipping comments."""
+    event, data = None, None
+    for line in iter(f.readline, b""):
+        line = line.decode().rstrip("\n")
+        if line.startswith("event: "):
+            event = line[7:]
+        elif line.startswith("data: "):
+            data = json.loads(line[6:])
+        elif line == "" and event:
+            return event, data
+    raise EOFError("event stream closed")
+
 #
 # --- Helpers for JSON tests --------------------------------------------------
 #
@@ -218,6 +293,71 @@ def test_malformed_id_no_crash():
     if code != 200:
         raise AssertionError("Server stopped responding after malformed id= arg")
     
+@test
+def test_query_args():
+    # names are case-insensitive, the first of a repeated arg wins
+    js = http_get_json("/blink1/fadeToRGB?RGB=%2300ff00&millis=100&millis=900&ledn=2")
+    assert_json_field(js, ["rgb"], "#00ff00")
+    assert_json_field(js, ["millis"], 100)
+    assert_json_field(js, ["ledn"], 2)
+    # args a route doesn't take are ignored
+    js = http_get_json("/blink1/effects?pname=foo&count=3")
+    if "pname" in js or "count" in js:
+        raise AssertionError(f"/blink1/effects echoed args it doesn't take: {js}")
+    # badly escaped or empty values are not there
+    js = http_get_json("/blink1/pattern/add?pname=%zz&pattern=")
+    if "error" not in js["status"]:
+        raise AssertionError(f"Expected error in status, got '{js['status']}'")
+
+@test
+def test_reply_compact_with_length():
+    # several replies on one keep-alive connection, each one sized
+    conn = http.client.HTTPConnection("localhost", int(BASE_URL.rsplit(":", 1)[1]), timeout=5)
+    for path in ["/blink1/patterns", "/blink1/red", "/blink1/id"]:
+        conn.request("GET", path)
+        resp = conn.getresponse()
+        length = resp.getheader("Content-Length")
+        chunked = resp.getheader("Transfer-Encoding")
+        body = resp.read().decode()
+        if chunked or length is None or int(length) != len(body.encode()):
+            raise AssertionError(f"{path}: expected Content-Length {len(body.encode())}, got {length}, chunked {chunked}")
+        js = json.loads(body)
+        if body != json.dumps(js, separators=(",", ":")):
+            raise AssertionError(f"{path}: reply isn't compact JSON: {body[:200]}")
+    conn.close()
+
+@test
+def test_pipelined_requests():
+    # requests behind one that waits on a blink1 are answered once it is, in order
+    port = int(BASE_URL.rsplit(":", 1)[1])
+    sock = socket.create_connection(("localhost", port), timeout=5)
+    batch = b'[{"op":"fade","id":0,"rgb":"#00ff00","millis":0}]'
+    sock.sendall(b"GET /blink1/red HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                 b"GET /blink1/id HTTP/1.1\r\nHost: localhost\r\n\r\n"
+                 b"POST /blink1/batch HTTP/1.1\r\nHost: localhost\r\n"
+                 b"Content-Length: " + str(len(batch)).encode() + b"\r\n\r\n" + batch +
+                 b"GET /blink1/lastColor HTTP/1.1\r\nHost: localhost\r\n\r\n")
+    f = sock.makefile("rb")
+    statuses = []
+    for _ in range(4):
+        length = 0
+        for line in iter(f.readline, b"\r\n"):
+            if line.lower().startswith(b"content-length:"):
+                length = int(line.split(b":")[1])
+        statuses.append(json.loads(f.read(length))["status"])
+    sock.close()
+    if statuses != ["blink1 set color #ff0000", "blink1 id", "blink1 batch", "blink1 lastColor"]:
+        raise AssertionError(f"Expected all four replies in order, got {statuses}")
+
+@test
+def test_reply_pretty():
+    code, out = http_get("/blink1/pattern/add?pname=a%22b%5C&pattern=1,%23ff0000,0.1,0&pretty=1")
+    js = json.loads(out)
+    if out != json.dumps(js, indent=4):
+        raise AssertionError(f"Reply isn't indented JSON: {out[:200]}")
+    assert_json_field(js, ["pname"], 'a"b\\')
+    http_get("/blink1/pattern/del?pname=a%22b%5C")
+
 @test
 def test_fadeToRGB_rgb_off():
     js = http_get_json("/blink1/off")
@@ -246,6 +386,212 @@ def test_lastColor_tracks_off():
     js = http_get_json("/blink1/lastColor")
     assert_json_field(js, ["lastColor"], "#000000")
 
+@test
+def test_effect_does_not_block_server():
+    # 50 blinks at 400 ms is 20 seconds of effect
+    js = http_get_json("/blink1/blinkserver?rgb=%23ff0000&millis=400&count=50")
+    assert_json_field(js, ["status"], "blink1 blinkserver")
+    if "effect_id" not in js:
+        raise AssertionError(f"no effect_id in response: {js}")
+    effect_id = js["effect_id"]
+
+    worst = 0.0
+    for i in range(20):
+        t = time.monotonic()
+        http_get_json("/blink1/id")
+        worst = max(worst, time.monotonic() - t)
+        time.sleep(0.05)
+    if worst > 0.25:
+        raise AssertionError(f"/blink1/id took {worst*1000:.0f} ms while an effect ran")
+
+    js = http_get_json("/blink1/effects")
+    assert_any_matches(js["effects"], {"effect_id": effect_id, "effect": "blinkserver",
+                                       "rgb": "#ff0000", "steps": 100})
+    step = [e for e in js["effects"] if e["effect_id"] == effect_id][0]["step"]
+    if not 2 <= step < 100:
+        raise AssertionError(f"effect at step {step}, expected it to be running")
+
+    js = http_get_json(f"/blink1/effects/cancel?effect_id={effect_id}")
+    assert_json_field(js, ["cancelled"], 1)
+    js = http_get_json("/blink1/effects")
+    assert_none_matches(js["effects"], {"effect_id": effect_id})
+
+@test
+def test_effect_runs_to_completion():
+    js = http_get_json("/blink1/random?millis=100&count=3")
+    effect_id = js["effect_id"]
+    time.sleep(0.4)
+    js = http_get_json("/blink1/effects")
+    assert_none_matches(js["effects"], {"effect_id": effect_id})
+
+@test
+def test_color_cancels_effect():
+    js = http_get_json("/blink1/blinkserver?millis=400&count=10")
+    effect_id = js["effect_id"]
+    http_get_json("/blink1/off")
+    js = http_get_json("/blink1/effects")
+    assert_none_matches(js["effects"], {"effect_id": effect_id})
+
+@test
+def test_effects_cancel_unknown():
+    js = http_get_json("/blink1/effects/cancel?effect_id=99999")
+    assert_json_field(js, ["cancelled"], 0)
+    if "error" not in js["status"]:
+        raise AssertionError(f"Expected error in status, got '{js['status']}'")
+
+@test
+def test_slow_blink1_does_not_block_others():
+    # a second server, whose virtual blink1s take 20 ms per report
+    if "BLINK1_VIRTUAL" not in os.environ:
+        print("skipped, needs BLINK1_VIRTUAL=2 or more")
+        return
+    global BASE_URL
+    env = dict(os.environ, BLINK1_VIRTUAL_LATENCY="20000")
+    slow = subprocess.Popen(["./blink1-tiny-server", "--port", "8001", "--quiet"], env=env)
+    base_url = BASE_URL
+    BASE_URL = "http://localhost:8001"
+    try:
+        time.sleep(0.5)
+        # 16 lines to upload to blink1 0, about 350 ms of USB
+        patt = "1" + ",%23ff0000,0.1,0,%23000000,0.1,0" * 8
+        upload = threading.Thread(target=http_get_json,
+                                  args=(f"/blink1/pattern/play?id=0&pattern={patt}",))
+        upload.start()
+        time.sleep(0.05)
+        t = time.monotonic()
+        http_get_json("/blink1/id")
+        id_secs = time.monotonic() - t
+        t = time.monotonic()
+        js = http_get_json("/blink1/red?id=1")
+        red_secs = time.monotonic() - t
+        upload.join()
+        assert_json_field(js, ["status"], "blink1 set color #ff0000")
+        if id_secs > 0.1 or red_secs > 0.15:
+            raise AssertionError(f"/blink1/id took {id_secs*1000:.0f} ms, /blink1/red?id=1 "
+                                 f"{red_secs*1000:.0f} ms during an upload to blink1 0")
+    finally:
+        BASE_URL = base_url
+        slow.send_signal(signal.SIGINT)
+        try:
+            slow.wait(timeout=2)
+        except subprocess.TimeoutExpired:
+            slow.kill()
+
+@test
+def test_ws_json_fade():
+    sock = ws_connect("/blink1/ws")
+    op, msg = ws_recv(sock)
+    hello = json.loads(msg)
+    if "blink1_serialnums" not in hello:
+        raise AssertionError(f"Expected the blink1 list first, got {hello}")
+    ws_send(sock, '{"id":0,"rgb":"#102030","millis":0,"seq":9}')
+    op, msg = ws_recv(sock)
+    js = json.loads(msg)
+    assert_json_field(js, ["ack"], 9)
+    assert_json_field(js, ["status"], "ok")
+    assert_json_field(js, ["rgb"], "#102030")
+    sock.close()
+    js = http_get_json("/blink1/lastColor")
+    assert_json_field(js, ["lastColor"], "#102030")
+
+@test
+def test_ws_binary_drops_stale():
+    sock = ws_connect("/blink1/ws")
+    ws_recv(sock)
+    # three fades for one blink1 in one message: the first goes to the
+    # blink1, the second waits and is replaced by the third
+    recs = b"".join(struct.pack("<IBBBBHH", 0, 0, seq, 0, 0, 0, seq) for seq in (1, 2, 3))
+    ws_send(sock, recs, binary=True)
+    statuses = {}
+    for _ in range(3):
+        op, msg = ws_recv(sock)
+        if op != 2 or len(msg) != 12:
+            raise AssertionError(f"Expected a 12-byte binary ack, got {op} {msg!r}")
+        id, ledn, r, g, b, status, _, seq = struct.unpack("<IBBBBBBH", msg)
+        statuses[seq] = status
+    if statuses != {1: 0, 2: 1, 3: 0}:
+        raise AssertionError(f"Expected 1 applied, 2 dropped, 3 applied, got {statuses}")
+    # a message that isn't whole records is refused, and the socket stays open
+    ws_send(sock, b"\x00" * 5, binary=True)
+    op, msg = ws_recv(sock)
+    if "error" not in json.loads(msg):
+        raise AssertionError(f"Expected an error for a short record, got {msg!r}")
+    sock.close()
+
+@test
+def test_batch():
+    js = http_post_json("/blink1/batch", [
+        {"op": "fade", "id": 0, "rgb": "#ff0000", "millis": 0},
+        {"op": "blink", "id": 1, "rgb": "#0000ff", "count": 1, "millis": 10},
+        {"op": "stop", "id": 1},
+        {"op": "zap", "id": 0},
+        {"op": "fade", "id": 99, "rgb": "#00ff00"},
+    ])
+    assert_json_field(js, ["status"], "blink1 batch")
+    assert_json_field(js, ["count"], 5)
+    ops = [(res["op"], res["id"]) for res in js["results"]]
+    if ops != [("fade", 0), ("blink", 1), ("stop", 1), ("?", 0), ("fade", 99)]:
+        raise AssertionError(f"Expected results in order, got {ops}")
+    statuses = [res["status"] for res in js["results"]]
+    assert_json_field(js, ["results", 0, "status"], "blink1 set color #ff0000")
+    if any("error" in s for s in statuses[:3]) or not all("error" in s for s in statuses[3:]):
+        raise AssertionError(f"Expected errors for the last two only, got {statuses}")
+
+@test
+def test_batch_needs_post():
+    js = http_get_json("/blink1/batch")
+    if "error" not in js["status"]:
+        raise AssertionError(f"Expected error in status, got '{js['status']}'")
+
+@test
+def test_events_state_and_color():
+    f = sse_connect("/blink1/events")
+    event, js = sse_next(f)
+    if event != "state" or len(js["blink1s"]) < 1:
+        raise AssertionError(f"Expected a state event with the blink1s first, got {event} {js}")
+    http_get_json("/blink1/fadeToRGB?rgb=%23112233&id=0&ledn=2")
+    event, js = sse_next(f)
+    assert_json_field(js, ["rgb"], "#112233")
+    assert_json_field(js, ["ledn"], 2)
+    assert_json_field(js, ["leds", 1], "#112233")
+    if event != "color":
+        raise AssertionError(f"Expected a color event, got {event}")
+    http_get_json("/blink1/pattern/play?id=0&pname=red%20flash")
+    event, js = sse_next(f)
+    assert_json_field(js, ["playing"], True)
+    assert_json_field(js, ["pname"], "red flash")
+    f.close()
+    # a new stream starts from the state the server kept
+    f = sse_connect("/blink1/events?id=0")
+    event, js = sse_next(f)
+    assert_json_field(js, ["blink1s", 0, "playing"], True)
+    f.close()
+
+@test
+def test_events_filter():
+    if "BLINK1_VIRTUAL" not in os.environ:
+        print("skipped, needs BLINK1_VIRTUAL=2 or more")
+        return
+    f = sse_connect("/blink1/events?id=1")
+    event, js = sse_next(f)
+    if [d["id"] for d in js["blink1s"]] != [1]:
+        raise AssertionError(f"Expected only blink1 1 in the state, got {js}")
+    http_get_json("/blink1/red?id=0")
+    http_get_json("/blink1/servertickle/on?id=1&millis=3000")
+    event, js = sse_next(f)
+    if event != "servertickle" or js["id"] != 1:
+        raise AssertionError(f"Expected blink1 0's color to be filtered out, got {event} {js}")
+    assert_json_field(js, ["servertickle"], True)
+    assert_json_field(js, ["servertickle_millis"], 3000)
+    http_get_json("/blink1/servertickle/off?id=1")
+    f.close()
+
+@test
+def test_events_unknown_id():
+    js = http_get_json("/blink1/events?id=99")
+    if "error" not in js["status"]:
+        raise AssertionError(f"Expected error in status, got '{js['status']}'")
+
 #
 # --- Main runner -------------------------------------------------------------
 #